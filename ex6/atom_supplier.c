@@ -199,7 +199,10 @@ int main(int argc, char *argv[])
                 break;
             }
 
-            if (send(sockfd, buffer, strlen(buffer), 0) < 0)
+            // The server frames commands by newline
+            size_t len = strlen(buffer);
+            buffer[len++] = '\n';
+            if (send(sockfd, buffer, len, 0) < 0)
             {
                 perror("send");
                 running = 0;
@@ -0,0 +1,283 @@
+#!/bin/bash
+
+# Throughput benchmarks for drinks_bar, driven by drinks_bench.
+# Usage: ./bench.sh <scenario> [requests per client]
+#   threads   - DELIVER throughput with 1, 2, 4 and 8 reactor threads
+#   io        - syscalls per request for the epoll and io_uring backends
+#   shards    - in-process ADD scaling, one shared stock vs per-thread shards
+#   dgram     - DELIVER throughput and datagrams per syscall by recvmmsg batch
+#   parser    - commands per second, single-pass parser vs the old sscanf one
+#   durability - DELIVER throughput and latency on a --save-file warehouse by
+#               --durability mode (set BENCH_DIR to put the file on a real disk)
+#   replication - ADD and DELIVER throughput alone and with one backup
+#               acking async or sync
+#   raft        - ADD and DELIVER throughput and latency on the leader of a 3
+#               and a 5 node raft group, then the failover time after the
+#               leader is killed
+#   crdt        - ADD and DELIVER throughput summed over 1, 2 and 4 CRDT
+#               nodes, each with its own clients
+#   edge        - DELIVER throughput and latency at the central and at an
+#               edge holding a lease from it
+#   log         - DELIVER throughput by --log-level, and how many log
+#               records the ring had to drop
+TCP_PORT=13345
+UDP_PORT=13346
+REQUESTS=${2:-20000}
+CLIENTS=8
+
+if [ ! -x ./drinks_bar ] || [ ! -x ./drinks_bench ] || [ ! -x ./warehouse_stress ]; then
+    echo "Build first: make all warehouse_stress"
+    exit 1
+fi
+
+SERVER_LOG=/dev/null
+
+start_server() {
+    ./drinks_bar -T $TCP_PORT -U $UDP_PORT -c 1000000 -h 1000000 -o 1000000 "$@" > $SERVER_LOG 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill -SIGINT $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+}
+
+bench_threads() {
+    echo "=== DELIVER throughput by reactor threads ($(nproc) cores) ==="
+    for threads in 1 2 4 8; do
+        start_server --threads $threads
+        echo -n "threads=$threads "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+    done
+}
+
+bench_io() {
+    echo "=== Syscalls per request by I/O backend ==="
+    SERVER_LOG=$(mktemp)
+    for backend in epoll uring; do
+        start_server --io-backend $backend
+        echo -n "backend=$backend "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+        grep "I/O stats" $SERVER_LOG
+    done
+    rm -f $SERVER_LOG
+    SERVER_LOG=/dev/null
+}
+
+bench_dgram() {
+    echo "=== DELIVER throughput by datagram batch size ==="
+    SERVER_LOG=$(mktemp)
+    for batch in 1 8 32 128; do
+        start_server --dgram-batch $batch
+        echo -n "batch=$batch "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+        grep "Datagram stats" $SERVER_LOG
+    done
+    rm -f $SERVER_LOG
+    SERVER_LOG=/dev/null
+}
+
+# One reactor thread per client, so sync mode has concurrent commits to
+# group; records_per_fdatasync shows how many each flush carried
+bench_durability() {
+    echo "=== DELIVER on a file-backed warehouse by durability mode ==="
+    SAVE_FILE=${BENCH_DIR:-.}/bench_warehouse.dat
+    SERVER_LOG=$(mktemp)
+    for mode in none async periodic sync; do
+        rm -f $SAVE_FILE $SAVE_FILE.wal
+        start_server -f $SAVE_FILE --durability $mode --threads $CLIENTS
+        echo -n "durability=$mode "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+        grep "WAL stats" $SERVER_LOG
+    done
+    rm -f $SAVE_FILE $SAVE_FILE.wal $SERVER_LOG
+    SERVER_LOG=/dev/null
+}
+
+bench_replication() {
+    echo "=== ADD and DELIVER throughput with a backup ==="
+    REPLICA_SOCK=/tmp/drinks_bench_replica_$$.sock
+    for setup in standalone async sync; do
+        if [ $setup = standalone ]; then
+            start_server
+        else
+            start_server --replica-listen $REPLICA_SOCK --replica-ack $setup
+            ./drinks_bar -T $((TCP_PORT + 2)) -U $((UDP_PORT + 2)) --replica-of $REPLICA_SOCK \
+                --replica-ack $setup > /dev/null 2>&1 &
+            BACKUP_PID=$!
+            sleep 0.5
+        fi
+        echo -n "replication=$setup "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        echo -n "replication=$setup "
+        ./drinks_bench -m add -p $TCP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+        if [ $setup != standalone ]; then
+            kill -SIGINT $BACKUP_PID 2>/dev/null
+            wait $BACKUP_PID 2>/dev/null
+        fi
+    done
+    rm -f $REPLICA_SOCK
+}
+
+bench_raft() {
+    echo "=== ADD and DELIVER through a raft group, and failover ==="
+    for size in 3 5; do
+        PEERS=""
+        for i in $(seq 1 $size); do
+            PEERS="$PEERS${PEERS:+,}$((UDP_PORT + 100 + i))"
+        done
+        LOGS=()
+        PIDS=()
+        for i in $(seq 1 $size); do
+            LOGS[$i]=$(mktemp)
+            ./drinks_bar -T $((TCP_PORT + 10 * i)) -U $((UDP_PORT + 10 * i)) -c 1000000 -h 1000000 \
+                -o 1000000 --threads $CLIENTS --raft-id $i --raft-peers $PEERS > ${LOGS[$i]} 2>&1 &
+            PIDS[$i]=$!
+        done
+        sleep 1
+        LEADER=$(grep -l "elected leader" ${LOGS[@]:1} | head -1)
+        for i in $(seq 1 $size); do
+            [ "${LOGS[$i]}" = "$LEADER" ] && LEADER=$i
+        done
+        echo -n "nodes=$size "
+        ./drinks_bench -p $((UDP_PORT + 10 * LEADER)) -c $CLIENTS -n $REQUESTS
+        echo -n "nodes=$size "
+        ./drinks_bench -m add -p $((TCP_PORT + 10 * LEADER)) -c $CLIENTS -n $REQUESTS
+        kill -9 ${PIDS[$LEADER]}
+        wait ${PIDS[$LEADER]} 2>/dev/null
+        sleep 1
+        echo -n "nodes=$size leader $LEADER killed: "
+        for i in $(seq 1 $size); do
+            [ $i != $LEADER ] && grep -h "elected leader" ${LOGS[$i]}
+        done
+        for i in $(seq 1 $size); do
+            kill -SIGINT ${PIDS[$i]} 2>/dev/null
+            wait ${PIDS[$i]} 2>/dev/null
+            rm -f ${LOGS[$i]}
+        done
+    done
+}
+
+bench_crdt() {
+    echo "=== ADD and DELIVER across CRDT nodes ($(nproc) cores) ==="
+    for size in 1 2 4; do
+        PEERS=""
+        for i in $(seq 1 $size); do
+            PEERS="$PEERS${PEERS:+,}$((UDP_PORT + 200 + i))"
+        done
+        LOGS=()
+        PIDS=()
+        for i in $(seq 1 $size); do
+            LOGS[$i]=$(mktemp)
+            ./drinks_bar -T $((TCP_PORT + 10 * i)) -U $((UDP_PORT + 10 * i)) -c 1000000 -h 1000000 \
+                -o 1000000 --crdt-id $i --crdt-peers $PEERS > ${LOGS[$i]} 2>&1 &
+            PIDS[$i]=$!
+        done
+        sleep 0.5
+        for mode in add deliver; do
+            RESULTS=$(mktemp)
+            CLIENT_PIDS=()
+            for i in $(seq 1 $size); do
+                if [ $mode = add ]; then
+                    PORT=$((TCP_PORT + 10 * i))
+                else
+                    PORT=$((UDP_PORT + 10 * i))
+                fi
+                ./drinks_bench -m $mode -p $PORT -c $CLIENTS -n $REQUESTS >> $RESULTS &
+                CLIENT_PIDS+=($!)
+            done
+            wait ${CLIENT_PIDS[@]}
+            echo "nodes=$size mode=$mode total throughput=$(grep -o 'throughput=[0-9]*' $RESULTS |
+                awk -F= '{ sum += $2 } END { print sum }') req/s"
+            rm -f $RESULTS
+        done
+        sleep 0.2
+        for i in $(seq 1 $size); do
+            kill -SIGINT ${PIDS[$i]} 2>/dev/null
+            wait ${PIDS[$i]} 2>/dev/null
+        done
+        grep -h "CRDT stats" ${LOGS[1]}
+        rm -f ${LOGS[@]:1}
+    done
+}
+
+bench_edge() {
+    echo "=== DELIVER at the central and at an edge ==="
+    start_server
+    echo -n "central "
+    ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+    EDGE_LOG=$(mktemp)
+    ./drinks_bar -T $((TCP_PORT + 2)) -U $((UDP_PORT + 2)) --edge-of $UDP_PORT --lease 20000 \
+        > $EDGE_LOG 2>&1 &
+    EDGE_PID=$!
+    sleep 0.5
+    echo -n "edge    "
+    ./drinks_bench -p $((UDP_PORT + 2)) -c $CLIENTS -n $REQUESTS
+    kill -SIGINT $EDGE_PID 2>/dev/null
+    wait $EDGE_PID 2>/dev/null
+    grep "Edge stats" $EDGE_LOG
+    rm -f $EDGE_LOG
+    stop_server
+}
+
+bench_log() {
+    echo "=== DELIVER throughput by log level ==="
+    SERVER_LOG=$(mktemp)
+    for level in debug info quiet; do
+        start_server --log-level $level
+        echo -n "level=$level "
+        ./drinks_bench -p $UDP_PORT -c $CLIENTS -n $REQUESTS
+        stop_server
+        grep "Log stats" $SERVER_LOG
+    done
+    rm -f $SERVER_LOG
+    SERVER_LOG=/dev/null
+}
+
+case "$1" in
+threads)
+    bench_threads
+    ;;
+io)
+    bench_io
+    ;;
+dgram)
+    bench_dgram
+    ;;
+parser)
+    echo "=== Command parsing ==="
+    make -s parser_bench && ./parser_bench bench
+    ;;
+durability)
+    bench_durability
+    ;;
+replication)
+    bench_replication
+    ;;
+raft)
+    bench_raft
+    ;;
+crdt)
+    bench_crdt
+    ;;
+edge)
+    bench_edge
+    ;;
+log)
+    bench_log
+    ;;
+shards)
+    echo "=== ADD scaling across shards ($(nproc) cores) ==="
+    ./warehouse_stress bench
+    ;;
+*)
+    echo "Usage: $0 threads|io|shards|dgram|parser|durability|replication|raft|crdt|edge|log [requests per client]"
+    exit 1
+    ;;
+esac
@@ -22,7 +22,7 @@ fi
 echo "Build successful!"
 
 echo "Checking built files..."
-ls -la atom_supplier drinks_bar molecule_requestor *.gcno 2>/dev/null
+ls -la atom_supplier drinks_bar molecule_requestor drinks_bench *.gcno 2>/dev/null
 
 echo "Running tests..."
 
@@ -119,6 +119,14 @@ wait \$UDS_PID 2>/dev/null
 rm -f /tmp/uds_test /tmp/uds_dgram
 " || echo "✓ Unix socket success test done"
 
+echo "=== WAREHOUSE ENGINE TESTS ==="
+
+echo "Test W1: Lock-free warehouse stress"
+make warehouse_stress > /dev/null 2>&1 && ./warehouse_stress || echo "ERROR: warehouse stress test failed"
+
+echo "Test W2: Command parser"
+make parser_bench > /dev/null 2>&1 && ./parser_bench || echo "ERROR: parser test failed"
+
 echo "=== MOLECULE_REQUESTOR TESTS ==="
 
 echo "Test R1: No arguments"
@@ -194,28 +202,125 @@ timeout 18 bash -c '
 ) | ./molecule_requestor -h 127.0.0.1 -p '"$UDP_PORT"' 2>/dev/null
 ' || echo "✓ Timeout with real server"
 
-# Test M10: Max clients reached
-echo "Test M10: Max clients reached"
+# Test M10: Many clients (connection table grows past the old 12-client cap)
+echo "Test M10: Many clients"
 timeout 10 bash -c '
 ./drinks_bar -T 8070 -U 8071 -c 50 -h 50 -o 50 &
 SERVER_PID=$!
 sleep 1
 
-# Open 12 clients (MAX_CLIENTS) that stay connected
-for i in $(seq 1 12); do
-    (echo "ADD CARBON 1"; sleep 8) | ./atom_supplier -h 127.0.0.1 -p 8070 &
-    sleep 0.1
+# Open 40 clients that stay connected
+for i in $(seq 1 40); do
+    (echo "ADD CARBON 1"; sleep 6) | ./atom_supplier -h 127.0.0.1 -p 8070 &
 done
 
 sleep 1
 
-# Try 13th client - should be rejected
+# One more client on top - should still be accepted
 echo "ADD HYDROGEN 1" | ./atom_supplier -h 127.0.0.1 -p 8070 &
 sleep 2
 
 kill -SIGINT $SERVER_PID
 wait $SERVER_PID 2>/dev/null
-' || echo "✓ Max clients reached test completed"
+' || echo "✓ Many clients test completed"
+
+echo "Test M10b: Max clients limit and accept batching"
+timeout 10 bash -c '
+./drinks_bar -T 8076 -U 8077 --max-clients 5 --backlog 64 &
+SERVER_PID=$!
+sleep 1
+for i in $(seq 1 8); do
+    (echo "ADD CARBON 1"; sleep 3) | ./atom_supplier -h 127.0.0.1 -p 8076 &
+done
+sleep 2
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+' || echo "✓ Max clients limit test completed"
+
+echo "Test M10c: Invalid backlog"
+./drinks_bar -T 8076 -U 8077 --backlog 0 2>/dev/null || echo "✓ Correctly rejected backlog 0"
+
+echo "Test M11: Multi-threaded reactors"
+timeout 10 bash -c '
+./drinks_bar -T 8072 -U 8073 -c 50 -h 50 -o 50 --threads 4 &
+SERVER_PID=$!
+sleep 1
+for i in $(seq 1 8); do
+    echo "ADD OXYGEN 1" | ./atom_supplier -h 127.0.0.1 -p 8072 &
+done
+./drinks_bench -p 8073 -c 4 -n 5
+sleep 1
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+' || echo "✓ Multi-threaded reactors test completed"
+
+echo "Test M13: io_uring backend"
+timeout 10 bash -c '
+./drinks_bar -T 8074 -U 8075 -c 50 -h 50 -o 50 --io-backend uring &
+SERVER_PID=$!
+sleep 1
+echo "ADD CARBON 5" | ./atom_supplier -h 127.0.0.1 -p 8074 &
+./drinks_bench -p 8075 -c 2 -n 5
+sleep 1
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+' || echo "✓ io_uring backend test completed"
+
+echo "Test M14: Invalid I/O backend"
+./drinks_bar -T 8074 -U 8075 --io-backend select 2>/dev/null || echo "✓ Correctly rejected unknown backend"
+
+echo "Test M15: Batched datagrams"
+timeout 10 bash -c '
+./drinks_bar -T 8076 -U 8077 -c 500 -h 500 -o 500 --dgram-batch 16 &
+SERVER_PID=$!
+sleep 1
+./drinks_bench -p 8077 -c 8 -n 10
+./drinks_bench -p 8077 -c 1 -n 3 -r "DELIVER UNKNOWN 1"
+sleep 1
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+' || echo "✓ Batched datagrams test completed"
+
+echo "Test M16: Invalid datagram batch"
+./drinks_bar -T 8076 -U 8077 --dgram-batch 0 2>/dev/null || echo "✓ Correctly rejected batch size 0"
+
+echo "Test M17: Pipelined ADD lines"
+timeout 10 bash -c '
+./drinks_bar -T 8078 -U 8079 &
+SERVER_PID=$!
+sleep 1
+./drinks_bench -p 8078 -m add -c 2 -n 200 -b 50
+sleep 1
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+' || echo "✓ Pipelined ADD test completed"
+
+echo "Test M18: Default output keeps the stock after every ADD, --log-level info drops it"
+timeout 10 bash -c '
+for level in default info; do
+    OUT=$(mktemp)
+    if [ $level = default ]; then
+        ./drinks_bar -T 8078 -U 8079 > $OUT &
+    else
+        ./drinks_bar -T 8078 -U 8079 --log-level info > $OUT &
+    fi
+    SERVER_PID=$!
+    sleep 1
+    (echo "ADD CARBON 3"; sleep 0.5; echo "EXIT") | ./atom_supplier -h 127.0.0.1 -p 8078 > /dev/null
+    sleep 1
+    kill -SIGINT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    if grep -q "Added 3 CARBON" $OUT && grep -q "Carbon: 3" $OUT; then
+        echo "$level: ADD and stock printed"
+    else
+        echo "$level: ADD and stock not printed"
+    fi
+    rm -f $OUT
+done
+' || echo "✓ Log level output test completed"
+
+echo "Test M12: Invalid thread count"
+./drinks_bar -T 8072 -U 8073 --threads 0 2>/dev/null || echo "✓ Correctly rejected 0 threads"
 
 echo "Test: Initial atoms"
 timeout 3 bash -c './drinks_bar -T 8080 -U 8081 -c 5 -h 10 -o 3 &
@@ -443,4 +548,6 @@ calculate_coverage() {
 
 calculate_coverage "atom_supplier.c"
 calculate_coverage "molecule_requestor.c"
-calculate_coverage "drinks_bar.c"
\ No newline at end of file
+calculate_coverage "drinks_bar.c"
+calculate_coverage "warehouse.c"
+calculate_coverage "protocol.c"
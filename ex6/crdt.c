@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include "crdt.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CRDT_MAGIC 0x54445243U // "CRDT"
+#define CRDT_SLOTS 64
+
+// Every counter only grows, so merging two copies is taking the larger
+typedef struct crdtRow
+{
+  long long base[3];
+  long long added[3];
+  long long taken[3];
+  long long given[CRDT_MAX_NODES][3]; // escrow handed to each node
+} crdtRow;
+
+typedef struct crdtMessage
+{
+  unsigned int magic;
+  int from;
+  unsigned int count; // rows that follow, one per node
+  unsigned int reserved;
+  crdtRow rows[CRDT_MAX_NODES];
+} crdtMessage;
+
+// This node's adds and takes, counted where they happen. Threads spread
+// over the slots so the request path shares no cache line.
+typedef struct crdtSlot
+{
+  long long added[3];
+  long long taken[3];
+} __attribute__((aligned(64))) crdtSlot;
+
+int crdt_running = 0;
+__thread int crdt_applying = 0;
+
+crdtSlot crdt_slots[CRDT_SLOTS];
+int crdt_next_slot = 0;
+static __thread int crdt_slot = -1;
+
+int crdt_id, crdt_nodes; // crdt_id counts from 0 here
+struct sockaddr_storage crdt_addrs[CRDT_MAX_NODES];
+socklen_t crdt_addr_lens[CRDT_MAX_NODES];
+int crdt_fd = -1;
+pthread_t crdt_thread;
+
+// Guarded by crdt_mutex
+pthread_mutex_t crdt_mutex = PTHREAD_MUTEX_INITIALIZER;
+crdtRow crdt_rows[CRDT_MAX_NODES];
+long long crdt_unlanded[3]; // escrow handed to us that did not fit the stock yet
+double crdt_heard[CRDT_MAX_NODES];
+crdtStats crdt_totals;
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// A path is a Unix datagram socket, otherwise "port" or "host:port" over UDP
+static int resolve_node(const char *address, struct sockaddr_storage *addr, socklen_t *len)
+{
+  memset(addr, 0, sizeof(*addr));
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    if (strlen(address) >= sizeof(un->sun_path))
+      return 0;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    *len = sizeof(*un);
+    return 1;
+  }
+
+  char host[256] = "127.0.0.1";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+    port = address;
+
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+  struct addrinfo *found;
+  if (getaddrinfo(host, port, &hints, &found) != 0)
+    return 0;
+  memcpy(addr, found->ai_addr, found->ai_addrlen);
+  *len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 1;
+}
+
+void crdt_count(const long long change[3])
+{
+  if (crdt_slot < 0)
+    crdt_slot = __atomic_fetch_add(&crdt_next_slot, 1, __ATOMIC_RELAXED) % CRDT_SLOTS;
+  crdtSlot *slot = &crdt_slots[crdt_slot];
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (change[atom] > 0)
+      __atomic_fetch_add(&slot->added[atom], change[atom], __ATOMIC_RELAXED);
+    else if (change[atom] < 0)
+      __atomic_fetch_add(&slot->taken[atom], -change[atom], __ATOMIC_RELAXED);
+  }
+}
+
+// Bring our own row up to date with the slots
+static void count_own()
+{
+  crdtRow *own = &crdt_rows[crdt_id];
+  memset(own->added, 0, sizeof(own->added));
+  memset(own->taken, 0, sizeof(own->taken));
+  for (int i = 0; i < CRDT_SLOTS; i++)
+  {
+    for (int atom = 0; atom < 3; atom++)
+    {
+      own->added[atom] += __atomic_load_n(&crdt_slots[i].added[atom], __ATOMIC_RELAXED);
+      own->taken[atom] += __atomic_load_n(&crdt_slots[i].taken[atom], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void merge_counter(long long *mine, long long theirs)
+{
+  if (theirs > *mine)
+    *mine = theirs;
+}
+
+// Put escrow handed to us into the stock. An atom whose counter cannot
+// take it all now keeps it for the next round; it is already in given,
+// so no later merge would bring it back.
+static void land_escrow()
+{
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (crdt_unlanded[atom] > 0 && warehouse_add(atom + 1, crdt_unlanded[atom]) > 0)
+      crdt_unlanded[atom] = 0;
+  }
+}
+
+// Take in another node's row. Escrow it handed us since we last heard is
+// counted for our share here, once, and landed by land_escrow().
+static void merge_row(int node, const crdtRow *row)
+{
+  crdtRow *known = &crdt_rows[node];
+  for (int atom = 0; atom < 3; atom++)
+  {
+    merge_counter(&known->base[atom], row->base[atom]);
+    merge_counter(&known->added[atom], row->added[atom]);
+    merge_counter(&known->taken[atom], row->taken[atom]);
+    for (int to = 0; to < crdt_nodes; to++)
+    {
+      long long before = known->given[to][atom];
+      merge_counter(&known->given[to][atom], row->given[to][atom]);
+      if (to == crdt_id && known->given[to][atom] > before)
+        crdt_unlanded[atom] += known->given[to][atom] - before;
+    }
+  }
+}
+
+static void handle_gossip(const crdtMessage *msg, ssize_t len, double now)
+{
+  if (len < (ssize_t)offsetof(crdtMessage, rows) || msg->magic != CRDT_MAGIC ||
+      msg->count != (unsigned int)crdt_nodes ||
+      len != (ssize_t)(offsetof(crdtMessage, rows) + msg->count * sizeof(crdtRow)) ||
+      msg->from < 0 || msg->from >= crdt_nodes || msg->from == crdt_id)
+    return;
+  crdt_heard[msg->from] = now;
+  crdt_totals.gossip_received++;
+  // Our own row is ours alone; what others know of it is never newer
+  for (int node = 0; node < crdt_nodes; node++)
+  {
+    if (node != crdt_id)
+      merge_row(node, &msg->rows[node]);
+  }
+}
+
+// A node's share as far as we know: its start, adds and takes, and the
+// escrow moved to and from it
+static long long share_of(int node, int atom)
+{
+  const crdtRow *row = &crdt_rows[node];
+  long long share = row->base[atom] + row->added[atom] - row->taken[atom];
+  for (int other = 0; other < crdt_nodes; other++)
+    share += crdt_rows[other].given[node][atom] - row->given[other][atom];
+  return share > 0 ? share : 0;
+}
+
+static void rebalance(double now)
+{
+  wareHouse local = warehouse_read();
+  long long mine[3] = {local.carbon, local.hydrogen, local.oxygen};
+  for (int node = 0; node < crdt_nodes; node++)
+  {
+    if (node == crdt_id || now - crdt_heard[node] > CRDT_PEER_TIMEOUT_MS)
+      continue;
+    for (int atom = 0; atom < 3; atom++)
+    {
+      long long theirs = share_of(node, atom);
+      long long amount = (mine[atom] - theirs) / 2;
+      if (mine[atom] <= 4 * theirs || amount <= 0)
+        continue;
+      unsigned long long need[3] = {0, 0, 0};
+      need[atom] = amount;
+      if (warehouse_take(need[0], need[1], need[2]) <= 0)
+        continue;
+      crdt_rows[crdt_id].given[node][atom] += amount;
+      mine[atom] -= amount;
+      crdt_totals.transfers++;
+      crdt_totals.transferred[atom] += amount;
+    }
+  }
+}
+
+static void *run_gossip(void *arg)
+{
+  (void)arg;
+  static crdtMessage in, out;
+  crdt_applying = 1;
+  double next_round = now_ms();
+
+  while (crdt_running)
+  {
+    double now = now_ms();
+    struct pollfd pfd = {.fd = crdt_fd, .events = POLLIN};
+    poll(&pfd, 1, next_round > now ? (int)(next_round - now) + 1 : 0);
+
+    pthread_mutex_lock(&crdt_mutex);
+    now = now_ms();
+    ssize_t got;
+    while ((got = recv(crdt_fd, &in, sizeof(in), MSG_DONTWAIT)) > 0)
+      handle_gossip(&in, got, now);
+    land_escrow();
+
+    int send_round = now >= next_round;
+    if (send_round)
+    {
+      count_own();
+      rebalance(now);
+      out.magic = CRDT_MAGIC;
+      out.from = crdt_id;
+      out.count = crdt_nodes;
+      memcpy(out.rows, crdt_rows, crdt_nodes * sizeof(crdtRow));
+      crdt_totals.gossip_sent += crdt_nodes - 1;
+      next_round = now + CRDT_GOSSIP_MS;
+    }
+    pthread_mutex_unlock(&crdt_mutex);
+
+    if (!send_round)
+      continue;
+    size_t len = offsetof(crdtMessage, rows) + crdt_nodes * sizeof(crdtRow);
+    for (int node = 0; node < crdt_nodes; node++)
+    {
+      // A lost round is made up by the next one
+      if (node != crdt_id)
+        sendto(crdt_fd, &out, len, MSG_DONTWAIT, (struct sockaddr *)&crdt_addrs[node], crdt_addr_lens[node]);
+    }
+  }
+  return NULL;
+}
+
+int crdt_start(int id, const char *nodes)
+{
+  char *list = strdup(nodes);
+  if (!list)
+    return 0;
+  crdt_nodes = 0;
+  for (char *save = NULL, *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+  {
+    if (crdt_nodes == CRDT_MAX_NODES ||
+        !resolve_node(name, &crdt_addrs[crdt_nodes], &crdt_addr_lens[crdt_nodes]))
+    {
+      fprintf(stderr, "Bad or too many CRDT node addresses at %s\n", name);
+      free(list);
+      return 0;
+    }
+    crdt_nodes++;
+  }
+  free(list);
+  if (id < 1 || id > crdt_nodes)
+  {
+    fprintf(stderr, "crdt-id must be between 1 and %d\n", crdt_nodes);
+    return 0;
+  }
+  crdt_id = id - 1;
+
+  struct sockaddr_storage *self = &crdt_addrs[crdt_id];
+  crdt_fd = socket(self->ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (self->ss_family == AF_UNIX)
+    unlink(((struct sockaddr_un *)self)->sun_path);
+  if (crdt_fd == -1 || bind(crdt_fd, (struct sockaddr *)self, crdt_addr_lens[crdt_id]) == -1)
+  {
+    perror("Failed to bind CRDT socket");
+    return 0;
+  }
+
+  wareHouse start = warehouse_read();
+  crdt_rows[crdt_id].base[0] = start.carbon;
+  crdt_rows[crdt_id].base[1] = start.hydrogen;
+  crdt_rows[crdt_id].base[2] = start.oxygen;
+
+  crdt_running = 1;
+  if (pthread_create(&crdt_thread, NULL, run_gossip, NULL) != 0)
+  {
+    perror("Failed to start CRDT gossip");
+    crdt_running = 0;
+    return 0;
+  }
+  pthread_detach(crdt_thread);
+  return 1;
+}
+
+wareHouse crdt_global()
+{
+  long long total[3] = {0, 0, 0};
+  pthread_mutex_lock(&crdt_mutex);
+  count_own();
+  for (int node = 0; node < crdt_nodes; node++)
+  {
+    for (int atom = 0; atom < 3; atom++)
+      total[atom] += crdt_rows[node].base[atom] + crdt_rows[node].added[atom] - crdt_rows[node].taken[atom];
+  }
+  pthread_mutex_unlock(&crdt_mutex);
+  return (wareHouse){.carbon = total[0], .hydrogen = total[1], .oxygen = total[2]};
+}
+
+void crdt_stats(crdtStats *stats)
+{
+  pthread_mutex_lock(&crdt_mutex);
+  *stats = crdt_totals;
+  pthread_mutex_unlock(&crdt_mutex);
+}
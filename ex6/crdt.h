@@ -0,0 +1,57 @@
+#ifndef CRDT_H
+#define CRDT_H
+
+#include "warehouse.h"
+
+// Multi-master default warehouse. Every node of the group takes ADD and
+// DELIVER on its own, with no coordination on the request path.
+//
+// Each node keeps grow-only counters per atom: what it started with, what
+// it added, what it took, and what it handed to each other node. Nodes
+// gossip all the counters they know of every CRDT_GOSSIP_MS, and a
+// receiver keeps the larger of each pair, so every node converges on the
+// same counters whatever gets lost or reordered. The warehouse is the sum
+// over the nodes of started + added - taken (PN-counters).
+//
+// Deliveries are covered by escrow: a node's local warehouse holds only
+// its share of the stock, its start plus its adds minus its takes, plus
+// what others handed it and minus what it handed out. A node can only
+// take what is in its share, so the warehouse as a whole never goes below
+// zero. A node whose share of an atom is a quarter of ours or less gets
+// half the difference at the next gossip round.
+//
+// Only the default warehouse is shared; named warehouses are refused. A
+// node's counters live in memory, so a node that restarts cannot rejoin
+// the group.
+
+#define CRDT_MAX_NODES 8
+#define CRDT_GOSSIP_MS 20
+#define CRDT_PEER_TIMEOUT_MS 1000 // no escrow goes to a peer silent this long
+
+typedef struct crdtStats
+{
+  unsigned long long gossip_sent;
+  unsigned long long gossip_received;
+  unsigned long long transfers;       // escrow handed to other nodes
+  unsigned long long transferred[3];  // atoms in them
+} crdtStats;
+
+// Join the group. nodes is a comma-separated list of datagram addresses
+// ("port", "host:port" or a Unix socket path); this node is the id-th
+// (from 1). What the in-memory warehouse holds now becomes this node's
+// start. Returns 0 on error.
+int crdt_start(int id, const char *nodes);
+
+// The whole warehouse as far as this node has heard
+wareHouse crdt_global();
+
+void crdt_stats(crdtStats *stats);
+
+// Hooks for warehouse.c: while crdt_running, successful changes of the
+// default warehouse are counted with crdt_count(), except on the gossip
+// thread, which moves escrow.
+extern int crdt_running;
+extern __thread int crdt_applying;
+void crdt_count(const long long change[3]);
+
+#endif
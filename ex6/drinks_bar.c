@@ -1,34 +1,52 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h> // Added for Unix Domain Sockets
+#include <sys/wait.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
-
-#define BACKLOG 10
-#define MAX_CLIENTS 12
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "uring.h"
+#include "crdt.h"
+#include "edge.h"
+#include "latency.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "raft.h"
+#include "replica.h"
+#include "wal.h"
+#include "warehouse.h"
+
+#define DEFAULT_BACKLOG SOMAXCONN
+#define INITIAL_CLIENTS 64
+#define MAX_EVENTS 256
+#define MAX_THREADS 64
+#define DEFAULT_DGRAM_BATCH 32
+#define MAX_DGRAM_BATCH 1024
+#define DGRAM_SIZE 256
+#define STREAM_READ_SIZE 4096
+#define MAX_LINE 1024
 
 extern int optopt;
 extern char *optarg;
 
-//-------------------atom functions---------------------------------------------
-typedef struct wareHouse
-{
-  unsigned long long carbon;
-  unsigned long long hydrogen;
-  unsigned long long oxygen;
-} wareHouse;
-
 // Global variable to control server shutdown
 volatile sig_atomic_t running = 1;
 
@@ -36,17 +54,21 @@ volatile sig_atomic_t running = 1;
 char *stream_path = NULL;
 char *datagram_path = NULL;
 
-// Global file descriptor and mapped memory for warehouse
-int warehouse_fd = -1;
-wareHouse *warehouse_ptr = NULL;
-char *warehouse_file_path = NULL;
-
 void handle_sigint(int sig)
 {
   running = 0;
   printf("\nSIGINT received — shutting down server gracefully... bli neder\n");
 }
 
+// Snapshot children report for themselves; only reap them
+void handle_sigchld(int sig)
+{
+  int saved_errno = errno;
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+  errno = saved_errno;
+}
+
 void handle_alarm(int sig)
 {
   printf("Alarm triggered — shutting down due to timeout\n");
@@ -65,395 +87,1857 @@ void cleanup_socket_files()
   }
 }
 
-void cleanup_warehouse_file()
+//-------------------reactor state------------------------------------------------
+
+typedef struct clientConn
+{
+  int fd;
+  int active;
+
+  // Bytes of an unfinished line carried over to the next read
+  char *pending;
+  size_t pending_len;
+  size_t pending_cap;
+  int discarding; // skipping the rest of an over-long line
+  int location;   // warehouse chosen with USE, 0 = default
+} clientConn;
+
+// One event loop. Every reactor owns its epoll instance and its connection
+// table; with --threads each also owns SO_REUSEPORT TCP/UDP sockets.
+typedef struct reactor
+{
+  int id;
+  int epoll_fd;
+  int listen_fd;
+  int udp_fd;
+  int use_stdin;
+  pthread_t thread;
+
+  // Connection table indexed by fd. It grows on demand, so the number of
+  // connected suppliers is bounded only by RLIMIT_NOFILE.
+  clientConn *clients;
+  int clients_cap;
+  int clients_count;
+
+  // I/O accounting used to compare backends
+  unsigned long long syscalls;
+  unsigned long long requests;
+
+  // Accept accounting; the batch counters cover the current wakeup
+  unsigned long long accepted;
+  unsigned long long rejected;
+  int max_accept_batch;
+  int batch_accepted;
+  int batch_rejected;
+
+  // recvmmsg/sendmmsg batch for the datagram socket
+  struct dgramBatch *dgram;
+  unsigned long long dgrams;
+  unsigned long long dgram_recv_calls;
+  unsigned long long dgram_send_calls;
+  struct uringState *uring;
+
+  // Requests whose replies the raft or edge forwarding thread finished,
+  // waiting to be sent from this thread, which it wakes through wake_fd
+  // (see parkedRequest)
+  int wake_fd;
+  struct parkedRequest *parked_head;
+  struct parkedRequest *parked_tail;
+} reactor;
+
+int idle_timeout = 0;
+int listen_backlog = DEFAULT_BACKLOG;
+int max_clients = 0; // 0 = limited only by RLIMIT_NOFILE
+int dgram_batch_size = DEFAULT_DGRAM_BATCH;
+
+// Connected clients over all reactors, checked against max_clients
+int connected_clients = 0;
+
+// Spare descriptor released when accept4() hits EMFILE, so the pending
+// connection can still be taken off the queue and refused
+int spare_fd = -1;
+pthread_mutex_t spare_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Lift the soft descriptor limit to the hard one so we can hold as many
+// supplier connections as the system allows
+void raise_fd_limit()
 {
-  if (warehouse_ptr && warehouse_ptr != MAP_FAILED)
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
   {
-    munmap(warehouse_ptr, sizeof(wareHouse));
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
   }
-  if (warehouse_fd != -1)
+}
+
+clientConn *add_client(reactor *r, int fd)
+{
+  if (fd >= r->clients_cap)
   {
-    close(warehouse_fd);
+    int new_cap = r->clients_cap ? r->clients_cap : INITIAL_CLIENTS;
+    while (new_cap <= fd)
+      new_cap *= 2;
+
+    clientConn *grown = realloc(r->clients, new_cap * sizeof(clientConn));
+    if (!grown)
+      return NULL;
+    memset(grown + r->clients_cap, 0, (new_cap - r->clients_cap) * sizeof(clientConn));
+    r->clients = grown;
+    r->clients_cap = new_cap;
   }
+
+  r->clients[fd].fd = fd;
+  r->clients[fd].active = 1;
+  r->clients_count++;
+  return &r->clients[fd];
 }
 
-//-------------------atom functions---------------------------------------------
+void remove_client(reactor *r, int fd)
+{
+  // close() also drops the fd from the epoll interest list
+  close(fd);
+  r->clients[fd].active = 0;
+  free(r->clients[fd].pending);
+  r->clients[fd].pending = NULL;
+  r->clients[fd].pending_len = 0;
+  r->clients[fd].pending_cap = 0;
+  r->clients[fd].discarding = 0;
+  r->clients[fd].location = 0;
+  r->clients_count--;
+  __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+}
 
-struct flock lock = {
-    .l_type = F_WRLCK,
-    .l_whence = SEEK_SET,
-    .l_start = 0,
-    .l_len = sizeof(wareHouse),
-    .l_pid = 0};
+// Register an accepted connection, or close it if we are at the limit
+int admit_client(reactor *r, int client_fd)
+{
+  int total = __atomic_add_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+  if (max_clients > 0 && total > max_clients)
+  {
+    __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Max clients reached, rejecting connection", NULL, 0, 0, 0, 0);
+    close(client_fd);
+    return 0;
+  }
 
-// Function to lock the warehouse file
-int lock_warehouse()
+  if (!add_client(r, client_fd))
+  {
+    __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Failed to grow client table, rejecting connection", NULL, 0, 0, 0, 0);
+    close(client_fd);
+    return 0;
+  }
+  return 1;
+}
+
+// Out of descriptors: free the spare one, take the pending connection off
+// the queue and close it. Returns 0 if there was nothing to refuse.
+int reject_with_spare_fd(reactor *r)
+{
+  int refused = 0;
+  pthread_mutex_lock(&spare_fd_mutex);
+  if (spare_fd >= 0)
+  {
+    close(spare_fd);
+    r->syscalls++;
+    int fd = accept4(r->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0)
+    {
+      close(fd);
+      refused = 1;
+      log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Out of file descriptors, rejecting connection", NULL, 0, 0, 0, 0);
+    }
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  pthread_mutex_unlock(&spare_fd_mutex);
+  return refused;
+}
+
+void record_accept_batch(reactor *r)
 {
-  if (warehouse_fd == -1)
-    return 0; // No file locking needed
+  int accepted = r->batch_accepted, rejected = r->batch_rejected;
+  r->batch_accepted = r->batch_rejected = 0;
+  if (accepted + rejected == 0)
+    return;
+
+  r->accepted += accepted;
+  r->rejected += rejected;
+  metrics_count(METRIC_ACCEPTED, accepted);
+  metrics_count(METRIC_REJECTED, rejected);
+  if (accepted > r->max_accept_batch)
+    r->max_accept_batch = accepted;
+  if (accepted + rejected > 1 || rejected > 0)
+    log_event(LOG_LEVEL_INFO, LOG_ACCEPT_BATCH, NULL, NULL, 0, accepted, rejected, 0);
+}
+
+//------------------------------------------------------------------------
+
+// ---------------------------socket setup---------------------------------
+
+// Open the TCP listener and UDP socket. With reuseport every reactor binds
+// its own pair to the same ports and the kernel spreads the load.
+int open_inet_sockets(int tcp_port, int udp_port, int reuseport,
+                      int *listen_fd, int *udp_fd)
+{
+  int opt = 1;
+
+  //--------------------tcp socket setup-------------------------------
+  // Create a listening socket
+  *listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (*listen_fd < 0)
+  {
+    perror("socket");
+    return 0;
+  }
+
+  // Set socket options to allow reuse of the address
+  setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (reuseport)
+    setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+  struct sockaddr_in serv_addr = {.sin_family = AF_INET,
+                                  .sin_port = htons(tcp_port),
+                                  .sin_addr.s_addr = INADDR_ANY};
+
+  if (bind(*listen_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+  {
+    perror("bind");
+    close(*listen_fd);
+    return 0;
+  }
+
+  if (listen(*listen_fd, listen_backlog) < 0)
+  {
+    perror("listen");
+    close(*listen_fd);
+    return 0;
+  }
+
+  // -------------------udp socket setup-------------------------------
+  *udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (*udp_fd < 0)
+  {
+    perror("socket");
+    close(*listen_fd);
+    return 0;
+  }
+
+  if (reuseport)
+    setsockopt(*udp_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
-  if (fcntl(warehouse_fd, F_SETLKW, &lock) == -1)
+  struct sockaddr_in udp_addr = {.sin_family = AF_INET,
+                                 .sin_port = htons(udp_port),
+                                 .sin_addr.s_addr = INADDR_ANY};
+
+  if (bind(*udp_fd, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0)
   {
-    perror("Failed to lock warehouse file");
+    perror("UDP bind");
+    close(*listen_fd);
+    close(*udp_fd);
     return 0;
   }
   return 1;
 }
 
-// Function to unlock the warehouse file
-int unlock_warehouse()
+// Open the UDS stream listener and datagram socket. Unix sockets cannot
+// use SO_REUSEPORT, so reactors share this single pair.
+int open_uds_sockets(int *listen_fd, int *udp_fd)
 {
-  if (warehouse_fd == -1)
-    return 1; // No file locking needed
+  struct sockaddr_un unix_addr;
+
+  //--------------------UDS stream socket setup-------------------------------
+  *listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (*listen_fd < 0)
+  {
+    perror("UDS stream socket");
+    return 0;
+  }
+
+  // Remove existing socket file if it exists
+  unlink(stream_path);
+
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  strncpy(unix_addr.sun_path, stream_path, sizeof(unix_addr.sun_path) - 1);
+
+  if (bind(*listen_fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
+  {
+    perror("UDS stream bind");
+    close(*listen_fd);
+    return 0;
+  }
 
-  struct flock unlock_lock = {
-      .l_type = F_UNLCK,
-      .l_whence = SEEK_SET,
-      .l_start = 0,
-      .l_len = sizeof(wareHouse),
-      .l_pid = 0};
+  if (listen(*listen_fd, listen_backlog) < 0)
+  {
+    perror("UDS stream listen");
+    close(*listen_fd);
+    return 0;
+  }
 
-  if (fcntl(warehouse_fd, F_SETLK, &unlock_lock) == -1)
+  // -------------------UDS datagram socket setup-------------------------------
+  *udp_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (*udp_fd < 0)
   {
-    perror("Failed to unlock warehouse file");
+    perror("UDS datagram socket");
+    close(*listen_fd);
+    return 0;
+  }
+
+  // Remove existing socket file if it exists
+  unlink(datagram_path);
+
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  strncpy(unix_addr.sun_path, datagram_path, sizeof(unix_addr.sun_path) - 1);
+
+  if (bind(*udp_fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
+  {
+    perror("UDS datagram bind");
+    close(*listen_fd);
+    close(*udp_fd);
     return 0;
   }
   return 1;
 }
 
-// Function to initialize warehouse file and memory mapping
-int init_warehouse_file(const char *file_path, int carbon, int hydrogen, int oxygen)
+//------------------------------------------------------------------------
+
+// ---------------------------event handlers-------------------------------
+
+// Accept every pending connection; the listener is edge-triggered so we
+// keep calling accept4() until EAGAIN, and a reconnect storm is taken in a
+// single wakeup
+void accept_clients(reactor *r)
+{
+  while (1)
+  {
+    r->syscalls++;
+    int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno == EMFILE || errno == ENFILE)
+      {
+        if (reject_with_spare_fd(r))
+        {
+          r->batch_rejected++;
+          continue;
+        }
+      }
+      else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept4");
+      break;
+    }
+
+    if (!admit_client(r, client_fd))
+    {
+      r->batch_rejected++;
+      continue;
+    }
+
+    r->syscalls++;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET};
+    ev.data.fd = client_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      remove_client(r, client_fd);
+      r->batch_rejected++;
+      continue;
+    }
+    r->batch_accepted++;
+    log_event(LOG_LEVEL_INFO, LOG_CONNECTED, NULL, NULL, 0, client_fd, r->clients_count, 0);
+  }
+  record_accept_batch(r);
+}
+
+// Warehouse a command runs in: the one its @name prefix names, else
+// fallback. Returns -1 for a name that cannot be used.
+int command_location(const command *cmd, int fallback)
+{
+  if (!cmd->warehouse)
+    return fallback;
+  if (crdt_running)
+  {
+    metrics_count(METRIC_BAD_WAREHOUSE, 1);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Error: named warehouses are not shared by a CRDT group", NULL, 0, 0, 0, 0);
+    return -1;
+  }
+  int location = warehouse_location(cmd->warehouse, cmd->warehouse_len);
+  if (location < 0)
+  {
+    metrics_count(METRIC_BAD_WAREHOUSE, 1);
+    log_event(LOG_LEVEL_WARN, LOG_BAD_WAREHOUSE, NULL, cmd->warehouse, cmd->warehouse_len, 0, 0, 0);
+  }
+  return location;
+}
+
+// Count a command by type for the metrics endpoint; console-only commands
+// other than GEN and USE are not counted
+static void count_command(int type)
+{
+  static const int counters[] = {
+      [CMD_INVALID] = METRIC_INVALID, [CMD_ADD] = METRIC_ADD,       [CMD_DELIVER] = METRIC_DELIVER,
+      [CMD_GEN] = METRIC_GEN,         [CMD_SNAPSHOT] = -1,          [CMD_USE] = METRIC_USE,
+      [CMD_PROMOTE] = -1,             [CMD_LEASE] = METRIC_LEASE,   [CMD_RETURN] = METRIC_RETURN,
+      [CMD_LATENCY] = -1};
+  if (counters[type] >= 0)
+    metrics_count(counters[type], 1);
+}
+
+// -------------------requests answered after a round trip---------------------
+// In a raft group a change commits only after a round trip to the
+// followers, a primary with sync backups waits for their acks, and an edge
+// may have to ask its central; a reactor waits for none of them. The
+// request is parked with what its reply needs and submitted with
+// warehouse_*_async() or edge_forward_async(); the raft, replication or
+// forwarding thread finishes it. A datagram reply then goes back to the
+// reactor that took the request and is sent from there.
+
+// Where a datagram came from, and the tag an edge put on it, which its
+// reply must start with
+typedef struct datagramSource
+{
+  reactor *r;
+  const struct sockaddr *addr;
+  socklen_t addr_len;
+  const char *tag;
+  int tag_len;
+} datagramSource;
+
+typedef struct parkedRequest
+{
+  int type; // CMD_ADD, CMD_DELIVER or CMD_GEN
+  int id;   // atom, molecule or drink
+  int location;
+  unsigned long long quantity; // ADD
+  unsigned long long start;    // when the request came in
+  unsigned long long submitted;
+  // Datagram: who asked, as they named the molecule, and the reply, which
+  // starts with the tag of the request
+  reactor *r;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char name[64];
+  int tag_len;
+  int response_len;
+  char response[DGRAM_SIZE];
+  struct parkedRequest *next;
+} parkedRequest;
+
+// Guards every reactor's parked list, and whether the reactors are still
+// there to take replies
+pthread_mutex_t parked_mutex = PTHREAD_MUTEX_INITIALIZER;
+int parked_open = 1;
+
+static parkedRequest *park_request(int type, int id, int location, unsigned long long start)
+{
+  parkedRequest *p = calloc(1, sizeof(parkedRequest));
+  if (!p)
+    return NULL;
+  p->type = type;
+  p->id = id;
+  p->location = location;
+  p->start = start;
+  p->submitted = latency_now();
+  return p;
+}
+
+// The reply goes to src once the request is finished
+static void park_reply_to(parkedRequest *p, const datagramSource *src)
+{
+  p->r = src->r;
+  memcpy(&p->addr, src->addr, src->addr_len);
+  p->addr_len = src->addr_len;
+  memcpy(p->response, src->tag, src->tag_len);
+  p->tag_len = src->tag_len;
+}
+
+// Write the reply after the tag
+static void set_reply(parkedRequest *p, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(p->response + p->tag_len, sizeof(p->response) - p->tag_len, format, args);
+  va_end(args);
+  p->response_len = p->tag_len + strlen(p->response + p->tag_len);
+}
+
+// Raft, replication or forwarding thread: queue a finished reply for its
+// reactor
+static void post_reply(parkedRequest *p)
+{
+  reactor *r = p->r;
+  pthread_mutex_lock(&parked_mutex);
+  if (!parked_open)
+  {
+    pthread_mutex_unlock(&parked_mutex);
+    free(p);
+    return;
+  }
+  if (r->parked_tail)
+    r->parked_tail->next = p;
+  else
+    r->parked_head = p;
+  r->parked_tail = p;
+  unsigned long long one = 1;
+  if (write(r->wake_fd, &one, sizeof(one)) < 0)
+    perror("reactor wakeup");
+  pthread_mutex_unlock(&parked_mutex);
+}
+
+// Reactor thread: take the replies finished for it
+static parkedRequest *take_replies(reactor *r)
 {
-  warehouse_file_path = strdup(file_path);
+  unsigned long long count;
+  r->syscalls++;
+  if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("reactor wakeup");
+  pthread_mutex_lock(&parked_mutex);
+  parkedRequest *p = r->parked_head;
+  r->parked_head = r->parked_tail = NULL;
+  pthread_mutex_unlock(&parked_mutex);
+  return p;
+}
 
-  // Try to open existing file first
-  warehouse_fd = open(file_path, O_RDWR);
-  int file_exists = (warehouse_fd != -1);
+// A reply is out: account for it and let the request go
+static void reply_sent(parkedRequest *p)
+{
+  latency_record(LATENCY_DELIVER, LATENCY_TOTAL, latency_now() - p->start, 1);
+  metrics_count(METRIC_BYTES_OUT, p->response_len);
+  free(p);
+}
 
-  if (!file_exists)
+static void delivery_applied(int result, void *arg)
+{
+  parkedRequest *p = arg;
+  const char *molecule = molecule_recipes[p->id].name;
+  latency_record(LATENCY_DELIVER, LATENCY_WAREHOUSE, latency_now() - p->submitted, 1);
+  warehouse_use(p->location);
+  if (result > 0)
   {
-    // Create new file
-    warehouse_fd = open(file_path, O_RDWR | O_CREAT, 0644);
-    if (warehouse_fd == -1)
+    log_event(LOG_LEVEL_DEBUG, LOG_DELIVERED, molecule, NULL, 0, 0, 0, 0);
+    log_event(LOG_LEVEL_DEBUG, LOG_MESSAGE, "currently in ware house there: ", NULL, 0, 0, 0, 0);
+    printAtoms();
+    set_reply(p, "OK: Delivered %s", molecule);
+  }
+  else
+  {
+    if (result == 0)
     {
-      perror("Failed to create warehouse file");
-      return 0;
+      metrics_count(METRIC_NOT_ENOUGH, 1);
+      log_event(LOG_LEVEL_DEBUG, LOG_NOT_ENOUGH, molecule, NULL, 0, 0, 0, 0);
     }
+    printAtoms();
+    set_reply(p, "did not deliver %s, sorry.", p->name);
+  }
+  warehouse_use(0);
+  post_reply(p);
+}
+
+static void add_applied(int result, void *arg)
+{
+  parkedRequest *p = arg;
+  latency_record(LATENCY_ADD, LATENCY_WAREHOUSE, latency_now() - p->submitted, 1);
+  warehouse_use(p->location);
+  if (result == 0)
+  {
+    metrics_count(METRIC_WAREHOUSE_FULL, 1);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Warehouse is full, atoms were not added", NULL, 0, 0, 0, 0);
+  }
+  log_event(LOG_LEVEL_DEBUG, LOG_ADDED, atom_names[p->id], NULL, 0, p->quantity, 0, 0);
+  printAtoms();
+  warehouse_use(0);
+  latency_record(LATENCY_ADD, LATENCY_TOTAL, latency_now() - p->start, 1);
+  free(p);
+}
+
+static void drink_applied(int result, void *arg)
+{
+  parkedRequest *p = arg;
+  const char *drink = drink_recipes[p->id].name;
+  latency_record(LATENCY_GEN, LATENCY_WAREHOUSE, latency_now() - p->submitted, 1);
+  warehouse_use(p->location);
+  if (result == 0)
+  {
+    metrics_count(METRIC_NOT_ENOUGH, 1);
+    log_event(LOG_LEVEL_DEBUG, LOG_NOT_ENOUGH, drink, NULL, 0, 0, 0, 0);
+  }
+  log_event(LOG_LEVEL_INFO, result > 0 ? LOG_GENERATED : LOG_NOT_GENERATED, drink, NULL, 0, 0, 0, 0);
+  log_event(LOG_LEVEL_INFO, LOG_MESSAGE, "------------------------------", NULL, 0, 0, 0, 0);
+  printAtoms();
+  warehouse_use(0);
+  latency_record(LATENCY_GEN, LATENCY_TOTAL, latency_now() - p->start, 1);
+  free(p);
+}
+
+// Submit a DELIVER without waiting for it. Returns -1 once it is on its
+// way, otherwise the length of the reply already in response.
+static int park_delivery(const datagramSource *src, const command *cmd, int location,
+                         unsigned long long start, char *response, size_t response_size)
+{
+  unsigned long long need[3];
+  parkedRequest *p = NULL;
+  // A product that overflows is more than any warehouse can hold
+  if (!recipe_scale(&molecule_recipes[cmd->id], cmd->quantity, need) ||
+      !(p = park_request(CMD_DELIVER, cmd->id, location, start)))
+  {
+    metrics_count(METRIC_NOT_ENOUGH, 1);
+    snprintf(response, response_size, "did not deliver %.*s, sorry.", (int)cmd->name_len, cmd->name);
+    return strlen(response);
+  }
+  park_reply_to(p, src);
+  snprintf(p->name, sizeof(p->name), "%.*s", (int)cmd->name_len, cmd->name);
+
+  warehouse_use(location);
+  int submitted = warehouse_take_async(need[0], need[1], need[2], delivery_applied, p);
+  warehouse_use(0);
+  if (submitted)
+    return -1;
+  free(p);
+  metrics_count(METRIC_REFUSED, 1);
+  snprintf(response, response_size, "not leader, try again later");
+  return strlen(response);
+}
+
+// Submit an ADD without waiting for it. Returns 0 if it was refused.
+static int park_add(int fd, const command *cmd, int location, unsigned long long start)
+{
+  parkedRequest *p = park_request(CMD_ADD, cmd->id, location, start);
+  if (p)
+    p->quantity = cmd->quantity;
+  warehouse_use(location);
+  int submitted = p && warehouse_add_async(cmd->id, cmd->quantity, add_applied, p);
+  warehouse_use(0);
+  if (submitted)
+    return 1;
+  free(p);
+  metrics_count(METRIC_REFUSED, 1);
+  log_event(LOG_LEVEL_WARN, LOG_ADD_REFUSED, "not the raft leader", NULL, 0, fd, 0, 0);
+  return 0;
+}
+
+// Submit a GEN from the console without waiting for it
+static void park_drink(int drink, int location, unsigned long long start)
+{
+  const recipe *r = &drink_recipes[drink];
+  parkedRequest *p = park_request(CMD_GEN, drink, location, start);
+  warehouse_use(location);
+  int submitted = p && warehouse_take_async(r->atoms[0], r->atoms[1], r->atoms[2], drink_applied, p);
+  warehouse_use(0);
+  if (submitted)
+    return;
+  free(p);
+  metrics_count(METRIC_REFUSED, 1);
+  printf("Not the raft leader, GEN on the leader once elected\n");
+}
+
+static void forward_answered(const char *reply, int len, void *arg)
+{
+  parkedRequest *p = arg;
+  if (len < 0)
+    set_reply(p, "central warehouse not answering, sorry.");
+  else
+    set_reply(p, "%.*s", len, reply);
+  post_reply(p);
+}
+
+// Relay a datagram an edge does not serve itself to its central, without
+// waiting for the reply. Returns -1 once it is on its way, otherwise the
+// length of the reply already in response.
+static int park_forward(const datagramSource *src, int type, const char *buffer, size_t len,
+                        unsigned long long start, char *response, size_t response_size)
+{
+  parkedRequest *p = park_request(type, -1, 0, start);
+  if (p)
+    park_reply_to(p, src);
+  if (p && edge_forward_async(buffer, len, forward_answered, p))
+    return -1;
+  free(p);
+  return snprintf(response, response_size, "central warehouse not answering, sorry.");
+}
+
+static int serve_datagram(const datagramSource *src, const char *buffer, size_t len, char *response,
+                          size_t response_size, unsigned long long start)
+{
+  command cmd;
+  int location;
+  int type = parse_command(buffer, len, &cmd);
+  count_command(type);
+  if (type == CMD_DELIVER)
+  {
+    latency_command = LATENCY_DELIVER;
+    latency_stage(LATENCY_PARSE, start);
+  }
+  if (type != CMD_DELIVER && type != CMD_LEASE && type != CMD_RETURN)
+  {
+    snprintf(response, response_size, "invalid command, sorry.");
+    return strlen(response);
+  }
+  // An edge holds a lease of the default warehouse only
+  if (edge_running && (type != CMD_DELIVER || cmd.warehouse))
+    return park_forward(src, type, buffer, len, start, response, response_size);
+  if ((location = command_location(&cmd, 0)) < 0)
+  {
+    snprintf(response, response_size, "invalid command, sorry.");
+    return strlen(response);
+  }
+  if (replica_role() == REPLICA_BACKUP)
+  {
+    metrics_count(METRIC_REFUSED, 1);
+    snprintf(response, response_size, "backup, not delivering, sorry.");
+    return strlen(response);
+  }
+  if (raft_running && !raft_is_leader())
+  {
+    const char *leader = raft_leader_address();
+    metrics_count(METRIC_REFUSED, 1);
+    snprintf(response, response_size, "not leader, try %s", leader ? leader : "again later");
+    return strlen(response);
+  }
 
-    // Initialize file with default values
-    wareHouse initial_warehouse = {
-        .carbon = (carbon > 0) ? carbon : 0,
-        .hydrogen = (hydrogen > 0) ? hydrogen : 0,
-        .oxygen = (oxygen > 0) ? oxygen : 0};
+  if (type != CMD_DELIVER)
+  {
+    warehouse_use(location);
+    int got = type == CMD_LEASE ? edge_grant(cmd.atoms, response, response_size)
+                                : edge_take_back(cmd.atoms, response, response_size);
+    warehouse_use(0);
+    log_event(LOG_LEVEL_DEBUG, LOG_REPLY, NULL, response, got, 0, 0, 0);
+    return got;
+  }
 
-    if (write(warehouse_fd, &initial_warehouse, sizeof(wareHouse)) != sizeof(wareHouse))
+  const char *molecule = cmd.id >= 0 ? molecule_recipes[cmd.id].name : NULL;
+  if (molecule && (raft_running || replica_sync()))
+    return park_delivery(src, &cmd, location, start, response, response_size);
+
+  warehouse_use(location);
+  unsigned long long taking = latency_now();
+  int delivered = molecule && deliverMolecules(cmd.id, cmd.quantity);
+  if (molecule)
+    latency_stage(LATENCY_WAREHOUSE, taking);
+  if (molecule && edge_running)
+  {
+    // The lease covers it, or the central may
+    if (!delivered)
     {
-      perror("Failed to initialize warehouse file");
-      close(warehouse_fd);
-      return 0;
+      edge_spent();
+      log_event(LOG_LEVEL_DEBUG, LOG_FORWARDED, molecule, NULL, 0, 0, 0, 0);
+      return park_forward(src, type, buffer, len, start, response, response_size);
     }
+    edge_spent();
+    log_event(LOG_LEVEL_DEBUG, LOG_DELIVERED, molecule, NULL, 0, 0, 0, 0);
+    return snprintf(response, response_size, "OK: Delivered %s", molecule);
+  }
+  if (delivered)
+  {
+    log_event(LOG_LEVEL_DEBUG, LOG_DELIVERED, molecule, NULL, 0, 0, 0, 0);
+    log_event(LOG_LEVEL_DEBUG, LOG_MESSAGE, "currently in ware house there: ", NULL, 0, 0, 0, 0);
+    printAtoms();
+    snprintf(response, response_size, "OK: Delivered %s", molecule);
   }
   else
   {
-    // Check if existing file has correct size
-    off_t file_size = lseek(warehouse_fd, 0, SEEK_END);
-    if (file_size != sizeof(wareHouse))
+    if (!molecule)
     {
-      fprintf(stderr, "Warehouse file has incorrect size\n");
-      close(warehouse_fd);
-      return 0;
+      metrics_count(METRIC_UNKNOWN_MOLECULE, 1);
+      log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "you tried to deliver unexisting molecule", NULL, 0, 0, 0, 0);
     }
-    lseek(warehouse_fd, 0, SEEK_SET);
+    printAtoms();
+    snprintf(response, response_size, "did not deliver %.*s, sorry.", (int)cmd.name_len,
+             cmd.name);
   }
+  warehouse_use(0);
+  return strlen(response);
+}
 
-  // Map file to memory
-  warehouse_ptr = mmap(NULL, sizeof(wareHouse), PROT_READ | PROT_WRITE, MAP_SHARED, warehouse_fd, 0);
-  if (warehouse_ptr == MAP_FAILED)
+// Apply one DELIVER (or an edge's LEASE/RETURN) datagram from r's socket
+// and build the reply. Shared by every I/O backend; buffer[0..len) need
+// not be NUL-terminated. Returns the reply length, or -1 if the request
+// went to the raft log or the central and its reply will come back
+// through r->wake_fd. Datagrams have no connection to remember a USE, so
+// only the @name prefix picks a warehouse. An edge's tag is copied to the
+// start of the reply.
+int process_datagram(reactor *r, const struct sockaddr *from, socklen_t from_len,
+                     const char *buffer, size_t len, char *response, size_t response_size)
+{
+  unsigned long long start = latency_now();
+  datagramSource src = {r, from, from_len, buffer, edge_tag_length(buffer, len)};
+  memcpy(response, src.tag, src.tag_len);
+  int got = serve_datagram(&src, buffer + src.tag_len, len - src.tag_len, response + src.tag_len,
+                           response_size - src.tag_len, start);
+  if (got >= 0)
+    got += src.tag_len;
+  metrics_count(METRIC_BYTES_IN, len);
+  if (got >= 0)
   {
-    perror("Failed to map warehouse file to memory");
-    close(warehouse_fd);
+    latency_stage(LATENCY_TOTAL, start);
+    metrics_count(METRIC_BYTES_OUT, got);
+  }
+  latency_command = -1;
+  return got;
+}
+
+// Returns 1 if the line went to the raft log and is finished from there
+static int serve_stream_line(clientConn *c, const char *line, size_t len, unsigned long long start)
+{
+  command cmd;
+  int type = parse_command(line, len, &cmd);
+  count_command(type);
+  if (type == CMD_ADD)
+  {
+    latency_command = LATENCY_ADD;
+    latency_stage(LATENCY_PARSE, start);
+  }
+  if (type == CMD_USE)
+  {
+    int location = command_location(&cmd, -1);
+    if (location >= 0)
+    {
+      c->location = location;
+      log_event(LOG_LEVEL_INFO, LOG_USE, NULL, cmd.warehouse, cmd.warehouse_len, c->fd, 0, 0);
+    }
     return 0;
   }
+  if (type != CMD_ADD)
+    return 0;
+  if (replica_role() == REPLICA_BACKUP)
+  {
+    metrics_count(METRIC_REFUSED, 1);
+    log_event(LOG_LEVEL_WARN, LOG_ADD_REFUSED, "this is a backup", NULL, 0, c->fd, 0, 0);
+    return 0;
+  }
+  if (raft_running && !raft_is_leader())
+  {
+    metrics_count(METRIC_REFUSED, 1);
+    log_event(LOG_LEVEL_WARN, LOG_ADD_REFUSED, "not the raft leader", NULL, 0, c->fd, 0, 0);
+    return 0;
+  }
+
+  int location = command_location(&cmd, c->location);
+  if (location < 0)
+    return 0;
+  if (cmd.id > 0 && (raft_running || replica_sync()))
+    return park_add(c->fd, &cmd, location, start);
+  if (cmd.id > 0)
+  {
+    warehouse_use(location);
+    unsigned long long adding = latency_now();
+    addAtom(cmd.id, cmd.quantity);
+    latency_stage(LATENCY_WAREHOUSE, adding);
+    log_event(LOG_LEVEL_DEBUG, LOG_ADDED, atom_names[cmd.id], NULL, 0, cmd.quantity, 0, 0);
+    printAtoms();
+    warehouse_use(0);
+  }
+  else
+  {
+    metrics_count(METRIC_UNKNOWN_ATOM, 1);
+    log_event(LOG_LEVEL_WARN, LOG_UNKNOWN_ATOM, NULL, cmd.name, cmd.name_len, 0, 0, 0);
+  }
+  return 0;
+}
 
+// Run one line from a stream connection; only ADD and USE are served
+void process_stream_data(clientConn *c, const char *line, size_t len)
+{
+  unsigned long long start = latency_now();
+  if (!serve_stream_line(c, line, len, start))
+    latency_stage(LATENCY_TOTAL, start);
+  latency_command = -1;
+}
+
+int append_pending(clientConn *c, const char *data, size_t len)
+{
+  if (c->pending_len + len + 1 > c->pending_cap)
+  {
+    size_t new_cap = c->pending_cap ? c->pending_cap : 256;
+    while (new_cap < c->pending_len + len + 1)
+      new_cap *= 2;
+    char *grown = realloc(c->pending, new_cap);
+    if (!grown)
+      return 0;
+    c->pending = grown;
+    c->pending_cap = new_cap;
+  }
+  memcpy(c->pending + c->pending_len, data, len);
+  c->pending_len += len;
   return 1;
 }
 
-// Modified addAtom function to work with file-backed storage
-void addAtom(int atom, int quantity, wareHouse *warehouse)
+static void line_too_long(clientConn *c)
 {
-  if (!lock_warehouse())
+  metrics_count(METRIC_LINE_TOO_LONG, 1);
+  log_event(LOG_LEVEL_WARN, LOG_LINE_TOO_LONG, NULL, NULL, 0, c->fd, MAX_LINE, 0);
+}
+
+// Run every complete line in data[0..len) in order. Lines are handed on
+// as pointer and length, so data is never written or NUL-terminated. A
+// trailing partial line is kept in the connection until the rest of it
+// arrives.
+void run_lines(reactor *r, clientConn *c, const char *data, size_t len)
+{
+  const char *line = data, *end = data + len;
+  while (line < end)
+  {
+    const char *newline = memchr(line, '\n', end - line);
+    if (!newline)
+      break;
+    if (!c->discarding && newline - line > MAX_LINE)
+      line_too_long(c);
+    else if (!c->discarding)
+    {
+      r->requests++;
+      process_stream_data(c, line, newline - line);
+    }
+    c->discarding = 0;
+    line = newline + 1;
+  }
+
+  size_t rest = end - line;
+  if (rest == 0 || c->discarding)
+    return;
+  if (rest > MAX_LINE)
+  {
+    line_too_long(c);
+    c->discarding = 1;
     return;
+  }
+  append_pending(c, line, rest);
+}
 
-  switch (atom)
+// Feed bytes received on a stream connection. When nothing is pending the
+// lines are parsed straight out of the receive buffer; otherwise the new
+// bytes are joined to the carried-over partial line first.
+void stream_consume(reactor *r, clientConn *c, char *data, size_t len)
+{
+  metrics_count(METRIC_BYTES_IN, len);
+  if (c->pending_len == 0)
   {
-  case 1:
-    warehouse->carbon += quantity;
-    break;
-  case 2:
-    warehouse->hydrogen += quantity;
-    break;
-  case 3:
-    warehouse->oxygen += quantity;
-    break;
-  default:
-    printf("Unknown atom type\n");
-    break;
+    run_lines(r, c, data, len);
+    return;
   }
 
-  // Force write to disk
-  if (warehouse_ptr)
+  char *newline = memchr(data, '\n', len);
+  if (!newline)
   {
-    msync(warehouse_ptr, sizeof(wareHouse), MS_SYNC);
+    if (c->pending_len + len > MAX_LINE)
+    {
+      line_too_long(c);
+      c->pending_len = 0;
+      c->discarding = 1;
+      return;
+    }
+    append_pending(c, data, len);
+    return;
   }
 
-  unlock_warehouse();
+  // Complete the carried-over line, then continue in the receive buffer
+  size_t head = newline - data + 1;
+  if (c->pending_len + head > MAX_LINE + 1)
+  {
+    line_too_long(c);
+    c->pending_len = 0;
+  }
+  else if (append_pending(c, data, head))
+  {
+    size_t line_len = c->pending_len;
+    c->pending_len = 0;
+    run_lines(r, c, c->pending, line_len);
+  }
+  run_lines(r, c, newline + 1, len - head);
 }
 
-void printAtoms(wareHouse *warehouse)
+// Buffers for one recvmmsg/sendmmsg round trip
+typedef struct dgramBatch
 {
-  printf("Carbon: %llu\n", warehouse->carbon);
-  printf("Hydrogen: %llu\n", warehouse->hydrogen);
-  printf("Oxygen: %llu\n", warehouse->oxygen);
+  struct mmsghdr *in;
+  struct mmsghdr *out;
+  struct iovec *in_iov;
+  struct iovec *out_iov;
+  struct sockaddr_storage *addrs;
+  char (*requests)[DGRAM_SIZE];
+  char (*responses)[DGRAM_SIZE];
+} dgramBatch;
+
+dgramBatch *dgram_batch_alloc(int size)
+{
+  dgramBatch *batch = calloc(1, sizeof(dgramBatch));
+  if (!batch)
+    return NULL;
+  batch->in = calloc(size, sizeof(struct mmsghdr));
+  batch->out = calloc(size, sizeof(struct mmsghdr));
+  batch->in_iov = calloc(size, sizeof(struct iovec));
+  batch->out_iov = calloc(size, sizeof(struct iovec));
+  batch->addrs = calloc(size, sizeof(struct sockaddr_storage));
+  batch->requests = calloc(size, DGRAM_SIZE);
+  batch->responses = calloc(size, DGRAM_SIZE);
+  return batch;
 }
 
-//------------------------------------------------------------------------
+void dgram_batch_free(dgramBatch *batch)
+{
+  if (!batch)
+    return;
+  free(batch->in);
+  free(batch->out);
+  free(batch->in_iov);
+  free(batch->out_iov);
+  free(batch->addrs);
+  free(batch->requests);
+  free(batch->responses);
+  free(batch);
+}
 
-// ---------------molecule deliver functions-----------------------------
+// Send the first count replies set up in r->dgram->out. Each reply is
+// charged its share of the sends; every datagram reply counts as a
+// DELIVER one.
+static void send_replies(reactor *r, int count)
+{
+  dgramBatch *batch = r->dgram;
+  unsigned long long sending = latency_now();
+  int sent = 0;
+  while (sent < count)
+  {
+    r->syscalls++;
+    r->dgram_send_calls++;
+    int n = sendmmsg(r->udp_fd, batch->out + sent, count - sent, MSG_DONTWAIT);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      // Socket buffer full or peer gone; like sendto() the reply is lost
+      sent++;
+      continue;
+    }
+    sent += n;
+  }
+  if (count > 0)
+    latency_record(LATENCY_DELIVER, LATENCY_REPLY, (latency_now() - sending) / count, count);
+}
 
-void numberOfAtomsNeeded(const char *molecule, int *carbon, int *oxygen,
-                         int *hydrogen, int numberOfMoleculs)
+// Send the DELIVER replies raft finished for this reactor, a batch at a time
+void send_parked(reactor *r)
 {
-  if (numberOfMoleculs > 0)
+  dgramBatch *batch = r->dgram;
+  parkedRequest *p = take_replies(r);
+  while (p)
   {
-    if (strcmp(molecule, "WATER") == 0)
+    parkedRequest *sending[dgram_batch_size];
+    int count = 0;
+    for (; p && count < dgram_batch_size; p = p->next, count++)
     {
-      *hydrogen = 2 * numberOfMoleculs;
-      *oxygen = 1 * numberOfMoleculs;
-      *carbon = 0 * numberOfMoleculs;
+      sending[count] = p;
+      batch->out_iov[count].iov_base = p->response;
+      batch->out_iov[count].iov_len = p->response_len;
+      memset(&batch->out[count].msg_hdr, 0, sizeof(struct msghdr));
+      batch->out[count].msg_hdr.msg_iov = &batch->out_iov[count];
+      batch->out[count].msg_hdr.msg_iovlen = 1;
+      batch->out[count].msg_hdr.msg_name = &p->addr;
+      batch->out[count].msg_hdr.msg_namelen = p->addr_len;
     }
+    send_replies(r, count);
+    for (int i = 0; i < count; i++)
+      reply_sent(sending[i]);
+  }
+}
+
+// Drain the datagram socket and answer every DELIVER request. Up to
+// dgram_batch_size requests come in with one recvmmsg() and all of their
+// replies go out with one sendmmsg().
+void handle_datagrams(reactor *r)
+{
+  dgramBatch *batch = r->dgram;
+  int size = dgram_batch_size;
 
-    else if (strcmp(molecule, "CARBON DIOXIDE") == 0)
+  while (1)
+  {
+    for (int i = 0; i < size; i++)
     {
-      *carbon = 1 * numberOfMoleculs;
-      *oxygen = 2 * numberOfMoleculs;
-      *hydrogen = 0 * numberOfMoleculs;
+      batch->in_iov[i].iov_base = batch->requests[i];
+      batch->in_iov[i].iov_len = DGRAM_SIZE - 1;
+      memset(&batch->in[i].msg_hdr, 0, sizeof(struct msghdr));
+      batch->in[i].msg_hdr.msg_iov = &batch->in_iov[i];
+      batch->in[i].msg_hdr.msg_iovlen = 1;
+      batch->in[i].msg_hdr.msg_name = &batch->addrs[i];
+      batch->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
     }
 
-    else if (strcmp(molecule, "GLUCOSE") == 0)
+    r->syscalls++;
+    r->dgram_recv_calls++;
+    int received = recvmmsg(r->udp_fd, batch->in, size, MSG_DONTWAIT, NULL);
+    if (received < 0)
     {
-      *carbon = 6 * numberOfMoleculs;
-      *hydrogen = 12 * numberOfMoleculs;
-      *oxygen = 6 * numberOfMoleculs;
+      if (errno == EINTR)
+        continue;
+      return; // EAGAIN - nothing more queued
     }
 
-    else if (strcmp(molecule, "ALCOHOL") == 0)
+    int replies = 0;
+    for (int i = 0; i < received; i++)
     {
-      *carbon = 2 * numberOfMoleculs;
-      *hydrogen = 6 * numberOfMoleculs;
-      *oxygen = 1 * numberOfMoleculs;
+      unsigned len = batch->in[i].msg_len;
+      if (len == 0)
+        continue;
+
+      r->requests++;
+      r->dgrams++;
+
+      int response_len = process_datagram(r, (struct sockaddr *)&batch->addrs[i],
+                                          batch->in[i].msg_hdr.msg_namelen, batch->requests[i],
+                                          len, batch->responses[replies], DGRAM_SIZE);
+      if (response_len < 0)
+        continue; // answered from another thread
+      batch->out_iov[replies].iov_base = batch->responses[replies];
+      batch->out_iov[replies].iov_len = response_len;
+      memset(&batch->out[replies].msg_hdr, 0, sizeof(struct msghdr));
+      batch->out[replies].msg_hdr.msg_iov = &batch->out_iov[replies];
+      batch->out[replies].msg_hdr.msg_iovlen = 1;
+      batch->out[replies].msg_hdr.msg_name = &batch->addrs[i];
+      batch->out[replies].msg_hdr.msg_namelen = batch->in[i].msg_hdr.msg_namelen;
+      replies++;
     }
 
-    else
+    send_replies(r, replies);
+
+    // A short batch means the queue was empty when we looked
+    if (received < size)
+      return;
+  }
+}
+
+// Read everything a supplier has sent; edge-triggered, so loop to EAGAIN
+// A last command without a newline still counts once the peer hangs up
+void stream_finish(reactor *r, clientConn *c)
+{
+  if (c->pending_len == 0 || c->discarding)
+    return;
+  size_t len = c->pending_len;
+  c->pending_len = 0;
+  r->requests++;
+  process_stream_data(c, c->pending, len);
+}
+
+void handle_client_data(reactor *r, int fd)
+{
+  while (1)
+  {
+    char buffer[STREAM_READ_SIZE];
+    r->syscalls++;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (len <= 0)
     {
-      *carbon = 0;
-      *hydrogen = 0;
-      *oxygen = 0;
+      log_event(LOG_LEVEL_INFO, LOG_DISCONNECTED, NULL, NULL, 0, fd, 0, 0);
+      stream_finish(r, &r->clients[fd]);
+      remove_client(r, fd);
+      return;
     }
+
+    stream_consume(r, &r->clients[fd], buffer, len);
   }
 }
 
-// Modified deliverMolecules function to work with file-backed storage
-int deliverMolecules(wareHouse *wareHouse, const char *molecule,
-                     int numOfMolecules)
+// Warehouse the console chose with USE
+int console_location = 0;
+
+// Handle one console line; returns 0 once stdin reached EOF
+int handle_stdin()
 {
-  if (!lock_warehouse())
+  char buffer[256];
+  command cmd;
+
+  if (fgets(buffer, sizeof(buffer), stdin) == NULL)
     return 0;
 
-  int carbon, oxygen, hydrogen;
-  numberOfAtomsNeeded(molecule, &carbon, &oxygen, &hydrogen, numOfMolecules);
+  unsigned long long start = latency_now();
+  int type = parse_command(buffer, strlen(buffer), &cmd);
+  count_command(type);
+  if (type == CMD_GEN)
+    latency_record(LATENCY_GEN, LATENCY_PARSE, latency_now() - start, 1);
+  if (type == CMD_USE)
+  {
+    int location = command_location(&cmd, -1);
+    if (location >= 0)
+    {
+      console_location = location;
+      printf("Now using warehouse %.*s\n", (int)cmd.warehouse_len, cmd.warehouse);
+    }
+  }
+  else if (type == CMD_PROMOTE)
+  {
+    if (replica_role() != REPLICA_BACKUP)
+      printf("Not a backup, nothing to promote\n");
+    else
+    {
+      replica_promote();
+      printf("Promoted to primary\n");
+    }
+  }
+  else if (type == CMD_LATENCY)
+  {
+    if (cmd.name)
+    {
+      latency_reset();
+      printf("Latency histograms reset\n");
+    }
+    else
+      latency_print("");
+  }
+  else if (type == CMD_SNAPSHOT)
+  {
+    char path[PATH_MAX];
+    double pause_us;
+    snprintf(path, sizeof(path), "%.*s", (int)cmd.name_len, cmd.name);
+    pid_t child = warehouse_snapshot(path, &pause_us);
+    if (child < 0)
+      printf("Snapshot to %s failed\n", path);
+    else
+      printf("Snapshot to %s started in process %d, traffic paused for %.1f us\n", path,
+             (int)child, pause_us);
+  }
+  else if (type == CMD_GEN)
+  {
+    if (cmd.id < 0)
+    {
+      printf("Unknown drink '%.*s'\n", (int)cmd.name_len, cmd.name);
+      printf("Available drinks: VODKA, CHAMPAGNE, SOFT DRINK\n");
+      return 1;
+    }
+    const char *drink = drink_recipes[cmd.id].name;
+    int location = command_location(&cmd, console_location);
+    if (location < 0)
+      return 1;
+    if (replica_role() == REPLICA_BACKUP)
+    {
+      metrics_count(METRIC_REFUSED, 1);
+      printf("This is a backup, PROMOTE it before generating drinks\n");
+      return 1;
+    }
+    if (raft_running && !raft_is_leader())
+    {
+      const char *leader = raft_leader_address();
+      metrics_count(METRIC_REFUSED, 1);
+      printf("Not the raft leader, GEN on %s\n", leader ? leader : "the leader once elected");
+      return 1;
+    }
+
+    warehouse_use(location);
+    // Without the lease a newer leader may have changed the stock already
+    if (!raft_running || raft_read_ok())
+      howManyDrinks(cmd.id);
+    log_event(LOG_LEVEL_INFO, LOG_MESSAGE, "---------------------------------------", NULL, 0, 0, 0, 0);
+    if (raft_running || replica_sync())
+    {
+      warehouse_use(0);
+      park_drink(cmd.id, location, start);
+      return 1;
+    }
+    latency_command = LATENCY_GEN;
+    unsigned long long making = latency_now();
+    int generated = genDrinks(cmd.id);
+    latency_stage(LATENCY_WAREHOUSE, making);
+    if (edge_running)
+      edge_spent();
+    unsigned long long replying = latency_now();
+    if (generated)
+    {
+      log_event(LOG_LEVEL_INFO, LOG_GENERATED, drink, NULL, 0, 0, 0, 0);
+      log_event(LOG_LEVEL_INFO, LOG_MESSAGE, "------------------------------", NULL, 0, 0, 0, 0);
+      printAtoms();
+    }
+    else
+    {
+      log_event(LOG_LEVEL_INFO, LOG_NOT_GENERATED, drink, NULL, 0, 0, 0, 0);
+      log_event(LOG_LEVEL_INFO, LOG_MESSAGE, "------------------------------", NULL, 0, 0, 0, 0);
+      printAtoms();
+    }
+    latency_stage(LATENCY_REPLY, replying);
+    latency_stage(LATENCY_TOTAL, start);
+    latency_command = -1;
+    warehouse_use(0);
+  }
+  else
+  {
+    printf("Invalid command. Use: [@warehouse] GEN <drink_name>, USE <warehouse>, SNAPSHOT <path>, PROMOTE or LATENCY [RESET]\n");
+    printf("Available drinks: VODKA, CHAMPAGNE, SOFT DRINK\n");
+  }
+  return 1;
+}
 
-  if (carbon == 0 && oxygen == 0 && hydrogen == 0)
+//------------------------------------------------------------------------
+
+// ---------------------------event loop-----------------------------------
+
+int reactor_init(reactor *r, int shared_sockets)
+{
+  r->dgram = dgram_batch_alloc(dgram_batch_size);
+  if (!r->dgram || !r->dgram->responses)
   {
-    printf("you tried to deliver unexisting molecule");
-    unlock_warehouse();
+    perror("dgram batch");
     return 0;
   }
 
-  if (wareHouse->carbon < carbon || wareHouse->hydrogen < hydrogen ||
-      wareHouse->oxygen < oxygen)
+  r->epoll_fd = epoll_create1(0);
+  if (r->epoll_fd < 0)
   {
-    printf("there is not enough atoms to deliver %s\n", molecule);
-    unlock_warehouse();
+    perror("epoll_create1");
     return 0;
   }
 
-  wareHouse->carbon -= carbon;
-  wareHouse->hydrogen -= hydrogen;
-  wareHouse->oxygen -= oxygen;
-
-  // Force write to disk
-  if (warehouse_ptr)
+  // Listening and datagram sockets are edge-triggered, so each is drained
+  // until EAGAIN on every wakeup. Sockets shared between reactors are
+  // registered exclusively so one connection wakes only one thread.
+  set_nonblocking(r->listen_fd);
+  set_nonblocking(r->udp_fd);
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET};
+  if (shared_sockets)
+    ev.events |= EPOLLEXCLUSIVE;
+  ev.data.fd = r->listen_fd;
+  epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+  ev.data.fd = r->udp_fd;
+  epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->udp_fd, &ev);
+  if (r->wake_fd >= 0)
   {
-    msync(warehouse_ptr, sizeof(wareHouse), MS_SYNC);
+    ev.events = EPOLLIN;
+    ev.data.fd = r->wake_fd;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev);
   }
 
-  unlock_warehouse();
+  // stdin stays level-triggered and blocking since its file description is
+  // shared with the terminal. epoll refuses regular files and /dev/null, in
+  // which case there is simply no console.
+  if (r->use_stdin)
+  {
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0)
+      r->use_stdin = 0;
+  }
   return 1;
 }
 
-//--------------------------------------------------------------------------
-// --------------------------gen drinks
-// -------------------------------------------------
+void *reactor_run_uring(reactor *r);
 
-// Modified genDrinks function to work with file-backed storage
-int genDrinks(wareHouse *wareHouse, const char *drinkToMake)
+void *reactor_run(void *arg)
 {
-  if (!lock_warehouse())
+  reactor *r = arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  warehouse_bind_shard(r->id);
+  if (r->uring)
+    return reactor_run_uring(r);
+
+  while (running)
+  {
+    r->syscalls++;
+    int ready = epoll_wait(r->epoll_fd, events, MAX_EVENTS, 1000);
+    if (ready < 0)
+    {
+      if (!running)
+        break;
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    // Only the fds that are actually ready are visited
+    for (int i = 0; i < ready; i++)
+    {
+      int fd = events[i].data.fd;
+
+      if (idle_timeout > 0)
+        alarm(idle_timeout);
+
+      if (fd == r->listen_fd)
+      {
+        // Handle new connections (both TCP and UDS stream)
+        accept_clients(r);
+      }
+      else if (fd == r->udp_fd)
+      {
+        // Handle datagram messages (both UDP and UDS datagram)
+        handle_datagrams(r);
+      }
+      else if (fd == r->wake_fd)
+      {
+        // Replies finished for requests this reactor took
+        send_parked(r);
+      }
+      else if (r->use_stdin && fd == STDIN_FILENO)
+      {
+        if (!handle_stdin())
+        {
+          epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+          r->use_stdin = 0;
+        }
+      }
+      else
+      {
+        handle_client_data(r, fd);
+      }
+    }
+  }
+
+  // Wake the other reactors as well if this one failed
+  running = 0;
+  return NULL;
+}
+
+void uring_state_free(struct uringState *u);
+
+void reactor_close(reactor *r, int close_sockets)
+{
+  // Raft or the central may still finish requests this reactor took; their
+  // replies have nowhere to go now
+  pthread_mutex_lock(&parked_mutex);
+  parked_open = 0;
+  parkedRequest *p = r->parked_head;
+  r->parked_head = r->parked_tail = NULL;
+  pthread_mutex_unlock(&parked_mutex);
+  while (p)
+  {
+    parkedRequest *next = p->next;
+    free(p);
+    p = next;
+  }
+  if (r->wake_fd != -1)
+    close(r->wake_fd);
+
+  uring_state_free(r->uring);
+  dgram_batch_free(r->dgram);
+  if (r->use_stdin)
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+  for (int fd = 0; fd < r->clients_cap; fd++)
+  {
+    if (r->clients[fd].active)
+      close(fd);
+  }
+  free(r->clients);
+  if (r->epoll_fd != -1)
+    close(r->epoll_fd);
+  if (close_sockets)
+  {
+    close(r->listen_fd);
+    if (r->udp_fd != -1)
+      close(r->udp_fd);
+  }
+}
+
+//----------------------------------------------------------------------------------------
+
+// ---------------------------io_uring backend-----------------------------
+// Same command handlers as the epoll loop, but accept and receive are
+// multishot requests fed from provided buffer rings, replies are queued as
+// SENDMSG requests, and everything is submitted in one io_uring_enter()
+// per loop iteration.
+
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024 // per buffer group, must be a power of two
+#define URING_BUF_SIZE 512
+#define URING_SENDS 256
+#define BGID_STREAM 1
+#define BGID_DGRAM 2
+
+enum uringOp
+{
+  OP_ACCEPT = 1,
+  OP_RECV,
+  OP_RECVMSG,
+  OP_SEND,
+  OP_STDIN,
+  OP_STDIN_REMOVE,
+  OP_TICK,
+  OP_WAKE
+};
+
+#define URING_DATA(op, value) (((unsigned long long)(op) << 32) | (unsigned)(value))
+#define URING_OP(data) ((int)((data) >> 32))
+#define URING_VALUE(data) ((int)((data) & 0xffffffffu))
+
+typedef struct uringSend
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_storage addr;
+  char data[256];
+  int next_free;
+} uringSend;
+
+typedef struct uringState
+{
+  uringRing ring;
+  uringBufRing stream_bufs;
+  uringBufRing dgram_bufs;
+  struct msghdr recvmsg_hdr; // layout template for multishot recvmsg
+  struct __kernel_timespec tick;
+  uringSend *sends;
+  int sends_free;
+} uringState;
+
+void uring_state_free(uringState *u)
+{
+  if (!u)
+    return;
+  uring_free_buf_ring(&u->ring, &u->stream_bufs);
+  uring_free_buf_ring(&u->ring, &u->dgram_bufs);
+  if (u->ring.fd > 0)
+    uring_exit(&u->ring);
+  free(u->sends);
+  free(u);
+}
+
+int reactor_init_uring(reactor *r)
+{
+  uringState *u = calloc(1, sizeof(uringState));
+  if (!u)
+    return 0;
+
+  int err = uring_init(&u->ring, URING_ENTRIES);
+  if (err == 0)
+    err = uring_setup_buf_ring(&u->ring, &u->stream_bufs, BGID_STREAM, URING_BUFS, URING_BUF_SIZE);
+  if (err == 0)
+    err = uring_setup_buf_ring(&u->ring, &u->dgram_bufs, BGID_DGRAM, URING_BUFS, URING_BUF_SIZE);
+  if (err != 0)
+  {
+    fprintf(stderr, "io_uring unavailable (%s)\n", strerror(-err));
+    uring_state_free(u);
     return 0;
+  }
 
-  int total_carbon = 0, total_oxygen = 0, total_hydrogen = 0;
-  int carbon, oxygen, hydrogen;
-
-  if (strcmp(drinkToMake, "VODKA") == 0)
-  {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("ALCOHOL", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("GLUCOSE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-  }
-
-  if (strcmp(drinkToMake, "CHAMPAGNE") == 0)
-  {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("ALCOHOL", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("CARBON DIOXIDE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-  }
-
-  if (strcmp(drinkToMake, "SOFT DRINK") == 0)
-  {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("GLUCOSE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("CARBON DIOXIDE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-  }
-
-  if (wareHouse->carbon < total_carbon ||
-      wareHouse->hydrogen < total_hydrogen ||
-      wareHouse->oxygen < total_oxygen)
-  {
-    printf("there is not enough atoms to deliver %s\n", drinkToMake);
-    unlock_warehouse();
+  u->sends = calloc(URING_SENDS, sizeof(uringSend));
+  if (!u->sends)
+  {
+    uring_state_free(u);
     return 0;
   }
+  for (int i = 0; i < URING_SENDS; i++)
+    u->sends[i].next_free = i + 1;
+  u->sends[URING_SENDS - 1].next_free = -1;
+  u->sends_free = 0;
+
+  u->recvmsg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+  u->tick.tv_sec = 1;
+  r->uring = u;
+  return 1;
+}
 
-  wareHouse->carbon -= total_carbon;
-  wareHouse->hydrogen -= total_hydrogen;
-  wareHouse->oxygen -= total_oxygen;
+void uring_arm_accept(reactor *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = r->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_DATA(OP_ACCEPT, r->listen_fd);
+}
+
+void uring_arm_recv(reactor *r, int fd)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BGID_STREAM;
+  sqe->user_data = URING_DATA(OP_RECV, fd);
+}
 
-  // Force write to disk
-  if (warehouse_ptr)
+void uring_arm_recvmsg(reactor *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = r->udp_fd;
+  sqe->addr = (unsigned long)&r->uring->recvmsg_hdr;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BGID_DGRAM;
+  sqe->user_data = URING_DATA(OP_RECVMSG, r->udp_fd);
+}
+
+void uring_arm_stdin(reactor *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = STDIN_FILENO;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = URING_DATA(OP_STDIN, STDIN_FILENO);
+}
+
+void uring_arm_tick(reactor *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long)&r->uring->tick;
+  sqe->len = 1;
+  sqe->user_data = URING_DATA(OP_TICK, 0);
+}
+
+void uring_arm_wake(reactor *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = r->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = URING_DATA(OP_WAKE, r->wake_fd);
+}
+
+// Queue a datagram reply; it goes out with the next io_uring_enter()
+void uring_queue_send(reactor *r, const struct sockaddr *addr, socklen_t addr_len,
+                      const char *data, int len)
+{
+  uringState *u = r->uring;
+  struct io_uring_sqe *sqe = NULL;
+  if (u->sends_free >= 0)
+    sqe = uring_get_sqe(&u->ring);
+
+  if (!sqe)
   {
-    msync(warehouse_ptr, sizeof(wareHouse), MS_SYNC);
+    // Out of send slots - fall back to a direct send
+    r->syscalls++;
+    sendto(r->udp_fd, data, len, 0, addr, addr_len);
+    return;
   }
 
-  unlock_warehouse();
-  return 1;
+  int slot = u->sends_free;
+  uringSend *send = &u->sends[slot];
+  u->sends_free = send->next_free;
+
+  memcpy(&send->addr, addr, addr_len);
+  memcpy(send->data, data, len);
+  send->iov.iov_base = send->data;
+  send->iov.iov_len = len;
+  memset(&send->msg, 0, sizeof(send->msg));
+  send->msg.msg_name = &send->addr;
+  send->msg.msg_namelen = addr_len;
+  send->msg.msg_iov = &send->iov;
+  send->msg.msg_iovlen = 1;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = r->udp_fd;
+  sqe->addr = (unsigned long)&send->msg;
+  sqe->len = 1;
+  sqe->user_data = URING_DATA(OP_SEND, slot);
 }
 
-int min(int a, int b, int c)
+void uring_handle_accept(reactor *r, struct io_uring_cqe *cqe)
 {
-  if (a <= b && a <= c)
-    return a;
-  if (b <= a && b <= c)
-    return b;
-  return c;
+  if (cqe->res >= 0)
+  {
+    int client_fd = cqe->res;
+    if (!admit_client(r, client_fd))
+      r->batch_rejected++;
+    else
+    {
+      r->batch_accepted++;
+      uring_arm_recv(r, client_fd);
+      log_event(LOG_LEVEL_INFO, LOG_CONNECTED, NULL, NULL, 0, client_fd, r->clients_count, 0);
+    }
+  }
+  else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+  {
+    if (reject_with_spare_fd(r))
+      r->batch_rejected++;
+  }
+  else if (cqe->res == -EINVAL)
+  {
+    fprintf(stderr, "io_uring multishot accept not supported by this kernel\n");
+    running = 0;
+    return;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_arm_accept(r);
+}
+
+void uring_handle_recv(reactor *r, struct io_uring_cqe *cqe)
+{
+  uringState *u = r->uring;
+  int fd = URING_VALUE(cqe->user_data);
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+  {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = uring_buf_addr(&u->stream_bufs, bid);
+    stream_consume(r, &r->clients[fd], buffer, cqe->res);
+    uring_buf_recycle(&u->stream_bufs, bid);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      uring_arm_recv(r, fd);
+  }
+  else if (cqe->res == -ENOBUFS)
+  {
+    // All buffers were in flight; they are recycled by now
+    uring_arm_recv(r, fd);
+  }
+  else
+  {
+    // EOF or error terminates the multishot request, so closing is safe
+    log_event(LOG_LEVEL_INFO, LOG_DISCONNECTED, NULL, NULL, 0, fd, 0, 0);
+    stream_finish(r, &r->clients[fd]);
+    remove_client(r, fd);
+  }
 }
 
-void howManyDrinks(wareHouse *wareHouse, const char *drinkToMake)
+void uring_handle_recvmsg(reactor *r, struct io_uring_cqe *cqe)
 {
-  int total_carbon = 0, total_oxygen = 0, total_hydrogen = 0;
-  int carbon, oxygen, hydrogen;
-  unsigned long long CounerDrinksCarbon, CounerDrinksOxygen, CounerDrinksHydrogen;
+  uringState *u = r->uring;
 
-  if (strcmp(drinkToMake, "VODKA") == 0)
+  if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
   {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("ALCOHOL", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("GLUCOSE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = uring_buf_addr(&u->dgram_bufs, bid);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    char *name = buffer + sizeof(*out);
+    char *payload = name + u->recvmsg_hdr.msg_namelen + u->recvmsg_hdr.msg_controllen;
+
+    // A truncated datagram reports its full length and is dropped
+    if (out->payloadlen > 0 && payload + out->payloadlen <= buffer + URING_BUF_SIZE)
+    {
+      r->requests++;
+
+      char response[256];
+      socklen_t addr_len = out->namelen;
+      if (addr_len > u->recvmsg_hdr.msg_namelen)
+        addr_len = u->recvmsg_hdr.msg_namelen;
+      int response_len = process_datagram(r, (struct sockaddr *)name, addr_len, payload,
+                                          out->payloadlen, response, sizeof(response));
+      // A parked request is answered from another thread
+      if (response_len >= 0)
+      {
+        unsigned long long sending = latency_now();
+        uring_queue_send(r, (struct sockaddr *)name, addr_len, response, response_len);
+        latency_record(LATENCY_DELIVER, LATENCY_REPLY, latency_now() - sending, 1);
+      }
+    }
+    uring_buf_recycle(&u->dgram_bufs, bid);
   }
 
-  if (strcmp(drinkToMake, "CHAMPAGNE") == 0)
-  {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("ALCOHOL", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("CARBON DIODXIDE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-  }
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_arm_recvmsg(r);
+}
+
+void *reactor_run_uring(reactor *r)
+{
+  uringState *u = r->uring;
+
+  uring_arm_accept(r);
+  uring_arm_recvmsg(r);
+  uring_arm_tick(r);
+  if (r->use_stdin)
+    uring_arm_stdin(r);
+  if (r->wake_fd >= 0)
+    uring_arm_wake(r);
+
+  while (running)
+  {
+    // Submits everything queued by the previous batch, replies included,
+    // and waits for the next completion in the same syscall
+    int ret = uring_submit_and_wait(&u->ring, 1);
+    if (ret < 0 && ret != -EINTR && ret != -EBUSY && ret != -EAGAIN)
+    {
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&u->ring)) != NULL)
+    {
+      int op = URING_OP(cqe->user_data);
+      if (idle_timeout > 0 && op != OP_TICK && op != OP_SEND && op != OP_WAKE)
+        alarm(idle_timeout);
+
+      switch (op)
+      {
+      case OP_ACCEPT:
+        uring_handle_accept(r, cqe);
+        break;
+
+      case OP_RECV:
+        uring_handle_recv(r, cqe);
+        break;
+
+      case OP_RECVMSG:
+        uring_handle_recvmsg(r, cqe);
+        break;
+
+      case OP_WAKE:
+        for (parkedRequest *p = take_replies(r), *next; p; p = next)
+        {
+          next = p->next;
+          unsigned long long sending = latency_now();
+          uring_queue_send(r, (struct sockaddr *)&p->addr, p->addr_len, p->response,
+                           p->response_len);
+          latency_record(LATENCY_DELIVER, LATENCY_REPLY, latency_now() - sending, 1);
+          reply_sent(p);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+          uring_arm_wake(r);
+        break;
+
+      case OP_SEND:
+      {
+        int slot = URING_VALUE(cqe->user_data);
+        u->sends[slot].next_free = u->sends_free;
+        u->sends_free = slot;
+        break;
+      }
+
+      case OP_STDIN:
+        if (r->use_stdin && !handle_stdin())
+        {
+          struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+          if (sqe)
+          {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = URING_DATA(OP_STDIN, STDIN_FILENO);
+            sqe->user_data = URING_DATA(OP_STDIN_REMOVE, 0);
+          }
+          r->use_stdin = 0;
+        }
+        else if (r->use_stdin && !(cqe->flags & IORING_CQE_F_MORE))
+          uring_arm_stdin(r);
+        break;
 
-  if (strcmp(drinkToMake, "SOFT DRINK") == 0)
-  {
-    numberOfAtomsNeeded("WATER", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("GLUCOSE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
-    numberOfAtomsNeeded("CARBON DIODXIDE", &carbon, &oxygen, &hydrogen, 1);
-    total_carbon += carbon;
-    total_hydrogen += hydrogen;
-    total_oxygen += oxygen;
+      case OP_TICK:
+        uring_arm_tick(r);
+        break;
+      }
+      uring_cqe_seen(&u->ring);
+    }
+    record_accept_batch(r);
   }
 
-  CounerDrinksCarbon = wareHouse->carbon / total_carbon;
-  CounerDrinksOxygen = wareHouse->oxygen / total_oxygen;
-  CounerDrinksHydrogen = wareHouse->hydrogen / total_hydrogen;
-  int minimum = min(CounerDrinksCarbon, CounerDrinksHydrogen, CounerDrinksOxygen);
-
-  printf("number of %s drinks can make %d\n", drinkToMake, minimum);
+  r->syscalls += u->ring.enters;
+  running = 0;
+  return NULL;
 }
 
 //----------------------------------------------------------------------------------------
@@ -466,8 +1950,25 @@ int main(int argc, char *argv[])
   int tcp_port = -1;
   int udp_port = -1;
   int carbon = -1, oxygen = -1, hydrogen = -1;
-  int timeout = 0;
+  int num_threads = 1;
+  int use_uring = 0;
   char *save_path = NULL;
+  int durability = DURABILITY_SYNC;
+  int flush_ms = DEFAULT_FLUSH_MS;
+  int flush_ops = DEFAULT_FLUSH_OPS;
+  char *replica_address = NULL;
+  char *primary_address = NULL;
+  int replica_ack = REPLICA_SYNC;
+  int raft_id = 0;
+  char *raft_peers = NULL;
+  char *raft_log_path = NULL;
+  int crdt_id = 0;
+  char *crdt_peers = NULL;
+  char *central_address = NULL;
+  unsigned long long lease_size = EDGE_DEFAULT_LEASE;
+  int log_min = LOG_DEFAULT_LEVEL;
+  char *metrics_address = NULL;
+  char *stats_name = NULL;
 
   // long opt
   struct option longopts[] = {
@@ -480,10 +1981,32 @@ int main(int argc, char *argv[])
       {"stream-path", required_argument, NULL, 's'},
       {"datagram-path", required_argument, NULL, 'd'},
       {"save-file", required_argument, NULL, 'f'},
+      {"threads", required_argument, NULL, 'n'},
+      {"io-backend", required_argument, NULL, 'i'},
+      {"backlog", required_argument, NULL, 'b'},
+      {"max-clients", required_argument, NULL, 'm'},
+      {"dgram-batch", required_argument, NULL, 'g'},
+      {"durability", required_argument, NULL, 'D'},
+      {"flush-ms", required_argument, NULL, 'F'},
+      {"flush-ops", required_argument, NULL, 'N'},
+      {"replica-listen", required_argument, NULL, 'R'},
+      {"replica-of", required_argument, NULL, 'P'},
+      {"replica-ack", required_argument, NULL, 'A'},
+      {"raft-id", required_argument, NULL, 'I'},
+      {"raft-peers", required_argument, NULL, 'G'},
+      {"raft-log", required_argument, NULL, 'L'},
+      {"crdt-id", required_argument, NULL, 'E'},
+      {"crdt-peers", required_argument, NULL, 'K'},
+      {"edge-of", required_argument, NULL, 'e'},
+      {"lease", required_argument, NULL, 'l'},
+      {"log-level", required_argument, NULL, 'v'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"stats-shm", required_argument, NULL, 'S'},
       {0, 0, 0, 0}};
 
   // all options
-  while ((c = getopt_long(argc, argv, ":T:U:c:o:h:t:s:d:f:", longopts, NULL)) != -1)
+  while ((c = getopt_long(argc, argv, ":T:U:c:o:h:t:s:d:f:n:i:b:m:g:D:F:N:R:P:A:I:G:L:E:K:e:l:v:qM:S:", longopts, NULL)) != -1)
   {
     switch (c)
     {
@@ -531,16 +2054,167 @@ int main(int argc, char *argv[])
       break;
 
     case 't':
-      timeout = (atoi(optarg));
-      if (timeout > 0)
+      idle_timeout = (atoi(optarg));
+      if (idle_timeout > 0)
       {
-        alarm(timeout);
+        alarm(idle_timeout);
       }
       break;
 
     case 'f':
       save_path = strdup(optarg);
       break;
+
+    case 'n':
+      num_threads = atoi(optarg);
+      if (num_threads < 1 || num_threads > MAX_THREADS)
+      {
+        fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'b':
+      listen_backlog = atoi(optarg);
+      if (listen_backlog < 1)
+      {
+        fprintf(stderr, "backlog must be a positive integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'm':
+      max_clients = atoi(optarg);
+      if (max_clients < 0)
+      {
+        fprintf(stderr, "max-clients must be 0 (unlimited) or more\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'g':
+      dgram_batch_size = atoi(optarg);
+      if (dgram_batch_size < 1 || dgram_batch_size > MAX_DGRAM_BATCH)
+      {
+        fprintf(stderr, "dgram-batch must be between 1 and %d\n", MAX_DGRAM_BATCH);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'D':
+      for (durability = DURABILITY_NONE; durability <= DURABILITY_SYNC; durability++)
+      {
+        if (strcmp(optarg, durability_name(durability)) == 0)
+          break;
+      }
+      if (durability > DURABILITY_SYNC)
+      {
+        fprintf(stderr, "durability must be none, async, periodic or sync\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'F':
+      flush_ms = atoi(optarg);
+      if (flush_ms < 1)
+      {
+        fprintf(stderr, "flush-ms must be a positive integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'N':
+      flush_ops = atoi(optarg);
+      if (flush_ops < 1)
+      {
+        fprintf(stderr, "flush-ops must be a positive integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'R':
+      replica_address = strdup(optarg);
+      break;
+
+    case 'P':
+      primary_address = strdup(optarg);
+      break;
+
+    case 'A':
+      if (strcmp(optarg, "sync") == 0)
+        replica_ack = REPLICA_SYNC;
+      else if (strcmp(optarg, "async") == 0)
+        replica_ack = REPLICA_ASYNC;
+      else
+      {
+        fprintf(stderr, "replica-ack must be sync or async\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'I':
+      raft_id = atoi(optarg);
+      break;
+
+    case 'G':
+      raft_peers = strdup(optarg);
+      break;
+
+    case 'L':
+      raft_log_path = strdup(optarg);
+      break;
+
+    case 'E':
+      crdt_id = atoi(optarg);
+      break;
+
+    case 'K':
+      crdt_peers = strdup(optarg);
+      break;
+
+    case 'e':
+      central_address = strdup(optarg);
+      break;
+
+    case 'l':
+      lease_size = strtoull(optarg, NULL, 10);
+      if (lease_size < 4)
+      {
+        fprintf(stderr, "lease must be at least 4\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'v':
+      log_min = log_parse_level(optarg);
+      if (log_min < 0)
+      {
+        fprintf(stderr, "log-level must be debug, info, warn, error or quiet\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'q':
+      log_min = LOG_LEVEL_QUIET;
+      break;
+
+    case 'M':
+      metrics_address = strdup(optarg);
+      break;
+
+    case 'S':
+      stats_name = strdup(optarg);
+      break;
+
+    case 'i':
+      if (strcmp(optarg, "uring") == 0)
+        use_uring = 1;
+      else if (strcmp(optarg, "epoll") != 0)
+      {
+        fprintf(stderr, "io-backend must be epoll or uring\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
     }
   }
 
@@ -550,7 +2224,7 @@ int main(int argc, char *argv[])
 
   if (!has_inet_sockets && !has_uds_sockets)
   {
-    fprintf(stderr, "Usage: %s [-T <tcp_port> -U <udp_port>] OR [-s <stream_path> -d <datagram_path>]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-T <tcp_port> -U <udp_port>] OR [-s <stream_path> -d <datagram_path>] [--threads N] [--io-backend epoll|uring] [--backlog N] [--max-clients N] [--dgram-batch N] [-f <save_file> [--durability none|async|periodic|sync] [--flush-ms N] [--flush-ops N]] [--replica-listen <port|host:port|path>] [--replica-of <port|host:port|path>] [--replica-ack sync|async] [--raft-id N --raft-peers <addr,addr,addr[,addr,addr]> [--raft-log <path>]] [--crdt-id N --crdt-peers <addr,...>] [--edge-of <central udp port|host:port|datagram path> [--lease N]] [--log-level debug|info|warn|error|quiet | --quiet] [--metrics <path|port|host:port>] [--stats-shm <name, e.g. /drinks_bar>]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -561,53 +2235,97 @@ int main(int argc, char *argv[])
     exit(EXIT_FAILURE);
   }
 
+  // Raft replicates the in-memory warehouse and has its own failover
+  if (raft_peers && (save_path || replica_address || primary_address))
+  {
+    fprintf(stderr, "Error: --raft-peers cannot be combined with -f or the replica options\n");
+    exit(EXIT_FAILURE);
+  }
+  if (crdt_peers && (save_path || replica_address || primary_address || raft_peers))
+  {
+    fprintf(stderr, "Error: --crdt-peers cannot be combined with -f, raft or the replica options\n");
+    exit(EXIT_FAILURE);
+  }
+  if (central_address && (save_path || replica_address || primary_address || raft_peers || crdt_peers))
+  {
+    fprintf(stderr, "Error: --edge-of cannot be combined with -f, raft, CRDT or the replica options\n");
+    exit(EXIT_FAILURE);
+  }
+  if (central_address && (carbon > 0 || hydrogen > 0 || oxygen > 0))
+  {
+    fprintf(stderr, "Error: an edge's stock comes from its lease, not -c/-h/-o\n");
+    exit(EXIT_FAILURE);
+  }
+
   // Set up cleanup on exit
   atexit(cleanup_socket_files);
   atexit(cleanup_warehouse_file);
   signal(SIGINT, handle_sigint);
   signal(SIGALRM, handle_alarm);
-
-  // Initialize warehouse
-  wareHouse warehouse = {0};
-  wareHouse *warehouse_ref = &warehouse;
+  signal(SIGCHLD, handle_sigchld);
 
   // If save_path is provided, initialize file-backed storage
   if (save_path)
   {
+    warehouse_set_durability(durability, flush_ms, flush_ops);
     if (!init_warehouse_file(save_path, carbon, hydrogen, oxygen))
     {
       fprintf(stderr, "Failed to initialize warehouse file\n");
       exit(EXIT_FAILURE);
     }
-    warehouse_ref = warehouse_ptr;
-    printf("Using file-backed warehouse: %s\n", save_path);
+    if (durability == DURABILITY_PERIODIC)
+      printf("Using file-backed warehouse: %s (durability periodic, every %d ms or %d ops)\n",
+             save_path, flush_ms, flush_ops);
+    else
+      printf("Using file-backed warehouse: %s (durability %s)\n", save_path,
+             durability_name(durability));
   }
   else
   {
     // Use in-memory warehouse with command-line arguments
-    if (oxygen > 0)
-    {
-      warehouse.oxygen = oxygen;
-    }
-    if (hydrogen > 0)
-    {
-      warehouse.hydrogen = hydrogen;
-    }
-    if (carbon > 0)
-    {
-      warehouse.carbon = carbon;
-    }
-    printf("Using in-memory warehouse\n");
+    warehouse_init_memory(carbon, hydrogen, oxygen, num_threads);
+    printf("Using in-memory warehouse (%s, %d shards)\n",
+           stock_is_lock_free() ? "lock-free" : "locked atomics", num_threads);
   }
 
-  printf("-------------------------------\n");
-  printAtoms(warehouse_ref);
-  printf("-------------------------------\n");
+  // A backup takes over --replica-listen only once promoted
+  if (primary_address)
+  {
+    if (!replica_follow(primary_address, replica_address, replica_ack))
+      exit(EXIT_FAILURE);
+    printf("Backup of %s (acks %s%s%s)\n", primary_address, replica_ack_name(replica_ack),
+           replica_address ? ", takes backups on " : "", replica_address ? replica_address : "");
+  }
+  else if (replica_address)
+  {
+    if (!replica_listen(replica_address, replica_ack))
+      exit(EXIT_FAILURE);
+    printf("Primary, taking backups on %s (acks %s)\n", replica_address, replica_ack_name(replica_ack));
+  }
 
-  const char *atoms[] = {"CARBON", "HYDROGEN", "OXYGEN"};
+  if (raft_peers)
+  {
+    if (!raft_start(raft_id, raft_peers, raft_log_path))
+      exit(EXIT_FAILURE);
+    printf("Raft node %d of %s%s%s\n", raft_id, raft_peers, raft_log_path ? ", log " : "",
+           raft_log_path ? raft_log_path : "");
+  }
+  if (crdt_peers)
+  {
+    if (!crdt_start(crdt_id, crdt_peers))
+      exit(EXIT_FAILURE);
+    printf("CRDT node %d of %s, this node's escrow is the stock above\n", crdt_id, crdt_peers);
+  }
+  if (central_address)
+  {
+    if (!edge_start(central_address, lease_size))
+      exit(EXIT_FAILURE);
+    printf("Edge of %s, leasing %llu of each atom at a time\n", central_address, lease_size);
+  }
 
-  int listen_fd = -1, udp_fd = -1;
-  struct sockaddr_un unix_addr;
+  printf("-------------------------------\n");
+  printAtoms();
+  printf("-------------------------------\n");
 
   if (has_inet_sockets)
   {
@@ -617,351 +2335,222 @@ int main(int argc, char *argv[])
       fprintf(stderr, "Invalid port number: %d or %d\n", tcp_port, udp_port);
       return 1;
     }
+  }
 
-    //--------------------tcp socket setup-------------------------------
-    // Create a listening socket
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0)
-    {
-      perror("socket");
-      return 1;
-    }
-
-    // Set socket options to allow reuse of the address
-    int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  raise_fd_limit();
+  spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    struct sockaddr_in serv_addr = {.sin_family = AF_INET,
-                                    .sin_port = htons(tcp_port),
-                                    .sin_addr.s_addr = INADDR_ANY};
+  // ---------------- reactors setup ------------------------
+  reactor *reactors = calloc(num_threads, sizeof(reactor));
+  if (!reactors)
+  {
+    perror("calloc");
+    return 1;
+  }
 
-    if (bind(listen_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+  // SO_REUSEPORT is only requested with several reactors, so a second
+  // single-threaded server still fails to bind an occupied port
+  int shared_sockets = !has_inet_sockets && num_threads > 1;
+  int opened = 0;
+  for (int i = 0; i < num_threads; i++)
+  {
+    reactor *r = &reactors[i];
+    r->id = i;
+    r->epoll_fd = -1;
+    r->use_stdin = (i == 0);
+    r->wake_fd = -1;
+
+    int ok;
+    if (has_inet_sockets)
+      ok = open_inet_sockets(tcp_port, udp_port, num_threads > 1,
+                             &r->listen_fd, &r->udp_fd);
+    else if (i == 0)
+      ok = open_uds_sockets(&r->listen_fd, &r->udp_fd);
+    else
     {
-      perror("bind");
-      close(listen_fd);
-      return 1;
+      r->listen_fd = reactors[0].listen_fd;
+      r->udp_fd = reactors[0].udp_fd;
+      ok = 1;
     }
 
-    if (listen(listen_fd, BACKLOG) < 0)
+    // Raft, backup ack and central replies come back to the reactor that
+    // took the request
+    int parking = raft_running || edge_running ||
+                  (replica_ack == REPLICA_SYNC && (replica_address || primary_address));
+    if (ok && parking && (r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
     {
-      perror("listen");
-      close(listen_fd);
-      return 1;
+      perror("eventfd");
+      ok = 0;
     }
 
-    // -------------------udp socket setup-------------------------------
-    udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_fd < 0)
+    if (ok && use_uring && !reactor_init_uring(r))
     {
-      perror("socket");
-      close(listen_fd);
-      return 1;
+      if (i > 0)
+        ok = 0;
+      else
+      {
+        printf("Falling back to the epoll backend\n");
+        use_uring = 0;
+      }
     }
 
-    struct sockaddr_in udp_addr = {.sin_family = AF_INET,
-                                   .sin_port = htons(udp_port),
-                                   .sin_addr.s_addr = INADDR_ANY};
-
-    if (bind(udp_fd, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0)
+    if (!ok || (!r->uring && !reactor_init(r, shared_sockets)))
     {
-      perror("UDP bind");
-      close(listen_fd);
-      close(udp_fd);
+      if (ok)
+        reactor_close(r, has_inet_sockets || i == 0);
+      for (int j = 0; j < opened; j++)
+        reactor_close(&reactors[j], has_inet_sockets || j == 0);
       return 1;
     }
+    opened++;
+  }
 
+  if (has_inet_sockets)
     printf("Server running on TCP port %d and UDP port %d...\n", tcp_port, udp_port);
-  }
   else
+    printf("Server running on UDS stream socket %s and datagram socket %s...\n",
+           stream_path, datagram_path);
+  if (num_threads > 1)
+    printf("Running %d reactor threads\n", num_threads);
+  printf("I/O backend: %s\n", use_uring ? "io_uring" : "epoll");
+  if (log_min != LOG_DEFAULT_LEVEL)
+    printf("Logging at level %s\n", log_level_name(log_min));
+  if (metrics_address)
   {
-    // UDS setup
-    //--------------------UDS stream socket setup-------------------------------
-    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (listen_fd < 0)
-    {
-      perror("UDS stream socket");
+    if (!metrics_start(metrics_address, &connected_clients))
       return 1;
-    }
-
-    // Remove existing socket file if it exists
-    unlink(stream_path);
-
-    memset(&unix_addr, 0, sizeof(unix_addr));
-    unix_addr.sun_family = AF_UNIX;
-    strncpy(unix_addr.sun_path, stream_path, sizeof(unix_addr.sun_path) - 1);
-
-    if (bind(listen_fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
-    {
-      perror("UDS stream bind");
-      close(listen_fd);
+    printf("Serving metrics on %s\n", metrics_address);
+  }
+  if (stats_name)
+  {
+    if (!metrics_publish(stats_name, &connected_clients))
       return 1;
-    }
+    printf("Publishing stats in shared memory %s (drinks_top %s)\n", stats_name, stats_name);
+  }
 
-    if (listen(listen_fd, BACKLOG) < 0)
-    {
-      perror("UDS stream listen");
-      close(listen_fd);
-      return 1;
-    }
+  // From here on requests are logged by the writer thread
+  fflush(stdout);
+  log_set_level(log_min);
+  log_start();
 
-    // -------------------UDS datagram socket setup-------------------------------
-    udp_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (udp_fd < 0)
+  for (int i = 1; i < num_threads; i++)
+  {
+    if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) != 0)
     {
-      perror("UDS datagram socket");
-      close(listen_fd);
-      return 1;
+      perror("pthread_create");
+      running = 0;
+      num_threads = i;
+      break;
     }
+  }
 
-    // Remove existing socket file if it exists
-    unlink(datagram_path);
+  // Reactor 0 runs on the main thread and owns the console
+  reactor_run(&reactors[0]);
 
-    memset(&unix_addr, 0, sizeof(unix_addr));
-    unix_addr.sun_family = AF_UNIX;
-    strncpy(unix_addr.sun_path, datagram_path, sizeof(unix_addr.sun_path) - 1);
+  for (int i = 1; i < num_threads; i++)
+    pthread_join(reactors[i].thread, NULL);
 
-    if (bind(udp_fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
-    {
-      perror("UDS datagram bind");
-      close(listen_fd);
-      close(udp_fd);
-      return 1;
-    }
+  // here only if running is false - signal CTRL C
+  metrics_stop();
+  metrics_unpublish();
+  log_stop();
+  printf("Shutting down server...\n");
 
-    printf("Server running on UDS stream socket %s and datagram socket %s...\n",
-           stream_path, datagram_path);
+  unsigned long long syscalls = 0, requests = 0;
+  for (int i = 0; i < opened; i++)
+  {
+    syscalls += reactors[i].syscalls;
+    requests += reactors[i].requests;
   }
+  printf("I/O stats: backend=%s syscalls=%llu requests=%llu syscalls_per_request=%.2f\n",
+         use_uring ? "io_uring" : "epoll", syscalls, requests,
+         requests ? (double)syscalls / requests : 0.0);
 
-  // ---------------- fds setup for poll ------------------------
-  struct pollfd fds[MAX_CLIENTS];
-  int nfds = 3;
-  fds[0].fd = listen_fd;
-  fds[0].events = POLLIN;
-  fds[1].fd = udp_fd;
-  fds[1].events = POLLIN;
-  fds[2].fd = STDIN_FILENO;
-  fds[2].events = POLLIN;
-
-  struct sockaddr_storage client_addr;
-  socklen_t addr_len = sizeof(client_addr);
-
-  while (running)
+  unsigned long long accepted = 0, rejected = 0;
+  int max_accept_batch = 0;
+  for (int i = 0; i < opened; i++)
   {
-    int ready = poll(fds, nfds, 1000);
-    if (ready < 0)
-    {
-      if (!running)
-        break;
-      perror("poll");
-      break;
-    }
-
-    // Handle new connections first (both TCP and UDS stream)
-    if (fds[0].revents & POLLIN)
-    {
-      if (timeout > 0)
-        alarm(timeout);
-      int client_fd = accept(listen_fd, NULL, NULL);
-      if (client_fd >= 0 && nfds < MAX_CLIENTS)
-      {
-        fds[nfds].fd = client_fd;
-        fds[nfds].events = POLLIN;
-        fds[nfds].revents = 0; // Clear revents
-        nfds++;
-        printf("New client connected: fd=%d\n", client_fd);
-      }
-      else if (client_fd >= 0)
-      {
-        printf("Max clients reached, rejecting connection\n");
-        close(client_fd);
-      }
-    }
+    accepted += reactors[i].accepted;
+    rejected += reactors[i].rejected;
+    if (reactors[i].max_accept_batch > max_accept_batch)
+      max_accept_batch = reactors[i].max_accept_batch;
+  }
+  printf("Accept stats: accepted=%llu rejected=%llu max_per_wakeup=%d\n",
+         accepted, rejected, max_accept_batch);
 
-    // Handle datagram messages (both UDP and UDS datagram)
-    if (fds[1].revents & POLLIN)
+  if (!use_uring)
+  {
+    unsigned long long dgrams = 0, dgram_calls = 0;
+    for (int i = 0; i < opened; i++)
     {
-      if (timeout > 0)
-        alarm(timeout);
-      char buffer[256];
-      ssize_t len = recvfrom(udp_fd, buffer, sizeof(buffer) - 1, 0,
-                             (struct sockaddr *)&client_addr, &addr_len);
-      if (len > 0)
-      {
-        buffer[len] = '\0';
-        // Remove newline if present
-        char *newline = strchr(buffer, '\n');
-        if (newline)
-          *newline = '\0';
-
-        char molecule[32];
-        char word1[16], word2[16];
-        int quantity = 0;
-        char response[256];
-
-        if (sscanf(buffer, "DELIVER %15s %d", molecule, &quantity) == 2 &&
-            quantity > 0)
-        {
-          int status = deliverMolecules(warehouse_ref, molecule, quantity);
-
-          if (status)
-          {
-            printf("Delivered molecule %s\n", molecule);
-            printf("currently in ware house there: \n");
-            printAtoms(warehouse_ref);
-            snprintf(response, sizeof(response), "OK: Delivered %s", molecule);
-          }
-          else
-          {
-            printAtoms(warehouse_ref);
-            snprintf(response, sizeof(response), "did not deliver %s, sorry.",
-                     molecule);
-          }
-        }
-        else if (sscanf(buffer, "DELIVER %15s %15s %d", word1, word2,
-                        &quantity) == 3 &&
-                 quantity > 0)
-        {
-          snprintf(molecule, sizeof(molecule), "%s %s", word1, word2);
-          int status = deliverMolecules(warehouse_ref, molecule, quantity);
-
-          if (status)
-          {
-            printf("Delivered molecule %s\n", molecule);
-            printf("currently in ware house there: \n");
-            printAtoms(warehouse_ref);
-            snprintf(response, sizeof(response), "OK: Delivered %s", molecule);
-          }
-          else
-          {
-            printAtoms(warehouse_ref);
-            snprintf(response, sizeof(response), "did not deliver %s, sorry.",
-                     molecule);
-          }
-        }
-        sendto(udp_fd, response, strlen(response), 0,
-               (struct sockaddr *)&client_addr, addr_len);
-      }
+      dgrams += reactors[i].dgrams;
+      dgram_calls += reactors[i].dgram_recv_calls + reactors[i].dgram_send_calls;
     }
+    printf("Datagram stats: batch=%d datagrams=%llu syscalls=%llu datagrams_per_syscall=%.2f\n",
+           dgram_batch_size, dgrams, dgram_calls, dgram_calls ? (double)dgrams / dgram_calls : 0.0);
+  }
 
-    // Handle client data - process from end to beginning to avoid index issues
-    for (int i = nfds - 1; i >= 3; i--)
-    {
-      if (fds[i].revents & POLLIN)
-      {
-        if (timeout > 0)
-          alarm(timeout);
-        char buffer[256];
-        ssize_t len = read(fds[i].fd, buffer, sizeof(buffer) - 1);
-
-        if (len <= 0)
-        {
-          printf("Client disconnected: fd=%d\n", fds[i].fd);
-          close(fds[i].fd);
-          // Move last element to current position
-          if (i < nfds - 1)
-          {
-            fds[i] = fds[nfds - 1];
-          }
-          nfds--;
-        }
-        else
-        {
-          buffer[len] = '\0';
-          // Remove newline if present
-          char *newline = strchr(buffer, '\n');
-          if (newline)
-            *newline = '\0';
-
-          char atom[16];
-          int quantity = 0;
-          if (sscanf(buffer, "ADD %15s %d", atom, &quantity) == 2 &&
-              quantity > 0)
-          {
-            int index_atom = -1;
-            for (int j = 0; j < 3; j++)
-            {
-              if (strcmp(atom, atoms[j]) == 0)
-              {
-                index_atom = j + 1;
-                break;
-              }
-            }
-            if (index_atom > 0)
-            {
-              addAtom(index_atom, quantity, warehouse_ref);
-              printf("Added %d %s\n", quantity, atom);
-              printAtoms(warehouse_ref);
-            }
-            else
-            {
-              printf("Error: Unknown atom type '%s'\n", atom);
-            }
-          }
-        }
-      }
-    }
+  if (save_path && wal_durability() != DURABILITY_NONE)
+  {
+    unsigned long long records, syncs;
+    wal_stats(&records, &syncs);
+    printf("WAL stats: durability=%s records=%llu fdatasyncs=%llu records_per_fdatasync=%.2f\n",
+           durability_name(wal_durability()), records, syncs, syncs ? (double)records / syncs : 0.0);
+  }
 
-    // Handle stdin input
-    if (fds[2].revents & POLLIN)
-    {
-      if (timeout > 0)
-        alarm(timeout);
-      char buffer[256];
-      char drink[64];
-      int status;
+  latency_print("Latency stats: ");
 
-      if (fgets(buffer, sizeof(buffer), stdin) != NULL)
-      {
-        char *newline = strchr(buffer, '\n');
-        if (newline)
-          *newline = '\0';
+  unsigned long long logged, log_drops;
+  log_stats(&logged, &log_drops);
+  printf("Log stats: level=%s written=%llu dropped=%llu\n", log_level_name(log_min), logged, log_drops);
 
-        if (strncmp(buffer, "GEN ", 4) == 0)
-        {
-          strncpy(drink, buffer + 4, sizeof(drink) - 1);
-          drink[sizeof(drink) - 1] = '\0';
+  if (primary_address || replica_address)
+  {
+    unsigned long long published;
+    double promotion_ms;
+    unsigned int term;
+    replica_stats(&published, &promotion_ms, &term);
+    printf("Replication stats: role=%s term=%u changes_streamed=%llu promotion_ms=%.0f\n",
+           replica_role() == REPLICA_BACKUP ? "backup" : "primary", term, published, promotion_ms);
+  }
 
-          howManyDrinks(warehouse_ref, drink);
-          printf("---------------------------------------\n");
-          status = genDrinks(warehouse_ref, drink);
-          if (status)
-          {
-            printf("Generated drink %s\n", drink);
-            printf("------------------------------\n");
-            printAtoms(warehouse_ref);
-          }
-          else
-          {
-            printf("Sorry man, couldn't generate %s\n", drink);
-            printf("------------------------------\n");
-            printAtoms(warehouse_ref);
-          }
-        }
-        else
-        {
-          printf("Invalid command. Use: GEN <drink_name>\n");
-          printf("Available drinks: VODKA, CHAMPAGNE, SOFT DRINK\n");
-        }
-      }
-    }
+  if (raft_peers)
+  {
+    raftStats stats;
+    raft_stats(&stats);
+    printf("Raft stats: role=%s term=%llu leader=%d committed=%llu appends=%llu entries_sent=%llu "
+           "elections_won=%llu failover_ms=%.0f\n",
+           stats.role == RAFT_LEADER ? "leader" : stats.role == RAFT_CANDIDATE ? "candidate" : "follower",
+           stats.term, stats.leader, stats.committed, stats.appends, stats.entries_sent,
+           stats.elections, stats.failover_ms);
+  }
 
-    // Clear all revents for next iteration
-    for (int i = 0; i < nfds; i++)
-    {
-      fds[i].revents = 0;
-    }
+  if (central_address)
+  {
+    edgeStats stats;
+    edge_stop();
+    edge_stats(&stats);
+    printf("Edge stats: leases=%llu leased C=%llu H=%llu O=%llu forwarded=%llu stale=%llu "
+           "returned C=%llu H=%llu O=%llu\n",
+           stats.leases, stats.leased[0], stats.leased[1], stats.leased[2], stats.forwarded, stats.stale,
+           stats.returned[0], stats.returned[1], stats.returned[2]);
   }
 
-  // here only if running is false - signal CTRL C
-  printf("Shutting down server...\n");
-  for (int i = 1; i < nfds; i++)
+  if (crdt_peers)
   {
-    close(fds[i].fd);
+    crdtStats stats;
+    crdt_stats(&stats);
+    wareHouse whole = crdt_global();
+    printf("CRDT stats: gossip_sent=%llu gossip_received=%llu transfers=%llu moved C=%llu H=%llu O=%llu "
+           "whole warehouse C=%llu H=%llu O=%llu\n",
+           stats.gossip_sent, stats.gossip_received, stats.transfers, stats.transferred[0],
+           stats.transferred[1], stats.transferred[2], whole.carbon, whole.hydrogen, whole.oxygen);
   }
 
-  close(listen_fd);
-  if (udp_fd != -1)
-    close(udp_fd);
+  for (int i = 0; i < opened; i++)
+    reactor_close(&reactors[i], has_inet_sockets || i == 0);
+  free(reactors);
+
   printf("Server terminated.\n");
   return 0;
-}
\ No newline at end of file
+}
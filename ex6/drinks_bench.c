@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+// Load generator for drinks_bar.
+// deliver mode: every client sends DELIVER datagrams closed-loop and times
+//               each reply.
+// add mode:     every client streams ADD lines over one TCP/UDS connection.
+
+extern char *optarg;
+
+typedef struct benchClient
+{
+    pthread_t thread;
+    int id;
+    long ok;
+    long lost;
+    double *latencies_us; // one per answered request
+} benchClient;
+
+const char *host = "127.0.0.1";
+int port = -1;
+const char *socket_path = NULL;
+const char *mode = "deliver";
+const char *request = NULL;
+int num_clients = 1;
+long requests_per_client = 10000;
+int lines_per_write = 1;
+
+double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [-h <host> -p <port>] OR [-f <socket_path>] [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -m <mode>    deliver (UDP/UDS datagram, default) or add (TCP/UDS stream)\n");
+    printf("  -c <n>       Number of concurrent clients (default 1)\n");
+    printf("  -n <n>       Requests per client (default 10000)\n");
+    printf("  -r <text>    Request to send (default DELIVER WATER 1 / ADD CARBON 1)\n");
+    printf("  -b <n>       add mode: lines per write (default 1)\n");
+}
+
+int connect_server(int type)
+{
+    int fd;
+    if (socket_path)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, type, 0);
+        if (fd < 0)
+            return -1;
+
+        // Datagram replies need an address of our own to come back to
+        if (type == SOCK_DGRAM)
+        {
+            struct sockaddr_un self = {.sun_family = AF_UNIX};
+            snprintf(self.sun_path, sizeof(self.sun_path), "/tmp/drinks_bench.%d.%lx",
+                     getpid(), (unsigned long)pthread_self());
+            unlink(self.sun_path);
+            if (bind(fd, (struct sockaddr *)&self, sizeof(self)) < 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0)
+        return -1;
+    fd = socket(AF_INET, type, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void *run_deliver(void *arg)
+{
+    benchClient *client = arg;
+    int fd = connect_server(SOCK_DGRAM);
+    if (fd < 0)
+    {
+        perror("connect");
+        return NULL;
+    }
+
+    struct timeval tv = {.tv_sec = 1};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    size_t req_len = strlen(request);
+    char response[256];
+    for (long i = 0; i < requests_per_client; i++)
+    {
+        double start = now_us();
+        if (send(fd, request, req_len, 0) < 0)
+        {
+            client->lost++;
+            continue;
+        }
+        if (recv(fd, response, sizeof(response), 0) <= 0)
+        {
+            client->lost++;
+            continue;
+        }
+        client->latencies_us[client->ok++] = now_us() - start;
+    }
+
+    if (socket_path)
+    {
+        struct sockaddr_un self;
+        socklen_t len = sizeof(self);
+        if (getsockname(fd, (struct sockaddr *)&self, &len) == 0)
+            unlink(self.sun_path);
+    }
+    close(fd);
+    return NULL;
+}
+
+void *run_add(void *arg)
+{
+    benchClient *client = arg;
+    int fd = connect_server(SOCK_STREAM);
+    if (fd < 0)
+    {
+        perror("connect");
+        return NULL;
+    }
+
+    size_t req_len = strlen(request);
+    char *batch = malloc((req_len + 1) * lines_per_write);
+    for (int i = 0; i < lines_per_write; i++)
+    {
+        memcpy(batch + i * (req_len + 1), request, req_len);
+        batch[i * (req_len + 1) + req_len] = '\n';
+    }
+
+    for (long sent = 0; sent < requests_per_client; sent += lines_per_write)
+    {
+        long lines = requests_per_client - sent;
+        if (lines > lines_per_write)
+            lines = lines_per_write;
+
+        size_t total = lines * (req_len + 1), done = 0;
+        while (done < total)
+        {
+            ssize_t n = write(fd, batch + done, total - done);
+            if (n <= 0)
+            {
+                client->lost += requests_per_client - sent;
+                goto out;
+            }
+            done += n;
+        }
+        client->ok += lines;
+    }
+
+out:
+    free(batch);
+    close(fd);
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "h:p:f:m:c:n:r:b:")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'f':
+            socket_path = optarg;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'c':
+            num_clients = atoi(optarg);
+            break;
+        case 'n':
+            requests_per_client = atol(optarg);
+            break;
+        case 'r':
+            request = optarg;
+            break;
+        case 'b':
+            lines_per_write = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int deliver = strcmp(mode, "deliver") == 0;
+    if ((!deliver && strcmp(mode, "add") != 0) || (port <= 0 && !socket_path) ||
+        num_clients < 1 || requests_per_client < 1 || lines_per_write < 1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!request)
+        request = deliver ? "DELIVER WATER 1" : "ADD CARBON 1";
+
+    benchClient *clients = calloc(num_clients, sizeof(benchClient));
+    for (int i = 0; i < num_clients; i++)
+    {
+        clients[i].id = i;
+        if (deliver)
+            clients[i].latencies_us = malloc(requests_per_client * sizeof(double));
+    }
+
+    double start = now_us();
+    for (int i = 0; i < num_clients; i++)
+        pthread_create(&clients[i].thread, NULL, deliver ? run_deliver : run_add, &clients[i]);
+    for (int i = 0; i < num_clients; i++)
+        pthread_join(clients[i].thread, NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    long ok = 0, lost = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        ok += clients[i].ok;
+        lost += clients[i].lost;
+    }
+
+    printf("mode=%s clients=%d ok=%ld lost=%ld time=%.3fs throughput=%.0f req/s",
+           mode, num_clients, ok, lost, elapsed, elapsed > 0 ? ok / elapsed : 0.0);
+
+    if (deliver && ok > 0)
+    {
+        double *all = malloc(ok * sizeof(double));
+        long n = 0;
+        for (int i = 0; i < num_clients; i++)
+        {
+            memcpy(all + n, clients[i].latencies_us, clients[i].ok * sizeof(double));
+            n += clients[i].ok;
+        }
+        qsort(all, n, sizeof(double), compare_double);
+        printf(" p50=%.1fus p99=%.1fus max=%.1fus", all[n / 2], all[(long)(n * 0.99)],
+               all[n - 1]);
+        free(all);
+    }
+    printf("\n");
+
+    for (int i = 0; i < num_clients; i++)
+        free(clients[i].latencies_us);
+    free(clients);
+    return lost > 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "shm_stats.h"
+
+// Live view of a running drinks_bar, read from its --stats-shm segment.
+// It maps the segment read-only and refreshes every interval; it never
+// sends the server a request.
+
+extern char *optarg;
+extern int optind;
+
+const char *command_labels[] = {"ADD", "DELIVER", "GEN", "LEASE", "RETURN", "USE", "INVALID"};
+const char *failure_labels[] = {"not enough atoms", "unknown molecule", "unknown atom", "warehouse full",
+                                "bad warehouse", "refused", "line too long"};
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [-i <interval ms>] [-n <refreshes>] [segment name, default %s]\n", program_name,
+           SHM_STATS_DEFAULT_NAME);
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One screen. Rates are over the time between the two snapshots.
+void show(const statsSegment *now, const statsSegment *before, double seconds, int clear)
+{
+    if (clear)
+        printf("\033[H\033[2J");
+    printf("drinks_bar pid %d, %s, updated %.2f s ago\n", now->pid, now->running ? "running" : "stopped",
+           now_seconds() - now->updated);
+    printf("stock  carbon %llu  hydrogen %llu  oxygen %llu   clients %d\n\n", now->stock[0], now->stock[1],
+           now->stock[2], now->clients);
+
+    printf("%-10s %14s %12s\n", "command", "total", "per second");
+    for (int c = METRIC_ADD; c <= METRIC_INVALID; c++)
+    {
+        double rate = seconds > 0 ? (now->counters[c] - before->counters[c]) / seconds : 0;
+        printf("%-10s %14llu %12.0f\n", command_labels[c - METRIC_ADD], now->counters[c], rate);
+    }
+
+    printf("\nfailures:");
+    for (int c = METRIC_NOT_ENOUGH; c <= METRIC_LINE_TOO_LONG; c++)
+    {
+        if (now->counters[c] > 0)
+            printf("  %s %llu", failure_labels[c - METRIC_NOT_ENOUGH], now->counters[c]);
+    }
+    printf("\n");
+
+    double in = seconds > 0 ? (now->counters[METRIC_BYTES_IN] - before->counters[METRIC_BYTES_IN]) / seconds : 0;
+    double out = seconds > 0 ? (now->counters[METRIC_BYTES_OUT] - before->counters[METRIC_BYTES_OUT]) / seconds : 0;
+    unsigned long long waits = now->counters[METRIC_LOCK_WAITS];
+    printf("traffic  in %.0f B/s  out %.0f B/s   lock waits %llu (avg %.2f us)   log dropped %llu\n\n", in, out,
+           waits, waits ? now->counters[METRIC_LOCK_WAIT_NS] / 1e3 / waits : 0.0, now->log_dropped);
+
+    printf("%-8s %-10s %10s %10s %10s %10s %10s\n", "latency", "stage", "count", "p50 us", "p99 us", "p999 us",
+           "max us");
+    for (int c = 0; c < LATENCY_COMMANDS; c++)
+    {
+        for (int stage = 0; stage < LATENCY_STAGES; stage++)
+        {
+            const latencySummary *s = &now->latency[c][stage];
+            if (s->count == 0)
+                continue;
+            printf("%-8s %-10s %10llu %10.1f %10.1f %10.1f %10.1f\n", latency_command_name(c),
+                   latency_stage_name(stage), s->count, s->p50 / 1e3, s->p99 / 1e3, s->p999 / 1e3,
+                   s->max / 1e3);
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int interval_ms = 100;
+    long refreshes = -1; // until the server stops
+    int c;
+    while ((c = getopt(argc, argv, "i:n:")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            refreshes = atol(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (interval_ms < 1 || refreshes == 0 || optind < argc - 1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *name = optind < argc ? argv[optind] : SHM_STATS_DEFAULT_NAME;
+
+    const statsSegment *segment = shm_stats_open(name);
+    if (!segment)
+    {
+        fprintf(stderr, "No drinks_bar stats segment %s (start drinks_bar with --stats-shm %s)\n", name, name);
+        return 1;
+    }
+
+    static statsSegment now, before;
+    if (!shm_stats_snapshot(segment, &before))
+        return 1;
+    double before_at = before.updated;
+    int clear = isatty(STDOUT_FILENO);
+    for (long i = 0; refreshes < 0 || i < refreshes; i++)
+    {
+        usleep(interval_ms * 1000);
+        if (!shm_stats_snapshot(segment, &now))
+            continue;
+        show(&now, &before, now.updated - before_at, clear);
+        if (!now.running)
+            break;
+        before = now;
+        before_at = now.updated;
+    }
+    shm_stats_close(segment);
+    return 0;
+}
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include "edge.h"
+
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FORWARD_TICK_MS 10 // how often the forwarding thread looks for timeouts
+
+int edge_running = 0;
+
+struct sockaddr_storage central_addr;
+socklen_t central_addr_len;
+unsigned long long edge_lease_size;
+int refill_fd = -1;
+int forward_fd = -1;
+unsigned edge_seq = 0;
+
+// A forwarded request waiting for its reply, in the slot of its sequence
+// number. done is NULL while the slot is free.
+typedef struct edgeForward
+{
+  unsigned seq;
+  edgeDone done;
+  void *arg;
+  long long deadline;
+} edgeForward;
+
+pthread_t refill_thread;
+pthread_t forward_thread;
+pthread_mutex_t edge_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refill_due = PTHREAD_COND_INITIALIZER;
+int refill_wanted = 0;
+edgeForward edge_forwards[EDGE_FORWARDS];
+edgeStats edge_totals;
+
+static long long now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Never 0, which stands for an untagged reply
+static unsigned next_seq()
+{
+  unsigned seq;
+  do
+    seq = __atomic_add_fetch(&edge_seq, 1, __ATOMIC_RELAXED);
+  while (seq == 0);
+  return seq;
+}
+
+int edge_tag_length(const char *buffer, size_t len)
+{
+  if (len < 3 || buffer[0] != '#')
+    return 0;
+  size_t i = 1;
+  while (i < len && i <= 10 && buffer[i] >= '0' && buffer[i] <= '9')
+    i++;
+  return i > 1 && i < len && buffer[i] == ' ' ? (int)i + 1 : 0;
+}
+
+// The sequence number a reply is tagged with, 0 without a tag
+static unsigned reply_seq(const char *reply, size_t len, int *tag_len)
+{
+  *tag_len = edge_tag_length(reply, len);
+  return *tag_len ? (unsigned)strtoul(reply + 1, NULL, 10) : 0;
+}
+
+// A path is a Unix datagram socket, otherwise "port" or "host:port" over UDP
+static int resolve_central(const char *address)
+{
+  memset(&central_addr, 0, sizeof(central_addr));
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un *un = (struct sockaddr_un *)&central_addr;
+    if (strlen(address) >= sizeof(un->sun_path))
+      return 0;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    central_addr_len = sizeof(*un);
+    return 1;
+  }
+
+  char host[256] = "127.0.0.1";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+    port = address;
+
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+  struct addrinfo *found;
+  if (getaddrinfo(host, port, &hints, &found) != 0)
+    return 0;
+  memcpy(&central_addr, found->ai_addr, found->ai_addrlen);
+  central_addr_len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 1;
+}
+
+// Connected to the central, so nothing else reaches it. A Unix socket is
+// autobound to an abstract name the central can reply to.
+static int central_socket()
+{
+  int fd = socket(central_addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  sa_family_t family = AF_UNIX;
+  struct timeval timeout = {.tv_sec = EDGE_TIMEOUT_MS / 1000, .tv_usec = EDGE_TIMEOUT_MS % 1000 * 1000};
+  if ((central_addr.ss_family == AF_UNIX && bind(fd, (struct sockaddr *)&family, sizeof(family)) == -1) ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+      connect(fd, (struct sockaddr *)&central_addr, central_addr_len) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Stock what a LEASED reply granted; returns 0 if the reply is not one or
+// granted nothing
+static int take_lease(const char *reply)
+{
+  unsigned long long granted[3];
+  if (sscanf(reply, "OK: LEASED %llu %llu %llu", &granted[0], &granted[1], &granted[2]) != 3)
+    return 0;
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (granted[atom] > 0)
+      warehouse_add(atom + 1, granted[atom]);
+  }
+  pthread_mutex_lock(&edge_mutex);
+  edge_totals.leases++;
+  for (int atom = 0; atom < 3; atom++)
+    edge_totals.leased[atom] += granted[atom];
+  pthread_mutex_unlock(&edge_mutex);
+  return granted[0] || granted[1] || granted[2];
+}
+
+// Send request tagged with a new sequence number on refill_fd and wait for
+// the reply with that number, which is left in reply without its tag. Any
+// LEASED reply that comes first, late for an earlier request, is stocked.
+// Returns the reply length, or -1 without one.
+static int exchange(const char *request, char *reply, size_t reply_size)
+{
+  unsigned seq = next_seq();
+  char tagged[128];
+  int len = snprintf(tagged, sizeof(tagged), "#%u %s", seq, request);
+  if (len >= (int)sizeof(tagged) || send(refill_fd, tagged, len, 0) != len)
+    return -1;
+  ssize_t got;
+  while ((got = recv(refill_fd, reply, reply_size - 1, 0)) > 0)
+  {
+    reply[got] = '\0';
+    int tag_len;
+    if (reply_seq(reply, got, &tag_len) == seq)
+    {
+      memmove(reply, reply + tag_len, got - tag_len + 1);
+      return got - tag_len;
+    }
+    if (!take_lease(reply + tag_len))
+    {
+      pthread_mutex_lock(&edge_mutex);
+      edge_totals.stale++;
+      pthread_mutex_unlock(&edge_mutex);
+    }
+  }
+  return -1;
+}
+
+// Ask for whatever tops every atom up to the lease size. Returns 0 if
+// nothing came.
+static int refill()
+{
+  wareHouse have = warehouse_read();
+  unsigned long long stock[3] = {have.carbon, have.hydrogen, have.oxygen}, want[3];
+  for (int atom = 0; atom < 3; atom++)
+    want[atom] = stock[atom] < edge_lease_size ? edge_lease_size - stock[atom] : 0;
+  if (want[0] == 0 && want[1] == 0 && want[2] == 0)
+    return 1;
+
+  char request[96], reply[128];
+  snprintf(request, sizeof(request), "LEASE %llu %llu %llu\n", want[0], want[1], want[2]);
+  return exchange(request, reply, sizeof(reply)) >= 0 && take_lease(reply);
+}
+
+static void *run_refill(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&edge_mutex);
+  while (edge_running)
+  {
+    while (edge_running && !refill_wanted)
+      pthread_cond_wait(&refill_due, &edge_mutex);
+    refill_wanted = 0;
+    if (!edge_running)
+      break;
+    pthread_mutex_unlock(&edge_mutex);
+    // An empty central is asked again only after a pause, not on every
+    // delivery that finds the lease short
+    if (!refill())
+      usleep(EDGE_RETRY_MS * 1000);
+    pthread_mutex_lock(&edge_mutex);
+  }
+  pthread_mutex_unlock(&edge_mutex);
+  return NULL;
+}
+
+// Free the slot of a forwarded request if seq still holds it, or if it is
+// due by now; returns what it held, done NULL if nothing
+static edgeForward claim_forward(edgeForward *slot, unsigned seq, long long now)
+{
+  edgeForward claimed = {0};
+  pthread_mutex_lock(&edge_mutex);
+  if (slot->done && (slot->seq == seq || slot->deadline <= now))
+  {
+    claimed = *slot;
+    slot->done = NULL;
+  }
+  pthread_mutex_unlock(&edge_mutex);
+  return claimed;
+}
+
+// Answer forwarded requests with the replies that match them, and with
+// nothing once they time out
+static void *run_forward(void *arg)
+{
+  (void)arg;
+  char reply[256];
+  while (__atomic_load_n(&edge_running, __ATOMIC_ACQUIRE))
+  {
+    struct pollfd ready = {.fd = forward_fd, .events = POLLIN};
+    poll(&ready, 1, FORWARD_TICK_MS);
+    ssize_t got;
+    while ((got = recv(forward_fd, reply, sizeof(reply), MSG_DONTWAIT)) > 0)
+    {
+      int tag_len;
+      unsigned seq = reply_seq(reply, got, &tag_len);
+      edgeForward answered = seq ? claim_forward(&edge_forwards[seq % EDGE_FORWARDS], seq, -1) : (edgeForward){0};
+      if (answered.done)
+        answered.done(reply + tag_len, got - tag_len, answered.arg);
+      else
+      {
+        pthread_mutex_lock(&edge_mutex);
+        edge_totals.stale++;
+        pthread_mutex_unlock(&edge_mutex);
+      }
+    }
+    long long now = now_ms();
+    for (int i = 0; i < EDGE_FORWARDS; i++)
+    {
+      edgeForward expired = claim_forward(&edge_forwards[i], 0, now);
+      if (expired.done)
+        expired.done(NULL, -1, expired.arg);
+    }
+  }
+  return NULL;
+}
+
+int edge_start(const char *address, unsigned long long lease_size)
+{
+  if (!resolve_central(address))
+  {
+    fprintf(stderr, "Bad central address: %s\n", address);
+    return 0;
+  }
+  edge_lease_size = lease_size;
+  refill_fd = central_socket();
+  forward_fd = central_socket();
+  if (refill_fd == -1 || forward_fd == -1)
+  {
+    perror("Failed to reach the central warehouse");
+    return 0;
+  }
+
+  refill();
+  edge_running = 1;
+  if (pthread_create(&refill_thread, NULL, run_refill, NULL) != 0)
+  {
+    perror("Failed to start the lease refill");
+    edge_running = 0;
+    return 0;
+  }
+  if (pthread_create(&forward_thread, NULL, run_forward, NULL) != 0)
+  {
+    perror("Failed to start forwarding to the central");
+    pthread_mutex_lock(&edge_mutex);
+    edge_running = 0;
+    pthread_cond_signal(&refill_due);
+    pthread_mutex_unlock(&edge_mutex);
+    pthread_join(refill_thread, NULL);
+    return 0;
+  }
+  return 1;
+}
+
+void edge_stop()
+{
+  if (!edge_running)
+    return;
+  pthread_mutex_lock(&edge_mutex);
+  __atomic_store_n(&edge_running, 0, __ATOMIC_RELEASE);
+  pthread_cond_signal(&refill_due);
+  pthread_mutex_unlock(&edge_mutex);
+  pthread_join(refill_thread, NULL);
+  pthread_join(forward_thread, NULL);
+  for (int i = 0; i < EDGE_FORWARDS; i++)
+  {
+    edgeForward left = claim_forward(&edge_forwards[i], 0, LLONG_MAX);
+    if (left.done)
+      left.done(NULL, -1, left.arg);
+  }
+
+  // Nothing else takes any more, but a late LEASED reply may still add, so
+  // hand back until a RETURN leaves nothing behind
+  for (;;)
+  {
+    wareHouse left;
+    do
+      left = warehouse_read();
+    while (warehouse_take(left.carbon, left.hydrogen, left.oxygen) == 0);
+    if (left.carbon == 0 && left.hydrogen == 0 && left.oxygen == 0)
+      return;
+
+    char request[96], reply[128];
+    snprintf(request, sizeof(request), "RETURN %llu %llu %llu\n", left.carbon, left.hydrogen, left.oxygen);
+    if (exchange(request, reply, sizeof(reply)) < 0 || strncmp(reply, "OK: RETURNED", 12) != 0)
+    {
+      printf("Central did not confirm the return of Carbon: %llu Hydrogen: %llu Oxygen: %llu\n",
+             left.carbon, left.hydrogen, left.oxygen);
+      return;
+    }
+    pthread_mutex_lock(&edge_mutex);
+    edge_totals.returned[0] += left.carbon;
+    edge_totals.returned[1] += left.hydrogen;
+    edge_totals.returned[2] += left.oxygen;
+    pthread_mutex_unlock(&edge_mutex);
+  }
+}
+
+void edge_spent()
+{
+  wareHouse have = warehouse_read();
+  unsigned long long low = edge_lease_size / 4;
+  if (have.carbon >= low && have.hydrogen >= low && have.oxygen >= low)
+    return;
+  pthread_mutex_lock(&edge_mutex);
+  refill_wanted = 1;
+  pthread_cond_signal(&refill_due);
+  pthread_mutex_unlock(&edge_mutex);
+}
+
+int edge_forward_async(const char *request, size_t len, edgeDone done, void *arg)
+{
+  unsigned seq = next_seq();
+  char tagged[320];
+  int tag_len = snprintf(tagged, sizeof(tagged), "#%u ", seq);
+  if (tag_len + len > sizeof(tagged))
+    return 0;
+  memcpy(tagged + tag_len, request, len);
+
+  // Taken before sending, so the reply cannot beat it
+  edgeForward *slot = &edge_forwards[seq % EDGE_FORWARDS];
+  pthread_mutex_lock(&edge_mutex);
+  if (slot->done)
+  {
+    pthread_mutex_unlock(&edge_mutex);
+    return 0;
+  }
+  *slot = (edgeForward){.seq = seq, .done = done, .arg = arg, .deadline = now_ms() + EDGE_TIMEOUT_MS};
+  edge_totals.forwarded++;
+  pthread_mutex_unlock(&edge_mutex);
+
+  if (send(forward_fd, tagged, tag_len + len, MSG_DONTWAIT) == (ssize_t)(tag_len + len))
+    return 1;
+  // Unless it timed out already, in which case done has run
+  pthread_mutex_lock(&edge_mutex);
+  int unsent = slot->done == done && slot->seq == seq;
+  if (unsent)
+  {
+    slot->done = NULL;
+    edge_totals.forwarded--;
+  }
+  pthread_mutex_unlock(&edge_mutex);
+  return !unsent;
+}
+
+typedef struct forwardWait
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t answered;
+  int done;
+  int len;
+  char *response;
+  size_t response_size;
+} forwardWait;
+
+static void forward_answered(const char *reply, int len, void *arg)
+{
+  forwardWait *wait = arg;
+  pthread_mutex_lock(&wait->mutex);
+  if (len >= 0)
+  {
+    if ((size_t)len >= wait->response_size)
+      len = wait->response_size - 1;
+    memcpy(wait->response, reply, len);
+    wait->response[len] = '\0';
+  }
+  wait->len = len;
+  wait->done = 1;
+  pthread_cond_signal(&wait->answered);
+  pthread_mutex_unlock(&wait->mutex);
+}
+
+int edge_forward(const char *request, size_t len, char *response, size_t response_size)
+{
+  forwardWait wait = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, -1, response, response_size};
+  if (!edge_forward_async(request, len, forward_answered, &wait))
+    return -1;
+  pthread_mutex_lock(&wait.mutex);
+  while (!wait.done)
+    pthread_cond_wait(&wait.answered, &wait.mutex);
+  pthread_mutex_unlock(&wait.mutex);
+  return wait.len;
+}
+
+void edge_stats(edgeStats *stats)
+{
+  pthread_mutex_lock(&edge_mutex);
+  *stats = edge_totals;
+  pthread_mutex_unlock(&edge_mutex);
+}
+
+int edge_grant(const unsigned long long want[3], char *response, size_t response_size)
+{
+  // As much of each atom as there is, up to what was asked
+  unsigned long long granted[3] = {0, 0, 0};
+  for (int atom = 0; atom < 3; atom++)
+  {
+    unsigned long long need[3] = {0, 0, 0};
+    need[atom] = want[atom];
+    int status = 0;
+    while (need[atom] > 0 && (status = warehouse_take(need[0], need[1], need[2])) == 0)
+    {
+      wareHouse have = warehouse_read();
+      unsigned long long left = atom == 0 ? have.carbon : atom == 1 ? have.hydrogen : have.oxygen;
+      if (left < need[atom])
+        need[atom] = left;
+    }
+    if (status > 0)
+      granted[atom] = need[atom];
+  }
+  return snprintf(response, response_size, "OK: LEASED %llu %llu %llu", granted[0], granted[1], granted[2]);
+}
+
+int edge_take_back(const unsigned long long atoms[3], char *response, size_t response_size)
+{
+  unsigned long long added[3] = {0, 0, 0};
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (atoms[atom] > 0 && warehouse_add(atom + 1, atoms[atom]) > 0)
+      added[atom] = atoms[atom];
+  }
+  return snprintf(response, response_size, "OK: RETURNED %llu %llu %llu", added[0], added[1], added[2]);
+}
@@ -0,0 +1,81 @@
+#ifndef EDGE_H
+#define EDGE_H
+
+#include <stddef.h>
+
+#include "warehouse.h"
+
+// Edge/central tier. An edge drinks_bar holds a lease of stock taken from
+// a central drinks_bar and serves DELIVER and GEN from it locally. When
+// an atom falls below a quarter of the lease size, a background thread
+// asks the central for enough to fill every atom back up, in one LEASE.
+// A DELIVER the local stock cannot cover is forwarded to the central as
+// is, by a forwarding thread that hands the reply back to the caller, so
+// no reactor waits for the round trip. On shutdown the edge RETURNs
+// whatever it still holds, its own ADDs included.
+//
+// LEASE and RETURN are datagrams to the central's DELIVER address. The
+// central grants what it has of each atom, up to what was asked. A LEASE
+// reply lost on the way takes atoms from the central that never reach the
+// edge, and a lost RETURN loses what it carried; on a local link that does
+// not happen in practice.
+//
+// Every request to the central starts with a "#<seq> " tag, which the
+// central echoes at the start of its reply. A reply that arrives after its
+// request timed out is dropped instead of answering the next request; a
+// late LEASED reply is still taken into stock, as the central took those
+// atoms either way.
+
+#define EDGE_DEFAULT_LEASE 1000
+#define EDGE_TIMEOUT_MS 500
+#define EDGE_RETRY_MS 100
+#define EDGE_FORWARDS 256 // forwarded requests in flight at once
+
+typedef struct edgeStats
+{
+  unsigned long long leases;      // LEASE requests answered
+  unsigned long long leased[3];   // atoms they granted
+  unsigned long long forwarded;   // DELIVERs passed to the central
+  unsigned long long stale;       // replies to timed-out requests, dropped
+  unsigned long long returned[3]; // atoms given back on shutdown
+} edgeStats;
+
+// Become an edge of the central at address ("port", "host:port" or a Unix
+// datagram path) with lease_size of each atom, and take the first lease.
+// Returns 0 on error.
+int edge_start(const char *address, unsigned long long lease_size);
+
+// Return the stock left to the central and stop refilling
+void edge_stop();
+
+// Call after taking from the local stock: wakes the refill once an atom
+// is below the low-water mark
+void edge_spent();
+
+// Pass request to the central without waiting. done(reply, len, arg) runs
+// once on the forwarding thread with the central's reply, tag removed, or
+// with len -1 if none came within EDGE_TIMEOUT_MS; it must be quick.
+// Returns 0, never calling done, if the request was not sent or
+// EDGE_FORWARDS requests are already waiting.
+typedef void (*edgeDone)(const char *reply, int len, void *arg);
+int edge_forward_async(const char *request, size_t len, edgeDone done, void *arg);
+
+// The same, waiting for the reply, for threads that may block. Returns the
+// reply length, or -1 without one.
+int edge_forward(const char *request, size_t len, char *response, size_t response_size);
+
+// Length of the tag at the start of buffer[0..len), 0 if it has none. The
+// central copies it to the start of its reply.
+int edge_tag_length(const char *buffer, size_t len);
+
+void edge_stats(edgeStats *stats);
+
+extern int edge_running;
+
+// Central side, against the calling thread's warehouse: grant a LEASE of
+// up to want (carbon, hydrogen, oxygen), or take a RETURN back, and build
+// the reply. Returns its length.
+int edge_grant(const unsigned long long want[3], char *response, size_t response_size);
+int edge_take_back(const unsigned long long atoms[3], char *response, size_t response_size);
+
+#endif
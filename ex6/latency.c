@@ -0,0 +1,160 @@
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct latencyHistogram
+{
+  unsigned long long buckets[LATENCY_BUCKETS];
+  unsigned long long max;
+} latencyHistogram;
+
+typedef struct latencySlot
+{
+  latencyHistogram histograms[LATENCY_COMMANDS][LATENCY_STAGES];
+} __attribute__((aligned(64))) latencySlot;
+
+__thread int latency_command = -1;
+
+latencySlot latency_slots[LATENCY_SLOTS];
+int latency_next_slot = 0;
+static __thread int latency_slot = -1;
+
+static const char *command_names[] = {"ADD", "DELIVER", "GEN"};
+static const char *stage_names[] = {"parse", "lock", "sync", "warehouse", "reply", "total"};
+
+unsigned long long latency_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long ns)
+{
+  if (ns < LATENCY_SUB)
+    return ns;
+  int top = 63 - __builtin_clzll(ns);
+  if (top > LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+  int shift = top - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB + (int)(ns >> shift) - LATENCY_SUB;
+}
+
+// Highest value that falls into bucket
+static unsigned long long bucket_value(int bucket)
+{
+  if (bucket < LATENCY_SUB)
+    return bucket;
+  int shift = bucket / LATENCY_SUB - 1;
+  return ((unsigned long long)(bucket % LATENCY_SUB + LATENCY_SUB + 1) << shift) - 1;
+}
+
+void latency_record(int command, int stage, unsigned long long ns, unsigned long long count)
+{
+  if (latency_slot < 0)
+    latency_slot = __atomic_fetch_add(&latency_next_slot, 1, __ATOMIC_RELAXED) % LATENCY_SLOTS;
+  latencyHistogram *h = &latency_slots[latency_slot].histograms[command][stage];
+  __atomic_fetch_add(&h->buckets[bucket_of(ns)], count, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void latency_stage(int stage, unsigned long long start)
+{
+  if (latency_command >= 0)
+    latency_record(latency_command, stage, latency_now() - start, 1);
+}
+
+void latency_summary(int command, int stage, latencySummary *summary)
+{
+  static unsigned long long counts[LATENCY_BUCKETS];
+  static pthread_mutex_t summary_mutex = PTHREAD_MUTEX_INITIALIZER;
+  unsigned long long total = 0, max = 0;
+
+  pthread_mutex_lock(&summary_mutex);
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+    counts[b] = 0;
+  for (int s = 0; s < LATENCY_SLOTS; s++)
+  {
+    latencyHistogram *h = &latency_slots[s].histograms[command][stage];
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+      counts[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    unsigned long long slot_max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (slot_max > max)
+      max = slot_max;
+  }
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+    total += counts[b];
+
+  // The value at or below which each share of the samples falls
+  const double shares[3] = {0.5, 0.99, 0.999};
+  unsigned long long values[3] = {0, 0, 0}, seen = 0;
+  int next = 0;
+  for (int b = 0; b < LATENCY_BUCKETS && next < 3 && total > 0; b++)
+  {
+    seen += counts[b];
+    while (next < 3 && seen >= shares[next] * total)
+    {
+      unsigned long long value = bucket_value(b);
+      values[next++] = value < max ? value : max;
+    }
+  }
+  pthread_mutex_unlock(&summary_mutex);
+
+  summary->count = total;
+  summary->p50 = values[0];
+  summary->p99 = values[1];
+  summary->p999 = values[2];
+  summary->max = max;
+}
+
+void latency_reset()
+{
+  for (int s = 0; s < LATENCY_SLOTS; s++)
+  {
+    for (int c = 0; c < LATENCY_COMMANDS; c++)
+    {
+      for (int stage = 0; stage < LATENCY_STAGES; stage++)
+      {
+        latencyHistogram *h = &latency_slots[s].histograms[c][stage];
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+          __atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+const char *latency_command_name(int command)
+{
+  return command >= 0 && command < LATENCY_COMMANDS ? command_names[command] : "?";
+}
+
+const char *latency_stage_name(int stage)
+{
+  return stage >= 0 && stage < LATENCY_STAGES ? stage_names[stage] : "?";
+}
+
+void latency_print(const char *prefix)
+{
+  int printed = 0;
+  for (int c = 0; c < LATENCY_COMMANDS; c++)
+  {
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+      latencySummary s;
+      latency_summary(c, stage, &s);
+      if (s.count == 0)
+        continue;
+      printf("%s%s %s: count=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", prefix,
+             command_names[c], stage_names[stage], s.count, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3,
+             s.max / 1e3);
+      printed = 1;
+    }
+  }
+  if (!printed)
+    printf("%sno samples\n", prefix);
+}
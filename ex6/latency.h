@@ -0,0 +1,70 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Per-stage latency histograms for ADD, DELIVER and GEN. Each command type
+// has a histogram per stage; a sample is a duration in nanoseconds taken
+// with CLOCK_MONOTONIC (vDSO, no syscall).
+//
+// Histograms are HDR-style: exact below 2^LATENCY_SUB_BITS ns, then every
+// power of two is split into 2^LATENCY_SUB_BITS buckets, so a percentile is
+// off by at most 1/16 of its value. Samples above 2^LATENCY_MAX_BITS ns
+// land in the last bucket. Threads count into their own slot of
+// histograms, so the request path shares no cache line; a query sums the
+// slots.
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_MAX_BITS 36 // about 69 s
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+#define LATENCY_SLOTS 16
+
+enum latencyCommand
+{
+  LATENCY_ADD,
+  LATENCY_DELIVER,
+  LATENCY_GEN,
+  LATENCY_COMMANDS
+};
+
+enum latencyStage
+{
+  LATENCY_PARSE,     // tokenizing the line
+  LATENCY_LOCK,      // waiting for the warehouse file lock
+  LATENCY_SYNC,      // waiting for the log or the mapped file to reach disk
+  LATENCY_WAREHOUSE, // the whole warehouse change, lock and sync included
+  LATENCY_REPLY,     // handing the reply to the kernel (GEN: logging it)
+  LATENCY_TOTAL,     // parse to reply built
+  LATENCY_STAGES
+};
+
+typedef struct latencySummary
+{
+  unsigned long long count;
+  unsigned long long p50, p99, p999, max; // ns
+} latencySummary;
+
+unsigned long long latency_now(); // ns
+
+// Command the calling thread is timing, -1 for none. Stages recorded deep
+// in the warehouse (lock, sync) are charged to it.
+extern __thread int latency_command;
+
+// Record count samples of ns for a command's stage
+void latency_record(int command, int stage, unsigned long long ns, unsigned long long count);
+
+// Record the time since start for the calling thread's command, if any
+void latency_stage(int stage, unsigned long long start);
+
+void latency_summary(int command, int stage, latencySummary *summary);
+
+// Zero every histogram. Samples recorded while it runs may survive it.
+void latency_reset();
+
+const char *latency_command_name(int command);
+const char *latency_stage_name(int stage);
+
+// Print p50/p99/p999/max of every stage that has samples, each line
+// starting with prefix
+void latency_print(const char *prefix);
+
+#endif
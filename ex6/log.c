@@ -0,0 +1,245 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_IDLE_NS 1000000 // writer nap when the ring is empty
+
+typedef struct logRecord
+{
+  int event;
+  int text_len;
+  long long args[3];
+  const char *name;
+  char text[LOG_TEXT_MAX];
+} logRecord;
+
+// Bounded ring with a sequence number per slot: a slot is free for the
+// producer that claims position pos when its seq is pos, and holds a
+// record for the writer when its seq is pos + 1.
+typedef struct logSlot
+{
+  unsigned long long seq;
+  logRecord record;
+} __attribute__((aligned(64))) logSlot;
+
+logSlot log_ring[LOG_RING_SIZE];
+unsigned long long log_tail __attribute__((aligned(64))) = 0; // next position to claim
+unsigned long long log_head __attribute__((aligned(64))) = 0; // next position to write, writer only
+unsigned long long log_total_written = 0;
+unsigned long long log_total_dropped = 0;
+
+int log_min_level = LOG_LEVEL_DEBUG;
+int log_running = 0;
+pthread_t log_writer;
+
+static const char *level_names[] = {"debug", "info", "warn", "error", "quiet"};
+
+void log_set_level(int level)
+{
+  __atomic_store_n(&log_min_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level()
+{
+  return __atomic_load_n(&log_min_level, __ATOMIC_RELAXED);
+}
+
+const char *log_level_name(int level)
+{
+  return level >= LOG_LEVEL_DEBUG && level <= LOG_LEVEL_QUIET ? level_names[level] : "?";
+}
+
+int log_parse_level(const char *name)
+{
+  for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_QUIET; level++)
+  {
+    if (strcmp(name, level_names[level]) == 0)
+      return level;
+  }
+  return -1;
+}
+
+// The lines drinks_bar printed before there was a log
+static void format_record(const logRecord *r)
+{
+  const long long *a = r->args;
+  switch (r->event)
+  {
+  case LOG_MESSAGE:
+    printf("%s\n", r->name);
+    break;
+  case LOG_STOCK:
+    printf("Carbon: %llu\nHydrogen: %llu\nOxygen: %llu\n", (unsigned long long)a[0],
+           (unsigned long long)a[1], (unsigned long long)a[2]);
+    break;
+  case LOG_CONNECTED:
+    printf("New client connected: fd=%lld (%lld clients)\n", a[0], a[1]);
+    break;
+  case LOG_DISCONNECTED:
+    printf("Client disconnected: fd=%lld\n", a[0]);
+    break;
+  case LOG_ACCEPT_BATCH:
+    printf("Accepted %lld connections, rejected %lld in one wakeup\n", a[0], a[1]);
+    break;
+  case LOG_LINE_TOO_LONG:
+    printf("Error: line longer than %lld bytes from fd=%lld dropped\n", a[1], a[0]);
+    break;
+  case LOG_BAD_WAREHOUSE:
+    printf("Error: cannot use warehouse '%.*s'\n", r->text_len, r->text);
+    break;
+  case LOG_USE:
+    printf("fd=%lld now uses warehouse %.*s\n", a[0], r->text_len, r->text);
+    break;
+  case LOG_ADDED:
+    printf("Added %llu %s\n", (unsigned long long)a[0], r->name);
+    break;
+  case LOG_ADD_REFUSED:
+    printf("Error: %s, ADD from fd=%lld refused\n", r->name, a[0]);
+    break;
+  case LOG_UNKNOWN_ATOM:
+    printf("Error: Unknown atom type '%.*s'\n", r->text_len, r->text);
+    break;
+  case LOG_DELIVERED:
+    printf("Delivered molecule %s\n", r->name);
+    break;
+  case LOG_NOT_ENOUGH:
+    printf("there is not enough atoms to deliver %s\n", r->name);
+    break;
+  case LOG_FORWARDED:
+    printf("Forwarding DELIVER %s to the central warehouse\n", r->name);
+    break;
+  case LOG_REPLY:
+    printf("%.*s\n", r->text_len, r->text);
+    break;
+  case LOG_GENERATED:
+    printf("Generated drink %s\n", r->name);
+    break;
+  case LOG_NOT_GENERATED:
+    printf("Sorry man, couldn't generate %s\n", r->name);
+    break;
+  case LOG_DRINK_COUNT:
+    printf("number of %s drinks can make %llu\n", r->name, (unsigned long long)a[0]);
+    break;
+  }
+}
+
+static void fill_record(logRecord *r, int event, const char *name, const char *text, size_t text_len,
+                        long long a, long long b, long long c)
+{
+  r->event = event;
+  r->name = name;
+  r->args[0] = a;
+  r->args[1] = b;
+  r->args[2] = c;
+  if (text_len > LOG_TEXT_MAX - 1)
+    text_len = LOG_TEXT_MAX - 1;
+  r->text_len = text ? text_len : 0;
+  if (text)
+    memcpy(r->text, text, text_len);
+}
+
+void log_event(int level, int event, const char *name, const char *text, size_t text_len,
+               long long a, long long b, long long c)
+{
+  if (level < log_level())
+    return;
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+  {
+    logRecord record;
+    fill_record(&record, event, name, text, text_len, a, b, c);
+    format_record(&record);
+    return;
+  }
+
+  unsigned long long pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+  logSlot *slot;
+  while (1)
+  {
+    slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+    long long diff = (long long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // The writer has not freed this slot yet: the ring is full
+      __atomic_fetch_add(&log_total_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else
+      pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+  }
+  fill_record(&slot->record, event, name, text, text_len, a, b, c);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Write every record published so far. Returns how many there were.
+static int drain()
+{
+  int count = 0;
+  while (1)
+  {
+    logSlot *slot = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+      break;
+    format_record(&slot->record);
+    __atomic_store_n(&slot->seq, log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    log_head++;
+    count++;
+  }
+  __atomic_fetch_add(&log_total_written, count, __ATOMIC_RELAXED);
+  return count;
+}
+
+static void *run_writer(void *arg)
+{
+  (void)arg;
+  while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+  {
+    if (drain() == 0)
+    {
+      // Caught up: push out what stdio holds and nap
+      fflush(stdout);
+      struct timespec nap = {.tv_nsec = LOG_IDLE_NS};
+      nanosleep(&nap, NULL);
+    }
+  }
+  drain();
+  fflush(stdout);
+  return NULL;
+}
+
+int log_start()
+{
+  for (unsigned long long i = 0; i < LOG_RING_SIZE; i++)
+    log_ring[i].seq = log_head + i;
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&log_writer, NULL, run_writer, NULL) != 0)
+  {
+    perror("Failed to start the log writer");
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return 1;
+}
+
+void log_stop()
+{
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    return;
+  // Callers stop logging first; the writer drains once more after it sees
+  // the flag drop
+  __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+  pthread_join(log_writer, NULL);
+}
+
+void log_stats(unsigned long long *written, unsigned long long *dropped)
+{
+  *written = __atomic_load_n(&log_total_written, __ATOMIC_RELAXED);
+  *dropped = __atomic_load_n(&log_total_dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,75 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+// Request logging off the request path. log_event() writes a small binary
+// record (an event, up to three numbers, a static name and a short copied
+// text) into a lock-free ring, and a background thread formats the
+// records and writes them to stdout. Nothing on the request path makes a
+// syscall or waits for a lock. When the ring is full the record is dropped
+// and counted.
+//
+// Until log_start() (and after log_stop()), log_event() formats and prints
+// right away, so tools that never start the thread print as they always
+// did.
+
+#define LOG_RING_SIZE 8192 // records, a power of two
+#define LOG_TEXT_MAX 64
+
+enum logLevel
+{
+  LOG_LEVEL_DEBUG, // every request, and the stock after it
+  LOG_LEVEL_INFO,  // connections and console commands
+  LOG_LEVEL_WARN,  // refused and malformed requests
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_QUIET  // nothing
+};
+
+enum logEvent
+{
+  LOG_MESSAGE,          // name
+  LOG_STOCK,            // carbon, hydrogen, oxygen
+  LOG_CONNECTED,        // fd, clients
+  LOG_DISCONNECTED,     // fd
+  LOG_ACCEPT_BATCH,     // accepted, rejected
+  LOG_LINE_TOO_LONG,    // fd, limit
+  LOG_BAD_WAREHOUSE,    // text: the name
+  LOG_USE,              // fd, text: the name
+  LOG_ADDED,            // quantity, name: the atom
+  LOG_ADD_REFUSED,      // fd, name: why
+  LOG_UNKNOWN_ATOM,     // text
+  LOG_DELIVERED,        // name: the molecule
+  LOG_NOT_ENOUGH,       // name: the molecule or drink
+  LOG_FORWARDED,        // name: the molecule
+  LOG_REPLY,            // text
+  LOG_GENERATED,        // name: the drink
+  LOG_NOT_GENERATED,    // name: the drink
+  LOG_DRINK_COUNT       // count, name: the drink
+};
+
+// drinks_bar's level unless told otherwise: every ADD and DELIVER line
+// with the stock after it. That reads every shard on the request path;
+// --log-level info leaves the stock alone.
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_DEBUG
+
+// Log at or above level from now on
+void log_set_level(int level);
+int log_level();
+const char *log_level_name(int level);
+int log_parse_level(const char *name); // -1 if unknown
+
+// Start and stop the writer thread. log_stop() writes what is queued
+// first; nothing may be logging concurrently by then.
+int log_start();
+void log_stop();
+
+// Record an event. name must outlive the record (a string literal or a
+// recipe name); text is copied, up to LOG_TEXT_MAX - 1 bytes.
+void log_event(int level, int event, const char *name, const char *text, size_t text_len,
+               long long a, long long b, long long c);
+
+// Records written and dropped
+void log_stats(unsigned long long *written, unsigned long long *dropped);
+
+#endif
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "log.h"
+#include "shm_stats.h"
+#include "warehouse.h"
+
+#define METRICS_POLL_MS 200
+#define METRICS_TIMEOUT_MS 500 // for a scraper to send its request and take the reply
+#define METRICS_BUFFER (64 * 1024)
+
+typedef struct metricsSlot
+{
+  unsigned long long counters[METRIC_COUNTERS];
+} __attribute__((aligned(64))) metricsSlot;
+
+int metrics_running = 0;
+
+metricsSlot metrics_slots[METRICS_SLOTS];
+int metrics_next_slot = 0;
+static __thread int metrics_slot = -1;
+
+int metrics_fd = -1;
+char *metrics_path = NULL; // Unix socket to remove on stop
+const int *metrics_clients = NULL;
+pthread_t metrics_thread;
+
+statsSegment *published = NULL;
+char *published_name = NULL;
+int publishing = 0;
+pthread_t publish_thread;
+
+static const char *command_labels[] = {"ADD", "DELIVER", "GEN", "LEASE", "RETURN", "USE", "INVALID"};
+static const char *failure_labels[] = {"not_enough_atoms", "unknown_molecule", "unknown_atom",
+                                       "warehouse_full", "bad_warehouse", "refused", "line_too_long"};
+
+void metrics_count(int counter, unsigned long long amount)
+{
+  if (metrics_slot < 0)
+    metrics_slot = __atomic_fetch_add(&metrics_next_slot, 1, __ATOMIC_RELAXED) % METRICS_SLOTS;
+  __atomic_fetch_add(&metrics_slots[metrics_slot].counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+unsigned long long metrics_total(int counter)
+{
+  unsigned long long total = 0;
+  for (int i = 0; i < METRICS_SLOTS; i++)
+    total += __atomic_load_n(&metrics_slots[i].counters[counter], __ATOMIC_RELAXED);
+  return total;
+}
+
+typedef struct renderBuffer
+{
+  char *data;
+  size_t size;
+  size_t len;
+} renderBuffer;
+
+static void emit(renderBuffer *out, const char *format, ...)
+{
+  if (out->len + 1 >= out->size)
+    return;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(out->data + out->len, out->size - out->len, format, args);
+  va_end(args);
+  if (n > 0)
+    out->len = out->len + n < out->size ? out->len + n : out->size - 1;
+}
+
+static void emit_stock(const char *location, wareHouse stock, void *arg)
+{
+  renderBuffer *out = arg;
+  const char *name = location[0] ? location : "default";
+  emit(out, "drinks_stock_atoms{warehouse=\"%s\",atom=\"carbon\"} %llu\n", name, stock.carbon);
+  emit(out, "drinks_stock_atoms{warehouse=\"%s\",atom=\"hydrogen\"} %llu\n", name, stock.hydrogen);
+  emit(out, "drinks_stock_atoms{warehouse=\"%s\",atom=\"oxygen\"} %llu\n", name, stock.oxygen);
+}
+
+int metrics_render(char *buffer, size_t size)
+{
+  renderBuffer out = {.data = buffer, .size = size, .len = 0};
+  buffer[0] = '\0';
+
+  emit(&out, "# HELP drinks_commands_total Commands received, by type.\n"
+             "# TYPE drinks_commands_total counter\n");
+  for (int c = METRIC_ADD; c <= METRIC_INVALID; c++)
+    emit(&out, "drinks_commands_total{command=\"%s\"} %llu\n", command_labels[c - METRIC_ADD],
+         metrics_total(c));
+
+  emit(&out, "# HELP drinks_failures_total Commands that failed, by reason.\n"
+             "# TYPE drinks_failures_total counter\n");
+  for (int c = METRIC_NOT_ENOUGH; c <= METRIC_LINE_TOO_LONG; c++)
+    emit(&out, "drinks_failures_total{reason=\"%s\"} %llu\n", failure_labels[c - METRIC_NOT_ENOUGH],
+         metrics_total(c));
+
+  emit(&out, "# HELP drinks_stock_atoms Atoms in each warehouse.\n"
+             "# TYPE drinks_stock_atoms gauge\n");
+  warehouse_visit(emit_stock, &out);
+
+  emit(&out, "# HELP drinks_connected_clients Open stream connections.\n"
+             "# TYPE drinks_connected_clients gauge\n"
+             "drinks_connected_clients %d\n",
+       metrics_clients ? __atomic_load_n(metrics_clients, __ATOMIC_RELAXED) : 0);
+  emit(&out, "# HELP drinks_connections_accepted_total Stream connections accepted.\n"
+             "# TYPE drinks_connections_accepted_total counter\n"
+             "drinks_connections_accepted_total %llu\n",
+       metrics_total(METRIC_ACCEPTED));
+  emit(&out, "# HELP drinks_connections_rejected_total Stream connections turned away.\n"
+             "# TYPE drinks_connections_rejected_total counter\n"
+             "drinks_connections_rejected_total %llu\n",
+       metrics_total(METRIC_REJECTED));
+  emit(&out, "# HELP drinks_received_bytes_total Request bytes read from clients.\n"
+             "# TYPE drinks_received_bytes_total counter\n"
+             "drinks_received_bytes_total %llu\n",
+       metrics_total(METRIC_BYTES_IN));
+  emit(&out, "# HELP drinks_sent_bytes_total Reply bytes sent to clients.\n"
+             "# TYPE drinks_sent_bytes_total counter\n"
+             "drinks_sent_bytes_total %llu\n",
+       metrics_total(METRIC_BYTES_OUT));
+  emit(&out, "# HELP drinks_lock_waits_total Times the warehouse file lock was taken.\n"
+             "# TYPE drinks_lock_waits_total counter\n"
+             "drinks_lock_waits_total %llu\n",
+       metrics_total(METRIC_LOCK_WAITS));
+  emit(&out, "# HELP drinks_lock_wait_seconds_total Time spent waiting for the warehouse file lock.\n"
+             "# TYPE drinks_lock_wait_seconds_total counter\n"
+             "drinks_lock_wait_seconds_total %.9f\n",
+       metrics_total(METRIC_LOCK_WAIT_NS) / 1e9);
+
+  unsigned long long written, dropped;
+  log_stats(&written, &dropped);
+  emit(&out, "# HELP drinks_log_records_total Log records written and dropped.\n"
+             "# TYPE drinks_log_records_total counter\n"
+             "drinks_log_records_total{outcome=\"written\"} %llu\n"
+             "drinks_log_records_total{outcome=\"dropped\"} %llu\n",
+       written, dropped);
+
+  emit(&out, "# HELP drinks_request_duration_seconds Time in each stage of a command since the last LATENCY RESET.\n"
+             "# TYPE drinks_request_duration_seconds summary\n");
+  for (int c = 0; c < LATENCY_COMMANDS; c++)
+  {
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+      latencySummary s;
+      latency_summary(c, stage, &s);
+      if (s.count == 0)
+        continue;
+      const char *labels[2] = {latency_command_name(c), latency_stage_name(stage)};
+      const char *quantiles[4] = {"0.5", "0.99", "0.999", "1"};
+      const unsigned long long values[4] = {s.p50, s.p99, s.p999, s.max};
+      for (int q = 0; q < 4; q++)
+        emit(&out, "drinks_request_duration_seconds{command=\"%s\",stage=\"%s\",quantile=\"%s\"} %.9f\n",
+             labels[0], labels[1], quantiles[q], values[q] / 1e9);
+      emit(&out, "drinks_request_duration_seconds_count{command=\"%s\",stage=\"%s\"} %llu\n", labels[0],
+           labels[1], s.count);
+    }
+  }
+  return out.len;
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return;
+    data += sent;
+    len -= sent;
+  }
+}
+
+// Whatever the scraper asks for, it gets the whole exposition
+static void serve_scrape(int fd)
+{
+  static char body[METRICS_BUFFER];
+  char request[1024], header[160];
+  struct timeval timeout = {.tv_sec = 0, .tv_usec = METRICS_TIMEOUT_MS * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (recv(fd, request, sizeof(request), 0) < 0)
+    return;
+
+  int len = metrics_render(body, sizeof(body));
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %d\r\n\r\n",
+                            len);
+  write_all(fd, header, header_len);
+  write_all(fd, body, len);
+}
+
+static void *run_metrics(void *arg)
+{
+  (void)arg;
+  while (metrics_running)
+  {
+    struct pollfd pfd = {.fd = metrics_fd, .events = POLLIN};
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+      continue;
+    int fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+      continue;
+    serve_scrape(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+// A path is a Unix stream socket, otherwise "port" or "host:port" over TCP
+static int metrics_socket(const char *address)
+{
+  int fd;
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(address) >= sizeof(addr.sun_path))
+      return -1;
+    strcpy(addr.sun_path, address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(address);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+      if (fd != -1)
+        close(fd);
+      return -1;
+    }
+    metrics_path = strdup(address);
+    return fd;
+  }
+
+  char host[256] = "";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+    port = address;
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+  struct addrinfo *found;
+  if (getaddrinfo(host[0] ? host : NULL, port, &hints, &found) != 0)
+    return -1;
+  fd = -1;
+  for (struct addrinfo *ai = found; ai && fd == -1; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, 16) == -1)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+int metrics_start(const char *address, const int *clients)
+{
+  metrics_fd = metrics_socket(address);
+  if (metrics_fd == -1)
+  {
+    fprintf(stderr, "Cannot serve metrics on %s\n", address);
+    return 0;
+  }
+  metrics_clients = clients;
+  metrics_running = 1;
+  if (pthread_create(&metrics_thread, NULL, run_metrics, NULL) != 0)
+  {
+    perror("Failed to start the metrics thread");
+    metrics_running = 0;
+    return 0;
+  }
+  return 1;
+}
+
+void metrics_stop()
+{
+  if (!metrics_running)
+    return;
+  metrics_running = 0;
+  pthread_join(metrics_thread, NULL);
+  close(metrics_fd);
+  if (metrics_path)
+    unlink(metrics_path);
+}
+
+static void publish(int running)
+{
+  statsSegment *seg = published;
+  wareHouse stock = warehouse_read();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  shm_stats_write_begin(seg);
+  seg->running = running;
+  seg->updated = now.tv_sec + now.tv_nsec / 1e9;
+  seg->clients = metrics_clients ? __atomic_load_n(metrics_clients, __ATOMIC_RELAXED) : 0;
+  for (int c = 0; c < METRIC_COUNTERS; c++)
+    seg->counters[c] = metrics_total(c);
+  seg->stock[0] = stock.carbon;
+  seg->stock[1] = stock.hydrogen;
+  seg->stock[2] = stock.oxygen;
+  log_stats(&seg->log_written, &seg->log_dropped);
+  for (int c = 0; c < LATENCY_COMMANDS; c++)
+  {
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+      latency_summary(c, stage, &seg->latency[c][stage]);
+  }
+  shm_stats_write_end(seg);
+}
+
+static void *run_publish(void *arg)
+{
+  (void)arg;
+  while (publishing)
+  {
+    publish(1);
+    usleep(SHM_STATS_PUBLISH_MS * 1000);
+  }
+  return NULL;
+}
+
+int metrics_publish(const char *name, const int *clients)
+{
+  published = shm_stats_create(name);
+  if (!published)
+  {
+    perror("Failed to create the stats segment");
+    return 0;
+  }
+  published_name = strdup(name);
+  metrics_clients = clients;
+  publishing = 1;
+  if (pthread_create(&publish_thread, NULL, run_publish, NULL) != 0)
+  {
+    perror("Failed to start publishing stats");
+    publishing = 0;
+    return 0;
+  }
+  return 1;
+}
+
+void metrics_unpublish()
+{
+  if (!publishing)
+    return;
+  publishing = 0;
+  pthread_join(publish_thread, NULL);
+  // A reader that still has it mapped sees the server stopped
+  publish(0);
+  shm_stats_close(published);
+  shm_stats_remove(published_name);
+  free(published_name);
+  published = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+// Metrics endpoint. A thread of its own serves every connection to the
+// metrics address one Prometheus text exposition (format 0.0.4) in an
+// HTTP/1.0 response, then closes it, so a scrape never runs on a reactor.
+// The address is a Unix stream socket path (curl --unix-socket) or a TCP
+// "port" / "host:port".
+//
+// Counters are counted where they happen into the calling thread's slot,
+// like the latency histograms, and summed at scrape time. Stock comes
+// from warehouse_visit() and latency quantiles from latency_summary().
+
+#define METRICS_SLOTS 16
+
+enum metricCounter
+{
+  // Commands served, by type
+  METRIC_ADD,
+  METRIC_DELIVER,
+  METRIC_GEN,
+  METRIC_LEASE,
+  METRIC_RETURN,
+  METRIC_USE,
+  METRIC_INVALID,
+  // Failures, by reason
+  METRIC_NOT_ENOUGH,        // a molecule or drink the stock could not cover
+  METRIC_UNKNOWN_MOLECULE,
+  METRIC_UNKNOWN_ATOM,
+  METRIC_WAREHOUSE_FULL,
+  METRIC_BAD_WAREHOUSE,     // an @name or USE that cannot be used
+  METRIC_REFUSED,           // a backup or raft follower turning a change away
+  METRIC_LINE_TOO_LONG,
+  // Connections and traffic
+  METRIC_ACCEPTED,
+  METRIC_REJECTED,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  // The warehouse file lock
+  METRIC_LOCK_WAITS,
+  METRIC_LOCK_WAIT_NS,
+  METRIC_COUNTERS
+};
+
+void metrics_count(int counter, unsigned long long amount);
+
+// Serve metrics on address; clients is read for the connected clients
+// gauge. Returns 0 on error.
+int metrics_start(const char *address, const int *clients);
+void metrics_stop();
+
+// Write the exposition into buffer. Returns its length, at most size - 1.
+int metrics_render(char *buffer, size_t size);
+
+// Publish the same numbers into the shared memory segment name (see
+// shm_stats.h) every SHM_STATS_PUBLISH_MS until metrics_unpublish(),
+// which removes it. Returns 0 on error.
+int metrics_publish(const char *name, const int *clients);
+void metrics_unpublish();
+
+unsigned long long metrics_total(int counter);
+
+extern int metrics_running;
+
+#endif
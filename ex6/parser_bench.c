@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "protocol.h"
+
+// Checks parse_command() against the commands drinks_bar accepts, and with
+// "bench" compares its speed to the sscanf parsing it replaced.
+
+#define ROUNDS 2000000
+
+typedef struct parseCase
+{
+    const char *line;
+    int type;
+    int id;
+    unsigned long long quantity;
+} parseCase;
+
+const parseCase cases[] = {
+    {"ADD CARBON 5\n", CMD_ADD, ATOM_CARBON, 5},
+    {"ADD HYDROGEN 12", CMD_ADD, ATOM_HYDROGEN, 12},
+    {"ADD OXYGEN 1\r\n", CMD_ADD, ATOM_OXYGEN, 1},
+    {"  ADD\tOXYGEN   7  ", CMD_ADD, ATOM_OXYGEN, 7},
+    {"ADD CARBON 18446744073709551615", CMD_ADD, ATOM_CARBON, 18446744073709551615ULL},
+    {"ADD CARBON 18446744073709551616", CMD_INVALID, -1, 0},
+    {"ADD NITROGEN 3", CMD_ADD, -1, 3},
+    {"ADD CARBON 0", CMD_INVALID, -1, 0},
+    {"ADD CARBON -4", CMD_INVALID, -1, 0},
+    {"ADD CARBON 4x", CMD_INVALID, -1, 0},
+    {"ADD CARBON", CMD_INVALID, -1, 0},
+    {"ADD CARBON 1 2", CMD_INVALID, -1, 0},
+    {"add CARBON 1", CMD_INVALID, -1, 0},
+    {"DELIVER WATER 3\n", CMD_DELIVER, MOLECULE_WATER, 3},
+    {"DELIVER CARBON DIOXIDE 2", CMD_DELIVER, MOLECULE_CARBON_DIOXIDE, 2},
+    {"DELIVER CARBON   DIOXIDE 2", CMD_DELIVER, MOLECULE_CARBON_DIOXIDE, 2},
+    {"DELIVER GLUCOSE 1", CMD_DELIVER, MOLECULE_GLUCOSE, 1},
+    {"DELIVER ALCOHOL 9", CMD_DELIVER, MOLECULE_ALCOHOL, 9},
+    {"DELIVER WATERS 1", CMD_DELIVER, -1, 1},
+    {"DELIVER CARBON 1", CMD_DELIVER, -1, 1},
+    {"DELIVER WATER", CMD_INVALID, -1, 0},
+    {"DELIVER A B C 1", CMD_INVALID, -1, 0},
+    {"DELIVERWATER 1", CMD_INVALID, -1, 0},
+    {"GEN VODKA\n", CMD_GEN, DRINK_VODKA, 0},
+    {"GEN SOFT DRINK", CMD_GEN, DRINK_SOFT_DRINK, 0},
+    {"GEN CHAMPAGNE", CMD_GEN, DRINK_CHAMPAGNE, 0},
+    {"GEN BEER", CMD_GEN, -1, 0},
+    {"GEN", CMD_INVALID, -1, 0},
+    {"", CMD_INVALID, -1, 0},
+    {"\n", CMD_INVALID, -1, 0},
+    {"ADD CARBON 5\rX", CMD_INVALID, -1, 0},
+    {"SNAPSHOT /tmp/bar.dat\n", CMD_SNAPSHOT, -1, 0},
+    {"SNAPSHOT", CMD_INVALID, -1, 0},
+    {"SNAPSHOT a b", CMD_INVALID, -1, 0},
+    {"@bar42 ADD OXYGEN 3", CMD_ADD, ATOM_OXYGEN, 3},
+    {"@bar42 DELIVER CARBON DIOXIDE 2", CMD_DELIVER, MOLECULE_CARBON_DIOXIDE, 2},
+    {"@ ADD OXYGEN 3", CMD_INVALID, -1, 0},
+    {"@bar42", CMD_INVALID, -1, 0},
+    {"USE bar42", CMD_USE, -1, 0},
+    {"@bar1 USE bar42", CMD_INVALID, -1, 0},
+    {"PROMOTE\n", CMD_PROMOTE, -1, 0},
+    {"PROMOTE now", CMD_INVALID, -1, 0},
+    {"@bar1 PROMOTE", CMD_INVALID, -1, 0},
+    {"ADD", CMD_INVALID, -1, 0},
+    {"LEASE 100 200 0\n", CMD_LEASE, -1, 300},
+    {"@bar42 RETURN 0 0 7", CMD_RETURN, -1, 7},
+    {"LEASE 0 0 0", CMD_INVALID, -1, 0},
+    {"LEASE 1 2", CMD_INVALID, -1, 0},
+    {"RETURN 1 -2 3", CMD_INVALID, -1, 0},
+    {"LEASE 18446744073709551615 1 0", CMD_INVALID, -1, 0},
+    {"LATENCY\n", CMD_LATENCY, -1, 0},
+    {"LATENCY RESET", CMD_LATENCY, -1, 0},
+    {"LATENCY NOW", CMD_INVALID, -1, 0},
+    {"@bar1 LATENCY", CMD_INVALID, -1, 0},
+};
+
+int check()
+{
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const parseCase *c = &cases[i];
+        command cmd;
+        int type = parse_command(c->line, strlen(c->line), &cmd);
+        int ok = type == c->type && cmd.type == c->type;
+        if (ok && type != CMD_INVALID)
+            ok = cmd.id == c->id && cmd.quantity == c->quantity;
+        if (!ok)
+        {
+            printf("FAIL: \"%s\" -> type=%d id=%d quantity=%llu\n", c->line, type, cmd.id,
+                   cmd.quantity);
+            failed++;
+        }
+    }
+
+    // The parser must not read past the length it was given
+    command cmd;
+    const char *prefix = "ADD CARBON 12345";
+    if (parse_command(prefix, 13, &cmd) != CMD_ADD || cmd.quantity != 12)
+    {
+        printf("FAIL: length-bounded parse\n");
+        failed++;
+    }
+
+    // Each atom of a LEASE lands in its own slot
+    const char *lease = "LEASE 5 0 9";
+    if (parse_command(lease, strlen(lease), &cmd) != CMD_LEASE || cmd.atoms[0] != 5 ||
+        cmd.atoms[1] != 0 || cmd.atoms[2] != 9)
+    {
+        printf("FAIL: lease atoms\n");
+        failed++;
+    }
+
+    printf("parser: %s (%zu cases)\n", failed ? "FAIL" : "PASS",
+           sizeof(cases) / sizeof(cases[0]) + 2);
+    return failed == 0;
+}
+
+// Every drink's atom vector must be the sum of its three molecules
+int check_recipes()
+{
+    int failed = 0;
+    for (int d = 0; d < DRINK_COUNT; d++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned long long sum = 0;
+            for (int m = 0; m < 3; m++)
+                sum += molecule_recipes[drink_molecules[d][m]].atoms[i];
+            if (sum != drink_recipes[d].atoms[i])
+            {
+                printf("FAIL: %s needs %llu of atom %d, its molecules sum to %llu\n",
+                       drink_recipes[d].name, drink_recipes[d].atoms[i], i + 1, sum);
+                failed++;
+            }
+        }
+    }
+    printf("recipes: %s\n", failed ? "FAIL" : "PASS");
+    return failed == 0;
+}
+
+//----------------------------------------------------------------------------
+// The sscanf parsing drinks_bar used before, for comparison
+
+const char *atoms[] = {"CARBON", "HYDROGEN", "OXYGEN"};
+
+int sscanf_add(char *buffer, unsigned long long *quantity)
+{
+    char *newline = strchr(buffer, '\n');
+    if (newline)
+        *newline = '\0';
+
+    char atom[16];
+    int value = 0;
+    if (sscanf(buffer, "ADD %15s %d", atom, &value) == 2 && value > 0)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            if (strcmp(atom, atoms[j]) == 0)
+            {
+                *quantity = value;
+                return j + 1;
+            }
+        }
+    }
+    return -1;
+}
+
+int sscanf_deliver(char *buffer, char *molecule, unsigned long long *quantity)
+{
+    char *newline = strchr(buffer, '\n');
+    if (newline)
+        *newline = '\0';
+
+    char word1[16], word2[16];
+    int value = 0;
+    if (sscanf(buffer, "DELIVER %15s %d", molecule, &value) == 2 && value > 0)
+    {
+        *quantity = value;
+        return 1;
+    }
+    if (sscanf(buffer, "DELIVER %15s %15s %d", word1, word2, &value) == 3 && value > 0)
+    {
+        snprintf(molecule, 32, "%s %s", word1, word2);
+        *quantity = value;
+        return 1;
+    }
+    return 0;
+}
+
+double seconds_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench()
+{
+    char lines[4][32] = {"ADD CARBON 12\n", "ADD OXYGEN 7\n", "DELIVER WATER 3\n",
+                         "DELIVER CARBON DIOXIDE 2\n"};
+    size_t lengths[4];
+    for (int i = 0; i < 4; i++)
+        lengths[i] = strlen(lines[i]);
+
+    // Sink so the compiler keeps the work
+    volatile unsigned long long sink = 0;
+
+    double start = seconds_now();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        char *line = lines[i & 3];
+        unsigned long long quantity = 0;
+        char molecule[32];
+        if ((i & 3) < 2)
+            sink += sscanf_add(line, &quantity);
+        else
+            sink += sscanf_deliver(line, molecule, &quantity);
+        sink += quantity;
+    }
+    double legacy = ROUNDS / (seconds_now() - start) / 1e6;
+
+    start = seconds_now();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        command cmd;
+        parse_command(lines[i & 3], lengths[i & 3], &cmd);
+        sink += cmd.id + cmd.quantity;
+    }
+    double single_pass = ROUNDS / (seconds_now() - start) / 1e6;
+
+    printf("sscanf:      %8.2f Mcmds/s\n", legacy);
+    printf("single-pass: %8.2f Mcmds/s (%.1fx)\n", single_pass, single_pass / legacy);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+    int ok = check();
+    ok = check_recipes() && ok;
+    return ok ? 0 : 1;
+}
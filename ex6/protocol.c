@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include "protocol.h"
+
+// Longest valid commands are "DELIVER CARBON DIOXIDE <n>" and LEASE/RETURN
+// with their three counts, plus the prefix
+#define MAX_COMMAND_TOKENS 4
+#define MAX_TOKENS (MAX_COMMAND_TOKENS + 1)
+
+static int is_blank(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+static int token_is(const char *token, size_t len, const char *word, size_t word_len)
+{
+  return len == word_len && memcmp(token, word, len) == 0;
+}
+
+// Decimal digits only, no sign; values past 2^64-1 are rejected
+static int parse_count(const char *digits, size_t len, unsigned long long *out)
+{
+  unsigned long long value = 0;
+  if (len == 0)
+    return 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    unsigned digit = (unsigned char)digits[i] - '0';
+    if (digit > 9)
+      return 0;
+    if (value > (~0ULL - digit) / 10)
+      return 0;
+    value = value * 10 + digit;
+  }
+  *out = value;
+  return 1;
+}
+
+// As parse_count(), and 0 is rejected too
+static int parse_quantity(const char *digits, size_t len, unsigned long long *out)
+{
+  return parse_count(digits, len, out) && *out > 0;
+}
+
+int parse_command(const char *line, size_t len, command *cmd)
+{
+  const char *start[MAX_TOKENS];
+  size_t length[MAX_TOKENS];
+  int tokens = 0;
+
+  cmd->type = CMD_INVALID;
+  cmd->id = -1;
+  cmd->quantity = 0;
+  cmd->atoms[0] = cmd->atoms[1] = cmd->atoms[2] = 0;
+  cmd->name = NULL;
+  cmd->name_len = 0;
+  cmd->warehouse = NULL;
+  cmd->warehouse_len = 0;
+
+  // One pass over the line records where each blank-separated token is.
+  // A NUL ends the line just like the newline does.
+  const char *p = line, *end = line + len;
+  while (p < end)
+  {
+    while (p < end && is_blank(*p))
+      p++;
+    if (p == end || *p == '\n' || *p == '\r' || *p == '\0')
+      break;
+    if (tokens == MAX_TOKENS)
+      return CMD_INVALID;
+    start[tokens] = p;
+    while (p < end && !is_blank(*p) && *p != '\n' && *p != '\r' && *p != '\0')
+      p++;
+    length[tokens] = p - start[tokens];
+    tokens++;
+  }
+  if (p < end && *p == '\r')
+    p++;
+  if (p < end && *p != '\n' && *p != '\0')
+    return CMD_INVALID; // stray '\r' inside the line
+
+  // @<warehouse> prefix: the command proper starts at the next token
+  const char **word = start;
+  size_t *word_len = length;
+  if (tokens > 0 && start[0][0] == '@')
+  {
+    if (length[0] < 2)
+      return CMD_INVALID;
+    cmd->warehouse = start[0] + 1;
+    cmd->warehouse_len = length[0] - 1;
+    word++;
+    word_len++;
+    tokens--;
+  }
+  if (tokens < 1 || tokens > MAX_COMMAND_TOKENS)
+    return CMD_INVALID;
+
+  // PROMOTE, the only command without arguments
+  if (token_is(word[0], word_len[0], "PROMOTE", 7))
+    return cmd->type = tokens == 1 && !cmd->warehouse ? CMD_PROMOTE : CMD_INVALID;
+
+  // LATENCY [RESET]
+  if (token_is(word[0], word_len[0], "LATENCY", 7))
+  {
+    if (cmd->warehouse || tokens > 2 || (tokens == 2 && !token_is(word[1], word_len[1], "RESET", 5)))
+      return CMD_INVALID;
+    if (tokens == 2)
+    {
+      cmd->name = word[1];
+      cmd->name_len = word_len[1];
+    }
+    return cmd->type = CMD_LATENCY;
+  }
+  if (tokens < 2)
+    return CMD_INVALID;
+
+  // ADD <atom> <n>
+  if (token_is(word[0], word_len[0], "ADD", 3))
+  {
+    if (tokens != 3 || !parse_quantity(word[2], word_len[2], &cmd->quantity))
+      return CMD_INVALID;
+    cmd->name = word[1];
+    cmd->name_len = word_len[1];
+    cmd->id = recipe_lookup(NAME_ATOM, word[1], word_len[1], NULL, 0);
+    return cmd->type = CMD_ADD;
+  }
+
+  // DELIVER <molecule> <n>, where the molecule may be two words
+  if (token_is(word[0], word_len[0], "DELIVER", 7))
+  {
+    if (tokens < 3 || !parse_quantity(word[tokens - 1], word_len[tokens - 1], &cmd->quantity))
+      return CMD_INVALID;
+    cmd->name = word[1];
+    cmd->name_len = word[tokens - 2] + word_len[tokens - 2] - word[1];
+    cmd->id = tokens == 3 ? recipe_lookup(NAME_MOLECULE, word[1], word_len[1], NULL, 0)
+                          : recipe_lookup(NAME_MOLECULE, word[1], word_len[1], word[2], word_len[2]);
+    return cmd->type = CMD_DELIVER;
+  }
+
+  // GEN <drink>, where the drink may be two words
+  if (token_is(word[0], word_len[0], "GEN", 3))
+  {
+    if (tokens > 3)
+      return CMD_INVALID;
+    cmd->name = word[1];
+    cmd->name_len = word[tokens - 1] + word_len[tokens - 1] - word[1];
+    cmd->id = tokens == 2 ? recipe_lookup(NAME_DRINK, word[1], word_len[1], NULL, 0)
+                          : recipe_lookup(NAME_DRINK, word[1], word_len[1], word[2], word_len[2]);
+    return cmd->type = CMD_GEN;
+  }
+
+  // USE <warehouse>
+  if (token_is(word[0], word_len[0], "USE", 3))
+  {
+    if (tokens != 2 || cmd->warehouse)
+      return CMD_INVALID;
+    cmd->warehouse = word[1];
+    cmd->warehouse_len = word_len[1];
+    return cmd->type = CMD_USE;
+  }
+
+  // SNAPSHOT <path>
+  if (token_is(word[0], word_len[0], "SNAPSHOT", 8))
+  {
+    if (tokens != 2)
+      return CMD_INVALID;
+    cmd->name = word[1];
+    cmd->name_len = word_len[1];
+    return cmd->type = CMD_SNAPSHOT;
+  }
+
+  // LEASE|RETURN <carbon> <hydrogen> <oxygen>, not all of them 0
+  int lease = token_is(word[0], word_len[0], "LEASE", 5);
+  if (lease || token_is(word[0], word_len[0], "RETURN", 6))
+  {
+    if (tokens != 4)
+      return CMD_INVALID;
+    for (int i = 0; i < 3; i++)
+    {
+      if (!parse_count(word[i + 1], word_len[i + 1], &cmd->atoms[i]) ||
+          cmd->quantity + cmd->atoms[i] < cmd->quantity)
+        return CMD_INVALID;
+      cmd->quantity += cmd->atoms[i];
+    }
+    if (cmd->quantity == 0)
+      return CMD_INVALID;
+    return cmd->type = lease ? CMD_LEASE : CMD_RETURN;
+  }
+
+  return CMD_INVALID;
+}
@@ -0,0 +1,55 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+#include "recipe.h"
+
+// Text protocol of drinks_bar, one command per line:
+//   ADD <atom> <n>          stream sockets (TCP / UDS stream)
+//   DELIVER <molecule> <n>  datagram sockets (UDP / UDS datagram)
+//   GEN <drink>             server console
+//   SNAPSHOT <path>         server console, copy the warehouse to path
+//   USE <warehouse>         stream sockets and console, pick a named warehouse
+//   PROMOTE                 server console, turn a backup into the primary
+//   LEASE <c> <h> <o>       datagram sockets, an edge asks for stock
+//   RETURN <c> <h> <o>      datagram sockets, an edge gives stock back
+//   LATENCY [RESET]         server console, print or zero the latency histograms
+// Any command may be prefixed with @<warehouse> to run it against a named
+// warehouse instead of the connection's current one.
+// parse_command() tokenizes a line in a single pass, in place, without
+// copying or NUL-terminating anything, and resolves every name to an ID.
+
+enum commandType
+{
+  CMD_INVALID = 0,
+  CMD_ADD,
+  CMD_DELIVER,
+  CMD_GEN,
+  CMD_SNAPSHOT,
+  CMD_USE,
+  CMD_PROMOTE,
+  CMD_LEASE,
+  CMD_RETURN,
+  CMD_LATENCY
+};
+
+typedef struct command
+{
+  int type;                    // enum commandType
+  int id;                      // atom, molecule or drink; -1 if the name is unknown
+  unsigned long long quantity; // ADD and DELIVER; LEASE and RETURN: the sum of atoms; always > 0
+  unsigned long long atoms[3]; // LEASE and RETURN: carbon, hydrogen, oxygen, each may be 0
+  const char *name;            // the name (SNAPSHOT: the path; LATENCY: RESET or NULL) as it appears in the line
+  size_t name_len;
+  const char *warehouse;       // @ prefix (without the @) or USE argument; NULL if none
+  size_t warehouse_len;
+} command;
+
+// Parse line[0..len). A trailing '\n' or '\r\n' is allowed. Returns the
+// command type; CMD_INVALID for anything malformed, including a missing,
+// zero or out-of-range quantity. A well-formed line with an unknown name
+// returns its type with id == -1.
+int parse_command(const char *line, size_t len, command *cmd);
+
+#endif
@@ -0,0 +1,897 @@
+#define _GNU_SOURCE
+#include "raft.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RAFT_LOG_MAGIC 0x54464152U // "RAFT"
+#define RAFT_LOG_ENTRIES 4096      // entries start after the state block
+
+enum raftMessageType
+{
+  RAFT_VOTE = 1,
+  RAFT_VOTE_REPLY,
+  RAFT_APPEND,
+  RAFT_APPEND_REPLY
+};
+
+enum raftOp
+{
+  RAFT_OP_NOOP, // a new leader's first entry, commits what earlier terms left
+  RAFT_OP_CHANGE
+};
+
+typedef struct raftEntry
+{
+  unsigned long long term;
+  unsigned int op;
+  unsigned int check; // in the log file; a torn entry fails it
+  long long change[3];
+  char location[LOCATION_NAME_MAX];
+} raftEntry;
+
+// Term and vote, at offset 0 of the log file
+typedef struct raftState
+{
+  unsigned int magic;
+  int voted_for;
+  unsigned long long term;
+} raftState;
+
+typedef struct raftMessage
+{
+  unsigned int type;
+  int from;
+  unsigned long long term;
+  unsigned long long index;    // VOTE: last log index; APPEND: the one before the entries;
+                               // APPEND_REPLY: last index known to match (or a hint)
+  unsigned long long log_term; // VOTE: term of the last entry; APPEND: of the one before
+  unsigned long long commit;   // APPEND
+  double sent_ms;              // APPEND, echoed in the reply: when the leader sent it
+  unsigned int count;          // APPEND: entries that follow
+  unsigned int ok;             // replies
+} raftMessage;
+
+typedef struct raftSlot
+{
+  raftEntry entry;
+  int result;          // of applying it
+  raftDone done;       // raft_submit_async() waiting for it, or NULL
+  void *done_arg;
+  double submitted_ms;
+} raftSlot;
+
+int raft_running = 0;
+__thread int raft_applying = 0;
+
+int node_id, node_count;
+char *node_names[RAFT_MAX_NODES + 1];
+struct sockaddr_storage node_addrs[RAFT_MAX_NODES + 1];
+socklen_t node_addr_lens[RAFT_MAX_NODES + 1];
+int raft_fd = -1;
+int raft_wake_fd = -1;
+int raft_log_fd = -1;
+pthread_t raft_thread;
+
+// Everything below is guarded by raft_mutex. The raft thread drops it only
+// to wait for messages and to sync the leader's own log.
+pthread_mutex_t raft_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t raft_applied_cond = PTHREAD_COND_INITIALIZER;
+
+int raft_role_now = RAFT_FOLLOWER;
+unsigned long long raft_term = 0;
+int voted_for = 0;
+int leader_id = 0;
+int votes = 0;
+
+// The log, indexed from 1. written entries are in the log file (all of
+// them without one).
+raftSlot *raft_log = NULL;
+unsigned long long log_cap = 0, log_len = 0, log_written = 0;
+unsigned long long commit_index = 0, applied_index = 0;
+
+// Leader's view of each node
+unsigned long long next_index[RAFT_MAX_NODES + 1];
+unsigned long long match_index[RAFT_MAX_NODES + 1];
+double acked_sent[RAFT_MAX_NODES + 1];
+
+double last_heard = 0;
+double election_deadline = 0;
+double next_heartbeat = 0;
+
+unsigned long long stat_appends = 0, stat_entries_sent = 0, stat_elections = 0;
+double stat_failover_ms = 0;
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void reset_election_timer(double now)
+{
+  election_deadline =
+      now + RAFT_ELECTION_MIN_MS + rand() % (RAFT_ELECTION_MAX_MS - RAFT_ELECTION_MIN_MS + 1);
+}
+
+//-------------------persistence---------------------------------------------------
+
+// FNV-1a over everything but check
+static unsigned int entry_check(const raftEntry *entry)
+{
+  raftEntry copy = *entry;
+  copy.check = 0;
+  const unsigned char *bytes = (const unsigned char *)&copy;
+  unsigned int hash = 2166136261U;
+  for (size_t i = 0; i < sizeof(copy); i++)
+  {
+    hash ^= bytes[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static off_t entry_offset(unsigned long long index)
+{
+  return RAFT_LOG_ENTRIES + (off_t)(index - 1) * sizeof(raftEntry);
+}
+
+// Term and vote must be on disk before anyone hears about them
+static void save_state()
+{
+  if (raft_log_fd == -1)
+    return;
+  raftState state = {.magic = RAFT_LOG_MAGIC, .voted_for = voted_for, .term = raft_term};
+  if (pwrite(raft_log_fd, &state, sizeof(state), 0) != sizeof(state) || fdatasync(raft_log_fd) == -1)
+    perror("Failed to save raft state");
+}
+
+static int grow_log(unsigned long long len)
+{
+  if (len < log_cap)
+    return 1;
+  unsigned long long cap = log_cap ? log_cap * 2 : 1024;
+  while (cap <= len)
+    cap *= 2;
+  raftSlot *grown = realloc(raft_log, cap * sizeof(raftSlot));
+  if (!grown)
+    return 0;
+  raft_log = grown;
+  log_cap = cap;
+  return 1;
+}
+
+static int load_log(const char *path)
+{
+  raft_log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (raft_log_fd == -1)
+  {
+    perror("Failed to open raft log");
+    return 0;
+  }
+
+  raftState state;
+  if (pread(raft_log_fd, &state, sizeof(state), 0) == sizeof(state) && state.magic == RAFT_LOG_MAGIC)
+  {
+    raft_term = state.term;
+    voted_for = state.voted_for;
+  }
+
+  raftEntry entry;
+  while (pread(raft_log_fd, &entry, sizeof(entry), entry_offset(log_len + 1)) == sizeof(entry) &&
+         entry.check == entry_check(&entry))
+  {
+    if (!grow_log(log_len + 1))
+      return 0;
+    raft_log[++log_len].entry = entry;
+  }
+  log_written = log_len;
+  if (ftruncate(raft_log_fd, entry_offset(log_len + 1)) == -1)
+    perror("Failed to trim raft log");
+  printf("Raft log %s: term %llu, %llu entries\n", path, raft_term, log_len);
+  return 1;
+}
+
+// Write entries (log_written, upto] and sync them. Caller holds
+// raft_mutex; dropped meanwhile if unlock is set, so submitters can keep
+// appending.
+static void write_log(unsigned long long upto, int unlock)
+{
+  if (upto <= log_written)
+    return;
+  if (raft_log_fd == -1)
+  {
+    log_written = upto;
+    return;
+  }
+
+  unsigned long long from = log_written + 1, count = upto - log_written;
+  raftEntry *batch = malloc(count * sizeof(raftEntry));
+  if (!batch)
+    return;
+  for (unsigned long long i = 0; i < count; i++)
+  {
+    batch[i] = raft_log[from + i].entry;
+    batch[i].check = entry_check(&batch[i]);
+  }
+
+  if (unlock)
+    pthread_mutex_unlock(&raft_mutex);
+  ssize_t size = count * sizeof(raftEntry);
+  int ok = pwrite(raft_log_fd, batch, size, entry_offset(from)) == size && fdatasync(raft_log_fd) == 0;
+  if (unlock)
+    pthread_mutex_lock(&raft_mutex);
+  free(batch);
+
+  if (!ok)
+    perror("Failed to write raft log");
+  // The log may have been cut back meanwhile (only a follower does that,
+  // and only on this thread, so not while unlocked)
+  else if (upto > log_written)
+    log_written = upto;
+}
+
+// Tell an asynchronous submitter how its entry ended
+static void finish_submit(raftSlot *slot, int result)
+{
+  raftDone done = slot->done;
+  if (!done)
+    return;
+  slot->done = NULL;
+  done(result, slot->done_arg);
+}
+
+static void truncate_log(unsigned long long len)
+{
+  // A newer leader replaces these entries with its own
+  for (unsigned long long index = len + 1; index <= log_len; index++)
+    finish_submit(&raft_log[index], -1);
+  log_len = len;
+  if (log_written > len)
+  {
+    log_written = len;
+    if (raft_log_fd != -1 && ftruncate(raft_log_fd, entry_offset(len + 1)) == -1)
+      perror("Failed to trim raft log");
+  }
+}
+
+//-------------------network-------------------------------------------------------
+
+// A path is a Unix datagram socket, otherwise "port" or "host:port" over UDP
+static int resolve_node(const char *address, struct sockaddr_storage *addr, socklen_t *len)
+{
+  memset(addr, 0, sizeof(*addr));
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    if (strlen(address) >= sizeof(un->sun_path))
+      return 0;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    *len = sizeof(*un);
+    return 1;
+  }
+
+  char host[256] = "127.0.0.1";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+    port = address;
+
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+  struct addrinfo *found;
+  if (getaddrinfo(host, port, &hints, &found) != 0)
+    return 0;
+  memcpy(addr, found->ai_addr, found->ai_addrlen);
+  *len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 1;
+}
+
+static void send_to(int node, const void *data, size_t len)
+{
+  // A full socket buffer or a dead peer loses the message; Raft resends
+  sendto(raft_fd, data, len, MSG_DONTWAIT, (struct sockaddr *)&node_addrs[node], node_addr_lens[node]);
+}
+
+//-------------------protocol------------------------------------------------------
+
+static unsigned long long last_term()
+{
+  return log_len ? raft_log[log_len].entry.term : 0;
+}
+
+static void become_follower(unsigned long long term, int leader)
+{
+  if (term > raft_term)
+  {
+    raft_term = term;
+    voted_for = 0;
+    save_state();
+  }
+  raft_role_now = RAFT_FOLLOWER;
+  leader_id = leader;
+}
+
+// Send node the entries from its next index on, at most one batch
+static void send_append(int node, double now)
+{
+  static __thread char buffer[sizeof(raftMessage) + RAFT_MAX_BATCH * sizeof(raftEntry)];
+  unsigned long long next = next_index[node];
+  if (next > log_len + 1)
+    next = log_len + 1;
+  unsigned long long count = log_len + 1 - next;
+  if (count > RAFT_MAX_BATCH)
+    count = RAFT_MAX_BATCH;
+
+  raftMessage *msg = (raftMessage *)buffer;
+  *msg = (raftMessage){.type = RAFT_APPEND,
+                       .from = node_id,
+                       .term = raft_term,
+                       .index = next - 1,
+                       .log_term = next > 1 ? raft_log[next - 1].entry.term : 0,
+                       .commit = commit_index,
+                       .sent_ms = now,
+                       .count = count};
+  raftEntry *entries = (raftEntry *)(msg + 1);
+  for (unsigned long long i = 0; i < count; i++)
+    entries[i] = raft_log[next + i].entry;
+  send_to(node, buffer, sizeof(*msg) + count * sizeof(raftEntry));
+
+  // Pipelining: assume it arrives; a rejection moves next_index back
+  next_index[node] = next + count;
+  stat_appends++;
+  stat_entries_sent += count;
+}
+
+// New entries go out right away, a few batches deep; idle followers get
+// a heartbeat
+static void replicate(double now)
+{
+  int heartbeat = now >= next_heartbeat;
+  for (int node = 1; node <= node_count; node++)
+  {
+    if (node == node_id)
+      continue;
+    int sent = 0;
+    while (next_index[node] <= log_len && sent < 4)
+    {
+      send_append(node, now);
+      sent++;
+    }
+    if (!sent && heartbeat)
+      send_append(node, now);
+  }
+  if (heartbeat)
+    next_heartbeat = now + RAFT_HEARTBEAT_MS;
+}
+
+static void become_leader(double now)
+{
+  raft_role_now = RAFT_LEADER;
+  leader_id = node_id;
+  for (int node = 1; node <= node_count; node++)
+  {
+    next_index[node] = log_len + 1;
+    match_index[node] = 0;
+    acked_sent[node] = 0;
+  }
+
+  if (grow_log(log_len + 1))
+  {
+    raftSlot *slot = &raft_log[++log_len];
+    memset(slot, 0, sizeof(*slot));
+    slot->entry.term = raft_term;
+    slot->entry.op = RAFT_OP_NOOP;
+  }
+
+  stat_elections++;
+  stat_failover_ms = now - last_heard;
+  next_heartbeat = now;
+  printf("Raft node %d elected leader of term %llu, %.0f ms after last hearing from a leader\n",
+         node_id, raft_term, stat_failover_ms);
+  fflush(stdout);
+}
+
+static void start_election(double now)
+{
+  raft_role_now = RAFT_CANDIDATE;
+  raft_term++;
+  voted_for = node_id;
+  votes = 1;
+  leader_id = 0;
+  save_state();
+  reset_election_timer(now);
+
+  if (votes > node_count / 2)
+  {
+    become_leader(now);
+    return;
+  }
+  raftMessage msg = {.type = RAFT_VOTE,
+                     .from = node_id,
+                     .term = raft_term,
+                     .index = log_len,
+                     .log_term = last_term()};
+  for (int node = 1; node <= node_count; node++)
+  {
+    if (node != node_id)
+      send_to(node, &msg, sizeof(msg));
+  }
+}
+
+static void handle_vote(const raftMessage *msg, double now)
+{
+  // Stickiness: while the leader is alive, nobody else can win, which is
+  // what makes its read lease safe
+  if (raft_role_now == RAFT_LEADER ||
+      (leader_id != 0 && leader_id != msg->from && now - last_heard < RAFT_ELECTION_MIN_MS))
+    return;
+  if (msg->term > raft_term)
+    become_follower(msg->term, 0);
+
+  int up_to_date = msg->log_term > last_term() || (msg->log_term == last_term() && msg->index >= log_len);
+  int granted = msg->term == raft_term && (voted_for == 0 || voted_for == msg->from) && up_to_date;
+  if (granted)
+  {
+    voted_for = msg->from;
+    save_state();
+    reset_election_timer(now);
+  }
+  raftMessage reply = {.type = RAFT_VOTE_REPLY, .from = node_id, .term = raft_term, .ok = granted};
+  send_to(msg->from, &reply, sizeof(reply));
+}
+
+static void handle_vote_reply(const raftMessage *msg, double now)
+{
+  if (msg->term > raft_term)
+  {
+    become_follower(msg->term, 0);
+    return;
+  }
+  if (raft_role_now == RAFT_CANDIDATE && msg->term == raft_term && msg->ok && ++votes > node_count / 2)
+    become_leader(now);
+}
+
+static void handle_append(const raftMessage *msg, const raftEntry *entries, double now)
+{
+  raftMessage reply = {.type = RAFT_APPEND_REPLY, .from = node_id, .sent_ms = msg->sent_ms};
+  if (msg->term < raft_term)
+  {
+    reply.term = raft_term;
+    send_to(msg->from, &reply, sizeof(reply));
+    return;
+  }
+
+  become_follower(msg->term, msg->from);
+  last_heard = now;
+  reset_election_timer(now);
+  reply.term = raft_term;
+
+  if (msg->index > log_len || (msg->index > 0 && raft_log[msg->index].entry.term != msg->log_term))
+  {
+    // Tell the leader where to back up to
+    reply.index = msg->index > log_len ? log_len : msg->index - 1;
+    send_to(msg->from, &reply, sizeof(reply));
+    return;
+  }
+
+  unsigned long long index = msg->index;
+  for (unsigned int i = 0; i < msg->count; i++)
+  {
+    index++;
+    if (index <= log_len)
+    {
+      if (raft_log[index].entry.term == entries[i].term)
+        continue; // a resent entry we already have
+      truncate_log(index - 1);
+    }
+    if (!grow_log(index))
+      break;
+    raft_log[index].entry = entries[i];
+    raft_log[index].result = 0;
+    raft_log[index].done = NULL;
+    log_len = index;
+  }
+  write_log(log_len, 0);
+
+  unsigned long long matched = index < log_written ? index : log_written;
+  if (msg->commit > commit_index)
+    commit_index = msg->commit < matched ? msg->commit : matched;
+  reply.ok = 1;
+  reply.index = matched;
+  send_to(msg->from, &reply, sizeof(reply));
+}
+
+static void handle_append_reply(const raftMessage *msg, double now)
+{
+  if (msg->term > raft_term)
+  {
+    become_follower(msg->term, 0);
+    return;
+  }
+  if (raft_role_now != RAFT_LEADER || msg->term != raft_term)
+    return;
+
+  int node = msg->from;
+  if (msg->sent_ms > acked_sent[node])
+    acked_sent[node] = msg->sent_ms;
+  if (msg->ok)
+  {
+    if (msg->index > match_index[node])
+      match_index[node] = msg->index;
+    if (next_index[node] < match_index[node] + 1)
+      next_index[node] = match_index[node] + 1;
+  }
+  else if (msg->index + 1 < next_index[node])
+  {
+    next_index[node] = msg->index + 1;
+    send_append(node, now);
+  }
+}
+
+static void advance_commit()
+{
+  for (unsigned long long n = log_len; n > commit_index; n--)
+  {
+    // Only entries of the current term commit by counting (Raft §5.4.2)
+    if (raft_log[n].entry.term != raft_term)
+      break;
+    int have = 0;
+    for (int node = 1; node <= node_count; node++)
+      have += node == node_id ? log_written >= n : match_index[node] >= n;
+    if (have > node_count / 2)
+    {
+      commit_index = n;
+      break;
+    }
+  }
+}
+
+// Same as a backup applying the replication stream: add the positive
+// part, take the negative part
+static int apply_change(const raftEntry *entry)
+{
+  int location = entry->location[0] == '\0'
+                     ? 0
+                     : warehouse_location(entry->location, strnlen(entry->location, sizeof(entry->location)));
+  if (location < 0)
+    return -1;
+
+  // All or nothing: the take goes first, and adds that do not all fit are
+  // rolled back along with it
+  unsigned long long take[3] = {0, 0, 0}, add[3] = {0, 0, 0};
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (entry->change[atom] < 0)
+      take[atom] = -(unsigned long long)entry->change[atom];
+    else
+      add[atom] = entry->change[atom];
+  }
+
+  int status = 1;
+  warehouse_use(location);
+  if (take[0] || take[1] || take[2])
+    status = warehouse_take(take[0], take[1], take[2]);
+  int took = status > 0;
+  unsigned long long added[3] = {0, 0, 0};
+  for (int atom = 0; atom < 3 && status > 0; atom++)
+  {
+    if (add[atom] && (status = warehouse_add(atom + 1, add[atom])) > 0)
+      added[atom] = add[atom];
+  }
+  if (status <= 0 && took)
+  {
+    // Nothing else changes this stock meanwhile, so both fit back
+    if (added[0] || added[1] || added[2])
+      warehouse_take(added[0], added[1], added[2]);
+    for (int atom = 0; atom < 3; atom++)
+    {
+      if (take[atom])
+        warehouse_add(atom + 1, take[atom]);
+    }
+  }
+  warehouse_use(0);
+  return status;
+}
+
+static void apply_committed()
+{
+  if (applied_index >= commit_index)
+    return;
+  while (applied_index < commit_index)
+  {
+    raftSlot *slot = &raft_log[++applied_index];
+    slot->result = slot->entry.op == RAFT_OP_CHANGE ? apply_change(&slot->entry) : 1;
+    finish_submit(slot, slot->result);
+  }
+  pthread_cond_broadcast(&raft_applied_cond);
+}
+
+// Give up on asynchronous submits that did not commit in time, as
+// raft_submit() does
+static void expire_submits(double now)
+{
+  for (unsigned long long index = applied_index + 1; index <= log_len; index++)
+  {
+    if (raft_log[index].done && now - raft_log[index].submitted_ms >= RAFT_SUBMIT_TIMEOUT_MS)
+      finish_submit(&raft_log[index], -1);
+  }
+}
+
+static void handle_message(const char *data, size_t len, double now)
+{
+  const raftMessage *msg = (const raftMessage *)data;
+  if (len < sizeof(*msg) || msg->from < 1 || msg->from > node_count || msg->from == node_id)
+    return;
+  switch (msg->type)
+  {
+  case RAFT_VOTE:
+    handle_vote(msg, now);
+    break;
+  case RAFT_VOTE_REPLY:
+    handle_vote_reply(msg, now);
+    break;
+  case RAFT_APPEND:
+    if (msg->count <= RAFT_MAX_BATCH && len == sizeof(*msg) + msg->count * sizeof(raftEntry))
+      handle_append(msg, (const raftEntry *)(msg + 1), now);
+    break;
+  case RAFT_APPEND_REPLY:
+    handle_append_reply(msg, now);
+    break;
+  }
+}
+
+static void *run_raft(void *arg)
+{
+  (void)arg;
+  static char buffer[sizeof(raftMessage) + RAFT_MAX_BATCH * sizeof(raftEntry) + 1];
+  raft_applying = 1;
+
+  pthread_mutex_lock(&raft_mutex);
+  while (raft_running)
+  {
+    double now = now_ms();
+    double wake = raft_role_now == RAFT_LEADER ? next_heartbeat : election_deadline;
+    int timeout = wake > now ? (int)(wake - now) + 1 : 0;
+    pthread_mutex_unlock(&raft_mutex);
+
+    struct pollfd fds[2] = {{.fd = raft_fd, .events = POLLIN}, {.fd = raft_wake_fd, .events = POLLIN}};
+    poll(fds, 2, timeout);
+    if (fds[1].revents & POLLIN)
+    {
+      unsigned long long count;
+      if (read(raft_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("raft wakeup");
+    }
+
+    pthread_mutex_lock(&raft_mutex);
+    now = now_ms();
+    ssize_t got;
+    while ((got = recv(raft_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+      handle_message(buffer, got, now);
+
+    if (raft_role_now != RAFT_LEADER && now >= election_deadline)
+      start_election(now);
+    if (raft_role_now == RAFT_LEADER)
+    {
+      // Followers write their copy while we write ours
+      replicate(now);
+      write_log(log_len, 1);
+      if (raft_role_now == RAFT_LEADER)
+        advance_commit();
+    }
+    apply_committed();
+    expire_submits(now);
+  }
+  pthread_mutex_unlock(&raft_mutex);
+  return NULL;
+}
+
+//-------------------API-----------------------------------------------------------
+
+int raft_start(int id, const char *nodes, const char *log_path)
+{
+  char *list = strdup(nodes);
+  if (!list)
+    return 0;
+  node_count = 0;
+  for (char *save = NULL, *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+  {
+    if (node_count == RAFT_MAX_NODES)
+    {
+      node_count++;
+      break;
+    }
+    node_count++;
+    node_names[node_count] = strdup(name);
+    if (!resolve_node(name, &node_addrs[node_count], &node_addr_lens[node_count]))
+    {
+      fprintf(stderr, "Bad raft node address: %s\n", name);
+      free(list);
+      return 0;
+    }
+  }
+  free(list);
+  if (node_count != 3 && node_count != 5)
+  {
+    fprintf(stderr, "A raft group has 3 or 5 nodes\n");
+    return 0;
+  }
+  if (id < 1 || id > node_count)
+  {
+    fprintf(stderr, "raft-id must be between 1 and %d\n", node_count);
+    return 0;
+  }
+  node_id = id;
+
+  struct sockaddr_storage *self = &node_addrs[node_id];
+  raft_fd = socket(self->ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (self->ss_family == AF_UNIX)
+    unlink(((struct sockaddr_un *)self)->sun_path);
+  if (raft_fd == -1 || bind(raft_fd, (struct sockaddr *)self, node_addr_lens[node_id]) == -1)
+  {
+    perror("Failed to bind raft socket");
+    return 0;
+  }
+  raft_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (raft_wake_fd == -1 || (log_path && !load_log(log_path)))
+    return 0;
+
+  srand(getpid() ^ (unsigned)now_ms());
+  last_heard = now_ms();
+  reset_election_timer(last_heard);
+  raft_running = 1;
+  if (pthread_create(&raft_thread, NULL, run_raft, NULL) != 0)
+  {
+    perror("Failed to start raft");
+    raft_running = 0;
+    return 0;
+  }
+  pthread_detach(raft_thread);
+  return 1;
+}
+
+int raft_is_leader()
+{
+  pthread_mutex_lock(&raft_mutex);
+  int leader = raft_role_now == RAFT_LEADER;
+  pthread_mutex_unlock(&raft_mutex);
+  return leader;
+}
+
+const char *raft_leader_address()
+{
+  pthread_mutex_lock(&raft_mutex);
+  const char *name = leader_id ? node_names[leader_id] : NULL;
+  pthread_mutex_unlock(&raft_mutex);
+  return name;
+}
+
+int raft_read_ok()
+{
+  pthread_mutex_lock(&raft_mutex);
+  int ok = 0;
+  if (raft_role_now == RAFT_LEADER)
+  {
+    // The lease runs from the send time of the newest round a majority
+    // (this node included) has acked, a little shorter than the time
+    // followers stay loyal, for clock drift
+    double now = now_ms(), sent[RAFT_MAX_NODES];
+    int count = 0;
+    for (int node = 1; node <= node_count; node++)
+      sent[count++] = node == node_id ? now : acked_sent[node];
+    for (int i = 1; i < count; i++)
+    {
+      for (int j = i; j > 0 && sent[j] > sent[j - 1]; j--)
+      {
+        double swap = sent[j];
+        sent[j] = sent[j - 1];
+        sent[j - 1] = swap;
+      }
+    }
+    // Until an entry of its own term commits, a new leader may not have
+    // applied everything its predecessor committed
+    ok = now < sent[node_count / 2] + RAFT_ELECTION_MIN_MS * 0.9 && commit_index > 0 &&
+         raft_log[commit_index].entry.term == raft_term && applied_index == commit_index;
+  }
+  pthread_mutex_unlock(&raft_mutex);
+  return ok;
+}
+
+// Append a change as leader and wake the raft thread to send it. Under
+// raft_mutex; returns its index, 0 if this node is not the leader.
+static unsigned long long append_change(const char *location, const long long change[3])
+{
+  if (raft_role_now != RAFT_LEADER || !grow_log(log_len + 1))
+    return 0;
+  unsigned long long index = ++log_len;
+  raftSlot *slot = &raft_log[index];
+  memset(slot, 0, sizeof(*slot));
+  slot->entry.term = raft_term;
+  slot->entry.op = RAFT_OP_CHANGE;
+  memcpy(slot->entry.change, change, sizeof(slot->entry.change));
+  snprintf(slot->entry.location, sizeof(slot->entry.location), "%s", location);
+
+  unsigned long long one = 1;
+  if (write(raft_wake_fd, &one, sizeof(one)) < 0)
+    perror("raft wakeup");
+  return index;
+}
+
+int raft_submit_async(const char *location, const long long change[3], raftDone done, void *arg)
+{
+  pthread_mutex_lock(&raft_mutex);
+  unsigned long long index = append_change(location, change);
+  if (index)
+  {
+    raft_log[index].done = done;
+    raft_log[index].done_arg = arg;
+    raft_log[index].submitted_ms = now_ms();
+  }
+  pthread_mutex_unlock(&raft_mutex);
+  return index != 0;
+}
+
+int raft_submit(const char *location, const long long change[3])
+{
+  pthread_mutex_lock(&raft_mutex);
+  unsigned long long index = append_change(location, change), term = raft_term;
+  if (index == 0)
+  {
+    pthread_mutex_unlock(&raft_mutex);
+    return -1;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += RAFT_SUBMIT_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (RAFT_SUBMIT_TIMEOUT_MS % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (applied_index < index && raft_running)
+  {
+    if (pthread_cond_timedwait(&raft_applied_cond, &raft_mutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+  // A new leader may have replaced the entry with one of its own
+  int result = applied_index >= index && index <= log_len && raft_log[index].entry.term == term
+                   ? raft_log[index].result
+                   : -1;
+  pthread_mutex_unlock(&raft_mutex);
+  return result;
+}
+
+void raft_stats(raftStats *stats)
+{
+  pthread_mutex_lock(&raft_mutex);
+  stats->term = raft_term;
+  stats->role = raft_role_now;
+  stats->leader = leader_id;
+  stats->committed = commit_index;
+  stats->appends = stat_appends;
+  stats->entries_sent = stat_entries_sent;
+  stats->elections = stat_elections;
+  stats->failover_ms = stat_failover_ms;
+  pthread_mutex_unlock(&raft_mutex);
+}
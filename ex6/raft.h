@@ -0,0 +1,92 @@
+#ifndef RAFT_H
+#define RAFT_H
+
+#include "warehouse.h"
+
+// Raft replication of the in-memory warehouse over a group of 3 or 5
+// drinks_bar nodes. Every stock change (ADD, and the takes behind DELIVER
+// and GEN) becomes a log entry. The leader appends it and streams it to
+// the followers, and every node applies it once a majority has it. A
+// client is answered once the leader has applied its entry, so a change it
+// was told succeeded survives the loss of any minority of nodes. Reactors
+// submit without waiting (raft_submit_async), so one thread keeps many
+// entries in flight and serves its other connections meanwhile.
+//
+// Nodes talk over datagrams: UDP ("port" or "host:port") or Unix datagram
+// sockets (paths). Entries are batched, up to RAFT_MAX_BATCH per message,
+// and pipelined: the leader sends the next batch without waiting for the
+// previous one to be acked.
+//
+// Reads are served from the leader's state while it holds a lease. A
+// follower that heard from the leader within RAFT_ELECTION_MIN_MS ignores
+// vote requests, so no other leader can be elected until that long after
+// a majority last acked the leader.
+//
+// The log is kept in memory, and also in a file if one is given: the
+// term, the vote and the entries, fdatasync'd before they count towards a
+// majority. A restarted node rebuilds its warehouse by applying the log
+// again. The log is never compacted.
+
+#define RAFT_MAX_NODES 5
+#define RAFT_HEARTBEAT_MS 50
+#define RAFT_ELECTION_MIN_MS 150
+#define RAFT_ELECTION_MAX_MS 300
+#define RAFT_MAX_BATCH 64
+#define RAFT_SUBMIT_TIMEOUT_MS 1000
+
+enum raftRole
+{
+  RAFT_FOLLOWER,
+  RAFT_CANDIDATE,
+  RAFT_LEADER
+};
+
+typedef struct raftStats
+{
+  unsigned long long term;
+  int role;
+  int leader;                     // node ID, 0 if unknown
+  unsigned long long committed;   // log entries
+  unsigned long long appends;     // append messages sent by this node as leader
+  unsigned long long entries_sent;
+  unsigned long long elections;   // won by this node
+  double failover_ms;             // last win: time since the previous leader was heard
+} raftStats;
+
+// Join the group. nodes is a comma-separated list of 3 or 5 addresses;
+// this node is the id-th (from 1). log_path may be NULL. Returns 0 on
+// error.
+int raft_start(int id, const char *nodes, const char *log_path);
+
+int raft_is_leader();
+
+// Address of the leader as given in the node list, or NULL if unknown
+const char *raft_leader_address();
+
+// 1 if this node is the leader and holds its lease, so its warehouse has
+// every committed change
+int raft_read_ok();
+
+// Commit a change of the named warehouse ("" for the default) through the
+// log and apply it. Returns what warehouse_add()/warehouse_take() returned
+// on the leader, or -1 if this node is not the leader or the entry did not
+// commit in time.
+int raft_submit(const char *location, const long long change[3]);
+
+// The same without waiting, for reactor threads: done(result, arg) runs
+// on the raft thread, under its lock, once the entry is applied, with -1
+// if a newer leader dropped it or it did not commit within
+// RAFT_SUBMIT_TIMEOUT_MS. done must be quick and must not call raft_*().
+// Returns 0, without ever calling done, if this node is not the leader.
+typedef void (*raftDone)(int result, void *arg);
+int raft_submit_async(const char *location, const long long change[3], raftDone done, void *arg);
+
+void raft_stats(raftStats *stats);
+
+// Hooks for warehouse.c: while raft_running, warehouse_add() and
+// warehouse_take() submit through the log, except on the thread applying
+// committed entries.
+extern int raft_running;
+extern __thread int raft_applying;
+
+#endif
@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "recipe.h"
+
+const char *const atom_names[4] = {"", "CARBON", "HYDROGEN", "OXYGEN"};
+
+const recipe molecule_recipes[MOLECULE_COUNT] = {
+    [MOLECULE_WATER] = {"WATER", {0, 2, 1}},
+    [MOLECULE_CARBON_DIOXIDE] = {"CARBON DIOXIDE", {1, 0, 2}},
+    [MOLECULE_GLUCOSE] = {"GLUCOSE", {6, 12, 6}},
+    [MOLECULE_ALCOHOL] = {"ALCOHOL", {2, 6, 1}},
+};
+
+// What each drink is mixed from; drink_recipes below must be the sums
+const int drink_molecules[DRINK_COUNT][3] = {
+    [DRINK_VODKA] = {MOLECULE_WATER, MOLECULE_ALCOHOL, MOLECULE_GLUCOSE},
+    [DRINK_CHAMPAGNE] = {MOLECULE_WATER, MOLECULE_ALCOHOL, MOLECULE_CARBON_DIOXIDE},
+    [DRINK_SOFT_DRINK] = {MOLECULE_WATER, MOLECULE_GLUCOSE, MOLECULE_CARBON_DIOXIDE},
+};
+
+const recipe drink_recipes[DRINK_COUNT] = {
+    [DRINK_VODKA] = {"VODKA", {8, 20, 8}},
+    [DRINK_CHAMPAGNE] = {"CHAMPAGNE", {3, 8, 4}},
+    [DRINK_SOFT_DRINK] = {"SOFT DRINK", {7, 14, 9}},
+};
+
+//-----------------------------name lookup-------------------------------------
+// (first char + 5 * last char + 4 * length) % 16 is collision-free over all
+// ten names; each slot holds the one name that can hash there.
+
+#define NAME_SLOTS 16
+#define NAME_HASH(first, last, len) (((unsigned)(first) + 5u * (last) + 4u * (len)) % NAME_SLOTS)
+
+typedef struct nameSlot
+{
+  const char *name; // NULL for an empty slot
+  int kind;
+  int id;
+} nameSlot;
+
+static const nameSlot name_slots[NAME_SLOTS] = {
+    [0] = {"CHAMPAGNE", NAME_DRINK, DRINK_CHAMPAGNE},
+    [1] = {"CARBON", NAME_ATOM, ATOM_CARBON},
+    [2] = {"SOFT DRINK", NAME_DRINK, DRINK_SOFT_DRINK},
+    [4] = {"CARBON DIOXIDE", NAME_MOLECULE, MOLECULE_CARBON_DIOXIDE},
+    [5] = {"WATER", NAME_MOLECULE, MOLECULE_WATER},
+    [9] = {"ALCOHOL", NAME_MOLECULE, MOLECULE_ALCOHOL},
+    [12] = {"GLUCOSE", NAME_MOLECULE, MOLECULE_GLUCOSE},
+    [13] = {"OXYGEN", NAME_ATOM, ATOM_OXYGEN},
+    [14] = {"HYDROGEN", NAME_ATOM, ATOM_HYDROGEN},
+    [15] = {"VODKA", NAME_DRINK, DRINK_VODKA},
+};
+
+int recipe_lookup(int kind, const char *first, size_t first_len, const char *second,
+                  size_t second_len)
+{
+  if (first_len == 0)
+    return -1;
+
+  size_t len = first_len;
+  char last = first[first_len - 1];
+  if (second)
+  {
+    if (second_len == 0)
+      return -1;
+    len += 1 + second_len;
+    last = second[second_len - 1];
+  }
+
+  const nameSlot *slot = &name_slots[NAME_HASH((unsigned char)first[0], (unsigned char)last, len)];
+  if (!slot->name || slot->kind != kind || strlen(slot->name) != len)
+    return -1;
+  if (memcmp(slot->name, first, first_len) != 0)
+    return -1;
+  if (second && (slot->name[first_len] != ' ' ||
+                 memcmp(slot->name + first_len + 1, second, second_len) != 0))
+    return -1;
+  return slot->id;
+}
+
+int recipe_scale(const recipe *r, unsigned long long count, unsigned long long atoms[3])
+{
+  for (int i = 0; i < 3; i++)
+  {
+    if (r->atoms[i] && count > ~0ULL / r->atoms[i])
+      return 0;
+    atoms[i] = r->atoms[i] * count;
+  }
+  return 1;
+}
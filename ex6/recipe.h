@@ -0,0 +1,62 @@
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include <stddef.h>
+
+// Every molecule and drink the bar knows, as a dense vector of the atoms
+// it takes. Drinks are precomputed sums of their three molecules, so
+// DELIVER, GEN and capacity queries are a lookup and a multiply.
+
+// Same numbering as warehouse_add(); vectors are indexed by atom - 1
+enum atomId
+{
+  ATOM_CARBON = 1,
+  ATOM_HYDROGEN = 2,
+  ATOM_OXYGEN = 3
+};
+
+enum moleculeId
+{
+  MOLECULE_WATER = 0,
+  MOLECULE_CARBON_DIOXIDE,
+  MOLECULE_GLUCOSE,
+  MOLECULE_ALCOHOL,
+  MOLECULE_COUNT
+};
+
+enum drinkId
+{
+  DRINK_VODKA = 0,
+  DRINK_CHAMPAGNE,
+  DRINK_SOFT_DRINK,
+  DRINK_COUNT
+};
+
+enum nameKind
+{
+  NAME_ATOM,
+  NAME_MOLECULE,
+  NAME_DRINK
+};
+
+typedef struct recipe
+{
+  const char *name;
+  unsigned long long atoms[3]; // carbon, hydrogen, oxygen
+} recipe;
+
+extern const char *const atom_names[4]; // indexed by enum atomId
+extern const recipe molecule_recipes[MOLECULE_COUNT];
+extern const recipe drink_recipes[DRINK_COUNT];
+extern const int drink_molecules[DRINK_COUNT][3];
+
+// Resolve a name of the given kind to its ID, or -1. Two-word names
+// ("CARBON DIOXIDE", "SOFT DRINK") are passed as two words; second may be
+// NULL. Uses a perfect hash, so at most one string compare.
+int recipe_lookup(int kind, const char *first, size_t first_len, const char *second,
+                  size_t second_len);
+
+// atoms = count * r->atoms. Returns 0 if any product overflows.
+int recipe_scale(const recipe *r, unsigned long long count, unsigned long long atoms[3]);
+
+#endif
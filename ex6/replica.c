@@ -0,0 +1,877 @@
+#define _GNU_SOURCE
+#include "replica.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+int replica_publishing = 0;
+int replica_role_now = REPLICA_NONE;
+int replica_ack = REPLICA_ASYNC;
+
+// Mutation order of the in-memory warehouse while publishing
+pthread_mutex_t replica_order = PTHREAD_MUTEX_INITIALIZER;
+
+// One connected backup. Its sender thread writes out what was queued in
+// out; its reader thread collects acks. The last of the two to stop frees
+// it.
+typedef struct backupLink
+{
+  int fd;
+  int alive;
+  int threads;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  unsigned long long acked;
+} backupLink;
+
+// A reply waiting for every backup to ack seq
+typedef struct replicaWaiter
+{
+  unsigned long long seq;
+  int result;
+  replicaDone done;
+  void *arg;
+  double deadline;
+  struct replicaWaiter *next;
+} replicaWaiter;
+
+// Links, their queues, acks, the sequence counter, the term and the
+// replies waiting for acks
+pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t replica_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t replica_acked = PTHREAD_COND_INITIALIZER;
+backupLink *backup_links[REPLICA_MAX_BACKUPS];
+unsigned long long replica_seq = 0;
+unsigned long long replica_published = 0;
+unsigned int replica_term = 1;
+double replica_held_until = 0; // REPLICA_SYNC replies wait until then
+replicaWaiter *replica_waiting = NULL;
+
+// Last change this thread published, for replica_commit()
+__thread unsigned long long replica_pending = 0;
+
+int replica_listen_fd = -1;
+char *replica_listen_address = NULL;
+pthread_t replica_acceptor;
+pthread_t replica_committer;
+int replica_committing = 0;
+
+// Backup side
+char *replica_promoted_address = NULL;
+pthread_t replica_follower;
+double replica_promotion_ms = 0;
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+const char *replica_ack_name(int ack)
+{
+  return ack == REPLICA_SYNC ? "sync" : "async";
+}
+
+int replica_role()
+{
+  return __atomic_load_n(&replica_role_now, __ATOMIC_ACQUIRE);
+}
+
+int replica_sync()
+{
+  return replica_ack == REPLICA_SYNC && replica_role() == REPLICA_PRIMARY;
+}
+
+//-------------------addresses-----------------------------------------------------
+
+// A path (anything with a '/') is a Unix socket, otherwise "port" or
+// "host:port" over TCP. Returns a listening or connected socket, or -1.
+static int replica_socket(const char *address, int listening)
+{
+  int fd;
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(address) >= sizeof(addr.sun_path))
+    {
+      fprintf(stderr, "Replication path too long: %s\n", address);
+      return -1;
+    }
+    strcpy(addr.sun_path, address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return -1;
+    if (listening)
+    {
+      unlink(address);
+      if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, REPLICA_MAX_BACKUPS) == -1)
+      {
+        close(fd);
+        return -1;
+      }
+    }
+    else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  char host[256] = "";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+    port = address;
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *found;
+  if (listening)
+    hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host[0] ? host : NULL, port, &hints, &found) != 0)
+  {
+    fprintf(stderr, "Bad replication address: %s\n", address);
+    return -1;
+  }
+
+  fd = -1;
+  for (struct addrinfo *ai = found; ai && fd == -1; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int ok = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, REPLICA_MAX_BACKUPS) == 0
+                       : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    if (!ok)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return 0;
+    p += sent;
+    len -= sent;
+  }
+  return 1;
+}
+
+//-------------------primary-------------------------------------------------------
+
+// Caller holds replica_mutex. A backup is gone, and may have been promoted:
+// give it time to say so before telling clients anything more.
+static void hold_replies()
+{
+  replica_held_until = now_ms() + REPLICA_TIMEOUT_MS;
+}
+
+// Caller holds replica_mutex
+static void queue_message(backupLink *link, const replicaMessage *msg)
+{
+  if (link->out_len + sizeof(*msg) > link->out_cap)
+  {
+    size_t cap = link->out_cap ? link->out_cap * 2 : 64 * sizeof(*msg);
+    char *grown = realloc(link->out, cap);
+    if (!grown)
+    {
+      // Cannot keep it in step any more
+      link->alive = 0;
+      shutdown(link->fd, SHUT_RDWR);
+      hold_replies();
+      return;
+    }
+    link->out = grown;
+    link->out_cap = cap;
+  }
+  memcpy(link->out + link->out_len, msg, sizeof(*msg));
+  link->out_len += sizeof(*msg);
+}
+
+// Caller holds replica_mutex
+static void release_link(backupLink *link)
+{
+  if (link->alive)
+    hold_replies();
+  link->alive = 0;
+  if (--link->threads > 0)
+  {
+    shutdown(link->fd, SHUT_RDWR);
+    return;
+  }
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    if (backup_links[i] == link)
+      backup_links[i] = NULL;
+  }
+  close(link->fd);
+  free(link->out);
+  free(link);
+  pthread_cond_broadcast(&replica_acked);
+}
+
+static void *run_sender(void *arg)
+{
+  backupLink *link = arg;
+  char *batch = NULL;
+  size_t batch_cap = 0;
+
+  pthread_mutex_lock(&replica_mutex);
+  while (link->alive)
+  {
+    if (link->out_len == 0)
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += REPLICA_HEARTBEAT_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      if (pthread_cond_timedwait(&replica_queued, &replica_mutex, &deadline) == ETIMEDOUT &&
+          link->out_len == 0)
+      {
+        replicaMessage beat = {.seq = replica_seq, .type = REPLICA_MSG_HEARTBEAT, .term = replica_term};
+        queue_message(link, &beat);
+      }
+      continue;
+    }
+
+    // Swap buffers and write out the whole queue: one write carries
+    // everything published since the last one
+    char *out = link->out;
+    size_t len = link->out_len, cap = link->out_cap;
+    link->out = batch;
+    link->out_cap = batch_cap;
+    link->out_len = 0;
+    pthread_mutex_unlock(&replica_mutex);
+
+    int sent = write_all(link->fd, out, len);
+
+    pthread_mutex_lock(&replica_mutex);
+    batch = out;
+    batch_cap = cap;
+    if (!sent)
+      break;
+  }
+  release_link(link);
+  pthread_mutex_unlock(&replica_mutex);
+  free(batch);
+  return NULL;
+}
+
+static void *run_ack_reader(void *arg)
+{
+  backupLink *link = arg;
+  unsigned long long acks[64];
+  size_t have = 0;
+  while (1)
+  {
+    ssize_t got = recv(link->fd, (char *)acks + have, sizeof(acks) - have, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    have += got;
+    size_t whole = have / sizeof(acks[0]);
+    if (whole == 0)
+      continue;
+
+    // Acks only grow, so the last one is all that matters
+    pthread_mutex_lock(&replica_mutex);
+    if (acks[whole - 1] > link->acked)
+    {
+      link->acked = acks[whole - 1];
+      pthread_cond_broadcast(&replica_acked);
+    }
+    pthread_mutex_unlock(&replica_mutex);
+    have -= whole * sizeof(acks[0]);
+    memmove(acks, acks + whole, have);
+  }
+
+  pthread_mutex_lock(&replica_mutex);
+  release_link(link);
+  pthread_mutex_unlock(&replica_mutex);
+  return NULL;
+}
+
+// Join: the backup gets the stock as of now and every change after it.
+// The link is not attached yet, so its queue needs no lock.
+static void queue_state(const char *location, wareHouse stock, void *arg)
+{
+  backupLink *link = arg;
+  replicaMessage msg = {.seq = replica_seq,
+                        .type = REPLICA_MSG_STATE,
+                        .term = replica_term,
+                        .stock = {stock.carbon, stock.hydrogen, stock.oxygen}};
+  snprintf(msg.location, sizeof(msg.location), "%s", location);
+  queue_message(link, &msg);
+}
+
+static void attach_backup(int fd)
+{
+  backupLink *link = calloc(1, sizeof(*link));
+  if (!link)
+  {
+    close(fd);
+    return;
+  }
+  link->fd = fd;
+  link->alive = 1;
+  link->threads = 2;
+
+  // No mutation may slip in between the state and the first change
+  pthread_mutex_lock(&replica_order);
+  pthread_mutex_lock(&replica_mutex);
+  int slot = -1;
+  for (int i = 0; i < REPLICA_MAX_BACKUPS && slot == -1; i++)
+  {
+    if (!backup_links[i])
+      slot = i;
+  }
+  pthread_mutex_unlock(&replica_mutex);
+  if (slot == -1)
+  {
+    pthread_mutex_unlock(&replica_order);
+    fprintf(stderr, "Too many backups, refusing one\n");
+    close(fd);
+    free(link);
+    return;
+  }
+
+  // warehouse_visit() holds the file lock, under which file mutations
+  // publish, so replica_seq stands still meanwhile
+  warehouse_visit(queue_state, link);
+  pthread_mutex_lock(&replica_mutex);
+  link->acked = replica_seq;
+  backup_links[slot] = link;
+  pthread_mutex_unlock(&replica_mutex);
+  pthread_mutex_unlock(&replica_order);
+
+  pthread_t sender, reader;
+  pthread_create(&sender, NULL, run_sender, link);
+  pthread_create(&reader, NULL, run_ack_reader, link);
+  pthread_detach(sender);
+  pthread_detach(reader);
+  printf("Backup connected (%d backups)\n", replica_backups());
+  fflush(stdout);
+}
+
+// A primary of a newer term took over: take no more mutations, cut the
+// backups loose, fail what waits for their acks, and follow the new
+// primary if it takes backups. A mutation that got past the role check
+// is still published, to no one, so that replica_commit() fails it too.
+static void step_down(const replicaHello *hello)
+{
+  pthread_mutex_lock(&replica_mutex);
+  replica_term = hello->term;
+  __atomic_store_n(&replica_role_now, REPLICA_BACKUP, __ATOMIC_RELEASE);
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    backupLink *link = backup_links[i];
+    if (link && link->alive)
+    {
+      link->alive = 0;
+      shutdown(link->fd, SHUT_RDWR);
+    }
+  }
+  pthread_cond_broadcast(&replica_acked);
+  pthread_mutex_unlock(&replica_mutex);
+
+  close(replica_listen_fd);
+  replica_listen_fd = -1;
+  printf("Primary of term %u took over, stepping down%s%s\n", hello->term,
+         hello->address[0] ? " to follow it at " : "", hello->address);
+  fflush(stdout);
+  if (hello->address[0])
+    replica_follow(hello->address, replica_listen_address, replica_ack);
+}
+
+static void *run_acceptor(void *arg)
+{
+  (void)arg;
+  while (1)
+  {
+    int fd = accept4(replica_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1 && errno == EINTR)
+      continue;
+    if (fd == -1)
+      break;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Whoever it is says first which term it knows of
+    replicaHello hello;
+    struct timeval timeout = {.tv_sec = REPLICA_TIMEOUT_MS / 1000, .tv_usec = REPLICA_TIMEOUT_MS % 1000 * 1000};
+    struct timeval forever = {0, 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever)) == -1)
+    {
+      close(fd);
+      continue;
+    }
+    hello.address[sizeof(hello.address) - 1] = '\0';
+    pthread_mutex_lock(&replica_mutex);
+    int replaced = hello.term > replica_term;
+    pthread_mutex_unlock(&replica_mutex);
+    if (replaced)
+    {
+      close(fd);
+      step_down(&hello);
+      break;
+    }
+    attach_backup(fd);
+  }
+  return NULL;
+}
+
+// Caller holds replica_mutex. Whether some backup has yet to ack seq.
+static int acks_missing(unsigned long long seq)
+{
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    if (backup_links[i] && backup_links[i]->alive && backup_links[i]->acked < seq)
+      return 1;
+  }
+  return 0;
+}
+
+// Caller holds replica_mutex. Stalled backups would stall every client;
+// cut them loose.
+static void drop_stalled(unsigned long long seq)
+{
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    backupLink *link = backup_links[i];
+    if (link && link->alive && link->acked < seq)
+    {
+      fprintf(stderr, "Backup did not ack within %d ms, dropping it\n", REPLICA_TIMEOUT_MS);
+      link->alive = 0;
+      shutdown(link->fd, SHUT_RDWR);
+      hold_replies();
+    }
+  }
+}
+
+// Hand out the replies whose acks are in, and fail them all if this
+// primary stepped down
+static void *run_committer(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&replica_mutex);
+  while (1)
+  {
+    double now = now_ms(), wake = now + REPLICA_HEARTBEAT_MS;
+    int replaced = replica_role() != REPLICA_PRIMARY;
+    replicaWaiter *answered = NULL;
+    for (replicaWaiter **at = &replica_waiting; *at;)
+    {
+      replicaWaiter *w = *at;
+      int missing = !replaced && acks_missing(w->seq);
+      if (missing && w->deadline <= now)
+      {
+        drop_stalled(w->seq);
+        missing = 0;
+      }
+      if (replaced || (!missing && now >= replica_held_until))
+      {
+        *at = w->next;
+        if (replaced)
+          w->result = -1;
+        w->next = answered;
+        answered = w;
+        continue;
+      }
+      if (missing && w->deadline < wake)
+        wake = w->deadline;
+      at = &w->next;
+    }
+
+    if (answered)
+    {
+      // Done may take other locks; and more may have come in meanwhile
+      pthread_mutex_unlock(&replica_mutex);
+      while (answered)
+      {
+        replicaWaiter *next = answered->next;
+        answered->done(answered->result, answered->arg);
+        free(answered);
+        answered = next;
+      }
+      pthread_mutex_lock(&replica_mutex);
+      continue;
+    }
+
+    if (replica_waiting && replica_held_until > now && replica_held_until < wake)
+      wake = replica_held_until;
+    double wait_ms = wake - now_ms();
+    if (wait_ms <= 0)
+      continue;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(wait_ms * 1e6);
+    deadline.tv_sec += ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+    pthread_cond_timedwait(&replica_acked, &replica_mutex, &deadline);
+  }
+  return NULL;
+}
+
+int replica_listen(const char *address, int ack)
+{
+  replica_listen_fd = replica_socket(address, 1);
+  if (replica_listen_fd == -1)
+  {
+    perror("Failed to listen for backups");
+    return 0;
+  }
+  char *copy = strdup(address);
+  free(replica_listen_address);
+  replica_listen_address = copy;
+  replica_ack = ack;
+  pthread_mutex_lock(&replica_mutex);
+  // This may be a primary that was replaced while it was away
+  hold_replies();
+  pthread_mutex_unlock(&replica_mutex);
+  __atomic_store_n(&replica_role_now, REPLICA_PRIMARY, __ATOMIC_RELEASE);
+  replica_publishing = 1;
+  if (!replica_committing)
+  {
+    if (pthread_create(&replica_committer, NULL, run_committer, NULL) != 0)
+    {
+      perror("Failed to start replication");
+      return 0;
+    }
+    pthread_detach(replica_committer);
+    replica_committing = 1;
+  }
+  if (pthread_create(&replica_acceptor, NULL, run_acceptor, NULL) != 0)
+  {
+    perror("Failed to start replication");
+    return 0;
+  }
+  pthread_detach(replica_acceptor);
+  return 1;
+}
+
+int replica_backups()
+{
+  int count = 0;
+  pthread_mutex_lock(&replica_mutex);
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    if (backup_links[i] && backup_links[i]->alive)
+      count++;
+  }
+  pthread_mutex_unlock(&replica_mutex);
+  return count;
+}
+
+int replica_order_lock()
+{
+  if (!replica_publishing)
+    return 0;
+  pthread_mutex_lock(&replica_order);
+  return 1;
+}
+
+void replica_order_unlock()
+{
+  pthread_mutex_unlock(&replica_order);
+}
+
+void replica_publish(const char *location, const long long change[3])
+{
+  replicaMessage msg = {.type = REPLICA_MSG_DELTA, .stock = {change[0], change[1], change[2]}};
+  snprintf(msg.location, sizeof(msg.location), "%s", location);
+
+  pthread_mutex_lock(&replica_mutex);
+  msg.seq = ++replica_seq;
+  msg.term = replica_term;
+  replica_published++;
+  for (int i = 0; i < REPLICA_MAX_BACKUPS; i++)
+  {
+    if (backup_links[i] && backup_links[i]->alive)
+      queue_message(backup_links[i], &msg);
+  }
+  pthread_cond_broadcast(&replica_queued);
+  pthread_mutex_unlock(&replica_mutex);
+  replica_pending = msg.seq;
+}
+
+void replica_commit_async(int result, replicaDone done, void *arg)
+{
+  unsigned long long seq = replica_pending;
+  replica_pending = 0;
+  if (seq == 0 || replica_ack != REPLICA_SYNC)
+  {
+    done(result, arg);
+    return;
+  }
+
+  pthread_mutex_lock(&replica_mutex);
+  if (replica_role() != REPLICA_PRIMARY)
+    result = -1;
+  else if (acks_missing(seq) || now_ms() < replica_held_until)
+  {
+    replicaWaiter *w = malloc(sizeof(*w));
+    if (w)
+    {
+      *w = (replicaWaiter){seq, result, done, arg, now_ms() + REPLICA_TIMEOUT_MS, replica_waiting};
+      replica_waiting = w;
+      pthread_cond_broadcast(&replica_acked);
+      pthread_mutex_unlock(&replica_mutex);
+      return;
+    }
+    result = -1; // cannot tell when the backups have it
+  }
+  pthread_mutex_unlock(&replica_mutex);
+  done(result, arg);
+}
+
+typedef struct commitWait
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t acked;
+  int done;
+  int result;
+} commitWait;
+
+static void commit_acked(int result, void *arg)
+{
+  commitWait *wait = arg;
+  pthread_mutex_lock(&wait->mutex);
+  wait->result = result;
+  wait->done = 1;
+  pthread_cond_signal(&wait->acked);
+  pthread_mutex_unlock(&wait->mutex);
+}
+
+int replica_commit(int result)
+{
+  if (replica_pending == 0 || replica_ack != REPLICA_SYNC)
+  {
+    replica_pending = 0;
+    return result;
+  }
+  commitWait wait = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, result};
+  replica_commit_async(result, commit_acked, &wait);
+  pthread_mutex_lock(&wait.mutex);
+  while (!wait.done)
+    pthread_cond_wait(&wait.acked, &wait.mutex);
+  pthread_mutex_unlock(&wait.mutex);
+  return wait.result;
+}
+
+void replica_stats(unsigned long long *published, double *promotion_ms, unsigned int *term)
+{
+  pthread_mutex_lock(&replica_mutex);
+  *published = replica_published;
+  *promotion_ms = replica_promotion_ms;
+  *term = replica_term;
+  pthread_mutex_unlock(&replica_mutex);
+}
+
+//-------------------backup--------------------------------------------------------
+
+// Bring location to the primary's stock by adding or taking the difference
+static void apply_message(const replicaMessage *msg)
+{
+  int location = msg->location[0] == '\0'
+                     ? 0
+                     : warehouse_location(msg->location, strnlen(msg->location, sizeof(msg->location)));
+  if (location < 0)
+    return;
+
+  long long change[3] = {msg->stock[0], msg->stock[1], msg->stock[2]};
+  warehouse_use(location);
+  if (msg->type == REPLICA_MSG_STATE)
+  {
+    wareHouse have = warehouse_read();
+    change[0] -= have.carbon;
+    change[1] -= have.hydrogen;
+    change[2] -= have.oxygen;
+  }
+  for (int atom = 0; atom < 3; atom++)
+  {
+    if (change[atom] > 0)
+      warehouse_add(atom + 1, change[atom]);
+  }
+  if (change[0] < 0 || change[1] < 0 || change[2] < 0)
+    warehouse_take(change[0] < 0 ? -change[0] : 0, change[1] < 0 ? -change[1] : 0,
+                   change[2] < 0 ? -change[2] : 0);
+  warehouse_use(0);
+}
+
+// What this node tells a primary it connects to
+static replicaHello hello_now()
+{
+  replicaHello hello = {0};
+  pthread_mutex_lock(&replica_mutex);
+  hello.term = replica_term;
+  pthread_mutex_unlock(&replica_mutex);
+  if (replica_promoted_address)
+    snprintf(hello.address, sizeof(hello.address), "%s", replica_promoted_address);
+  return hello;
+}
+
+// arg is the primary's address, this thread's own copy
+static void *run_follower(void *arg)
+{
+  char *primary = arg;
+  replicaMessage msgs[64];
+  size_t have = 0;
+  int fd = -1;
+  double heard = now_ms();
+
+  // Until the first connection the primary may just not be up yet
+  while (fd == -1 && replica_role() == REPLICA_BACKUP)
+  {
+    fd = replica_socket(primary, 0);
+    if (fd == -1)
+      usleep(REPLICA_HEARTBEAT_MS * 1000);
+  }
+  if (fd != -1)
+  {
+    // A failed write shows as a lost primary below
+    replicaHello hello = hello_now();
+    write_all(fd, &hello, sizeof(hello));
+    printf("Following primary %s\n", primary);
+  }
+  fflush(stdout);
+  heard = now_ms();
+
+  while (fd != -1 && replica_role() == REPLICA_BACKUP)
+  {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, REPLICA_HEARTBEAT_MS);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready == 0)
+    {
+      if (now_ms() - heard >= REPLICA_TIMEOUT_MS)
+        break;
+      continue;
+    }
+
+    ssize_t got = recv(fd, (char *)msgs + have, sizeof(msgs) - have, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    heard = now_ms();
+    have += got;
+
+    size_t whole = have / sizeof(replicaMessage);
+    unsigned long long last = 0;
+    unsigned int term = 0;
+    for (size_t i = 0; i < whole; i++)
+    {
+      if (msgs[i].type != REPLICA_MSG_HEARTBEAT)
+        apply_message(&msgs[i]);
+      last = msgs[i].seq;
+      if (msgs[i].term > term)
+        term = msgs[i].term;
+    }
+    pthread_mutex_lock(&replica_mutex);
+    if (term > replica_term)
+      replica_term = term;
+    pthread_mutex_unlock(&replica_mutex);
+    have -= whole * sizeof(replicaMessage);
+    memmove(msgs, (char *)msgs + whole * sizeof(replicaMessage), have);
+
+    // One ack for the whole batch
+    if (whole > 0 && !write_all(fd, &last, sizeof(last)))
+      break;
+  }
+
+  if (fd != -1)
+    close(fd);
+  if (replica_role() == REPLICA_BACKUP)
+  {
+    double took = now_ms() - heard;
+    pthread_mutex_lock(&replica_mutex);
+    replica_promotion_ms = took;
+    pthread_mutex_unlock(&replica_mutex);
+    replica_promote();
+    printf("Lost primary %s, promoted to primary %.0f ms after last hearing from it\n", primary, took);
+    fflush(stdout);
+  }
+
+  // The old primary may only have stalled, or come back: whenever its
+  // address answers, tell it of the newer term
+  while (replica_role() == REPLICA_PRIMARY)
+  {
+    int probe = replica_socket(primary, 0);
+    if (probe != -1)
+    {
+      replicaHello hello = hello_now();
+      write_all(probe, &hello, sizeof(hello));
+      close(probe);
+    }
+    usleep(REPLICA_HEARTBEAT_MS * 1000);
+  }
+  free(primary);
+  return NULL;
+}
+
+int replica_follow(const char *address, const char *promoted_address, int ack)
+{
+  free(replica_promoted_address);
+  replica_promoted_address = promoted_address ? strdup(promoted_address) : NULL;
+  replica_ack = ack;
+  __atomic_store_n(&replica_role_now, REPLICA_BACKUP, __ATOMIC_RELEASE);
+  if (pthread_create(&replica_follower, NULL, run_follower, strdup(address)) != 0)
+  {
+    perror("Failed to start replication");
+    return 0;
+  }
+  pthread_detach(replica_follower);
+  return 1;
+}
+
+void replica_promote()
+{
+  int expected = REPLICA_BACKUP;
+  if (!__atomic_compare_exchange_n(&replica_role_now, &expected, REPLICA_PRIMARY, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&replica_mutex);
+  replica_term++;
+  pthread_mutex_unlock(&replica_mutex);
+  if (replica_promoted_address && !replica_listen(replica_promoted_address, replica_ack))
+    fprintf(stderr, "Promoted, but cannot take backups on %s\n", replica_promoted_address);
+}
@@ -0,0 +1,122 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include "warehouse.h"
+
+// Primary/backup replication. A primary streams every stock change it
+// applies, in the order it applied them, to the backups connected to its
+// replication address (a TCP port, "host:port", or a Unix socket path).
+// A backup applies the stream to its own warehouse, memory or file, acks
+// what it applied, and refuses client mutations. When the primary goes
+// quiet for REPLICA_TIMEOUT_MS the backup promotes itself, and starts
+// listening for backups of its own if it was given an address for that.
+//
+// With REPLICA_SYNC a mutation returns only once every backup has acked it
+// (a backup that takes longer than REPLICA_TIMEOUT_MS is dropped), so a
+// promoted backup has everything a client was told succeeded. With
+// REPLICA_ASYNC the last few changes may be lost in a failover. Reactors
+// do not wait for the acks: they take the reply from replica_commit_async().
+//
+// Every primary has a term, one more than the newest its backup had seen
+// when it was promoted. A backup tells its primary its term when it
+// connects, and a promoted backup keeps telling the primary it replaced,
+// whenever that one's address answers. A primary that hears of a newer
+// term steps down: it takes no more mutations, fails the ones still
+// waiting for acks, and follows the new primary if that takes backups.
+// Since a primary cannot tell a dead backup from a promoted one, in
+// REPLICA_SYNC it holds back every reply for REPLICA_TIMEOUT_MS after it
+// starts and after it loses a backup, which gives the newer primary time
+// to be heard.
+//
+// On the primary, mutations of the in-memory warehouse are serialized
+// while replicating, so the stream has one order; the file-backed one is
+// serialized by its lock anyway. Only mutations made by this process are
+// streamed.
+
+#define REPLICA_HEARTBEAT_MS 100
+#define REPLICA_TIMEOUT_MS 500
+#define REPLICA_MAX_BACKUPS 8
+#define REPLICA_ADDRESS_MAX 108 // a Unix socket path
+
+enum replicaRole
+{
+  REPLICA_NONE,
+  REPLICA_PRIMARY,
+  REPLICA_BACKUP
+};
+
+enum replicaAck
+{
+  REPLICA_ASYNC,
+  REPLICA_SYNC
+};
+
+enum replicaMessageType
+{
+  REPLICA_MSG_STATE = 1, // absolute stock of a location, sent when a backup joins
+  REPLICA_MSG_DELTA,     // change applied by the primary
+  REPLICA_MSG_HEARTBEAT
+};
+
+// Primary to backup. The backup answers with the seq (8 bytes) of the
+// last message it applied.
+typedef struct replicaMessage
+{
+  unsigned long long seq;
+  unsigned int type;
+  unsigned int term;               // of the primary that sent it
+  long long stock[3];              // carbon, hydrogen, oxygen
+  char location[LOCATION_NAME_MAX]; // "" for the default warehouse
+} replicaMessage;
+
+// First on every connection to a primary, from a backup or from a
+// promoted backup that replaced it
+typedef struct replicaHello
+{
+  unsigned int term;                   // newest term the sender knows of
+  char address[REPLICA_ADDRESS_MAX];   // where it takes backups as primary, "" if nowhere
+} replicaHello;
+
+// Accept backups on address and stream to them. Returns 0 on error.
+int replica_listen(const char *address, int ack);
+
+// Become a backup of the primary at address. After a promotion, listen
+// on promoted_address (may be NULL) with the same ack mode. Returns 0 on
+// error.
+int replica_follow(const char *address, const char *promoted_address, int ack);
+
+// Stop following and take client mutations, as after losing the primary
+void replica_promote();
+
+int replica_role();
+const char *replica_ack_name(int ack);
+
+// 1 on a primary whose mutations wait for backup acks
+int replica_sync();
+
+// Backups connected to this primary
+int replica_backups();
+
+// Changes streamed, the time in ms the last promotion took from the last
+// message heard from the primary, and the newest term known here
+void replica_stats(unsigned long long *published, double *promotion_ms, unsigned int *term);
+
+// Hooks for warehouse.c. replica_publishing is set once this node has been
+// a primary. Memory mutations run between replica_order_lock() (which
+// returns 0 and takes nothing when not publishing) and
+// replica_order_unlock(); file mutations publish under the warehouse lock.
+// replica_commit() then waits for the acks in REPLICA_SYNC, and returns
+// result, the mutation's own, or -1 if this primary stepped down first.
+extern int replica_publishing;
+int replica_order_lock();
+void replica_order_unlock();
+void replica_publish(const char *location, const long long change[3]);
+int replica_commit(int result);
+
+// The same without waiting: done(result, arg) runs once the acks are in,
+// on the replication thread, or right away on this one if there are none
+// to wait for. done must be quick and must not mutate the warehouse.
+typedef void (*replicaDone)(int result, void *arg);
+void replica_commit_async(int result, replicaDone done, void *arg);
+
+#endif
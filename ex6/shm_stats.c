@@ -0,0 +1,99 @@
+#include "shm_stats.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_TRIES 1000
+
+statsSegment *shm_stats_create(const char *name)
+{
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return NULL;
+  if (ftruncate(fd, sizeof(statsSegment)) == -1)
+  {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  statsSegment *segment = mmap(NULL, sizeof(statsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED)
+  {
+    shm_unlink(name);
+    return NULL;
+  }
+  segment->version = SHM_STATS_VERSION;
+  segment->pid = getpid();
+  // Readers check the magic last
+  __atomic_store_n(&segment->magic, SHM_STATS_MAGIC, __ATOMIC_RELEASE);
+  return segment;
+}
+
+const statsSegment *shm_stats_open(const char *name)
+{
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(statsSegment))
+  {
+    close(fd);
+    return NULL;
+  }
+  const statsSegment *segment = mmap(NULL, sizeof(statsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED)
+    return NULL;
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_STATS_MAGIC ||
+      segment->version != SHM_STATS_VERSION)
+  {
+    munmap((void *)segment, sizeof(statsSegment));
+    return NULL;
+  }
+  return segment;
+}
+
+void shm_stats_close(const statsSegment *segment)
+{
+  munmap((void *)segment, sizeof(statsSegment));
+}
+
+void shm_stats_remove(const char *name)
+{
+  shm_unlink(name);
+}
+
+void shm_stats_write_begin(statsSegment *segment)
+{
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shm_stats_write_end(statsSegment *segment)
+{
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELEASE);
+}
+
+int shm_stats_snapshot(const statsSegment *segment, statsSegment *copy)
+{
+  for (int tries = 0; tries < SNAPSHOT_TRIES; tries++)
+  {
+    unsigned long long before = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      sched_yield();
+      continue;
+    }
+    memcpy(copy, (const void *)segment, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) == before)
+      return 1;
+  }
+  return 0;
+}
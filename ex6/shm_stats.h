@@ -0,0 +1,55 @@
+#ifndef SHM_STATS_H
+#define SHM_STATS_H
+
+#include "latency.h"
+#include "metrics.h"
+
+// Live statistics in a POSIX shared memory segment. drinks_bar publishes
+// a copy of its counters, stock and latency summaries there every
+// SHM_STATS_PUBLISH_MS from a thread of its own (see metrics_publish());
+// drinks_top maps the segment read-only and never talks to the server.
+//
+// The segment is guarded by a seqlock: the writer makes seq odd, updates
+// the fields and makes seq even again. A reader copies the segment between
+// two reads of seq and keeps the copy only if both are the same even
+// number, so it never sees half an update and never blocks the writer.
+
+#define SHM_STATS_MAGIC 0x5354424bU // "KBTS"
+#define SHM_STATS_VERSION 1
+#define SHM_STATS_PUBLISH_MS 50
+#define SHM_STATS_DEFAULT_NAME "/drinks_bar"
+
+typedef struct statsSegment
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned long long seq; // odd while an update is in progress
+  int pid;
+  int running;            // 0 once the server has shut down
+  double updated;         // CLOCK_REALTIME seconds of the last update
+  int clients;
+  unsigned long long counters[METRIC_COUNTERS];
+  unsigned long long stock[3]; // default warehouse
+  unsigned long long log_written;
+  unsigned long long log_dropped;
+  latencySummary latency[LATENCY_COMMANDS][LATENCY_STAGES];
+} statsSegment;
+
+// Create name (e.g. "/drinks_bar") for writing, replacing any old one
+statsSegment *shm_stats_create(const char *name);
+
+// Map an existing segment read-only. NULL if there is none or it is not
+// a segment of this version.
+const statsSegment *shm_stats_open(const char *name);
+
+void shm_stats_close(const statsSegment *segment);
+void shm_stats_remove(const char *name);
+
+void shm_stats_write_begin(statsSegment *segment);
+void shm_stats_write_end(statsSegment *segment);
+
+// Copy a consistent snapshot. Returns 0 if the writer kept getting in the
+// way for too long.
+int shm_stats_snapshot(const statsSegment *segment, statsSegment *copy);
+
+#endif
@@ -0,0 +1,205 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uring_init(uringRing *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    return -errno;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_len > ring->sq_len)
+      ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    goto fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+  {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED)
+      goto fail;
+  }
+
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+  char *sq = ring->sq_ptr;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sqe_tail = *ring->sq_tail;
+
+  char *cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+fail:;
+  int err = -errno;
+  uring_exit(ring);
+  return err;
+}
+
+void uring_exit(uringRing *ring)
+{
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+    munmap(ring->sq_ptr, ring->sq_len);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uringRing *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= ring->sq_entries)
+  {
+    // Queue full - push what we have and try once more
+    if (uring_submit_and_wait(ring, 0) < 0)
+      return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+      return NULL;
+  }
+
+  unsigned index = ring->sqe_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sqe_tail++;
+  return sqe;
+}
+
+int uring_submit_and_wait(uringRing *ring, unsigned wait_nr)
+{
+  unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  ring->enters++;
+  int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                    wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uringRing *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uringRing *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_buf_ring(uringRing *ring, uringBufRing *bufs, unsigned short bgid,
+                         unsigned count, unsigned size)
+{
+  // count must be a power of two
+  memset(bufs, 0, sizeof(*bufs));
+  size_t ring_len = count * sizeof(struct io_uring_buf);
+  bufs->br = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs->br == MAP_FAILED)
+  {
+    bufs->br = NULL;
+    return -errno;
+  }
+
+  bufs->buffers = malloc((size_t)count * size);
+  if (!bufs->buffers)
+  {
+    munmap(bufs->br, ring_len);
+    bufs->br = NULL;
+    return -ENOMEM;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)bufs->br;
+  reg.ring_entries = count;
+  reg.bgid = bgid;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    int err = -errno;
+    free(bufs->buffers);
+    munmap(bufs->br, ring_len);
+    memset(bufs, 0, sizeof(*bufs));
+    return err;
+  }
+
+  bufs->count = count;
+  bufs->size = size;
+  bufs->bgid = bgid;
+  for (unsigned i = 0; i < count; i++)
+    uring_buf_recycle(bufs, i);
+  return 0;
+}
+
+void uring_free_buf_ring(uringRing *ring, uringBufRing *bufs)
+{
+  if (!bufs->br)
+    return;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = bufs->bgid;
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(bufs->br, bufs->count * sizeof(struct io_uring_buf));
+  free(bufs->buffers);
+  memset(bufs, 0, sizeof(*bufs));
+}
+
+char *uring_buf_addr(uringBufRing *bufs, unsigned short bid)
+{
+  return bufs->buffers + (size_t)bid * bufs->size;
+}
+
+void uring_buf_recycle(uringBufRing *bufs, unsigned short bid)
+{
+  struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & (bufs->count - 1)];
+  buf->addr = (unsigned long)uring_buf_addr(bufs, bid);
+  // The handlers take data[0..len) as it is, so the whole buffer is usable
+  buf->len = bufs->size;
+  buf->bid = bid;
+  bufs->tail++;
+  __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,67 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on top of the raw syscalls (no liburing).
+// One ring per reactor thread; none of these functions are thread safe.
+
+typedef struct uringRing
+{
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail; // prepared but not yet published to the kernel
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+
+  unsigned long long enters; // io_uring_enter() calls issued
+} uringRing;
+
+// Provided buffer ring: the kernel picks a buffer per completion
+typedef struct uringBufRing
+{
+  struct io_uring_buf_ring *br;
+  char *buffers;
+  unsigned count;
+  unsigned size;
+  unsigned short bgid;
+  unsigned short tail;
+} uringBufRing;
+
+int uring_init(uringRing *ring, unsigned entries);
+void uring_exit(uringRing *ring);
+
+// Returns a zeroed SQE, flushing pending ones first if the queue is full
+struct io_uring_sqe *uring_get_sqe(uringRing *ring);
+
+// Publish pending SQEs and optionally wait for wait_nr completions in the
+// same syscall. Returns the number submitted or -errno.
+int uring_submit_and_wait(uringRing *ring, unsigned wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(uringRing *ring);
+void uring_cqe_seen(uringRing *ring);
+
+int uring_setup_buf_ring(uringRing *ring, uringBufRing *bufs, unsigned short bgid,
+                         unsigned count, unsigned size);
+void uring_free_buf_ring(uringRing *ring, uringBufRing *bufs);
+char *uring_buf_addr(uringBufRing *bufs, unsigned short bid);
+
+// Hand a consumed buffer back to the kernel
+void uring_buf_recycle(uringBufRing *bufs, unsigned short bid);
+
+#endif
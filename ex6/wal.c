@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int wal_fd = -1;
+
+int wal_mode = DURABILITY_SYNC;
+int wal_flush_ms = DEFAULT_FLUSH_MS;
+int wal_flush_ops = DEFAULT_FLUSH_OPS;
+
+// Group commit state. written is the last sequence number appended by
+// this process, durable the last one known to be on disk. Only one thread
+// at a time runs fdatasync; the others wait for it and usually find their
+// record covered when it returns.
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;
+unsigned long long wal_written = 0;
+unsigned long long wal_durable = 0;
+int wal_syncing = 0;
+
+// DURABILITY_PERIODIC: flushes in the background, woken early by a
+// committer once flush_ops records are waiting
+pthread_t wal_flusher;
+int wal_flusher_running = 0;
+pthread_cond_t wal_flush_due = PTHREAD_COND_INITIALIZER;
+
+unsigned long long wal_since_checkpoint = 0;
+unsigned long long wal_appends = 0;
+unsigned long long wal_syncs = 0;
+
+// FNV-1a over everything before check; the seed keeps an all-zero record
+// from checking out
+static unsigned long long wal_check(const walRecord *record)
+{
+  const unsigned char *bytes = (const unsigned char *)record;
+  unsigned long long hash = 0xcbf29ce484222325ULL ^ 0x57414cULL;
+  for (size_t i = 0; i < offsetof(walRecord, check); i++)
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void wal_set_durability(int mode, int flush_ms, int flush_ops)
+{
+  wal_mode = mode;
+  wal_flush_ms = flush_ms > 0 ? flush_ms : DEFAULT_FLUSH_MS;
+  wal_flush_ops = flush_ops > 0 ? flush_ops : DEFAULT_FLUSH_OPS;
+}
+
+int wal_durability()
+{
+  return wal_mode;
+}
+
+// Wait until record seq is on disk, running the fdatasync ourselves if
+// nobody else is. Called and returns with wal_mutex held.
+static int wal_sync_locked(unsigned long long seq)
+{
+  while (wal_durable < seq)
+  {
+    if (wal_syncing)
+    {
+      pthread_cond_wait(&wal_synced, &wal_mutex);
+      continue;
+    }
+
+    // Become the leader: one flush covers everything appended so far
+    wal_syncing = 1;
+    unsigned long long target = wal_written;
+    pthread_mutex_unlock(&wal_mutex);
+
+    int synced = fdatasync(wal_fd) == 0;
+    if (!synced)
+      perror("Failed to sync warehouse log");
+
+    pthread_mutex_lock(&wal_mutex);
+    wal_syncing = 0;
+    wal_syncs++;
+    if (synced && target > wal_durable)
+      wal_durable = target;
+    pthread_cond_broadcast(&wal_synced);
+    if (!synced)
+      return 0;
+  }
+  return 1;
+}
+
+static void *run_flusher(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&wal_mutex);
+  while (wal_flusher_running)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wal_flush_ms / 1000;
+    deadline.tv_nsec += (wal_flush_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (wal_flusher_running && wal_written - wal_durable < (unsigned long long)wal_flush_ops)
+    {
+      if (pthread_cond_timedwait(&wal_flush_due, &wal_mutex, &deadline) == ETIMEDOUT)
+        break;
+    }
+    if (wal_written > wal_durable)
+      wal_sync_locked(wal_written);
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  return NULL;
+}
+
+int wal_open(const char *warehouse_path)
+{
+  size_t len = strlen(warehouse_path);
+  char *path = malloc(len + sizeof(".wal"));
+  if (!path)
+    return 0;
+  memcpy(path, warehouse_path, len);
+  memcpy(path + len, ".wal", sizeof(".wal"));
+
+  wal_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (wal_fd == -1)
+    perror("Failed to open warehouse log");
+  free(path);
+  if (wal_fd == -1)
+    return 0;
+
+  if (wal_mode == DURABILITY_PERIODIC)
+  {
+    wal_flusher_running = 1;
+    if (pthread_create(&wal_flusher, NULL, run_flusher, NULL) != 0)
+    {
+      perror("Failed to start warehouse log flusher");
+      wal_flusher_running = 0;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void wal_close()
+{
+  if (wal_flusher_running)
+  {
+    pthread_mutex_lock(&wal_mutex);
+    wal_flusher_running = 0;
+    pthread_cond_signal(&wal_flush_due);
+    pthread_mutex_unlock(&wal_mutex);
+    pthread_join(wal_flusher, NULL);
+  }
+  if (wal_fd != -1)
+  {
+    fdatasync(wal_fd);
+    close(wal_fd);
+    wal_fd = -1;
+  }
+}
+
+int wal_replay(void (*apply)(int location, const wareHouse *state))
+{
+  walRecord records[256];
+  off_t offset = 0;
+  int found = 0;
+
+  while (1)
+  {
+    ssize_t got = pread(wal_fd, records, sizeof(records), offset);
+    if (got <= 0)
+      break;
+    size_t count = got / sizeof(walRecord);
+    for (size_t i = 0; i < count; i++)
+    {
+      // Appends are serialized, so the first bad record is the torn
+      // tail of a crashed write and nothing valid follows it
+      if (records[i].check != wal_check(&records[i]))
+        return found;
+      apply((int)records[i].location, &records[i].state);
+      found++;
+    }
+    if (count < sizeof(records) / sizeof(records[0]))
+      break;
+    offset += got;
+  }
+  return found;
+}
+
+// Write one record at end, leaving no partial record behind on failure
+static int wal_write(int location, const wareHouse *state, off_t end)
+{
+  walRecord record = {.state = *state, .location = location};
+  record.check = wal_check(&record);
+  if (pwrite(wal_fd, &record, sizeof(record), end) != sizeof(record))
+  {
+    perror("Failed to append to warehouse log");
+    if (ftruncate(wal_fd, end) == -1)
+      perror("Failed to trim warehouse log");
+    return 0;
+  }
+  return 1;
+}
+
+unsigned long long wal_append(int location, const wareHouse *state)
+{
+  // Another process may have appended since our last write, so find the
+  // end each time rather than trusting a cached offset
+  off_t end = lseek(wal_fd, 0, SEEK_END);
+  if (end == -1)
+  {
+    perror("Failed to append to warehouse log");
+    return 0;
+  }
+  if (!wal_write(location, state, end))
+    return 0;
+
+  pthread_mutex_lock(&wal_mutex);
+  unsigned long long seq = ++wal_written;
+  wal_since_checkpoint++;
+  wal_appends++;
+  pthread_mutex_unlock(&wal_mutex);
+  return seq;
+}
+
+int wal_commit(unsigned long long seq)
+{
+  int ok = 1;
+  pthread_mutex_lock(&wal_mutex);
+  if (wal_mode == DURABILITY_SYNC)
+    ok = wal_sync_locked(seq);
+  else if (wal_mode == DURABILITY_PERIODIC &&
+           wal_written - wal_durable >= (unsigned long long)wal_flush_ops)
+    pthread_cond_signal(&wal_flush_due);
+  pthread_mutex_unlock(&wal_mutex);
+  return ok;
+}
+
+int wal_claim_checkpoint()
+{
+  int claimed = 0;
+  pthread_mutex_lock(&wal_mutex);
+  if (wal_since_checkpoint >= WAL_CHECKPOINT_RECORDS)
+  {
+    wal_since_checkpoint = 0;
+    claimed = 1;
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  return claimed;
+}
+
+int wal_reset(const wareHouse *state)
+{
+  if (ftruncate(wal_fd, 0) == -1)
+  {
+    perror("Failed to truncate warehouse log");
+    return 0;
+  }
+  return state ? wal_write(0, state, 0) : 1;
+}
+
+unsigned long long wal_position()
+{
+  off_t end = lseek(wal_fd, 0, SEEK_END);
+  return end < 0 ? 0 : end;
+}
+
+void wal_stats(unsigned long long *appends, unsigned long long *syncs)
+{
+  pthread_mutex_lock(&wal_mutex);
+  *appends = wal_appends;
+  *syncs = wal_syncs;
+  pthread_mutex_unlock(&wal_mutex);
+}
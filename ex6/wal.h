@@ -0,0 +1,66 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "warehouse.h"
+
+// Write-ahead log of the file-backed warehouse, kept next to it as
+// "<save-file>.wal". Every mutation appends the contents it left behind in
+// the warehouse it touched, so replay is just "take the last intact record
+// of each location". The mmap'd file
+// is only a checkpoint; it is msync'd and the log restarted from it every
+// WAL_CHECKPOINT_RECORDS records. The log therefore always ends with the
+// last committed state, which is also what a lock holder that died
+// mid-mutation is rolled back to.
+//
+// Appends happen under the warehouse lock, in mutation order. Making them
+// durable happens after the lock is released: concurrent committers share
+// one fdatasync (group commit) instead of each flushing on its own. How
+// long a committer waits for that depends on the durability mode
+// (warehouse.h).
+
+#define WAL_CHECKPOINT_RECORDS 4096
+
+typedef struct walRecord
+{
+  wareHouse state;             // warehouse contents after the mutation
+  unsigned long long location; // 0 for the default warehouse, else its ID
+  unsigned long long check;    // of state and location; a torn or stale record fails it
+} walRecord;
+
+// Mode and flush thresholds apply from the next wal_open()
+void wal_set_durability(int mode, int flush_ms, int flush_ops);
+int wal_durability();
+
+// Starts the flusher thread in DURABILITY_PERIODIC
+int wal_open(const char *warehouse_path);
+void wal_close();
+
+// Hand every intact record to apply, oldest first, so each location ends
+// at its last logged state. Returns the number of records. Caller holds
+// the warehouse lock.
+int wal_replay(void (*apply)(int location, const wareHouse *state));
+
+// Append a record; caller holds the warehouse lock. Returns its sequence
+// number for wal_commit(), or 0 on a write error (nothing is appended).
+unsigned long long wal_append(int location, const wareHouse *state);
+
+// Wait until record seq is on disk (DURABILITY_SYNC), or only nudge the
+// flusher. Returns 0 if fdatasync failed.
+int wal_commit(unsigned long long seq);
+
+// Returns 1 for exactly one caller once a checkpoint is due
+int wal_claim_checkpoint();
+
+// Restart the log with the checkpointed default warehouse as its only
+// record (or empty it if state is NULL); caller holds the warehouse lock
+// and has msync'd the checkpoint, named locations included. Returns 0 on
+// error.
+int wal_reset(const wareHouse *state);
+
+// Size of the log in bytes; caller holds the warehouse lock
+unsigned long long wal_position();
+
+// Records appended and fdatasyncs issued by this process
+void wal_stats(unsigned long long *appends, unsigned long long *syncs);
+
+#endif
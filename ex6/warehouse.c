@@ -0,0 +1,1492 @@
+#define _GNU_SOURCE
+#include "crdt.h"
+#include "latency.h"
+#include "log.h"
+#include "metrics.h"
+#include "raft.h"
+#include "recipe.h"
+#include "replica.h"
+#include "wal.h"
+#include "warehouse.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+// Global file descriptor and mapped memory for warehouse
+int warehouse_fd = -1;
+warehouseFile *warehouse_file = NULL;
+wareHouse *warehouse_ptr = NULL;
+char *warehouse_file_path = NULL;
+
+// In-memory warehouse, used when there is no save file. The stock is split
+// into per-thread shards on separate cache lines so ADDs from different
+// reactors never touch the same line.
+typedef struct stockShard
+{
+  atomStock stock;
+  // Changes begun and finished, so readers need no CAS (see shard_read)
+  unsigned long long writes_begun;
+  unsigned long long writes_done;
+} __attribute__((aligned(64))) stockShard;
+
+stockShard memory_shards[MAX_SHARDS];
+int shard_count = 1;
+__thread int local_shard = -1;
+
+// Only one thread at a time may move stock between shards, so two short
+// shards cannot starve each other while the total would have been enough
+pthread_mutex_t steal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Odd while steal_mutex's holder has stock in transit between shards. A
+// sum of the shards is only kept if it saw the same even value before and
+// after, so it never counts those atoms twice or not at all.
+unsigned long long shard_seq = 0;
+
+// Tries a seqlock reader makes before giving up on a writer
+#define SEQLOCK_TRIES 1000
+
+// Named warehouses when there is no save file, created on first use, and
+// the lock that serializes creating them (the file has its own)
+warehouseFile *memory_locations = NULL;
+pthread_mutex_t location_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread int current_location = 0;
+
+static int checkpoint_warehouse();
+
+static warehouseFile *location_store()
+{
+  return warehouse_file ? warehouse_file : __atomic_load_n(&memory_locations, __ATOMIC_ACQUIRE);
+}
+
+// Seqlock writer side; writers are serialized by a lock of their own
+static void seq_write_begin(unsigned long long *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(unsigned long long *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int *location_index(warehouseFile *store)
+{
+  return (unsigned int *)((char *)store + LOCATION_INDEX_OFFSET);
+}
+
+static locationRecord *location_record(warehouseFile *store, int location)
+{
+  return (locationRecord *)((char *)store + LOCATION_RECORD_OFFSET) + (location - 1);
+}
+
+// As backups know it: "" for the default warehouse
+static const char *location_name(int location)
+{
+  return location > 0 ? location_record(location_store(), location)->name : "";
+}
+
+// A clean shutdown leaves a checkpoint and a log holding just its state
+void cleanup_warehouse_file()
+{
+  if (warehouse_file)
+  {
+    if (warehouse_ptr && lock_warehouse())
+    {
+      checkpoint_warehouse();
+      unlock_warehouse();
+    }
+    munmap(warehouse_file, WAREHOUSE_MAP_MAX);
+  }
+  warehouse_file = NULL;
+  warehouse_ptr = NULL;
+  wal_close();
+  if (warehouse_fd != -1)
+  {
+    close(warehouse_fd);
+  }
+  warehouse_fd = -1;
+}
+
+//-------------------lock-free stock---------------------------------------------
+
+#define STOCK_FIELD(packed, index) \
+  ((unsigned long long)((packed) >> ((index) * STOCK_BITS)) & STOCK_MAX)
+
+// With cmpxchg16b available (-mcx16) the CAS is a single inline
+// instruction; otherwise libatomic provides it, possibly with a lock.
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+#define STOCK_CAS(ptr, expected, desired) \
+  __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define STOCK_LOAD(ptr) __sync_val_compare_and_swap((ptr), 0, 0)
+#else
+#define STOCK_CAS(ptr, expected, desired)                                   \
+  ({                                                                        \
+    unsigned __int128 expected_copy = (expected);                           \
+    __atomic_compare_exchange_n((ptr), &expected_copy, (desired), 0,        \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);        \
+  })
+#define STOCK_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#endif
+
+static unsigned __int128 stock_pack(unsigned long long carbon, unsigned long long hydrogen,
+                                    unsigned long long oxygen)
+{
+  return (unsigned __int128)carbon |
+         ((unsigned __int128)hydrogen << STOCK_BITS) |
+         ((unsigned __int128)oxygen << (2 * STOCK_BITS));
+}
+
+void stock_init(atomStock *stock, unsigned long long carbon,
+                unsigned long long hydrogen, unsigned long long oxygen)
+{
+  unsigned __int128 old = STOCK_LOAD(&stock->packed);
+  while (!STOCK_CAS(&stock->packed, old, stock_pack(carbon, hydrogen, oxygen)))
+    old = STOCK_LOAD(&stock->packed);
+}
+
+int stock_add(atomStock *stock, int atom, unsigned long long quantity)
+{
+  if (atom < 1 || atom > 3)
+    return 0;
+  int index = atom - 1;
+
+  // The plain read may be torn; the CAS then fails and we retry
+  unsigned __int128 old = stock->packed;
+  while (1)
+  {
+    // A field overflowing would carry into its neighbour
+    if (STOCK_FIELD(old, index) + quantity > STOCK_MAX)
+    {
+      old = STOCK_LOAD(&stock->packed);
+      if (STOCK_FIELD(old, index) + quantity > STOCK_MAX)
+        return 0;
+    }
+    unsigned __int128 updated = old + ((unsigned __int128)quantity << (index * STOCK_BITS));
+    if (STOCK_CAS(&stock->packed, old, updated))
+      return 1;
+    old = STOCK_LOAD(&stock->packed);
+  }
+}
+
+int stock_take(atomStock *stock, unsigned long long carbon,
+               unsigned long long hydrogen, unsigned long long oxygen)
+{
+  if (carbon > STOCK_MAX || hydrogen > STOCK_MAX || oxygen > STOCK_MAX)
+    return 0;
+
+  unsigned __int128 need = stock_pack(carbon, hydrogen, oxygen);
+  unsigned __int128 old = STOCK_LOAD(&stock->packed);
+  while (1)
+  {
+    if (STOCK_FIELD(old, 0) < carbon || STOCK_FIELD(old, 1) < hydrogen ||
+        STOCK_FIELD(old, 2) < oxygen)
+      return 0;
+    // Every field covers its need, so the subtraction never borrows
+    if (STOCK_CAS(&stock->packed, old, old - need))
+      return 1;
+    old = STOCK_LOAD(&stock->packed);
+  }
+}
+
+int stock_take_upto(atomStock *stock, const unsigned long long want[3],
+                    unsigned long long got[3])
+{
+  unsigned __int128 old = STOCK_LOAD(&stock->packed);
+  while (1)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      unsigned long long have = STOCK_FIELD(old, i);
+      got[i] = have < want[i] ? have : want[i];
+    }
+    if (got[0] == 0 && got[1] == 0 && got[2] == 0)
+      return 0;
+    if (STOCK_CAS(&stock->packed, old, old - stock_pack(got[0], got[1], got[2])))
+      return 1;
+    old = STOCK_LOAD(&stock->packed);
+  }
+}
+
+wareHouse stock_read(atomStock *stock)
+{
+  unsigned __int128 packed = STOCK_LOAD(&stock->packed);
+  wareHouse snapshot = {
+      .carbon = STOCK_FIELD(packed, 0),
+      .hydrogen = STOCK_FIELD(packed, 1),
+      .oxygen = STOCK_FIELD(packed, 2)};
+  return snapshot;
+}
+
+int stock_is_lock_free()
+{
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+  return 1;
+#else
+  return __atomic_is_lock_free(sizeof(unsigned __int128), &memory_shards[0].stock.packed);
+#endif
+}
+
+//-------------------atom functions---------------------------------------------
+
+// fcntl record locks on two bytes, only taken at startup. INIT serializes
+// creating, migrating and setting up the file. Every live process holds a
+// read lock on ALIVE, so whoever gets a write lock on it is alone with the
+// file and must not trust a mutex left behind by a crashed machine. The
+// bytes are the ones used before the file had a header, so an older
+// drinks_bar on the same file is seen as alive.
+#define FILE_INIT_BYTE 24
+#define FILE_ALIVE_BYTE 25
+
+static int lock_file_byte(int fd, off_t offset, short type, int wait)
+{
+  struct flock byte_lock = {
+      .l_type = type,
+      .l_whence = SEEK_SET,
+      .l_start = offset,
+      .l_len = 1,
+      .l_pid = 0};
+  return fcntl(fd, wait ? F_SETLKW : F_SETLK, &byte_lock) != -1;
+}
+
+// Replay target. A record for a location the file does not have was
+// logged after a creation that never reached the disk; it is dropped.
+static void apply_logged(int location, const wareHouse *state)
+{
+  if (location == 0)
+  {
+    seq_write_begin(&warehouse_file->stock_seq);
+    *warehouse_ptr = *state;
+    seq_write_end(&warehouse_file->stock_seq);
+  }
+  else if (location > 0 && (unsigned int)location <= warehouse_file->header.location_count)
+    stock_init(&location_record(warehouse_file, location)->stock, state->carbon, state->hydrogen,
+               state->oxygen);
+}
+
+// Put the stock back to the last committed state after a lock holder died
+// halfway through a mutation. Without a log (DURABILITY_NONE) there is
+// nothing to go back to and the stock is kept as found.
+static void repair_warehouse()
+{
+  // Readers wait out an odd stock_seq; the dead holder will not end it
+  if (warehouse_file->stock_seq & 1)
+    seq_write_end(&warehouse_file->stock_seq);
+  if (wal_durability() != DURABILITY_NONE)
+    wal_replay(apply_logged);
+  fprintf(stderr, "Warehouse lock holder died, stock restored to Carbon: %llu Hydrogen: %llu "
+                  "Oxygen: %llu\n",
+          warehouse_ptr->carbon, warehouse_ptr->hydrogen, warehouse_ptr->oxygen);
+}
+
+// Function to lock the warehouse file
+int lock_warehouse()
+{
+  unsigned long long start = latency_now();
+  int rc = pthread_mutex_lock(&warehouse_file->lock);
+  unsigned long long waited = latency_now() - start;
+  if (latency_command >= 0)
+    latency_record(latency_command, LATENCY_LOCK, waited, 1);
+  metrics_count(METRIC_LOCK_WAITS, 1);
+  metrics_count(METRIC_LOCK_WAIT_NS, waited);
+  if (rc == EOWNERDEAD)
+  {
+    repair_warehouse();
+    rc = pthread_mutex_consistent(&warehouse_file->lock);
+  }
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to lock warehouse file: %s\n", strerror(rc));
+    return 0;
+  }
+  return 1;
+}
+
+// Function to unlock the warehouse file
+int unlock_warehouse()
+{
+  int rc = pthread_mutex_unlock(&warehouse_file->lock);
+  if (rc != 0)
+  {
+    fprintf(stderr, "Failed to unlock warehouse file: %s\n", strerror(rc));
+    return 0;
+  }
+  return 1;
+}
+
+static int init_file_lock(pthread_mutex_t *mutex)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int rc = pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (rc != 0)
+    fprintf(stderr, "Failed to set up warehouse lock: %s\n", strerror(rc));
+  return rc == 0;
+}
+
+//-------------------file format-------------------------------------------------
+
+// The layout written before the header existed: the stock, then the lock
+typedef struct legacyLockedFile
+{
+  wareHouse stock;
+  unsigned int lock_magic;
+  pthread_mutex_t lock;
+} legacyLockedFile;
+
+static unsigned int crc32(const void *data, size_t len)
+{
+  const unsigned char *bytes = data;
+  unsigned int crc = ~0U;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static unsigned int header_crc(const warehouseHeader *header)
+{
+  warehouseHeader copy = *header;
+  copy.header_crc = 0;
+  return crc32(&copy, sizeof(copy));
+}
+
+static unsigned int stock_crc(const warehouseFile *file)
+{
+  return crc32(file->stock.atoms, file->header.atom_types * sizeof(file->stock.atoms[0]));
+}
+
+// Constant-time validation at startup: nothing past the header is read
+static int check_header(const warehouseHeader *header, off_t size)
+{
+  const char *problem = NULL;
+  if (header->magic != WAREHOUSE_MAGIC)
+    problem = "not a warehouse file";
+  else if (header->version > WAREHOUSE_VERSION)
+    problem = "written by a newer drinks_bar";
+  else if (header->header_crc != header_crc(header))
+    problem = "header checksum mismatch";
+  // A grow interrupted before the header was updated leaves extra pages
+  else if (header->file_size % WAREHOUSE_PAGE_SIZE != 0 || header->file_size > (unsigned long long)size ||
+           header->file_size > WAREHOUSE_MAP_MAX)
+    problem = "truncated";
+  else if (header->atom_types < 3 || header->atom_types > WAREHOUSE_MAX_ATOMS)
+    problem = "bad atom count";
+  else if (header->location_count > LOCATION_MAX ||
+           (header->location_count > 0 &&
+            header->file_size < LOCATION_RECORD_OFFSET + header->location_count * sizeof(locationRecord)))
+    problem = "bad location count";
+
+  if (problem)
+    fprintf(stderr, "Warehouse file is corrupt: %s\n", problem);
+  return problem == NULL;
+}
+
+// Open path with FILE_INIT_BYTE locked. The file may be replaced by rename
+// while we wait for the lock, so retry until the locked file is the one
+// the path names.
+static int open_warehouse_locked(const char *path)
+{
+  while (1)
+  {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+      perror("Failed to open warehouse file");
+      return -1;
+    }
+    if (!lock_file_byte(fd, FILE_INIT_BYTE, F_WRLCK, 1))
+    {
+      perror("Failed to lock warehouse file");
+      close(fd);
+      return -1;
+    }
+
+    struct stat opened, named;
+    if (fstat(fd, &opened) == 0 && stat(path, &named) == 0 && opened.st_ino == named.st_ino &&
+        opened.st_dev == named.st_dev)
+      return fd;
+    close(fd);
+  }
+}
+
+// Page 0 of a fresh version 1 file holding stock
+static void format_page(warehouseFile *page, const wareHouse *stock)
+{
+  memset(page, 0, WAREHOUSE_PAGE_SIZE);
+  page->header.magic = WAREHOUSE_MAGIC;
+  page->header.version = WAREHOUSE_VERSION;
+  page->header.file_size = WAREHOUSE_PAGE_SIZE;
+  page->header.atom_types = 3;
+  page->stock.current = *stock;
+  page->header.stock_crc = stock_crc(page);
+  page->header.header_crc = header_crc(&page->header);
+}
+
+// Write size bytes of image next to path and rename it over path, so a
+// crash leaves either the old file or the complete new one. Returns the
+// new descriptor with FILE_INIT_BYTE locked, or -1.
+static int replace_file(const char *path, const void *image, size_t size)
+{
+  size_t len = strlen(path);
+  char *temp_path = malloc(len + sizeof(".new"));
+  if (!temp_path)
+    return -1;
+  memcpy(temp_path, path, len);
+  memcpy(temp_path + len, ".new", sizeof(".new"));
+
+  int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1 || !lock_file_byte(fd, FILE_INIT_BYTE, F_WRLCK, 1) ||
+      pwrite(fd, image, size, 0) != (ssize_t)size || fsync(fd) == -1 ||
+      rename(temp_path, path) == -1)
+  {
+    perror("Failed to write warehouse file");
+    if (fd != -1)
+    {
+      close(fd);
+      unlink(temp_path);
+    }
+    fd = -1;
+  }
+  free(temp_path);
+  return fd;
+}
+
+static int create_warehouse_file(const char *path, const wareHouse *stock)
+{
+  warehouseFile *page = malloc(WAREHOUSE_PAGE_SIZE);
+  if (!page)
+    return -1;
+  format_page(page, stock);
+  int fd = replace_file(path, page, WAREHOUSE_PAGE_SIZE);
+  free(page);
+  return fd;
+}
+
+// Bring the file at warehouse_fd to the current format, map it and make
+// sure the mutex in it is usable. Caller holds FILE_INIT_BYTE. Returns 0
+// on error.
+static int map_warehouse_file(const char *path, const wareHouse *initial)
+{
+  struct stat st;
+  if (fstat(warehouse_fd, &st) == -1)
+  {
+    perror("Failed to stat warehouse file");
+    return 0;
+  }
+
+  if (st.st_size < WAREHOUSE_PAGE_SIZE)
+  {
+    wareHouse stock = *initial;
+    if (st.st_size == sizeof(wareHouse) || st.st_size == sizeof(legacyLockedFile))
+    {
+      if (!lock_file_byte(warehouse_fd, FILE_ALIVE_BYTE, F_WRLCK, 0))
+      {
+        fprintf(stderr, "Warehouse file is in use by an older drinks_bar, cannot migrate it\n");
+        return 0;
+      }
+      if (pread(warehouse_fd, &stock, sizeof(stock), 0) != sizeof(stock))
+      {
+        perror("Failed to read warehouse file");
+        return 0;
+      }
+      printf("Migrating warehouse file %s to version %d\n", path, WAREHOUSE_VERSION);
+    }
+    else if (st.st_size != 0)
+    {
+      fprintf(stderr, "Warehouse file has incorrect size\n");
+      return 0;
+    }
+
+    int fd = create_warehouse_file(path, &stock);
+    if (fd == -1)
+      return 0;
+    close(warehouse_fd);
+    warehouse_fd = fd;
+    st.st_size = WAREHOUSE_PAGE_SIZE;
+  }
+
+  warehouse_file = mmap(NULL, WAREHOUSE_MAP_MAX, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        warehouse_fd, 0);
+  if (warehouse_file == MAP_FAILED)
+  {
+    perror("Failed to map warehouse file to memory");
+    warehouse_file = NULL;
+    return 0;
+  }
+  if (!check_header(&warehouse_file->header, st.st_size))
+    return 0;
+
+  // Alone with the file: a lock word found here belongs to a process that
+  // is gone, maybe with the whole machine, and nobody would ever report its
+  // death
+  int alone = lock_file_byte(warehouse_fd, FILE_ALIVE_BYTE, F_WRLCK, 0);
+  if (alone || warehouse_file->lock_magic != WAREHOUSE_LOCK_MAGIC)
+  {
+    if (!init_file_lock(&warehouse_file->lock))
+      return 0;
+    warehouse_file->lock_magic = WAREHOUSE_LOCK_MAGIC;
+    if (warehouse_file->stock_seq & 1)
+      warehouse_file->stock_seq++;
+  }
+  if (!lock_file_byte(warehouse_fd, FILE_ALIVE_BYTE, F_RDLCK, 1))
+  {
+    perror("Failed to lock warehouse file");
+    return 0;
+  }
+  warehouse_ptr = &warehouse_file->stock.current;
+  return 1;
+}
+
+static unsigned long long round_to_pages(unsigned long long size)
+{
+  return (size + WAREHOUSE_PAGE_SIZE - 1) / WAREHOUSE_PAGE_SIZE * WAREHOUSE_PAGE_SIZE;
+}
+
+// Caller holds the warehouse lock
+static int grow_file_locked(unsigned long long size)
+{
+  size = round_to_pages(size);
+  warehouseHeader *header = &warehouse_file->header;
+  if (size > WAREHOUSE_MAP_MAX)
+    return 0;
+  if (size <= header->file_size)
+    return 1;
+  if (ftruncate(warehouse_fd, size) == -1)
+  {
+    perror("Failed to grow warehouse file");
+    return 0;
+  }
+  header->file_size = size;
+  header->header_crc = header_crc(header);
+  return 1;
+}
+
+int warehouse_file_grow(unsigned long long size)
+{
+  if (!warehouse_file || !lock_warehouse())
+    return 0;
+  int ok = grow_file_locked(size);
+  unlock_warehouse();
+  return ok;
+}
+
+const char *durability_name(int mode)
+{
+  static const char *const names[] = {"none", "async", "periodic", "sync"};
+  return mode >= DURABILITY_NONE && mode <= DURABILITY_SYNC ? names[mode] : "unknown";
+}
+
+void warehouse_set_durability(int mode, int flush_ms, int flush_ops)
+{
+  wal_set_durability(mode, flush_ms, flush_ops);
+}
+
+// Make the mapped file durable and drop the log records it now covers.
+// In DURABILITY_ASYNC the log was never waited for, so neither is the
+// checkpoint. Caller holds the warehouse lock.
+static int checkpoint_warehouse()
+{
+  int mode = wal_durability();
+  warehouseHeader *header = &warehouse_file->header;
+  header->generation++;
+  header->stock_crc = stock_crc(warehouse_file);
+  header->header_crc = header_crc(header);
+  if (msync(warehouse_file, header->file_size, mode == DURABILITY_ASYNC ? MS_ASYNC : MS_SYNC) == -1)
+  {
+    perror("Failed to checkpoint warehouse file");
+    return 0;
+  }
+  return wal_reset(mode == DURABILITY_NONE ? NULL : warehouse_ptr);
+}
+
+// Log the mutation that left location as it is now and release the lock.
+// On a log error the mutation is undone from *before. Returns 1 once the
+// record is as durable as the mode asks for, -1 on error.
+static int commit_warehouse(int location, const wareHouse *before)
+{
+  atomStock *named = location ? &location_record(warehouse_file, location)->stock : NULL;
+  wareHouse after = named ? stock_read(named) : *warehouse_ptr;
+  const long long change[3] = {after.carbon - before->carbon, after.hydrogen - before->hydrogen,
+                               after.oxygen - before->oxygen};
+
+  // Under the lock, so backups see changes in the order they happened
+  if (wal_durability() == DURABILITY_NONE)
+  {
+    if (replica_publishing)
+      replica_publish(location_name(location), change);
+    unlock_warehouse();
+    return 1;
+  }
+
+  unsigned long long seq = wal_append(location, &after);
+  if (seq == 0 && named)
+    stock_init(named, before->carbon, before->hydrogen, before->oxygen);
+  else if (seq == 0)
+  {
+    seq_write_begin(&warehouse_file->stock_seq);
+    *warehouse_ptr = *before;
+    seq_write_end(&warehouse_file->stock_seq);
+  }
+  else if (replica_publishing)
+    replica_publish(location_name(location), change);
+  unlock_warehouse();
+  unsigned long long start = latency_now();
+  if (seq == 0 || !wal_commit(seq))
+    return -1;
+  latency_stage(LATENCY_SYNC, start);
+
+  if (wal_claim_checkpoint() && lock_warehouse())
+  {
+    start = latency_now();
+    checkpoint_warehouse();
+    latency_stage(LATENCY_SYNC, start);
+    unlock_warehouse();
+  }
+  return 1;
+}
+
+// Function to initialize warehouse file and memory mapping
+int init_warehouse_file(const char *file_path, int carbon, int hydrogen, int oxygen)
+{
+  free(warehouse_file_path);
+  warehouse_file_path = strdup(file_path);
+
+  // Stock for a file that does not exist yet
+  wareHouse initial_warehouse = {
+      .carbon = (carbon > 0) ? carbon : 0,
+      .hydrogen = (hydrogen > 0) ? hydrogen : 0,
+      .oxygen = (oxygen > 0) ? oxygen : 0};
+
+  warehouse_fd = open_warehouse_locked(file_path);
+  if (warehouse_fd == -1)
+    return 0;
+  int mapped = map_warehouse_file(file_path, &initial_warehouse);
+  lock_file_byte(warehouse_fd, FILE_INIT_BYTE, F_UNLCK, 0);
+  if (!mapped || !wal_open(file_path))
+  {
+    cleanup_warehouse_file();
+    return 0;
+  }
+
+  // Mutations logged after the last checkpoint may not have reached the
+  // mapped file before a crash; the last record of each location holds
+  // where they ended up
+  if (!lock_warehouse())
+  {
+    cleanup_warehouse_file();
+    return 0;
+  }
+  if (wal_replay(apply_logged) == 0 && stock_crc(warehouse_file) != warehouse_file->header.stock_crc)
+    fprintf(stderr, "Warehouse stock changed after its last checkpoint and there is no log; "
+                    "keeping it as found\n");
+  int ok = checkpoint_warehouse();
+  unlock_warehouse();
+  return ok;
+}
+
+//-------------------named warehouses-----------------------------------------------
+
+static int valid_location_name(const char *name, size_t len)
+{
+  if (len == 0 || len >= LOCATION_NAME_MAX)
+    return 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+          c == '-'))
+      return 0;
+  }
+  return 1;
+}
+
+// FNV-1a
+static unsigned int location_hash(const char *name, size_t len)
+{
+  unsigned int hash = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+// Lock-free: a bucket is published only after its record is written.
+// Returns 0 if there is no such location.
+static int find_location(warehouseFile *store, const char *name, size_t len, unsigned int hash)
+{
+  // Until the first location exists the index pages may not either
+  if (__atomic_load_n(&store->header.location_count, __ATOMIC_ACQUIRE) == 0)
+    return 0;
+
+  unsigned int *index = location_index(store);
+  for (unsigned int probe = 0; probe < LOCATION_BUCKETS; probe++)
+  {
+    unsigned int slot =
+        __atomic_load_n(&index[(hash + probe) & (LOCATION_BUCKETS - 1)], __ATOMIC_ACQUIRE);
+    if (slot == 0)
+      return 0;
+    const char *stored = location_record(store, slot)->name;
+    if (memcmp(stored, name, len) == 0 && stored[len] == '\0')
+      return slot;
+  }
+  return 0;
+}
+
+// Caller holds the warehouse lock, or location_mutex without a save file
+static int add_location(const char *name, size_t len, unsigned int hash)
+{
+  if (!warehouse_file && !memory_locations)
+  {
+    // Reserve the whole layout; pages are only backed once touched
+    void *store = mmap(NULL, WAREHOUSE_MAP_MAX, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (store == MAP_FAILED)
+    {
+      perror("Failed to map warehouses");
+      return -1;
+    }
+    __atomic_store_n(&memory_locations, store, __ATOMIC_RELEASE);
+  }
+
+  // Someone may have created it while we waited for the lock
+  warehouseFile *store = location_store();
+  int found = find_location(store, name, len, hash);
+  if (found)
+    return found;
+
+  warehouseHeader *header = &store->header;
+  unsigned int count = header->location_count;
+  if (count == LOCATION_MAX)
+  {
+    fprintf(stderr, "Too many warehouses, cannot add %.*s\n", (int)len, name);
+    return -1;
+  }
+  if (warehouse_file && !grow_file_locked(LOCATION_RECORD_OFFSET + (count + 1) * sizeof(locationRecord)))
+    return -1;
+
+  locationRecord *record = location_record(store, count + 1);
+  memset(record->name, 0, sizeof(record->name));
+  memcpy(record->name, name, len);
+  stock_init(&record->stock, 0, 0, 0);
+
+  unsigned int *index = location_index(store);
+  unsigned int bucket = hash;
+  while (index[bucket & (LOCATION_BUCKETS - 1)] != 0)
+    bucket++;
+  __atomic_store_n(&index[bucket & (LOCATION_BUCKETS - 1)], count + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->location_count, count + 1, __ATOMIC_RELEASE);
+
+  // Log records name the location by number, so it has to be on disk
+  // before any of them
+  if (warehouse_file)
+  {
+    header->header_crc = header_crc(header);
+    if (wal_durability() != DURABILITY_NONE && msync(store, header->file_size, MS_SYNC) == -1)
+      perror("Failed to save new warehouse");
+  }
+  return count + 1;
+}
+
+int warehouse_location(const char *name, size_t len)
+{
+  if (len == 7 && memcmp(name, "default", 7) == 0)
+    return 0;
+  if (!valid_location_name(name, len))
+    return -1;
+
+  unsigned int hash = location_hash(name, len);
+  warehouseFile *store = location_store();
+  int location = store ? find_location(store, name, len, hash) : 0;
+  if (location)
+    return location;
+
+  if (warehouse_file)
+  {
+    if (!lock_warehouse())
+      return -1;
+    location = add_location(name, len, hash);
+    unlock_warehouse();
+  }
+  else
+  {
+    pthread_mutex_lock(&location_mutex);
+    location = add_location(name, len, hash);
+    pthread_mutex_unlock(&location_mutex);
+  }
+  return location;
+}
+
+void warehouse_use(int location)
+{
+  current_location = location;
+}
+
+// Named warehouses are not sharded; in the file they follow the same
+// lock-log-commit path as the default one
+static int location_add(int location, int atom, unsigned long long quantity)
+{
+  atomStock *stock = &location_record(location_store(), location)->stock;
+  if (!warehouse_ptr)
+    return stock_add(stock, atom, quantity);
+
+  if (!lock_warehouse())
+    return -1;
+  wareHouse before = stock_read(stock);
+  if (!stock_add(stock, atom, quantity))
+  {
+    unlock_warehouse();
+    return 0;
+  }
+  return commit_warehouse(location, &before);
+}
+
+static int location_take(int location, unsigned long long carbon, unsigned long long hydrogen,
+                         unsigned long long oxygen)
+{
+  atomStock *stock = &location_record(location_store(), location)->stock;
+  if (!warehouse_ptr)
+    return stock_take(stock, carbon, hydrogen, oxygen);
+
+  if (!lock_warehouse())
+    return -1;
+  wareHouse before = stock_read(stock);
+  if (!stock_take(stock, carbon, hydrogen, oxygen))
+  {
+    unlock_warehouse();
+    return 0;
+  }
+  return commit_warehouse(location, &before);
+}
+
+//-------------------snapshots-----------------------------------------------------
+
+// Child side: the image is private to this process now, whatever the
+// parent does next
+static void write_snapshot(const char *path, const void *image, size_t size)
+{
+  int fd = replace_file(path, image, size);
+  if (fd == -1)
+    _exit(1);
+  close(fd);
+  const warehouseFile *file = image;
+  printf("Snapshot written to %s (Carbon: %llu Hydrogen: %llu Oxygen: %llu, log offset %llu)\n",
+         path, file->stock.current.carbon, file->stock.current.hydrogen,
+         file->stock.current.oxygen, file->header.snapshot_log_offset);
+  fflush(stdout);
+  _exit(0);
+}
+
+pid_t warehouse_snapshot(const char *path, double *pause_us)
+{
+  struct timespec start, end;
+  void *image = NULL;
+  size_t size = WAREHOUSE_PAGE_SIZE;
+  pid_t child;
+
+  // Whatever sits in stdio buffers would otherwise be printed twice
+  fflush(stdout);
+  fflush(stderr);
+
+  if (warehouse_ptr)
+  {
+    // The mapping is shared with the child, so it cannot stand for a point
+    // in time: copy the used part of the file under the lock, then fork
+    image = malloc(WAREHOUSE_MAP_MAX);
+    if (!image)
+      return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!lock_warehouse())
+    {
+      free(image);
+      return -1;
+    }
+    size = warehouse_file->header.file_size;
+    memcpy(image, warehouse_file, size);
+    unsigned long long log_offset = wal_position();
+    unlock_warehouse();
+    child = fork();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // The copy is a file nobody has open yet: no lock, stock as of now
+    if (child == 0)
+    {
+      warehouseFile *copy = image;
+      copy->lock_magic = 0;
+      memset(&copy->lock, 0, sizeof(copy->lock));
+      copy->stock_seq = 0;
+      copy->header.snapshot_log_offset = log_offset;
+      copy->header.stock_crc = stock_crc(copy);
+      copy->header.header_crc = header_crc(&copy->header);
+      write_snapshot(path, image, size);
+    }
+  }
+  else
+  {
+    // The shards are private memory, so the fork itself is the snapshot.
+    // Holding steal_mutex keeps stock in transit between shards out of it,
+    // location_mutex a half-created warehouse.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&location_mutex);
+    pthread_mutex_lock(&steal_mutex);
+    child = fork();
+    if (child != 0)
+    {
+      pthread_mutex_unlock(&steal_mutex);
+      pthread_mutex_unlock(&location_mutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (child == 0)
+    {
+      // Named warehouses keep their pages behind page 0
+      warehouseFile *store = memory_locations;
+      unsigned int count = store ? store->header.location_count : 0;
+      if (count > 0)
+        size = round_to_pages(LOCATION_RECORD_OFFSET + count * sizeof(locationRecord));
+      warehouseFile *copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (copy == MAP_FAILED)
+        _exit(1);
+      if (count > 0)
+        memcpy(copy, store, size);
+      current_location = 0;
+      wareHouse total = warehouse_read();
+      format_page(copy, &total);
+      copy->header.file_size = size;
+      copy->header.location_count = count;
+      copy->header.header_crc = header_crc(&copy->header);
+      write_snapshot(path, copy, size);
+    }
+  }
+
+  free(image);
+  if (child < 0)
+    perror("Failed to fork snapshot");
+  *pause_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+  return child;
+}
+
+void warehouse_init_memory(int carbon, int hydrogen, int oxygen, int shards)
+{
+  shard_count = shards < 1 ? 1 : (shards > MAX_SHARDS ? MAX_SHARDS : shards);
+  for (int i = 0; i < shard_count; i++)
+    stock_init(&memory_shards[i].stock, 0, 0, 0);
+  stock_init(&memory_shards[0].stock, (carbon > 0) ? carbon : 0,
+             (hydrogen > 0) ? hydrogen : 0, (oxygen > 0) ? oxygen : 0);
+  if (memory_locations)
+  {
+    munmap(memory_locations, WAREHOUSE_MAP_MAX);
+    memory_locations = NULL;
+  }
+}
+
+void warehouse_bind_shard(int index)
+{
+  local_shard = index;
+}
+
+static int current_shard()
+{
+  if (local_shard >= 0)
+    return local_shard % shard_count;
+  // Threads that never bound a shard use the one of the core they run on
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % shard_count;
+}
+
+// Every change of a shard's stock is bracketed by these. Several threads
+// may change one shard at once, so they count rather than flip a seqlock.
+static void shard_write_begin(stockShard *shard)
+{
+  __atomic_fetch_add(&shard->writes_begun, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shard_write_end(stockShard *shard)
+{
+  __atomic_fetch_add(&shard->writes_done, 1, __ATOMIC_RELEASE);
+}
+
+// A 16-byte load is a locked CAS, which would take the shard's line away
+// from its owner on every read. Instead the two halves are read with plain
+// loads and kept if no change began after the last one that was done
+// before them. A shard that never stays still falls back to the CAS.
+typedef unsigned long long stockHalf __attribute__((may_alias));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define STOCK_LOW_HALF 0
+#else
+#define STOCK_LOW_HALF 1
+#endif
+
+static wareHouse shard_read(stockShard *shard)
+{
+  const stockHalf *half = (const stockHalf *)&shard->stock.packed;
+  for (int tries = 0; tries < SEQLOCK_TRIES; tries++)
+  {
+    unsigned long long done = __atomic_load_n(&shard->writes_done, __ATOMIC_ACQUIRE);
+    unsigned long long low = __atomic_load_n(&half[STOCK_LOW_HALF], __ATOMIC_RELAXED);
+    unsigned long long high = __atomic_load_n(&half[1 - STOCK_LOW_HALF], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shard->writes_begun, __ATOMIC_RELAXED) == done)
+    {
+      unsigned __int128 packed = ((unsigned __int128)high << 64) | low;
+      wareHouse snapshot = {STOCK_FIELD(packed, 0), STOCK_FIELD(packed, 1), STOCK_FIELD(packed, 2)};
+      return snapshot;
+    }
+  }
+  return stock_read(&shard->stock);
+}
+
+// Put atoms into the local shard, spilling over to the next ones if full
+static int shard_put(int local, int atom, unsigned long long quantity)
+{
+  for (int i = 0; i < shard_count; i++)
+  {
+    stockShard *shard = &memory_shards[(local + i) % shard_count];
+    shard_write_begin(shard);
+    int added = stock_add(&shard->stock, atom, quantity);
+    shard_write_end(shard);
+    if (added)
+      return 1;
+  }
+  return 0;
+}
+
+// Slow path of a sharded delivery: the local lease is short, so collect
+// the missing atoms from the other shards. The need is only refused when
+// all shards together cannot cover it.
+static int shard_take_slow(int local, const unsigned long long need[3])
+{
+  unsigned long long held[3] = {0, 0, 0};
+  unsigned long long got[3];
+
+  pthread_mutex_lock(&steal_mutex);
+  seq_write_begin(&shard_seq);
+
+  for (int i = 0; i < shard_count; i++)
+  {
+    int shard = (local + i) % shard_count;
+    unsigned long long want[3];
+    for (int a = 0; a < 3; a++)
+    {
+      want[a] = need[a] - held[a];
+      // Refill the local lease beyond this request so the next ones
+      // stay on the fast path
+      if (shard != local && want[a] > 0)
+        want[a] *= LEASE_REFILL_FACTOR;
+    }
+    shard_write_begin(&memory_shards[shard]);
+    int taken = stock_take_upto(&memory_shards[shard].stock, want, got);
+    shard_write_end(&memory_shards[shard]);
+    if (taken)
+    {
+      for (int a = 0; a < 3; a++)
+        held[a] += got[a];
+    }
+    if (held[0] >= need[0] && held[1] >= need[1] && held[2] >= need[2])
+      break;
+  }
+
+  int ok = held[0] >= need[0] && held[1] >= need[1] && held[2] >= need[2];
+  if (ok)
+  {
+    for (int a = 0; a < 3; a++)
+      held[a] -= need[a];
+  }
+
+  // Whatever is left over becomes the local lease (or goes back if short)
+  for (int a = 0; a < 3; a++)
+  {
+    if (held[a] > 0)
+      shard_put(local, a + 1, held[a]);
+  }
+
+  seq_write_end(&shard_seq);
+  pthread_mutex_unlock(&steal_mutex);
+  return ok;
+}
+
+static int add_stock(int atom, unsigned long long quantity)
+{
+  if (current_location > 0)
+    return location_add(current_location, atom, quantity);
+  if (!warehouse_ptr)
+    return shard_put(current_shard(), atom, quantity);
+
+  if (!lock_warehouse())
+    return -1;
+
+  unsigned long long *counter = atom == 1 ? &warehouse_ptr->carbon
+                                : atom == 2 ? &warehouse_ptr->hydrogen
+                                : atom == 3 ? &warehouse_ptr->oxygen
+                                            : NULL;
+  // The parser takes any u64, so two big ADDs would wrap the counter
+  if (counter && *counter > ULLONG_MAX - quantity)
+  {
+    unlock_warehouse();
+    return 0;
+  }
+
+  wareHouse before = *warehouse_ptr;
+  seq_write_begin(&warehouse_file->stock_seq);
+  if (counter)
+    *counter += quantity;
+  seq_write_end(&warehouse_file->stock_seq);
+
+  return commit_warehouse(0, &before);
+}
+
+static int take_stock(unsigned long long carbon, unsigned long long hydrogen,
+                      unsigned long long oxygen)
+{
+  if (current_location > 0)
+    return location_take(current_location, carbon, hydrogen, oxygen);
+  if (!warehouse_ptr)
+  {
+    int local = current_shard();
+    shard_write_begin(&memory_shards[local]);
+    int taken = stock_take(&memory_shards[local].stock, carbon, hydrogen, oxygen);
+    shard_write_end(&memory_shards[local]);
+    if (taken)
+      return 1;
+    if (shard_count == 1)
+      return 0;
+    const unsigned long long need[3] = {carbon, hydrogen, oxygen};
+    return shard_take_slow(local, need);
+  }
+
+  if (!lock_warehouse())
+    return -1;
+
+  if (warehouse_ptr->carbon < carbon || warehouse_ptr->hydrogen < hydrogen ||
+      warehouse_ptr->oxygen < oxygen)
+  {
+    unlock_warehouse();
+    return 0;
+  }
+
+  wareHouse before = *warehouse_ptr;
+  seq_write_begin(&warehouse_file->stock_seq);
+  warehouse_ptr->carbon -= carbon;
+  warehouse_ptr->hydrogen -= hydrogen;
+  warehouse_ptr->oxygen -= oxygen;
+  seq_write_end(&warehouse_file->stock_seq);
+
+  return commit_warehouse(0, &before);
+}
+
+// A raft entry carries each change as a signed amount, so a larger
+// quantity would change sign on the way. No stock can hold it anyway.
+static int raft_fits(unsigned long long carbon, unsigned long long hydrogen, unsigned long long oxygen)
+{
+  return carbon <= LLONG_MAX && hydrogen <= LLONG_MAX && oxygen <= LLONG_MAX;
+}
+
+// File mutations publish from commit_warehouse(); memory ones are lock-free
+// and only ordered here while there are backups to publish to. Backups
+// have not acked the change yet (see replica_commit). In a CRDT group it
+// is counted for gossip.
+static int add_published(int atom, unsigned long long quantity)
+{
+  int ordered = !warehouse_ptr && replica_order_lock();
+  int status = add_stock(atom, quantity);
+  if (ordered)
+  {
+    if (status > 0 && atom >= 1 && atom <= 3)
+    {
+      long long change[3] = {0, 0, 0};
+      change[atom - 1] = quantity;
+      replica_publish(location_name(current_location), change);
+    }
+    replica_order_unlock();
+  }
+  if (crdt_running && !crdt_applying && status > 0 && current_location == 0 && atom >= 1 && atom <= 3)
+  {
+    long long change[3] = {0, 0, 0};
+    change[atom - 1] = quantity;
+    crdt_count(change);
+  }
+  return status;
+}
+
+static int take_published(unsigned long long carbon, unsigned long long hydrogen,
+                          unsigned long long oxygen)
+{
+  int ordered = !warehouse_ptr && replica_order_lock();
+  int status = take_stock(carbon, hydrogen, oxygen);
+  if (ordered)
+  {
+    if (status > 0)
+    {
+      const long long change[3] = {-(long long)carbon, -(long long)hydrogen, -(long long)oxygen};
+      replica_publish(location_name(current_location), change);
+    }
+    replica_order_unlock();
+  }
+  if (crdt_running && !crdt_applying && status > 0 && current_location == 0)
+  {
+    const long long change[3] = {-(long long)carbon, -(long long)hydrogen, -(long long)oxygen};
+    crdt_count(change);
+  }
+  return status;
+}
+
+// In a raft group a change goes through the log and is applied on the
+// raft thread
+int warehouse_add(int atom, unsigned long long quantity)
+{
+  if (raft_running && !raft_applying && atom >= 1 && atom <= 3)
+  {
+    if (!raft_fits(quantity, 0, 0))
+      return 0;
+    long long change[3] = {0, 0, 0};
+    change[atom - 1] = quantity;
+    return raft_submit(location_name(current_location), change);
+  }
+  return replica_commit(add_published(atom, quantity));
+}
+
+int warehouse_take(unsigned long long carbon, unsigned long long hydrogen,
+                   unsigned long long oxygen)
+{
+  if (raft_running && !raft_applying)
+  {
+    if (!raft_fits(carbon, hydrogen, oxygen))
+      return 0;
+    const long long change[3] = {-(long long)carbon, -(long long)hydrogen, -(long long)oxygen};
+    return raft_submit(location_name(current_location), change);
+  }
+  return replica_commit(take_published(carbon, hydrogen, oxygen));
+}
+
+int warehouse_add_async(int atom, unsigned long long quantity, void (*done)(int result, void *arg),
+                        void *arg)
+{
+  if (atom < 1 || atom > 3)
+    return 0;
+  if (!raft_running)
+  {
+    replica_commit_async(add_published(atom, quantity), done, arg);
+    return 1;
+  }
+  if (!raft_fits(quantity, 0, 0))
+  {
+    done(0, arg);
+    return 1;
+  }
+  long long change[3] = {0, 0, 0};
+  change[atom - 1] = quantity;
+  return raft_submit_async(location_name(current_location), change, done, arg);
+}
+
+int warehouse_take_async(unsigned long long carbon, unsigned long long hydrogen,
+                         unsigned long long oxygen, void (*done)(int result, void *arg), void *arg)
+{
+  if (!raft_running)
+  {
+    replica_commit_async(take_published(carbon, hydrogen, oxygen), done, arg);
+    return 1;
+  }
+  if (!raft_fits(carbon, hydrogen, oxygen))
+  {
+    done(0, arg);
+    return 1;
+  }
+  const long long change[3] = {-(long long)carbon, -(long long)hydrogen, -(long long)oxygen};
+  return raft_submit_async(location_name(current_location), change, done, arg);
+}
+
+int warehouse_file_read(const warehouseFile *file, wareHouse *stock)
+{
+  for (int tries = 0; tries < SEQLOCK_TRIES; tries++)
+  {
+    unsigned long long before = __atomic_load_n(&file->stock_seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      sched_yield();
+      continue;
+    }
+    stock->carbon = __atomic_load_n(&file->stock.current.carbon, __ATOMIC_RELAXED);
+    stock->hydrogen = __atomic_load_n(&file->stock.current.hydrogen, __ATOMIC_RELAXED);
+    stock->oxygen = __atomic_load_n(&file->stock.current.oxygen, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&file->stock_seq, __ATOMIC_RELAXED) == before)
+      return 1;
+  }
+  return 0;
+}
+
+// Global view of the memory warehouse: the sum of every shard. Fails if a
+// steal ran meanwhile; plain adds and takes do not hold it back.
+static int shards_read(wareHouse *total)
+{
+  unsigned long long before = __atomic_load_n(&shard_seq, __ATOMIC_ACQUIRE);
+  if (before & 1)
+    return 0;
+  *total = (wareHouse){0, 0, 0};
+  for (int i = 0; i < shard_count; i++)
+  {
+    wareHouse part = shard_read(&memory_shards[i]);
+    total->carbon += part.carbon;
+    total->hydrogen += part.hydrogen;
+    total->oxygen += part.oxygen;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&shard_seq, __ATOMIC_RELAXED) == before;
+}
+
+wareHouse warehouse_read()
+{
+  if (current_location > 0)
+    return stock_read(&location_record(location_store(), current_location)->stock);
+
+  wareHouse stock = {0, 0, 0};
+  if (!warehouse_ptr)
+  {
+    for (int tries = 0; tries < SEQLOCK_TRIES; tries++)
+    {
+      if (shards_read(&stock))
+        return stock;
+      sched_yield();
+    }
+    // Steals keep coming; wait for the one in progress instead
+    pthread_mutex_lock(&steal_mutex);
+    shards_read(&stock);
+    pthread_mutex_unlock(&steal_mutex);
+    return stock;
+  }
+
+  if (warehouse_file_read(warehouse_file, &stock))
+    return stock;
+  // A holder that died halfway left stock_seq odd; locking repairs it
+  if (lock_warehouse())
+  {
+    stock = *warehouse_ptr;
+    unlock_warehouse();
+  }
+  return stock;
+}
+
+void warehouse_visit(void (*visit)(const char *location, wareHouse stock, void *arg), void *arg)
+{
+  if (warehouse_ptr && !lock_warehouse())
+    return;
+  int saved = current_location;
+  current_location = 0;
+  visit("", warehouse_read(), arg);
+  current_location = saved;
+
+  warehouseFile *store = location_store();
+  unsigned int count = store ? __atomic_load_n(&store->header.location_count, __ATOMIC_ACQUIRE) : 0;
+  for (unsigned int i = 1; i <= count; i++)
+  {
+    locationRecord *record = location_record(store, i);
+    visit(record->name, stock_read(&record->stock), arg);
+  }
+  if (warehouse_ptr)
+    unlock_warehouse();
+}
+
+void addAtom(int atom, unsigned long long quantity)
+{
+  if (atom < 1 || atom > 3)
+  {
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Unknown atom type", NULL, 0, 0, 0, 0);
+    return;
+  }
+  if (warehouse_add(atom, quantity) == 0)
+  {
+    metrics_count(METRIC_WAREHOUSE_FULL, 1);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "Warehouse is full, atoms were not added", NULL, 0, 0, 0, 0);
+  }
+}
+
+void printAtoms()
+{
+  if (log_level() > LOG_LEVEL_DEBUG)
+    return;
+  wareHouse current = warehouse_read();
+  log_event(LOG_LEVEL_DEBUG, LOG_STOCK, NULL, NULL, 0, current.carbon, current.hydrogen, current.oxygen);
+}
+
+//------------------------------------------------------------------------
+
+// ---------------molecule deliver functions-----------------------------
+
+// Take count times the recipe's atoms, all at once or not at all
+static int take_recipe(const recipe *r, unsigned long long count)
+{
+  unsigned long long need[3];
+
+  // A product that overflows is more than any warehouse can hold
+  int status = recipe_scale(r, count, need) ? warehouse_take(need[0], need[1], need[2]) : 0;
+  if (status == 0)
+  {
+    metrics_count(METRIC_NOT_ENOUGH, 1);
+    log_event(LOG_LEVEL_DEBUG, LOG_NOT_ENOUGH, r->name, NULL, 0, 0, 0, 0);
+  }
+  return status > 0;
+}
+
+int deliverMolecules(int molecule, unsigned long long numOfMolecules)
+{
+  if (molecule < 0 || molecule >= MOLECULE_COUNT)
+  {
+    metrics_count(METRIC_UNKNOWN_MOLECULE, 1);
+    log_event(LOG_LEVEL_WARN, LOG_MESSAGE, "you tried to deliver unexisting molecule", NULL, 0, 0, 0, 0);
+    return 0;
+  }
+  return take_recipe(&molecule_recipes[molecule], numOfMolecules);
+}
+
+//--------------------------------------------------------------------------
+// --------------------------gen drinks
+// -------------------------------------------------
+
+int genDrinks(int drink)
+{
+  if (drink < 0 || drink >= DRINK_COUNT)
+    return 0;
+  return take_recipe(&drink_recipes[drink], 1);
+}
+
+unsigned long long howManyDrinks(int drink)
+{
+  if (drink < 0 || drink >= DRINK_COUNT)
+    return 0;
+
+  wareHouse current = warehouse_read();
+  const unsigned long long have[3] = {current.carbon, current.hydrogen, current.oxygen};
+  const recipe *r = &drink_recipes[drink];
+
+  // The scarcest atom relative to what one drink takes
+  unsigned long long minimum = ~0ULL;
+  for (int i = 0; i < 3; i++)
+  {
+    if (r->atoms[i] && have[i] / r->atoms[i] < minimum)
+      minimum = have[i] / r->atoms[i];
+  }
+
+  log_event(LOG_LEVEL_INFO, LOG_DRINK_COUNT, r->name, NULL, 0, minimum, 0, 0);
+  return minimum;
+}
@@ -0,0 +1,247 @@
+#ifndef WAREHOUSE_H
+#define WAREHOUSE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Atom warehouse shared by all reactor threads. Either file-backed
+// (mmap'd, shared between processes under a robust mutex kept in the file,
+// made durable through a write-ahead log, see wal.h) or in-memory
+// (lock-free, see atomStock below).
+
+typedef struct wareHouse
+{
+  unsigned long long carbon;
+  unsigned long long hydrogen;
+  unsigned long long oxygen;
+} wareHouse;
+
+// -------------------lock-free in-memory stock---------------------------------
+// The three counters are packed into one 128-bit word, 42 bits each, so a
+// delivery checks and deducts every atom it needs with a single CAS and a
+// failed delivery never leaves a partial deduction behind.
+
+#define STOCK_BITS 42
+#define STOCK_MAX ((1ULL << STOCK_BITS) - 1)
+
+typedef struct atomStock
+{
+  _Alignas(16) unsigned __int128 packed;
+} atomStock;
+
+void stock_init(atomStock *stock, unsigned long long carbon,
+                unsigned long long hydrogen, unsigned long long oxygen);
+
+// atom is 1 = carbon, 2 = hydrogen, 3 = oxygen. Returns 0 if the counter
+// would exceed STOCK_MAX.
+int stock_add(atomStock *stock, int atom, unsigned long long quantity);
+
+// Reserve all three amounts at once. Returns 0 if any is short.
+int stock_take(atomStock *stock, unsigned long long carbon,
+               unsigned long long hydrogen, unsigned long long oxygen);
+
+// Take up to want[] of each atom, whatever is there. Returns 0 if nothing
+// at all was taken.
+int stock_take_upto(atomStock *stock, const unsigned long long want[3],
+                    unsigned long long got[3]);
+
+wareHouse stock_read(atomStock *stock);
+
+int stock_is_lock_free();
+
+// -------------------warehouse----------------------------------------------
+
+// Layout of the save file (version 1). Page 0 holds a checksummed header,
+// the lock and the stock; the file grows a page at a time from there
+// (warehouse_file_grow) without moving anything already in it.
+//
+// Every thread of every process mapping the file takes the same
+// process-shared robust mutex; uncontended, that is a user-space CAS with
+// no syscall. If a holder dies, the next locker gets EOWNERDEAD and rolls
+// the stock back to the last logged state.
+//
+// Reads of the stock take no lock. Lock holders make stock_seq odd while
+// they change the stock and even again after, so a reader in any thread
+// or process mapping the file can tell a copy taken halfway through a
+// delivery and take it again (see warehouse_file_read).
+//
+// Files from before the header (the 24-byte raw wareHouse, and that plus
+// the lock) are migrated on open into a new file that replaces the old
+// one by rename.
+#define WAREHOUSE_MAGIC 0x5241425345524844ULL // "DHRESBAR"
+#define WAREHOUSE_VERSION 1
+#define WAREHOUSE_PAGE_SIZE 4096
+#define WAREHOUSE_MAP_MAX (1 << 20) // address space reserved for growth
+#define WAREHOUSE_MAX_ATOMS 16
+#define WAREHOUSE_LOCK_MAGIC 0x4b434f4cU // "LOCK"
+
+typedef struct warehouseHeader
+{
+  unsigned long long magic;       // WAREHOUSE_MAGIC
+  unsigned int version;           // WAREHOUSE_VERSION
+  unsigned int header_crc;        // CRC-32 of this header, taken as 0
+  unsigned long long file_size;   // bytes, a whole number of pages
+  unsigned long long generation;  // checkpoints written so far
+  unsigned int atom_types;        // stock slots in use: carbon, hydrogen, oxygen
+  unsigned int stock_crc;         // CRC-32 of the stock at that checkpoint
+  unsigned long long snapshot_log_offset; // snapshots only: log bytes the stock includes
+  unsigned int location_count;    // named warehouses in the location pages
+  unsigned int reserved_pad;
+  unsigned char reserved[200];    // zero; for fields of later versions
+} warehouseHeader;
+
+typedef struct warehouseFile
+{
+  warehouseHeader header;
+  unsigned int lock_magic; // WAREHOUSE_LOCK_MAGIC once lock is set up
+  pthread_mutex_t lock;
+  union
+  {
+    wareHouse current;                           // the atom_types in use
+    unsigned long long atoms[WAREHOUSE_MAX_ATOMS];
+  } stock __attribute__((aligned(64)));
+  unsigned long long stock_seq; // odd while a lock holder changes the stock
+} warehouseFile;
+
+_Static_assert(sizeof(warehouseHeader) == 256, "warehouse header must stay 256 bytes");
+_Static_assert(sizeof(warehouseFile) <= WAREHOUSE_PAGE_SIZE, "page 0 overflows");
+
+// Named warehouses ("locations"), each a 64-byte record in the pages after
+// page 0: first a hash index of LOCATION_BUCKETS slots (record number + 1,
+// 0 = empty, linear probing), then the records, added a page at a time.
+// Lookups read the index without a lock; creating a location takes it.
+// In memory the same layout lives in an anonymous mapping, so snapshots
+// carry the locations along.
+#define LOCATION_NAME_MAX 48
+#define LOCATION_MAX 8192
+#define LOCATION_BUCKETS 16384 // power of two, twice LOCATION_MAX
+#define LOCATION_INDEX_OFFSET WAREHOUSE_PAGE_SIZE
+#define LOCATION_RECORD_OFFSET (LOCATION_INDEX_OFFSET + LOCATION_BUCKETS * sizeof(unsigned int))
+
+typedef struct locationRecord
+{
+  atomStock stock;              // updated with the lock-free stock_*()
+  char name[LOCATION_NAME_MAX]; // NUL-padded
+} locationRecord;
+
+_Static_assert(sizeof(locationRecord) == 64, "location records are 64 bytes");
+_Static_assert(LOCATION_RECORD_OFFSET % WAREHOUSE_PAGE_SIZE == 0, "records start on a page");
+_Static_assert(LOCATION_RECORD_OFFSET + LOCATION_MAX * sizeof(locationRecord) <= WAREHOUSE_MAP_MAX,
+               "locations outgrow the mapping");
+
+extern int warehouse_fd;
+extern wareHouse *warehouse_ptr; // &stock.current of the mapped file
+
+// In memory the stock is sharded, one shard per reactor thread. ADDs land
+// in the caller's shard and deliveries draw on it first; a short shard
+// collects the rest from the others (and refills its lease while at it).
+#define MAX_SHARDS 64
+#define LEASE_REFILL_FACTOR 2
+
+// How hard the file-backed warehouse works to keep mutations across a
+// crash. A crash of drinks_bar alone never loses anything in any mode: the
+// mapping and the log live in the page cache. What differs is what a
+// crash of the machine (or power loss) can take with it:
+//   NONE      no log, nothing flushed; whatever the kernel has not
+//             written back of the mapped file yet (vm.dirty_expire_centisecs,
+//             30 s by default)
+//   ASYNC     logged, never waited for; the same writeback window
+//   PERIODIC  logged, a background thread fdatasyncs every flush_ms or
+//             every flush_ops records, whichever comes first; at most that
+//             much acknowledged work
+//   SYNC      logged and group-committed before the reply; nothing that
+//             was acknowledged
+enum durabilityMode
+{
+  DURABILITY_NONE,
+  DURABILITY_ASYNC,
+  DURABILITY_PERIODIC,
+  DURABILITY_SYNC
+};
+
+#define DEFAULT_FLUSH_MS 100
+#define DEFAULT_FLUSH_OPS 1000
+
+// Before init_warehouse_file(); the default is DURABILITY_SYNC
+void warehouse_set_durability(int mode, int flush_ms, int flush_ops);
+const char *durability_name(int mode);
+
+void warehouse_init_memory(int carbon, int hydrogen, int oxygen, int shards);
+void warehouse_bind_shard(int index);
+int init_warehouse_file(const char *file_path, int carbon, int hydrogen, int oxygen);
+void cleanup_warehouse_file();
+
+// The save file's robust mutex; 0 if it could not be taken
+int lock_warehouse();
+int unlock_warehouse();
+
+// Write a point-in-time copy of the warehouse to path as a version 1 save
+// file, from a forked child, replaced atomically by rename. The caller is
+// only held up for the fork (and, file-backed, for copying the file under
+// the lock); *pause_us reports how long. Returns the child's pid or -1.
+// The child prints the outcome; the caller must reap it.
+pid_t warehouse_snapshot(const char *path, double *pause_us);
+
+// Look up the warehouse called name[0..len), creating it on first use.
+// "default" is the unnamed warehouse drinks_bar always had, ID 0. Names
+// are 1 to LOCATION_NAME_MAX - 1 of [A-Za-z0-9_-]. Returns -1 for a bad
+// name or once LOCATION_MAX locations exist.
+int warehouse_location(const char *name, size_t len);
+
+// Location the calling thread's warehouse_*, addAtom, deliverMolecules,
+// genDrinks, howManyDrinks and printAtoms calls apply to; 0 = default
+void warehouse_use(int location);
+
+// Call visit for the default warehouse ("") and then each named one, with
+// no file mutation in between
+void warehouse_visit(void (*visit)(const char *location, wareHouse stock, void *arg), void *arg);
+
+// Make the save file at least size bytes (rounded up to whole pages).
+// Returns 0 on error or past WAREHOUSE_MAP_MAX.
+int warehouse_file_grow(unsigned long long size);
+
+// Returns 1 on success, 0 if the stock is short, -1 on a locking or
+// logging error
+int warehouse_take(unsigned long long carbon, unsigned long long hydrogen,
+                   unsigned long long oxygen);
+
+// The stock, without blocking the writers. A save file or a named
+// warehouse is read as of one moment (seqlock or CAS). The sharded memory
+// stock is a sum: each shard is consistent on its own and no steal moves
+// atoms between shards while they are summed, so nothing is counted twice
+// or missed in transit. Adds and takes on other shards may still land
+// between the shard reads, so the sum is not a snapshot.
+wareHouse warehouse_read();
+
+// Seqlock read of the default stock of a mapped save file, for readers
+// that map it themselves. Returns 0 if it kept changing for too long (or
+// its last writer died halfway and nobody has taken the lock since).
+int warehouse_file_read(const warehouseFile *file, wareHouse *stock);
+
+// Returns 1 on success, 0 if the counter is full, -1 on a locking or
+// logging error
+int warehouse_add(int atom, unsigned long long quantity);
+
+// In a raft group, for reactor threads: submit the change to the calling
+// thread's location and return without waiting for it to commit.
+// done(result, arg) later gets what warehouse_add()/warehouse_take() would
+// have returned (see raft_submit_async). A quantity above LLONG_MAX, which
+// no entry can carry, gets done(0, arg) right away on the calling thread.
+// Returns 0, never calling done, if this node is not the leader. Outside
+// raft the change is made at once, and done gets its result when the
+// backups have acked it (see replica_commit_async), right away without.
+int warehouse_add_async(int atom, unsigned long long quantity, void (*done)(int result, void *arg),
+                        void *arg);
+int warehouse_take_async(unsigned long long carbon, unsigned long long hydrogen,
+                         unsigned long long oxygen, void (*done)(int result, void *arg), void *arg);
+
+void addAtom(int atom, unsigned long long quantity);
+void printAtoms();
+
+// Molecule and drink IDs are from recipe.h. Both reserve every atom they
+// need at once or nothing; 0 if the stock is short.
+int deliverMolecules(int molecule, unsigned long long numOfMolecules);
+int genDrinks(int drink);
+unsigned long long howManyDrinks(int drink);
+
+#endif
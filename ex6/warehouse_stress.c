@@ -0,0 +1,1469 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "crdt.h"
+#include "edge.h"
+#include "latency.h"
+#include "log.h"
+#include "metrics.h"
+#include "raft.h"
+#include "recipe.h"
+#include "replica.h"
+#include "shm_stats.h"
+#include "wal.h"
+#include "warehouse.h"
+
+// Stress test for the lock-free in-memory stock: many threads deliver and
+// add at once, and the counters must never be oversubscribed or lose atoms.
+
+#define THREADS 8
+#define ROUNDS 200000
+
+typedef struct worker
+{
+    pthread_t thread;
+    unsigned seed;
+    int adder;
+    int sharded; // go through the sharded warehouse instead of one stock
+    int index;
+    unsigned long long taken[3];
+    unsigned long long added[3];
+    long failures;
+} worker;
+
+atomStock stock;
+wareHouse initial;
+volatile int workers_done = 0;
+volatile int violations = 0;
+
+int do_add(worker *w, int atom, unsigned long long quantity)
+{
+    if (w->sharded)
+        return warehouse_add(atom, quantity) == 1;
+    return stock_add(&stock, atom, quantity);
+}
+
+int do_take(worker *w, unsigned long long carbon, unsigned long long hydrogen,
+            unsigned long long oxygen)
+{
+    if (w->sharded)
+        return warehouse_take(carbon, hydrogen, oxygen) == 1;
+    return stock_take(&stock, carbon, hydrogen, oxygen);
+}
+
+wareHouse do_read(int sharded)
+{
+    return sharded ? warehouse_read() : stock_read(&stock);
+}
+
+void *run_worker(void *arg)
+{
+    worker *w = arg;
+    if (w->sharded)
+        warehouse_bind_shard(w->index);
+
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        if (w->adder && i % 4 == 0)
+        {
+            int atom = rand_r(&w->seed) % 3;
+            unsigned long long quantity = rand_r(&w->seed) % 5 + 1;
+            if (do_add(w, atom + 1, quantity))
+                w->added[atom] += quantity;
+            continue;
+        }
+
+        const recipe *r = &molecule_recipes[rand_r(&w->seed) % MOLECULE_COUNT];
+        unsigned long long count = rand_r(&w->seed) % 3 + 1;
+        if (do_take(w, r->atoms[0] * count, r->atoms[1] * count, r->atoms[2] * count))
+        {
+            for (int atom = 0; atom < 3; atom++)
+                w->taken[atom] += r->atoms[atom] * count;
+        }
+        else
+            w->failures++;
+    }
+    return NULL;
+}
+
+// Without adders every counter may only go down; a wrapped (negative)
+// counter would show up as a huge value
+void *run_monitor(void *arg)
+{
+    int sharded = *(int *)arg;
+    while (!workers_done)
+    {
+        wareHouse now = do_read(sharded);
+        if (now.carbon > initial.carbon || now.hydrogen > initial.hydrogen ||
+            now.oxygen > initial.oxygen)
+            violations++;
+    }
+    return NULL;
+}
+
+int run(const char *name, int with_adders, int with_monitor, int shards)
+{
+    worker workers[THREADS];
+    pthread_t monitor;
+    memset(workers, 0, sizeof(workers));
+    workers_done = 0;
+    violations = 0;
+
+    int sharded = shards > 0;
+    if (sharded)
+        warehouse_init_memory(initial.carbon, initial.hydrogen, initial.oxygen, shards);
+    else
+        stock_init(&stock, initial.carbon, initial.hydrogen, initial.oxygen);
+
+    if (with_monitor)
+        pthread_create(&monitor, NULL, run_monitor, &sharded);
+    for (int i = 0; i < THREADS; i++)
+    {
+        workers[i].seed = i * 7919 + 1;
+        workers[i].adder = with_adders && (i % 2 == 0);
+        workers[i].sharded = sharded;
+        workers[i].index = i;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(workers[i].thread, NULL);
+    workers_done = 1;
+    if (with_monitor)
+        pthread_join(monitor, NULL);
+
+    unsigned long long taken[3] = {0}, added[3] = {0};
+    long failures = 0;
+    for (int i = 0; i < THREADS; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            taken[a] += workers[i].taken[a];
+            added[a] += workers[i].added[a];
+        }
+        failures += workers[i].failures;
+    }
+
+    wareHouse final = do_read(sharded);
+    unsigned long long start[3] = {initial.carbon, initial.hydrogen, initial.oxygen};
+    unsigned long long end[3] = {final.carbon, final.hydrogen, final.oxygen};
+    int ok = violations == 0;
+    for (int a = 0; a < 3; a++)
+    {
+        // Atoms are conserved and nothing was handed out twice
+        if (start[a] + added[a] != end[a] + taken[a] || taken[a] > start[a] + added[a])
+            ok = 0;
+    }
+
+    printf("%s: %s (taken C=%llu H=%llu O=%llu, failed deliveries=%ld, left C=%llu H=%llu O=%llu)\n",
+           name, ok ? "PASS" : "FAIL", taken[0], taken[1], taken[2], failures,
+           final.carbon, final.hydrogen, final.oxygen);
+    return ok;
+}
+
+// A delivery from an empty shard must still succeed when the other shards
+// together hold enough, and fail only when they do not
+int run_spread()
+{
+    warehouse_init_memory(0, 0, 0, 4);
+    for (int shard = 1; shard < 4; shard++)
+    {
+        warehouse_bind_shard(shard);
+        warehouse_add(1, 2);  // carbon
+        warehouse_add(2, 4);  // hydrogen
+        warehouse_add(3, 2);  // oxygen
+    }
+
+    // 6 C, 12 H, 6 O in total is exactly one GLUCOSE
+    warehouse_bind_shard(0);
+    int first = warehouse_take(6, 12, 6);
+    int second = warehouse_take(0, 2, 1);
+    wareHouse left = warehouse_read();
+    int ok = first == 1 && second == 0 && left.carbon == 0 && left.hydrogen == 0 &&
+             left.oxygen == 0;
+    printf("delivery from stock spread over shards: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+#define WAL_ADDS 200
+
+void *run_logged_adds(void *arg)
+{
+    int atom = *(int *)arg % 3 + 1;
+    for (int i = 0; i < WAL_ADDS; i++)
+        warehouse_add(atom, 1);
+    return NULL;
+}
+
+// Remove a save file and its write-ahead log
+void remove_save_file(const char *path)
+{
+    char log_path[80];
+    snprintf(log_path, sizeof(log_path), "%s.wal", path);
+    unlink(path);
+    unlink(log_path);
+}
+
+// Name this process's save file for a case, clearing what a previous run
+// may have left there
+void temp_save_file(char *path, size_t size, const char *suffix)
+{
+    snprintf(path, size, "/tmp/warehouse_stress_%d.%s", (int)getpid(), suffix);
+    remove_save_file(path);
+}
+
+// File-backed warehouse: concurrent ADDs must share fdatasyncs, and a
+// checkpoint lost in a crash must come back from the log, ignoring the
+// torn record a crash mid-append leaves behind
+int run_wal()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "dat");
+
+    int ok = init_warehouse_file(path, 10, 20, 30);
+    pthread_t ids[THREADS];
+    int index[THREADS];
+    for (int i = 0; ok && i < THREADS; i++)
+    {
+        index[i] = i;
+        pthread_create(&ids[i], NULL, run_logged_adds, &index[i]);
+    }
+    for (int i = 0; ok && i < THREADS; i++)
+        pthread_join(ids[i], NULL);
+    ok = ok && warehouse_take(10, 20, 30) == 1;
+
+    unsigned long long appends = 0, syncs = 0;
+    wal_stats(&appends, &syncs);
+    wareHouse expected = warehouse_read();
+    cleanup_warehouse_file();
+
+    // Lose the checkpoint and tear the last append
+    wareHouse stale = {0, 0, 0};
+    int fd = open(path, O_WRONLY);
+    ok = ok && fd != -1 && pwrite(fd, &stale, sizeof(stale), offsetof(warehouseFile, stock)) ==
+                              sizeof(stale);
+    close(fd);
+    char log_path[80];
+    snprintf(log_path, sizeof(log_path), "%s.wal", path);
+    fd = open(log_path, O_WRONLY | O_APPEND);
+    ok = ok && fd != -1 && write(fd, &stale, sizeof(stale)) == sizeof(stale);
+    close(fd);
+
+    ok = ok && init_warehouse_file(path, 0, 0, 0);
+    wareHouse recovered = warehouse_read();
+    cleanup_warehouse_file();
+    remove_save_file(path);
+
+    // The take gave back exactly the initial stock
+    unsigned long long added[3] = {0, 0, 0};
+    for (int i = 0; i < THREADS; i++)
+        added[i % 3] += WAL_ADDS;
+    ok = ok && appends == THREADS * WAL_ADDS + 1 && syncs <= appends &&
+         expected.carbon == added[0] && expected.hydrogen == added[1] &&
+         expected.oxygen == added[2] &&
+         memcmp(&recovered, &expected, sizeof(wareHouse)) == 0;
+    printf("write-ahead log replay: %s (%llu records, %llu fdatasyncs)\n", ok ? "PASS" : "FAIL",
+           appends, syncs);
+    return ok;
+}
+
+// DURABILITY_PERIODIC must not flush on the request path, but the
+// background flusher has to get to every record within flush_ms
+int run_periodic_flush()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "dat");
+
+    unsigned long long appends_before, syncs_before, appends, syncs;
+    wal_stats(&appends_before, &syncs_before);
+    warehouse_set_durability(DURABILITY_PERIODIC, 50, 1000000);
+    int ok = init_warehouse_file(path, 0, 0, 0);
+    for (int i = 0; ok && i < 100; i++)
+        ok = warehouse_add(1, 1) == 1;
+    wal_stats(&appends, &syncs);
+    int flushed_inline = syncs != syncs_before;
+    usleep(200 * 1000);
+    wal_stats(&appends, &syncs);
+    ok = ok && !flushed_inline && syncs > syncs_before && appends == appends_before + 100;
+
+    cleanup_warehouse_file();
+    warehouse_set_durability(DURABILITY_SYNC, 0, 0);
+    remove_save_file(path);
+    printf("periodic durability flushes in the background: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+// A process that dies holding the file lock, halfway through a delivery,
+// must neither wedge the others nor leave its partial deduction behind
+int run_owner_died()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "dat");
+
+    int ok = init_warehouse_file(path, 100, 100, 100);
+    pid_t child = ok ? fork() : -1;
+    if (child == 0)
+    {
+        // Dies with the stock's seqlock odd, too
+        warehouseFile *file = (warehouseFile *)((char *)warehouse_ptr - offsetof(warehouseFile, stock));
+        if (lock_warehouse())
+        {
+            file->stock_seq++;
+            warehouse_ptr->carbon -= 6;
+        }
+        _exit(0);
+    }
+    ok = ok && child > 0 && waitpid(child, NULL, 0) == child;
+
+    // A lock-free read must not wait for the dead holder forever
+    wareHouse repaired = warehouse_read();
+    ok = ok && repaired.carbon == 100;
+    ok = ok && warehouse_add(2, 1) == 1;
+    wareHouse after = warehouse_read();
+    ok = ok && after.carbon == 100 && after.hydrogen == 101 && after.oxygen == 100;
+
+    cleanup_warehouse_file();
+    remove_save_file(path);
+    printf("lock holder dying mid-delivery: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+// An ADD that would wrap a counter of the file is refused, and neither the
+// file nor the log ever holds a wrapped value
+int run_file_overflow()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "dat");
+
+    int ok = init_warehouse_file(path, 0, 0, 0);
+    ok = ok && warehouse_add(1, ULLONG_MAX - 5) == 1 && warehouse_add(1, 10) == 0 &&
+         warehouse_add(1, ULLONG_MAX) == 0 && warehouse_add(1, 5) == 1 && warehouse_add(1, 1) == 0 &&
+         warehouse_add(2, ULLONG_MAX) == 1;
+    cleanup_warehouse_file();
+
+    ok = ok && init_warehouse_file(path, 0, 0, 0);
+    wareHouse reopened = warehouse_read();
+    ok = ok && reopened.carbon == ULLONG_MAX && reopened.hydrogen == ULLONG_MAX && reopened.oxygen == 0;
+    cleanup_warehouse_file();
+    remove_save_file(path);
+    printf("file-backed ADD near the u64 limit: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+// A 24-byte file from before the header is migrated with its stock, a
+// damaged header is refused, and the file grows in whole pages
+int run_file_format()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "dat");
+
+    wareHouse legacy = {7, 8, 9};
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    int ok = fd != -1 && write(fd, &legacy, sizeof(legacy)) == sizeof(legacy);
+    close(fd);
+
+    ok = ok && init_warehouse_file(path, 1, 1, 1);
+    wareHouse migrated = ok ? warehouse_read() : (wareHouse){0, 0, 0};
+    ok = ok && memcmp(&migrated, &legacy, sizeof(legacy)) == 0 &&
+         warehouse_file_grow(3 * WAREHOUSE_PAGE_SIZE - 100) &&
+         !warehouse_file_grow(WAREHOUSE_MAP_MAX + 1);
+    cleanup_warehouse_file();
+
+    struct stat st;
+    ok = ok && stat(path, &st) == 0 && st.st_size == 3 * WAREHOUSE_PAGE_SIZE;
+
+    // Reopening the grown file takes the fast path and keeps the stock
+    ok = ok && init_warehouse_file(path, 1, 1, 1);
+    migrated = ok ? warehouse_read() : (wareHouse){0, 0, 0};
+    ok = ok && memcmp(&migrated, &legacy, sizeof(legacy)) == 0;
+    cleanup_warehouse_file();
+
+    // One flipped bit in the header
+    unsigned long long generation = 0;
+    fd = open(path, O_RDWR);
+    ok = ok && fd != -1 &&
+         pread(fd, &generation, sizeof(generation), offsetof(warehouseHeader, generation)) ==
+             sizeof(generation);
+    generation ^= 1;
+    ok = ok && pwrite(fd, &generation, sizeof(generation), offsetof(warehouseHeader, generation)) ==
+                   sizeof(generation);
+    close(fd);
+    fprintf(stderr, "(a corrupt-header error is expected here)\n");
+    ok = ok && !init_warehouse_file(path, 1, 1, 1);
+
+    remove_save_file(path);
+    printf("file format migration and validation: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+// A snapshot of the sharded in-memory stock is a save file that opens to
+// the same totals, taken while adders keep running
+int run_snapshot()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "snap");
+
+    warehouse_init_memory(0, 0, 0, THREADS);
+    for (int shard = 0; shard < THREADS; shard++)
+    {
+        warehouse_bind_shard(shard);
+        warehouse_add(1, 10);
+        warehouse_add(2, 20);
+        warehouse_add(3, 30);
+    }
+    wareHouse expected = warehouse_read();
+
+    double pause_us = 0;
+    int status = 1;
+    pid_t child = warehouse_snapshot(path, &pause_us);
+    warehouse_add(1, 1); // after the fork, so not in the image
+    int ok = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0;
+
+    ok = ok && init_warehouse_file(path, 0, 0, 0);
+    wareHouse snapshot = ok ? warehouse_read() : (wareHouse){0, 0, 0};
+    ok = ok && memcmp(&snapshot, &expected, sizeof(wareHouse)) == 0;
+    cleanup_warehouse_file();
+    remove_save_file(path);
+    printf("snapshot by fork: %s (paused %.1f us)\n", ok ? "PASS" : "FAIL", pause_us);
+    return ok;
+}
+
+// Named warehouses: lookups, isolation, a memory snapshot carrying them,
+// and a file whose location pages lost writes that only reached the log
+int run_locations()
+{
+    enum { COUNT = 2000 };
+    char name[32];
+    int ids[COUNT];
+    int ok = warehouse_location("default", 7) == 0 && warehouse_location("a b", 3) == -1 &&
+             warehouse_location("", 0) == -1;
+
+    warehouse_init_memory(5, 5, 5, 1);
+    for (int i = 0; i < COUNT && ok; i++)
+    {
+        int len = snprintf(name, sizeof(name), "bar%d", i);
+        ids[i] = warehouse_location(name, len);
+        ok = ids[i] > 0;
+        warehouse_use(ids[i]);
+        ok = ok && warehouse_add(1, i + 1) == 1 && warehouse_take(1, 0, 0) == 1;
+        warehouse_use(0);
+    }
+    for (int i = 0; i < COUNT && ok; i++)
+    {
+        int len = snprintf(name, sizeof(name), "bar%d", i);
+        warehouse_use(warehouse_location(name, len));
+        ok = warehouse_location(name, len) == ids[i] && warehouse_read().carbon == (unsigned long long)i;
+        warehouse_use(0);
+    }
+    ok = ok && warehouse_read().carbon == 5;
+
+    char path[64];
+    temp_save_file(path, sizeof(path), "loc");
+
+    double pause_us;
+    int status = 1;
+    pid_t child = ok ? warehouse_snapshot(path, &pause_us) : -1;
+    ok = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+    ok = ok && init_warehouse_file(path, 0, 0, 0);
+    warehouse_use(ok ? warehouse_location("bar1999", 7) : 0);
+    ok = ok && warehouse_read().carbon == COUNT - 1;
+    warehouse_use(0);
+    cleanup_warehouse_file();
+
+    // A process that dies leaves its last mutations in the log only
+    child = fork();
+    if (child == 0)
+    {
+        if (!init_warehouse_file(path, 0, 0, 0))
+            _exit(1);
+        warehouse_use(warehouse_location("fresh", 5));
+        warehouse_add(2, 7);
+        warehouse_use(warehouse_location("bar3", 4));
+        warehouse_take(1, 0, 0);
+        _exit(0);
+    }
+    ok = ok && child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+
+    int fd = open(path, O_RDWR);
+    locationRecord lost;
+    memset(&lost, 0, sizeof(lost));
+    ok = ok && fd != -1 &&
+         pread(fd, lost.name, sizeof(lost.name),
+               LOCATION_RECORD_OFFSET + (ids[3] - 1) * sizeof(locationRecord) +
+                   offsetof(locationRecord, name)) == sizeof(lost.name) &&
+         pwrite(fd, &lost, sizeof(lost), LOCATION_RECORD_OFFSET + (ids[3] - 1) * sizeof(locationRecord)) ==
+             sizeof(lost);
+    if (fd != -1)
+        close(fd);
+
+    ok = ok && init_warehouse_file(path, 0, 0, 0);
+    warehouse_use(ok ? warehouse_location("fresh", 5) : 0);
+    ok = ok && warehouse_read().hydrogen == 7;
+    warehouse_use(ok ? warehouse_location("bar3", 4) : 0);
+    ok = ok && warehouse_location("bar3", 4) == ids[3] && warehouse_read().carbon == 2;
+    warehouse_use(0);
+    cleanup_warehouse_file();
+    remove_save_file(path);
+
+    printf("named warehouses: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+double seconds_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Deliveries of CARBON DIOXIDE only, from a stock of exactly twice as
+// much oxygen as carbon: any read that sees a delivery half done breaks
+// oxygen == 2 * carbon
+#define TORN_CARBON 20000
+
+void *run_co2_deliveries(void *arg)
+{
+    warehouse_bind_shard(*(int *)arg);
+    int count = 1;
+    while (warehouse_take(count, 0, 2 * count) == 1 || warehouse_take(1, 0, 2) == 1)
+        count = count % 3 + 1;
+    return NULL;
+}
+
+void *run_torn_reader(void *arg)
+{
+    long *torn = arg;
+    while (!workers_done)
+    {
+        wareHouse now = warehouse_read();
+        if (now.oxygen != 2 * now.carbon || now.hydrogen != 0)
+            (*torn)++;
+    }
+    return NULL;
+}
+
+// Reader in another process, with its own mapping of the save file
+int read_mapped_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    const warehouseFile *file =
+        fd == -1 ? MAP_FAILED : mmap(NULL, WAREHOUSE_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+        return 0;
+    long torn = 0;
+    wareHouse now = {1, 0, 2};
+    double start = seconds_now();
+    while (now.carbon > 0 && seconds_now() - start < 10)
+    {
+        if (warehouse_file_read(file, &now) && (now.oxygen != 2 * now.carbon || now.hydrogen != 0))
+            torn++;
+    }
+    return torn == 0 && now.carbon == 0;
+}
+
+// Readers never see a delivery half done, neither of the file (in this
+// process and in another one) nor of the sharded memory stock while
+// deliveries steal from other shards
+int run_consistent_reads()
+{
+    char path[64];
+    temp_save_file(path, sizeof(path), "seq");
+
+    int ok = 1;
+    for (int sharded = 0; sharded <= 1; sharded++)
+    {
+        pid_t child = -1;
+        if (sharded)
+            warehouse_init_memory(TORN_CARBON, 0, 2 * TORN_CARBON, THREADS);
+        else
+        {
+            warehouse_set_durability(DURABILITY_NONE, 0, 0);
+            ok = ok && init_warehouse_file(path, TORN_CARBON, 0, 2 * TORN_CARBON);
+
+            // A copy taken while a writer is at work is never handed out
+            warehouseFile *file = (warehouseFile *)((char *)warehouse_ptr - offsetof(warehouseFile, stock));
+            wareHouse seen;
+            if (ok && lock_warehouse())
+            {
+                file->stock_seq++;
+                ok = !warehouse_file_read(file, &seen);
+                file->stock_seq++;
+                ok = ok && warehouse_file_read(file, &seen) && seen.carbon == TORN_CARBON;
+                unlock_warehouse();
+            }
+            child = ok ? fork() : -1;
+            if (child == 0)
+                _exit(read_mapped_file(path) ? 0 : 1);
+        }
+
+        pthread_t writers[THREADS], readers[2];
+        int index[THREADS];
+        long torn[2] = {0, 0};
+        workers_done = 0;
+        for (int i = 0; i < 2; i++)
+            pthread_create(&readers[i], NULL, run_torn_reader, &torn[i]);
+        for (int i = 0; i < THREADS; i++)
+        {
+            index[i] = i;
+            pthread_create(&writers[i], NULL, run_co2_deliveries, &index[i]);
+        }
+        for (int i = 0; i < THREADS; i++)
+            pthread_join(writers[i], NULL);
+        workers_done = 1;
+        for (int i = 0; i < 2; i++)
+            pthread_join(readers[i], NULL);
+
+        wareHouse final = warehouse_read();
+        ok = ok && torn[0] + torn[1] == 0 && final.carbon == 0 && final.oxygen == 0;
+        if (!sharded)
+        {
+            int status = 1;
+            ok = ok && child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+                 WEXITSTATUS(status) == 0;
+            cleanup_warehouse_file();
+            warehouse_set_durability(DURABILITY_SYNC, 0, 0);
+        }
+    }
+    remove_save_file(path);
+    printf("consistent reads during deliveries: %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+#define REPLICATED_OPS 300
+
+void *run_replicated_ops(void *arg)
+{
+    warehouse_bind_shard(*(int *)arg);
+    int north = warehouse_location("north", 5);
+    for (int i = 0; i < REPLICATED_OPS; i++)
+    {
+        warehouse_add(1, 2);
+        warehouse_take(1, 0, 0);
+        warehouse_use(north);
+        warehouse_add(2, 1);
+        warehouse_use(0);
+    }
+    return NULL;
+}
+
+// Shared with the primary of run_replication()
+typedef struct replicationTest
+{
+    int late_add;     // what the primary's first change after its stall returned
+    int stepped_down; // whether it then gave way to this process
+    int rejoined;     // set once it follows this process
+} replicationTest;
+
+// A primary process streams concurrent changes to this one, then stalls
+// without a word. With sync acks everything it applied is here, and this
+// process takes over within a second. When the old primary comes back it
+// must hear of the newer term before it answers anything, then step down
+// and follow this process.
+int run_replication()
+{
+    char path[64], promoted[64];
+    snprintf(path, sizeof(path), "/tmp/warehouse_stress_%d.rep", (int)getpid());
+    snprintf(promoted, sizeof(promoted), "/tmp/warehouse_stress_%d.rep2", (int)getpid());
+    unlink(path);
+    replicationTest *shared = mmap(NULL, sizeof(replicationTest), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return 0;
+    memset(shared, 0, sizeof(*shared));
+
+    // The primary prints, and would print our buffered output again
+    fflush(stdout);
+    pid_t primary = fork();
+    if (primary == 0)
+    {
+        warehouse_init_memory(1000, 1000, 1000, THREADS);
+        if (!replica_listen(path, REPLICA_SYNC))
+            _exit(1);
+        while (replica_backups() == 0)
+            usleep(1000);
+        pthread_t ids[THREADS];
+        int index[THREADS];
+        for (int i = 0; i < THREADS; i++)
+        {
+            index[i] = i;
+            pthread_create(&ids[i], NULL, run_replicated_ops, &index[i]);
+        }
+        for (int i = 0; i < THREADS; i++)
+            pthread_join(ids[i], NULL);
+
+        raise(SIGSTOP);
+        shared->late_add = warehouse_add(1, 1);
+        double back = seconds_now();
+        while (replica_role() == REPLICA_PRIMARY && seconds_now() - back < 3)
+            usleep(1000);
+        shared->stepped_down = replica_role() == REPLICA_BACKUP;
+        while (!shared->rejoined && seconds_now() - back < 3)
+            usleep(1000);
+        _exit(0);
+    }
+
+    warehouse_init_memory(0, 0, 0, 1);
+    int status = 1;
+    int ok = primary > 0 && replica_follow(path, promoted, REPLICA_SYNC) &&
+             waitpid(primary, &status, WUNTRACED) == primary && WIFSTOPPED(status);
+    double died = seconds_now();
+    while (ok && replica_role() != REPLICA_PRIMARY && seconds_now() - died < 2)
+        usleep(1000);
+    double took_ms = (seconds_now() - died) * 1e3;
+    ok = ok && replica_role() == REPLICA_PRIMARY && took_ms < 1000;
+
+    wareHouse main_stock = warehouse_read();
+    warehouse_use(warehouse_location("north", 5));
+    wareHouse north = warehouse_read();
+    warehouse_use(0);
+    ok = ok && main_stock.carbon == 1000 + THREADS * REPLICATED_OPS && main_stock.hydrogen == 1000 &&
+         main_stock.oxygen == 1000 && north.hydrogen == THREADS * REPLICATED_OPS;
+
+    if (primary > 0)
+        kill(primary, SIGCONT);
+    double back = seconds_now();
+    while (ok && replica_backups() == 0 && seconds_now() - back < 3)
+        usleep(1000);
+    shared->rejoined = replica_backups() > 0;
+    ok = ok && shared->rejoined && waitpid(primary, &status, 0) == primary && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0 && shared->late_add < 0 && shared->stepped_down;
+    unlink(path);
+    unlink(promoted);
+
+    printf("replication and failover: %s (%d changes, promoted in %.0f ms, old primary %s)\n",
+           ok ? "PASS" : "FAIL", THREADS * REPLICATED_OPS * 3, took_ms,
+           shared->stepped_down ? "stepped down" : "still serving");
+    munmap(shared, sizeof(replicationTest));
+    return ok;
+}
+
+// Shared by the raft nodes of run_raft()
+typedef struct raftTest
+{
+    int first_leader;
+    int first_ok;
+    int refused_ok;
+    double died;
+    int second_leader;
+    int second_ok;
+    double elected;
+} raftTest;
+
+static int raft_state_ok()
+{
+    wareHouse main_stock = warehouse_read();
+    warehouse_use(warehouse_location("north", 5));
+    wareHouse north = warehouse_read();
+    warehouse_use(0);
+    return main_stock.carbon == 1000 + THREADS * REPLICATED_OPS && main_stock.hydrogen == 1000 &&
+           main_stock.oxygen == 1000 && north.hydrogen == THREADS * REPLICATED_OPS;
+}
+
+static void record_result(int result, void *arg)
+{
+    *(int *)arg = result;
+}
+
+// Changes that must leave the stock alone: a DELIVER WATER whose hydrogen
+// would wrap to +2 in a signed entry, an ADD no entry can carry, and an
+// entry that adds carbon but cannot take its oxygen
+static int raft_refuses_impossible()
+{
+    const long long mixed[3] = {5, 0, -2000};
+    int async_result = -2;
+    return warehouse_take(0, 2 * (unsigned long long)LLONG_MAX, LLONG_MAX) == 0 &&
+           warehouse_add(2, 1ULL << 63) == 0 && raft_submit("", mixed) == 0 &&
+           warehouse_take_async(0, ULLONG_MAX, 1, record_result, &async_result) && async_result == 0;
+}
+
+static void run_raft_node(int id, const char *nodes, raftTest *shared)
+{
+    warehouse_init_memory(1000, 1000, 1000, THREADS);
+    if (!raft_start(id, nodes, NULL))
+        _exit(1);
+
+    double start = seconds_now();
+    while (!__atomic_load_n(&shared->second_leader, __ATOMIC_ACQUIRE) && seconds_now() - start < 5)
+    {
+        if (!raft_is_leader())
+        {
+            usleep(1000);
+            continue;
+        }
+        int first = 0;
+        if (__atomic_compare_exchange_n(&shared->first_leader, &first, id, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+            shared->refused_ok = raft_refuses_impossible();
+            pthread_t ids[THREADS];
+            int index[THREADS];
+            for (int i = 0; i < THREADS; i++)
+            {
+                index[i] = i;
+                pthread_create(&ids[i], NULL, run_replicated_ops, &index[i]);
+            }
+            for (int i = 0; i < THREADS; i++)
+                pthread_join(ids[i], NULL);
+            shared->first_ok = raft_state_ok();
+            shared->died = seconds_now();
+            _exit(0);
+        }
+
+        shared->elected = seconds_now();
+        while (!raft_read_ok() && seconds_now() - start < 5)
+            usleep(1000);
+        shared->second_ok = raft_read_ok() && raft_state_ok();
+        __atomic_store_n(&shared->second_leader, id, __ATOMIC_RELEASE);
+        _exit(0);
+    }
+    _exit(0);
+}
+
+// Three raft nodes, each a process. The first leader has impossible
+// changes refused, commits concurrent changes through the log and dies;
+// another node must be elected within a second and have every change and
+// nothing else.
+int run_raft()
+{
+    char paths[3][64], nodes[3 * 64];
+    nodes[0] = '\0';
+    for (int i = 0; i < 3; i++)
+    {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/warehouse_stress_%d.raft%d", (int)getpid(), i + 1);
+        strcat(nodes, i ? "," : "");
+        strcat(nodes, paths[i]);
+    }
+    raftTest *shared = mmap(NULL, sizeof(raftTest), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return 0;
+    memset(shared, 0, sizeof(*shared));
+
+    fflush(stdout);
+    int ok = 1;
+    pid_t pids[3];
+    for (int i = 0; i < 3; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            run_raft_node(i + 1, nodes, shared);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        int status = 1;
+        ok &= pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status) &&
+              WEXITSTATUS(status) == 0;
+    }
+    for (int i = 0; i < 3; i++)
+        unlink(paths[i]);
+
+    double took_ms = (shared->elected - shared->died) * 1e3;
+    ok = ok && shared->refused_ok && shared->first_ok && shared->second_ok &&
+         shared->second_leader != shared->first_leader && took_ms < 1000;
+    printf("raft commit and failover: %s (%d entries, leader %d took over from %d in %.0f ms)\n",
+           ok ? "PASS" : "FAIL", THREADS * REPLICATED_OPS * 3, shared->second_leader,
+           shared->first_leader, took_ms);
+    munmap(shared, sizeof(raftTest));
+    return ok;
+}
+
+#define CRDT_NODE_OPS 2000
+
+// Shared by the CRDT nodes of run_crdt()
+typedef struct crdtTest
+{
+    long long base[3];
+    long long added[3];
+    long long taken[3];
+    int done;
+    int converged;
+    int ok[3];
+} crdtTest;
+
+static void wait_for_nodes(int *count, double start)
+{
+    while (__atomic_load_n(count, __ATOMIC_ACQUIRE) < 3 && seconds_now() - start < 5)
+        usleep(1000);
+}
+
+static void *run_crdt_supplier(void *arg)
+{
+    warehouse_bind_shard(*(int *)arg);
+    for (int i = 0; i < CRDT_NODE_OPS; i++)
+    {
+        for (int atom = 1; atom <= 3; atom++)
+            warehouse_add(atom, 1);
+        if (i % 100 == 0)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+static void *run_crdt_consumer(void *arg)
+{
+    warehouse_bind_shard(*(int *)arg);
+    long long taken = 0;
+    for (int i = 0; i < CRDT_NODE_OPS; i++)
+    {
+        if (warehouse_take(1, 2, 1) > 0)
+            taken++;
+        if (i % 100 == 0)
+            usleep(1000);
+    }
+    return (void *)(long)taken;
+}
+
+static void run_crdt_node(int id, const char *nodes, crdtTest *shared)
+{
+    long long base = id == 1 ? 1000 : 0;
+    warehouse_init_memory(base, base, base, THREADS);
+    if (!crdt_start(id, nodes))
+        _exit(1);
+    __atomic_fetch_add(&shared->base[0], base, __ATOMIC_RELAXED);
+
+    // Node 1 starts with all the stock and supplies; the others only
+    // deliver, from escrow handed to them
+    pthread_t ids[THREADS];
+    int index[THREADS];
+    long long taken = 0;
+    for (int i = 0; i < THREADS; i++)
+    {
+        index[i] = i;
+        pthread_create(&ids[i], NULL, id == 1 ? run_crdt_supplier : run_crdt_consumer, &index[i]);
+    }
+    for (int i = 0; i < THREADS; i++)
+    {
+        void *result;
+        pthread_join(ids[i], &result);
+        taken += (long)result;
+    }
+    if (id == 1)
+        __atomic_fetch_add(&shared->added[0], (long long)THREADS * CRDT_NODE_OPS, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&shared->taken[id - 1], taken, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shared->done, 1, __ATOMIC_ACQ_REL);
+
+    // Every node must come to the same whole warehouse, the one the
+    // counts above add up to
+    double start = seconds_now();
+    wait_for_nodes(&shared->done, start);
+    long long total_taken = shared->taken[1] + shared->taken[2];
+    long long carbon = shared->base[0] + shared->added[0] - total_taken;
+    long long hydrogen = shared->base[0] + shared->added[0] - 2 * total_taken;
+    wareHouse whole;
+    do
+    {
+        usleep(1000);
+        whole = crdt_global();
+    } while (((long long)whole.carbon != carbon || (long long)whole.hydrogen != hydrogen ||
+              (long long)whole.oxygen != carbon) &&
+             seconds_now() - start < 5);
+    shared->ok[id - 1] = (long long)whole.carbon == carbon && (long long)whole.hydrogen == hydrogen &&
+                         (long long)whole.oxygen == carbon && hydrogen >= 0;
+    // Keep gossiping until everyone has converged
+    __atomic_fetch_add(&shared->converged, 1, __ATOMIC_ACQ_REL);
+    wait_for_nodes(&shared->converged, start);
+    _exit(0);
+}
+
+// Three CRDT nodes, each a process. One supplies, two deliver only what
+// escrow lets them, and all three must agree on the whole warehouse.
+int run_crdt()
+{
+    char paths[3][64], nodes[3 * 64];
+    nodes[0] = '\0';
+    for (int i = 0; i < 3; i++)
+    {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/warehouse_stress_%d.crdt%d", (int)getpid(), i + 1);
+        strcat(nodes, i ? "," : "");
+        strcat(nodes, paths[i]);
+    }
+    crdtTest *shared = mmap(NULL, sizeof(crdtTest), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return 0;
+    memset(shared, 0, sizeof(*shared));
+
+    fflush(stdout);
+    int ok = 1;
+    pid_t pids[3];
+    for (int i = 0; i < 3; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            run_crdt_node(i + 1, nodes, shared);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        int status = 1;
+        ok &= pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status) &&
+              WEXITSTATUS(status) == 0 && shared->ok[i];
+    }
+    for (int i = 0; i < 3; i++)
+        unlink(paths[i]);
+
+    // Deliveries happened only through escrow handed over by gossip
+    ok = ok && shared->taken[1] > 0 && shared->taken[2] > 0;
+    printf("CRDT counters and escrow: %s (%lld added, %lld + %lld delivered from escrow)\n",
+           ok ? "PASS" : "FAIL", shared->added[0] * 3, shared->taken[1], shared->taken[2]);
+    munmap(shared, sizeof(crdtTest));
+    return ok;
+}
+
+#define EDGE_OPS 200
+
+// A central for run_edge(): leases, returns and forwarded deliveries of
+// water until the edge has given its stock back
+static void run_central(int fd, wareHouse *final)
+{
+    warehouse_init_memory(1000, 1000, 1000, 1);
+    struct timeval idle = {.tv_sec = 2};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    char request[128], reply[160], late[32];
+    struct sockaddr_un from, late_to;
+    socklen_t from_len = sizeof(from), late_len = 0;
+    int held = 0;
+    double held_at = 0;
+    ssize_t got;
+    while ((got = recvfrom(fd, request, sizeof(request) - 1, 0, (struct sockaddr *)&from, &from_len)) > 0)
+    {
+        request[got] = '\0';
+        // The first DELIVER is refused only with a later request, after
+        // the edge gave up on it; the edge must drop that reply rather
+        // than take it for the answer to another request
+        if (held == 1 && seconds_now() > held_at + EDGE_TIMEOUT_MS / 1000.0)
+        {
+            sendto(fd, late, strlen(late), 0, (struct sockaddr *)&late_to, late_len);
+            held = 2;
+        }
+        int tag = edge_tag_length(request, got);
+        const char *body = request + tag;
+        memcpy(reply, request, tag);
+        unsigned long long atoms[3];
+        int len, returned = sscanf(body, "RETURN %llu %llu %llu", &atoms[0], &atoms[1], &atoms[2]) == 3;
+        if (returned)
+            len = edge_take_back(atoms, reply + tag, sizeof(reply) - tag);
+        else if (sscanf(body, "LEASE %llu %llu %llu", &atoms[0], &atoms[1], &atoms[2]) == 3)
+            len = edge_grant(atoms, reply + tag, sizeof(reply) - tag);
+        else if (held == 0)
+        {
+            snprintf(late, sizeof(late), "%.*ssorry", tag, request);
+            late_to = from;
+            late_len = from_len;
+            held_at = seconds_now();
+            held = 1;
+            from_len = sizeof(from);
+            continue;
+        }
+        else // DELIVER WATER 1
+            len = snprintf(reply + tag, sizeof(reply) - tag, "%s", warehouse_take(0, 2, 1) > 0 ? "OK" : "sorry");
+        sendto(fd, reply, tag + len, 0, (struct sockaddr *)&from, from_len);
+        from_len = sizeof(from);
+        if (returned)
+            break;
+    }
+    *final = warehouse_read();
+    _exit(0);
+}
+
+typedef struct edgeWorker
+{
+    pthread_t thread;
+    int index;
+    long local;     // delivered from the lease
+    long forwarded; // delivered through the central
+} edgeWorker;
+
+static void *run_edge_deliveries(void *arg)
+{
+    edgeWorker *w = arg;
+    warehouse_bind_shard(w->index);
+    char reply[128];
+    for (int i = 0; i < EDGE_OPS; i++)
+    {
+        int local = warehouse_take(0, 2, 1) > 0;
+        edge_spent();
+        if (local)
+            w->local++;
+        else if (edge_forward("DELIVER WATER 1", 15, reply, sizeof(reply)) > 0 && strcmp(reply, "OK") == 0)
+            w->forwarded++;
+    }
+    return NULL;
+}
+
+// This process is an edge of a central in a child process. Water is
+// delivered from the lease while it lasts, refilled in the background,
+// then from the central; whatever the edge holds at the end goes back.
+// Every atom must be accounted for at the central.
+int run_edge()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/warehouse_stress_%d.central", (int)getpid());
+    unlink(path);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    wareHouse *final = mmap(NULL, sizeof(wareHouse), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || final == MAP_FAILED)
+        return 0;
+    memset(final, 0, sizeof(*final));
+
+    fflush(stdout);
+    pid_t central = fork();
+    if (central == 0)
+        run_central(fd, final);
+    close(fd);
+
+    warehouse_init_memory(0, 0, 0, THREADS);
+    int ok = central > 0 && edge_start(path, 100);
+    long local = 0, forwarded = 0;
+    if (ok)
+    {
+        edgeWorker workers[THREADS];
+        memset(workers, 0, sizeof(workers));
+        for (int i = 0; i < THREADS; i++)
+        {
+            workers[i].index = i;
+            pthread_create(&workers[i].thread, NULL, run_edge_deliveries, &workers[i]);
+        }
+        for (int i = 0; i < THREADS; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            local += workers[i].local;
+            forwarded += workers[i].forwarded;
+        }
+        edge_stop();
+    }
+    int status = 1;
+    ok = ok && waitpid(central, &status, 0) == central && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    unlink(path);
+
+    edgeStats stats;
+    edge_stats(&stats);
+    long delivered = local + forwarded;
+    ok = ok && local > 0 && stats.leases > 1 && final->carbon == 1000 &&
+         final->hydrogen == 1000 - 2 * (unsigned long long)delivered &&
+         final->oxygen == 1000 - (unsigned long long)delivered;
+    printf("edge lease and return: %s (%ld delivered from %llu leases, %ld through the central, "
+           "%llu stale replies)\n",
+           ok ? "PASS" : "FAIL", local, stats.leases, forwarded, stats.stale);
+    munmap(final, sizeof(wareHouse));
+    return ok;
+}
+
+#define LATENCY_OPS 10000
+
+static void *run_latency_samples(void *arg)
+{
+    (void)arg;
+    for (unsigned long long ns = 1; ns <= LATENCY_OPS; ns++)
+        latency_record(LATENCY_DELIVER, LATENCY_WAREHOUSE, ns, 1);
+    latency_stage(LATENCY_LOCK, 0); // no command being timed: not recorded
+    return NULL;
+}
+
+static int near(unsigned long long value, unsigned long long expected)
+{
+    return value * LATENCY_SUB >= expected * (LATENCY_SUB - 1) &&
+           value * LATENCY_SUB <= expected * (LATENCY_SUB + 1);
+}
+
+// Threads record 1..LATENCY_OPS ns each; the percentiles must be within a
+// bucket of the exact ones, and a reset must empty the histograms
+int run_latency()
+{
+    latency_reset();
+    pthread_t ids[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&ids[i], NULL, run_latency_samples, NULL);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(ids[i], NULL);
+
+    latencySummary s, lock, after;
+    latency_summary(LATENCY_DELIVER, LATENCY_WAREHOUSE, &s);
+    latency_summary(LATENCY_DELIVER, LATENCY_LOCK, &lock);
+    latency_reset();
+    latency_summary(LATENCY_DELIVER, LATENCY_WAREHOUSE, &after);
+
+    int ok = s.count == (unsigned long long)THREADS * LATENCY_OPS && s.max == LATENCY_OPS &&
+             near(s.p50, LATENCY_OPS / 2) && near(s.p99, LATENCY_OPS * 99 / 100) &&
+             near(s.p999, LATENCY_OPS * 999 / 1000) && lock.count == 0 && after.count == 0 && after.max == 0;
+    printf("latency histograms: %s (p50=%llu p99=%llu p999=%llu max=%llu ns)\n", ok ? "PASS" : "FAIL",
+           s.p50, s.p99, s.p999, s.max);
+    return ok;
+}
+
+static void *run_metric_counts(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < 1000; i++)
+        metrics_count(METRIC_DELIVER, 1);
+    return NULL;
+}
+
+// Scrape the metrics socket the way curl --unix-socket would: counters
+// counted on other threads and the stock must be in the exposition
+int run_metrics()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/warehouse_stress_%d.metrics", (int)getpid());
+    warehouse_init_memory(10, 20, 30, THREADS);
+    static int clients = 3;
+    if (!metrics_start(path, &clients))
+        return 0;
+    pthread_t ids[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&ids[i], NULL, run_metric_counts, NULL);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(ids[i], NULL);
+
+    static char reply[64 * 1024];
+    size_t got = 0;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        send(fd, request, strlen(request), 0) > 0)
+    {
+        ssize_t n;
+        while (got < sizeof(reply) - 1 && (n = recv(fd, reply + got, sizeof(reply) - 1 - got, 0)) > 0)
+            got += n;
+    }
+    reply[got] = '\0';
+    if (fd != -1)
+        close(fd);
+    metrics_stop();
+
+    char expected[128];
+    snprintf(expected, sizeof(expected), "drinks_commands_total{command=\"DELIVER\"} %d\n", THREADS * 1000);
+    int ok = strncmp(reply, "HTTP/1.0 200 OK", 15) == 0 && strstr(reply, expected) &&
+             strstr(reply, "drinks_stock_atoms{warehouse=\"default\",atom=\"oxygen\"} 30\n") &&
+             strstr(reply, "drinks_connected_clients 3\n") && access(path, F_OK) != 0;
+    printf("metrics endpoint: %s (%zu bytes scraped)\n", ok ? "PASS" : "FAIL", got);
+    return ok;
+}
+
+#define SHM_WRITES 200000
+
+// Rewrites every counter of the segment with the same value, over and over
+static void *run_shm_writer(void *arg)
+{
+    statsSegment *seg = arg;
+    for (unsigned long long i = 1; i <= SHM_WRITES; i++)
+    {
+        shm_stats_write_begin(seg);
+        for (int c = 0; c < METRIC_COUNTERS; c++)
+            seg->counters[c] = i;
+        seg->stock[0] = seg->stock[1] = seg->stock[2] = i;
+        shm_stats_write_end(seg);
+    }
+    return NULL;
+}
+
+// A reader mapping the segment read-only must never see half an update,
+// and drinks_bar's publisher must get counters into it
+int run_shm_stats()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/warehouse_stress_%d", (int)getpid());
+    statsSegment *seg = shm_stats_create(name);
+    const statsSegment *view = seg ? shm_stats_open(name) : NULL;
+    if (!view)
+        return 0;
+
+    static statsSegment copy;
+    pthread_t writer;
+    pthread_create(&writer, NULL, run_shm_writer, seg);
+    long snapshots = 0, torn = 0;
+    while (__atomic_load_n(&view->counters[0], __ATOMIC_RELAXED) < SHM_WRITES)
+    {
+        if (!shm_stats_snapshot(view, &copy))
+            continue;
+        snapshots++;
+        for (int c = 0; c < METRIC_COUNTERS; c++)
+            torn += copy.counters[c] != copy.counters[0];
+        torn += copy.stock[2] != copy.counters[0];
+    }
+    pthread_join(writer, NULL);
+    shm_stats_close(view);
+    shm_stats_close(seg);
+    shm_stats_remove(name);
+
+    // Through the publisher
+    warehouse_init_memory(1, 2, 3, 1);
+    static int clients = 2;
+    int ok = metrics_publish(name, &clients);
+    metrics_count(METRIC_GEN, 7);
+    usleep(3 * SHM_STATS_PUBLISH_MS * 1000);
+    view = ok ? shm_stats_open(name) : NULL;
+    ok = view && shm_stats_snapshot(view, &copy) && copy.running && copy.counters[METRIC_GEN] >= 7 &&
+         copy.stock[2] == 3 && copy.clients == 2;
+    metrics_unpublish();
+    ok = ok && shm_stats_snapshot(view, &copy) && !copy.running && shm_stats_open(name) == NULL;
+    if (view)
+        shm_stats_close(view);
+
+    ok = ok && torn == 0 && snapshots > 0;
+    printf("shared memory stats: %s (%ld snapshots, %ld torn)\n", ok ? "PASS" : "FAIL", snapshots, torn);
+    return ok;
+}
+
+#define LOG_OPS 50000
+
+static void *run_logging(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < LOG_OPS; i++)
+        log_event(LOG_LEVEL_DEBUG, LOG_DELIVERED, "WATER", NULL, 0, 0, 0, 0);
+    return NULL;
+}
+
+// Threads log into the ring faster than the writer can drain it: every
+// record is either written or counted as dropped, and records under the
+// level are neither. The output goes to /dev/null.
+int run_log()
+{
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved == -1 || null_fd == -1)
+        return 0;
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    int ok = log_start();
+    pthread_t ids[THREADS];
+    for (int i = 0; ok && i < THREADS; i++)
+        pthread_create(&ids[i], NULL, run_logging, NULL);
+    for (int i = 0; ok && i < THREADS; i++)
+        pthread_join(ids[i], NULL);
+    unsigned long long written, dropped;
+
+    log_set_level(LOG_LEVEL_QUIET);
+    run_logging(NULL);
+    log_set_level(LOG_LEVEL_DEBUG);
+    log_stop();
+    log_stats(&written, &dropped);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    // Counted once the writer, which may not have run yet, drains the ring
+    ok = ok && written + dropped == (unsigned long long)THREADS * LOG_OPS && written > 0;
+    printf("log ring: %s (%llu written, %llu dropped)\n", ok ? "PASS" : "FAIL", written, dropped);
+    return ok;
+}
+
+int bench_reads = 0; // also read the whole stock after every ADD
+
+// What drinks_bar does for an ADD request
+void *run_adds(void *arg)
+{
+    warehouse_bind_shard(*(int *)arg);
+    for (int i = 0; i < ROUNDS * 5; i++)
+    {
+        addAtom(i % 3 + 1, 1);
+        printAtoms();
+        if (bench_reads)
+            warehouse_read();
+    }
+    return NULL;
+}
+
+// ADD throughput with one shared stock vs one shard per thread, as
+// drinks_bar --log-level info runs them, and sharded with the stock read
+// after every ADD as the default (debug) level does
+void bench_adds()
+{
+    log_set_level(LOG_LEVEL_INFO);
+    printf("threads  1 shard (Mops/s)  sharded (Mops/s)  sharded + read (Mops/s)\n");
+    for (int threads = 1; threads <= THREADS; threads *= 2)
+    {
+        double rates[3];
+        for (int run = 0; run < 3; run++)
+        {
+            pthread_t ids[THREADS];
+            int index[THREADS];
+            warehouse_init_memory(0, 0, 0, run > 0 ? threads : 1);
+            bench_reads = run == 2;
+
+            double start = seconds_now();
+            for (int i = 0; i < threads; i++)
+            {
+                index[i] = i;
+                pthread_create(&ids[i], NULL, run_adds, &index[i]);
+            }
+            for (int i = 0; i < threads; i++)
+                pthread_join(ids[i], NULL);
+            rates[run] = threads * ROUNDS * 5.0 / (seconds_now() - start) / 1e6;
+        }
+        printf("%7d  %17.2f  %16.2f  %23.2f\n", threads, rates[0], rates[1], rates[2]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench_adds();
+        return 0;
+    }
+
+    int ok = 1;
+    printf("16-byte CAS is %s\n", stock_is_lock_free() ? "lock-free" : "NOT lock-free");
+
+    // Scarce stock: most deliveries must fail, none may overdraw
+    initial = (wareHouse){.carbon = 5000, .hydrogen = 9000, .oxygen = 7000};
+    ok &= run("scarce stock, deliveries only", 0, 1, 0);
+
+    // Deliveries racing with supplies
+    initial = (wareHouse){.carbon = 100, .hydrogen = 100, .oxygen = 100};
+    ok &= run("deliveries and adds", 1, 0, 0);
+
+    // No hydrogen at all: GLUCOSE/ALCOHOL/WATER must fail without touching
+    // carbon or oxygen, so only CARBON DIOXIDE ever consumes them
+    initial = (wareHouse){.carbon = 3000, .hydrogen = 0, .oxygen = 6000};
+    int partial_ok = run("all-or-nothing reservation", 0, 1, 0);
+    wareHouse final = stock_read(&stock);
+    if (final.carbon * 2 != final.oxygen || final.hydrogen != 0)
+    {
+        printf("all-or-nothing reservation: FAIL (partial deduction left C=%llu O=%llu)\n",
+               final.carbon, final.oxygen);
+        partial_ok = 0;
+    }
+    ok &= partial_ok;
+
+    // The same races through the per-thread shards
+    initial = (wareHouse){.carbon = 5000, .hydrogen = 9000, .oxygen = 7000};
+    ok &= run("sharded, scarce stock", 0, 1, THREADS);
+    initial = (wareHouse){.carbon = 100, .hydrogen = 100, .oxygen = 100};
+    ok &= run("sharded, deliveries and adds", 1, 0, THREADS);
+
+    // The rest set themselves up; each runs even if an earlier one failed
+    int (*const cases[])() = {
+        run_spread, run_wal, run_periodic_flush, run_owner_died, run_file_format,
+        run_file_overflow, run_snapshot, run_locations, run_consistent_reads, run_raft,
+        run_crdt, run_edge, run_log, run_latency, run_metrics, run_shm_stats,
+        // Last: this process stays a promoted primary
+        run_replication};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        ok &= cases[i]();
+
+    printf("%s\n", ok ? "All stress tests passed" : "Stress tests FAILED");
+    return ok ? 0 : 1;
+}